@@ -0,0 +1,178 @@
+-- Compares two result files of bench/run.lua and flags the benchmarks
+-- whose rate fell, or whose median latency grew, by more than a threshold.
+--
+--   lua bench/compare.lua old.json new.json [threshold]
+--
+-- threshold is a fraction (default 0.10). Exits with status 1 when there
+-- is a regression.
+
+local old_file, new_file = arg[1], arg[2]
+local threshold = tonumber (arg[3]) or 0.10
+assert (old_file and new_file, "usage: lua bench/compare.lua old.json new.json [threshold]")
+
+-- Decodes the JSON written by bench/run.lua
+local function decode (s)
+  local pos = 1
+  local value
+  local function space ()
+    pos = s:find ("[^ \t\r\n]", pos) or #s + 1
+  end
+  -- UTF-8 bytes of the code point n
+  local function utf8 (n)
+    if n < 0x80 then
+      return string.char (n)
+    elseif n < 0x800 then
+      return string.char (0xC0 + math.floor (n / 0x40), 0x80 + n % 0x40)
+    elseif n < 0x10000 then
+      return string.char (0xE0 + math.floor (n / 0x1000), 0x80 + math.floor (n / 0x40) % 0x40, 0x80 + n % 0x40)
+    end
+    return string.char (0xF0 + math.floor (n / 0x40000), 0x80 + math.floor (n / 0x1000) % 0x40,
+                        0x80 + math.floor (n / 0x40) % 0x40, 0x80 + n % 0x40)
+  end
+  local function hex4 (at)
+    local h = s:sub (at, at + 3)
+    assert (h:find ("^%x%x%x%x$"), "invalid \\u escape")
+    return tonumber (h, 16)
+  end
+  local function str ()
+    local i, j = pos + 1, pos + 1
+    local out = {}
+    while true do
+      local c = s:sub (j, j)
+      if c == "" then
+        error ("unterminated string")
+      elseif c == '"' then
+        out[#out+1] = s:sub (i, j - 1)
+        pos = j + 1
+        return table.concat (out)
+      elseif c == "\\" then
+        out[#out+1] = s:sub (i, j - 1)
+        local e = s:sub (j + 1, j + 1)
+        if e == "u" then
+          local n = hex4 (j + 2)
+          j = j + 6
+          if n >= 0xD800 and n < 0xDC00 and s:sub (j, j + 1) == "\\u" then
+            local lo = hex4 (j + 2)  -- the second half of a surrogate pair
+            if lo >= 0xDC00 and lo < 0xE000 then
+              n = 0x10000 + (n - 0xD800) * 0x400 + (lo - 0xDC00)
+              j = j + 6
+            end
+          end
+          out[#out+1] = utf8 (n)
+        else
+          out[#out+1] = ({n = "\n", t = "\t", r = "\r", b = "\b", f = "\f"})[e] or e
+          j = j + 2
+        end
+        i = j
+      else
+        j = j + 1
+      end
+    end
+  end
+  function value ()
+    space ()
+    local c = s:sub (pos, pos)
+    if c == "{" then
+      local t = {}
+      pos = pos + 1
+      space ()
+      if s:sub (pos, pos) == "}" then
+        pos = pos + 1
+        return t
+      end
+      repeat
+        space ()
+        local k = str ()
+        space ()
+        assert (s:sub (pos, pos) == ":", "':' expected")
+        pos = pos + 1
+        t[k] = value ()
+        space ()
+        c = s:sub (pos, pos)
+        pos = pos + 1
+      until c ~= ","
+      assert (c == "}", "'}' expected")
+      return t
+    elseif c == "[" then
+      local t = {}
+      pos = pos + 1
+      space ()
+      if s:sub (pos, pos) == "]" then
+        pos = pos + 1
+        return t
+      end
+      repeat
+        t[#t+1] = value ()
+        space ()
+        c = s:sub (pos, pos)
+        pos = pos + 1
+      until c ~= ","
+      assert (c == "]", "']' expected")
+      return t
+    elseif c == '"' then
+      return str ()
+    end
+    local word = s:match ("^[%w%.%+%-]+", pos)
+    assert (word, "value expected at "..pos)
+    pos = pos + #word
+    if word == "true" then
+      return true
+    elseif word == "false" then
+      return false
+    elseif word == "null" then
+      return nil
+    end
+    return assert (tonumber (word), "bad number "..word)
+  end
+  return value ()
+end
+
+local function load (path)
+  local f = assert (io.open (path))
+  local data = decode (f:read ("*a"))
+  f:close ()
+  local byname = {}
+  for _, r in ipairs (data.results) do
+    byname[r.name.."/"..r.cache] = r
+  end
+  return data, byname
+end
+
+local old, old_results = load (old_file)
+local new = load (new_file)
+if old.entries ~= new.entries then
+  io.write ("warning: the trees differ (", tostring (old.entries), " and ", tostring (new.entries), " entries)\n")
+end
+
+local function ratio (a, b)
+  return a and b and a > 0 and b / a or nil
+end
+
+local function fmt (x, spec)
+  return x and string.format (spec, x) or "-"
+end
+
+local regressions = 0
+io.write (string.format ("%-26s %12s %12s %8s %10s %10s  %s\n",
+  "benchmark", "old ops/s", "new ops/s", "rate", "old p50", "new p50", ""))
+for _, r in ipairs (new.results) do
+  local key = r.name.."/"..r.cache
+  local o = old_results[key]
+  if o then
+    local rate = ratio (o.ops_per_sec, r.ops_per_sec)
+    local p50 = ratio (o.p50_us, r.p50_us)
+    local flag = ""
+    if (rate and rate < 1 - threshold) or (p50 and p50 > 1 + threshold) then
+      flag = "REGRESSION"
+      regressions = regressions + 1
+    elseif rate and rate > 1 + threshold then
+      flag = "faster"
+    end
+    io.write (string.format ("%-26s %12.0f %12.0f %7.2fx %10s %10s  %s\n", key,
+      o.ops_per_sec, r.ops_per_sec, rate or 0, fmt (o.p50_us, "%.2f"), fmt (r.p50_us, "%.2f"), flag))
+  else
+    io.write (string.format ("%-26s %12s %12.0f\n", key, "-", r.ops_per_sec))
+  end
+end
+io.write (regressions, " regression(s) beyond ", threshold * 100, "%\n")
+os.exit (regressions > 0 and 1 or 0)
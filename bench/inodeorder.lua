@@ -0,0 +1,80 @@
+-- Stats every entry of a large directory in directory order and in inode
+-- order, with cold caches when they can be dropped (as root on Linux).
+--
+--   lua bench/inodeorder.lua dir [entries]
+--
+-- dir should be on the file system to measure, for instance a loop device:
+--
+--   truncate -s 4G /tmp/ext4.img && mkfs.ext4 -q /tmp/ext4.img
+--   mount -o loop /tmp/ext4.img /mnt && lua bench/inodeorder.lua /mnt/bench
+
+local lfs = require "lfs"
+
+local dir = assert (arg[1], "usage: lua bench/inodeorder.lua dir [entries]")
+local entries = tonumber (arg[2]) or 200000
+
+local function now ()
+  local p = io.popen ("date +%s%N")
+  local t = tonumber (p:read ("*l"))
+  p:close ()
+  return t / 1e9
+end
+
+local function drop_caches ()
+  os.execute ("sync")
+  local f = io.open ("/proc/sys/vm/drop_caches", "w")
+  if not f then
+    return false
+  end
+  f:write ("3\n")
+  f:close ()
+  return true
+end
+
+if not lfs.attributes (dir) then
+  assert (lfs.mkdirs (dir))
+  io.write ("creating ", entries, " files in ", dir, "\n")
+  for i = 1, entries do
+    local f = assert (io.open (dir.."/"..string.format ("%08x", (i * 2654435761) % 4294967296), "w"))
+    f:close ()
+  end
+end
+
+local _, d = lfs.dir (dir)
+local names, inodes = {}, {}
+while true do
+  local n, _, ino = d:read (65536)
+  if not n then
+    break
+  end
+  for i = 1, #n do
+    names[#names+1] = dir.."/"..n[i]
+    inodes[#inodes+1] = ino[i]
+  end
+end
+local cold = drop_caches ()
+io.write (#names, " entries, ", cold and "cold" or "warm (cannot drop caches)", " cache\n")
+
+local function run (label, fn)
+  drop_caches ()
+  local t = now ()
+  fn ()
+  t = now () - t
+  io.write (string.format ("%-40s %8.3f s %10.0f stats/s\n", label, t, #names / t))
+end
+
+for _, uring in ipairs {true, false} do
+  local how = uring and "io_uring" or "threads"
+  run ("attributes_many, "..how..", dir order", function ()
+    lfs.attributes_many (names, {"size"}, {uring = uring})
+  end)
+  run ("attributes_many, "..how..", inode order", function ()
+    lfs.attributes_many (names, {"size"}, {uring = uring, inodes = inodes})
+  end)
+end
+for _, order in ipairs {false, true} do
+  run ("walk, one thread, "..(order and "inode order" or "dir order"), function ()
+    for _ in lfs.walk (dir, {threads = 1, maxdepth = 1, fields = {"size"}, inodeorder = order}) do
+    end
+  end)
+end
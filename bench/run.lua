@@ -0,0 +1,319 @@
+-- Benchmarks of the hot paths of lfs, on synthetic trees made in place.
+--
+--   lua bench/run.lua [-d dir] [-n entries] [-o file.json] [-f pattern]
+--
+--   -d  where the trees are made and kept between runs (default bench_tree)
+--   -n  entries of the flat directory; the other trees scale with it
+--       (default 1000000)
+--   -o  JSON file for the results (default: standard output)
+--   -f  only run the benchmarks whose name matches the Lua pattern
+--
+-- Each benchmark runs with warm caches, after a pass that is not timed,
+-- and with cold ones when they can be dropped (as root on Linux). The
+-- rate comes from the wall clock; the percentiles come from the latency
+-- histograms of lfs.stats, so they are only given when the library has
+-- them. Compare two result files with bench/compare.lua.
+
+local lfs = require "lfs"
+
+local opts = {d = "bench_tree", n = 1000000}
+do
+  local i = 1
+  while arg[i] do
+    local flag = arg[i]:match ("^%-(%a)$")
+    if not flag or not arg[i+1] then
+      error ("usage: lua bench/run.lua [-d dir] [-n entries] [-o file.json] [-f pattern]")
+    end
+    opts[flag] = arg[i+1]
+    i = i + 2
+  end
+  opts.n = assert (tonumber (opts.n), "-n takes a number")
+end
+
+local root = opts.d
+local entries = math.floor (opts.n)
+local deep_levels = math.max (10, math.floor (entries / 5000))
+local small_dirs = math.max (1, math.floor (entries / 10000))
+
+local function now ()
+  local p = io.popen ("date +%s%N")
+  local t = tonumber (p and p:read ("*l") or "")
+  if p then
+    p:close ()
+  end
+  return t and t / 1e9 or os.clock ()
+end
+
+local function drop_caches ()
+  if lfs.cache and lfs.cache.flush then
+    lfs.cache.flush ()
+  end
+  os.execute ("sync")
+  local f = io.open ("/proc/sys/vm/drop_caches", "w")
+  if not f then
+    return false
+  end
+  f:write ("3\n")
+  f:close ()
+  return true
+end
+
+local function touch (path, size)
+  local f = assert (io.open (path, "w"))
+  if size > 0 then
+    f:write (string.rep ("x", size))
+  end
+  f:close ()
+end
+
+-- Makes the tree under path with fill unless the marker of the same size
+-- is there from an earlier run.
+local function tree (path, size, fill)
+  local marker = path.."/.complete"
+  local f = io.open (marker)
+  if f then
+    local done = f:read ("*l")
+    f:close ()
+    if done == tostring (size) then
+      return path
+    end
+    assert (lfs.rmtree (path))
+  end
+  io.stderr:write ("making ", path, "\n")
+  assert (lfs.mkdirs (path))
+  fill (path)
+  touch (marker, 0)
+  f = assert (io.open (marker, "w"))
+  f:write (tostring (size), "\n")
+  f:close ()
+  return path
+end
+
+-- A directory with entries empty files
+local flat = tree (root.."/flat", entries, function (path)
+  for i = 1, entries do
+    touch (string.format ("%s/%08x", path, (i * 2654435761) % 4294967296), 0)
+  end
+end)
+
+-- A chain of deep_levels directories, each with a file and a link
+local deep = tree (root.."/deep", deep_levels, function (path)
+  for _ = 1, deep_levels do
+    touch (path.."/file", 16)
+    assert (lfs.link ("file", path.."/link", true))
+    path = path.."/d"
+    assert (lfs.mkdir (path))
+  end
+end)
+
+-- small_dirs directories of 100 files of 1 KiB, with a link to each
+local small = tree (root.."/small", small_dirs, function (path)
+  for d = 1, small_dirs do
+    local dir = string.format ("%s/%04d", path, d)
+    assert (lfs.mkdir (dir))
+    for i = 1, 100 do
+      touch (string.format ("%s/%03d", dir, i), 1024)
+      assert (lfs.link (string.format ("%03d", i), string.format ("%s/l%03d", dir, i), true))
+    end
+  end
+end)
+
+-- Paths to stat: every entry of the small files tree
+local small_paths, small_links = {}, {}
+for d = 1, small_dirs do
+  local dir = string.format ("%s/%04d", small, d)
+  for i = 1, 100 do
+    small_paths[#small_paths+1] = string.format ("%s/%03d", dir, i)
+    small_links[#small_links+1] = string.format ("%s/l%03d", dir, i)
+  end
+end
+
+local deep_paths = {}
+do
+  local path = deep
+  for _ = 1, deep_levels do
+    deep_paths[#deep_paths+1] = path.."/file"
+    path = path.."/d"
+  end
+end
+
+local function walk (path)
+  local n = 0
+  for name in lfs.dir (path) do
+    if name ~= "." and name ~= ".." then
+      n = n + 1
+      local full = path.."/"..name
+      if lfs.symlinkattributes (full, "mode") == "directory" then
+        n = n + walk (full)
+      end
+    end
+  end
+  return n
+end
+
+-- Each benchmark returns the number of operations done; stat names the
+-- function of lfs.stats whose latencies are reported.
+local benchmarks = {
+  {name = "dir.flat", stat = "dir_iter", run = function ()
+    local n = 0
+    for _ in lfs.dir (flat) do
+      n = n + 1
+    end
+    return n
+  end},
+  {name = "dir.deep", stat = "dir_iter", run = function ()
+    return walk (deep)
+  end},
+  {name = "attributes.table", stat = "attributes", run = function ()
+    for i = 1, #small_paths do
+      lfs.attributes (small_paths[i])
+    end
+    return #small_paths
+  end},
+  {name = "attributes.member", stat = "attributes", run = function ()
+    for i = 1, #small_paths do
+      lfs.attributes (small_paths[i], "size")
+    end
+    return #small_paths
+  end},
+  {name = "attributes.deep", stat = "attributes", run = function ()
+    for i = 1, #deep_paths do
+      lfs.attributes (deep_paths[i], "size")
+    end
+    return #deep_paths
+  end},
+  {name = "symlinkattributes", stat = "symlinkattributes", run = function ()
+    for i = 1, #small_links do
+      lfs.symlinkattributes (small_links[i])
+    end
+    return #small_links
+  end},
+  {name = "lock.roundtrip", stat = "lock", run = function ()
+    local f = assert (io.open (root.."/lockfile", "w"))
+    local n = math.max (1000, math.floor (entries / 10))
+    for _ = 1, n do
+      assert (lfs.lock (f, "w"))
+      assert (lfs.unlock (f))
+    end
+    f:close ()
+    return n
+  end},
+  {name = "mkdir.churn", stat = "mkdir", run = function ()
+    local path = root.."/churn"
+    local n = math.max (1000, math.floor (entries / 100))
+    for _ = 1, n do
+      assert (lfs.mkdir (path))
+      assert (lfs.rmdir (path))
+    end
+    return n
+  end},
+}
+
+-- Latency in microseconds under which a fraction p of the calls in a
+-- histogram of lfs.stats fall, interpolated within its bucket.
+local function percentile (histogram, p)
+  local total = 0
+  for i = 1, #histogram do
+    total = total + histogram[i]
+  end
+  if total == 0 then
+    return nil
+  end
+  local target, seen = math.ceil (total * p), 0
+  for i = 1, #histogram do
+    if seen + histogram[i] >= target then
+      local low = i == 1 and 0 or 2 ^ (i - 1)
+      return (low + (2 ^ i - low) * (target - seen) / histogram[i]) / 1000
+    end
+    seen = seen + histogram[i]
+  end
+end
+
+local function measure (b, cache)
+  if cache == "cold" then
+    drop_caches ()
+  else
+    b.run ()
+  end
+  if lfs.resetstats then
+    lfs.resetstats ()
+  end
+  local t = now ()
+  local ops = b.run ()
+  t = now () - t
+  local r = {name = b.name, cache = cache, ops = ops, seconds = t, ops_per_sec = ops / t}
+  local s = lfs.stats and lfs.stats ()[b.stat]
+  if s then
+    r.p50_us = percentile (s.histogram, 0.5)
+    r.p99_us = percentile (s.histogram, 0.99)
+  end
+  io.stderr:write (string.format ("%-20s %-5s %12.0f ops/s  p50 %s us  p99 %s us\n", b.name, cache,
+    r.ops_per_sec, r.p50_us and string.format ("%.2f", r.p50_us) or "-",
+    r.p99_us and string.format ("%.2f", r.p99_us) or "-"))
+  return r
+end
+
+-- %q escapes for Lua, not JSON
+local escapes = { ['"'] = '\\"', ["\\"] = "\\\\", ["\n"] = "\\n" }
+
+local function json_string (s)
+  return '"'..s:gsub ('[%c"\\]', function (c)
+    return escapes[c] or string.format ("\\u%04x", c:byte ())
+  end)..'"'
+end
+
+local function json (v)
+  local t = type (v)
+  if t == "table" then
+    local out = {}
+    if #v > 0 then
+      for i = 1, #v do
+        out[i] = json (v[i])
+      end
+      return "[\n"..table.concat (out, ",\n").."\n]"
+    end
+    local keys = {}
+    for k in pairs (v) do
+      keys[#keys+1] = k
+    end
+    table.sort (keys)
+    for i, k in ipairs (keys) do
+      out[i] = json_string (tostring (k))..": "..json (v[k])
+    end
+    return "{"..table.concat (out, ", ").."}"
+  elseif t == "number" then
+    return v == math.floor (v) and string.format ("%d", v) or string.format ("%.10g", v)
+  elseif t == "string" then
+    return json_string (v)
+  end
+  return tostring (v)
+end
+
+local cold = drop_caches ()
+if not cold then
+  io.stderr:write ("cannot drop caches: warm runs only\n")
+end
+local results = {}
+for _, b in ipairs (benchmarks) do
+  if not opts.f or b.name:match (opts.f) then
+    results[#results+1] = measure (b, "warm")
+    if cold then
+      results[#results+1] = measure (b, "cold")
+    end
+  end
+end
+
+local out = json {
+  version = lfs._VERSION,
+  lua = _VERSION,
+  entries = entries,
+  stats = lfs.stats ~= nil,
+  results = results,
+}
+if opts.o then
+  local f = assert (io.open (opts.o, "w"))
+  f:write (out, "\n")
+  f:close ()
+else
+  io.write (out, "\n")
+end
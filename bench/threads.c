@@ -0,0 +1,224 @@
+/*
+** Multi-threaded benchmark of lfs, run the way a host embeds Lua: one
+** lua_State per worker thread, all of them loading the library.
+**
+**   bench/threads [-t threads] [-n calls] [-d dir] [-o file.json]
+**
+**   -t  most workers; the benchmarks run with 1, 2, 4... up to it
+**       (default: the number of processors)
+**   -n  calls made by each worker in each benchmark (default 200000)
+**   -d  where the directories of the workers are made (default bench_threads)
+**   -o  JSON file for the results, as bench/run.lua writes them
+**
+** The work is in bench/threads.lua, next to the program. Each worker moves
+** into a directory of its own, with permissions that differ from those of
+** the others, and checks every result it gets, so a result that belongs
+** to another state (a shared buffer, the working directory of another
+** worker) makes the program fail with status 1. The rate should grow with
+** the number of workers, as long as each one has a processor.
+** Build and run it with make bench-threads, which needs the Lua library.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define MAX_WORKERS 256
+
+static const char *const benchmarks[] = { "attributes", "dir", "errors", NULL };
+
+typedef struct worker {
+        pthread_t thread;
+        lua_State *L;
+        const char *bench;
+        long calls;
+        double ops;
+        char error[256];          /* empty if the run went well */
+} worker;
+
+typedef struct gate {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        int waiting;
+        int open;
+} gate;
+
+static gate start = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+static double now (void) {
+        struct timespec ts;
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+** Calls the function name of the table returned by bench/threads.lua, with
+** the integer arg. Returns 0, or -1 with the message in error.
+*/
+static int call (lua_State *L, const char *name, long arg, double *result, char *error) {
+        lua_getglobal (L, "bench");
+        lua_getfield (L, -1, name);
+        lua_pushinteger (L, (lua_Integer)arg);
+        if (lua_pcall (L, 1, 1, 0) != 0) {
+                snprintf (error, 256, "%s: %s", name, lua_tostring (L, -1));
+                lua_pop (L, 2);
+                return -1;
+        }
+        if (result)
+                *result = lua_tonumber (L, -1);
+        lua_pop (L, 2);
+        return 0;
+}
+
+static void *work (void *arg) {
+        worker *w = (worker *)arg;
+        pthread_mutex_lock (&start.lock);
+        start.waiting++;
+        pthread_cond_broadcast (&start.cond);
+        while (!start.open)
+                pthread_cond_wait (&start.cond, &start.lock);
+        pthread_mutex_unlock (&start.lock);
+        w->error[0] = '\0';
+        call (w->L, w->bench, w->calls, &w->ops, w->error);
+        return NULL;
+}
+
+/*
+** Runs bench on the first n workers at once. Returns the operations done
+** per second, or -1 if a worker failed.
+*/
+static double run (worker *workers, int n, const char *bench, long calls) {
+        double t, ops = 0;
+        int i, started, en, failed = 0;
+        start.waiting = start.open = 0;
+        for (started = 0; started < n; started++) {
+                workers[started].bench = bench;
+                workers[started].calls = calls;
+                workers[started].ops = 0;
+                if ((en = pthread_create (&workers[started].thread, NULL, work, &workers[started])) != 0) {
+                        fprintf (stderr, "cannot start a thread: %s\n", strerror (en));
+                        failed = 1;
+                        break;
+                }
+        }
+        /* the clock starts once every worker is waiting */
+        pthread_mutex_lock (&start.lock);
+        while (start.waiting < started)
+                pthread_cond_wait (&start.cond, &start.lock);
+        t = now ();
+        start.open = 1;
+        pthread_cond_broadcast (&start.cond);
+        pthread_mutex_unlock (&start.lock);
+        for (i = 0; i < started; i++)
+                pthread_join (workers[i].thread, NULL);
+        t = now () - t;
+        for (i = 0; i < started; i++) {
+                if (workers[i].error[0]) {
+                        fprintf (stderr, "worker %d: %s\n", i + 1, workers[i].error);
+                        failed = 1;
+                }
+                ops += workers[i].ops;
+        }
+        return failed ? -1 : ops / t;
+}
+
+/*
+** Makes the state of a worker, with the table of script in bench.
+*/
+static lua_State *worker_state (const char *script) {
+        lua_State *L = luaL_newstate ();
+        if (L == NULL)
+                return NULL;
+        luaL_openlibs (L);
+        if (luaL_loadfile (L, script) != 0 || lua_pcall (L, 0, 1, 0) != 0) {
+                fprintf (stderr, "%s\n", lua_tostring (L, -1));
+                lua_close (L);
+                return NULL;
+        }
+        lua_setglobal (L, "bench");
+        return L;
+}
+
+/*
+** Moves worker id into its directory under root. Returns 0 or -1.
+*/
+static int worker_setup (lua_State *L, const char *root, int id) {
+        lua_getglobal (L, "bench");
+        lua_getfield (L, -1, "setup");
+        lua_pushstring (L, root);
+        lua_pushinteger (L, id);
+        if (lua_pcall (L, 2, 0, 0) != 0) {
+                fprintf (stderr, "worker %d: %s\n", id, lua_tostring (L, -1));
+                return -1;
+        }
+        lua_pop (L, 1);
+        return 0;
+}
+
+int main (int argc, char *argv[]) {
+        static worker workers[MAX_WORKERS];
+        char script[4096];
+        const char *root = "bench_threads", *output = NULL, *slash;
+        long calls = 200000, cpus = sysconf (_SC_NPROCESSORS_ONLN);
+        int max = cpus > 0 ? (int)cpus : 1, n, i, b, failed = 0, first = 1;
+        FILE *out = stdout;
+        for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+                switch (argv[i][1]) {
+                case 't': max = atoi (argv[i + 1]); break;
+                case 'n': calls = atol (argv[i + 1]); break;
+                case 'd': root = argv[i + 1]; break;
+                case 'o': output = argv[i + 1]; break;
+                default: i = argc; break;
+                }
+        }
+        if (i != argc || max < 1 || max > MAX_WORKERS || calls < 1) {
+                fprintf (stderr, "usage: %s [-t threads] [-n calls] [-d dir] [-o file.json]\n", argv[0]);
+                return 2;
+        }
+        if (output && (out = fopen (output, "w")) == NULL) {
+                fprintf (stderr, "cannot open %s: %s\n", output, strerror (errno));
+                return 2;
+        }
+        slash = strrchr (argv[0], '/');
+        snprintf (script, sizeof(script), "%.*sthreads.lua", slash ? (int)(slash - argv[0] + 1) : 0, argv[0]);
+        /* all states are made before any of them moves */
+        for (i = 0; i < max; i++)
+                if ((workers[i].L = worker_state (script)) == NULL)
+                        return 1;
+        for (i = 0; i < max; i++)
+                if (worker_setup (workers[i].L, root, i + 1) != 0)
+                        return 1;
+        fprintf (out, "{\"threads\": %d, \"calls\": %ld, \"results\": [\n", max, calls);
+        for (b = 0; benchmarks[b] && !failed; b++) {
+                double single = 0;
+                for (n = 1; n <= max && !failed; n = n * 2 > max && n < max ? max : n * 2) {
+                        double rate = run (workers, n, benchmarks[b], calls);
+                        if (rate < 0) {
+                                failed = 1;
+                                break;
+                        }
+                        if (n == 1)
+                                single = rate;
+                        fprintf (stderr, "%-12s %3d threads %12.0f ops/s  %6.2fx\n",
+                                 benchmarks[b], n, rate, rate / single);
+                        fprintf (out, "%s{\"name\": \"%s.t%d\", \"cache\": \"warm\", \"threads\": %d, "
+                                 "\"ops_per_sec\": %.10g, \"speedup\": %.4g}",
+                                 first ? "" : ",\n", benchmarks[b], n, n, rate, rate / single);
+                        first = 0;
+                }
+        }
+        fprintf (out, "\n]}\n");
+        if (out != stdout)
+                fclose (out);
+        for (i = 0; i < max; i++)
+                lua_close (workers[i].L);
+        return failed;
+}
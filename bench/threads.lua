@@ -0,0 +1,83 @@
+-- Work of a worker of bench/threads.c, loaded in a lua_State of its own.
+--
+-- setup makes the directory of the worker, with entries whose permissions
+-- tell it from the directories of the other workers, and moves into it.
+-- Each benchmark then makes n calls with relative paths and raises an
+-- error on any result that is not the one of this worker.
+
+local lfs = require "lfs"
+
+-- No write bits for the group and others, which the umask would drop
+local modes = {
+  {"755", "rwxr-xr-x"}, {"700", "rwx------"}, {"750", "rwxr-x---"}, {"705", "rwx---r-x"},
+  {"711", "rwx--x--x"}, {"751", "rwxr-x--x"}, {"701", "rwx-----x"}, {"710", "rwx--x---"},
+}
+local entries = 100
+
+local bench = {}
+local perms, names, missing, id
+
+function bench.setup (root, worker)
+  if root:sub (1, 1) ~= "/" then
+    root = lfs.currentdir ().."/"..root
+  end
+  id = worker
+  local mode = modes[(id - 1) % #modes + 1]
+  local dir = root.."/w"..id
+  perms = mode[2]
+  names = {}
+  for i = 1, entries do
+    names[i] = string.format ("e%03d", i)
+    local path = dir.."/"..names[i]
+    if not lfs.attributes (path) then
+      assert (lfs.mkdirs (path, tonumber (mode[1], 8)))
+    end
+  end
+  assert (lfs.chdir (dir))
+  assert (lfs.attributes (names[1], "permissions") == perms, "the umask changed the permissions of "..dir)
+  missing = "missing"..id
+end
+
+function bench.attributes (n)
+  for i = 1, n do
+    local p = lfs.attributes (names[i % entries + 1], "permissions")
+    if p ~= perms then
+      error ("worker "..id.." got permissions "..tostring (p).." for "..perms)
+    end
+  end
+  return n
+end
+
+function bench.dir (n)
+  local count = 0
+  while count < n do
+    local seen = 0
+    for name in lfs.dir (".") do
+      if name ~= "." and name ~= ".." then
+        seen = seen + 1
+        if name:sub (1, 1) ~= "e" then
+          error ("worker "..id.." listed "..name)
+        end
+      end
+    end
+    if seen ~= entries then
+      error ("worker "..id.." listed "..seen.." entries instead of "..entries)
+    end
+    count = count + seen
+  end
+  return count
+end
+
+function bench.errors (n)
+  local expected
+  for i = 1, n do
+    local _, msg = lfs.attributes (missing)
+    expected = expected or msg
+    if msg ~= expected or not msg:find (missing, 1, true) then
+      error ("worker "..id.." got the message "..tostring (msg))
+    end
+  end
+  return n
+end
+
+return bench
@@ -4,19 +4,59 @@
 **
 ** File system manipulation library.
 ** This library offers these functions:
+**   lfs.async.attributes (filepath)
+**   lfs.async.close (fd)
+**   lfs.async.eventfd ()
+**   lfs.async.mkdir (path)
+**   lfs.async.open (filepath [, mode])
+**   lfs.async.poll ([wait])
+**   lfs.async.read (fd, count [, offset])
+**   lfs.async.remove (filepath)
+**   lfs.async.rename (old, new)
+**   lfs.async.rmdir (path)
+**   lfs.async.write (fd, data [, offset])
 **   lfs.attributes (filepath [, attributename | attributetable])
+**   lfs.attributes_many (paths [, attributenames [, options]])
+**   lfs.buffer (capacity)
+**   lfs.bufferstats ()
+**   lfs.cache.enable ([options])
+**   lfs.cache.disable ()
+**   lfs.cache.flush ()
+**   lfs.cache.stats ()
+**   lfs.cachestats ([budget])
 **   lfs.chdir (path)
+**   lfs.commit (files [, options])
+**   lfs.copy (src, dst [, options])
+**   lfs.copytree (src, dst [, options])
 **   lfs.currentdir ()
-**   lfs.dir (path)
+**   lfs.dir (path [, options])
+**   lfs.du (path [, options])
+**   lfs.flock (fh, mode [, options])
+**   lfs.glob (pattern [, options])
+**   lfs.hash (path [, algorithm])
+**   lfs.hashtree (path [, algorithm [, options]])
+**   lfs.index.open (path, indexfile [, options])
 **   lfs.link (old, new[, symlink])
-**   lfs.lock (fh, mode)
-**   lfs.lock_dir (path)
+**   lfs.loadsnapshot (filepath)
+**   lfs.lock (fh, mode [, start [, length]] [, options])
+**   lfs.lock_dir (path [, seconds_stale] [, options])
+**   lfs.lockstats ()
 **   lfs.mkdir (path)
+**   lfs.mkdirs (path [, mode])
+**   lfs.mmap (filepath [, mode])
+**   lfs.resetstats ()
 **   lfs.rmdir (path)
+**   lfs.rmtree (path [, options])
 **   lfs.setmode (filepath, mode)
+**   lfs.snapshot (path)
+**   lfs.stat (filepath [, fieldmask])
+**   lfs.stats ([format])
 **   lfs.symlinkattributes (filepath [, attributename])
 **   lfs.touch (filepath [, atime [, mtime]])
 **   lfs.unlock (fh)
+**   lfs.walk (path [, options])
+**   lfs.watch (path [, options])
+**   lfs.write_atomic (filepath, data [, options])
 */
 
 #ifndef LFS_DO_NOT_USE_LARGE_FILE
@@ -33,7 +73,48 @@
 #define _LARGEFILE64_SOURCE
 #endif
 
+#ifdef __linux__
+#define _GNU_SOURCE /* statx */
+#endif
+
+#if defined(__linux__) && !defined(LFS_NO_GETDENTS)
+#define LFS_HAVE_GETDENTS /* read directories straight from getdents64 */
+#endif
+
+#if defined(__linux__) && !defined(LFS_NO_BOX) && defined(__has_include)
+#if __has_include(<linux/openat2.h>)
+#define LFS_HAVE_BOX /* confine paths under LFB_ROOT */
+#endif
+#endif
+
+#ifndef LFB_ROOT
+#define LFB_ROOT "." /* the current directory when the library is loaded */
+#endif
+
+#ifndef LFS_DIRFD_BUDGET
+#define LFS_DIRFD_BUDGET 0 /* directory descriptors kept open by default */
+#endif
+
+#ifndef LFS_POOL_BUDGET
+#define LFS_POOL_BUDGET (64 << 20) /* bytes of free buffers kept for reuse */
+#endif
+
+#if defined(__linux__) && !defined(LFS_NO_CACHE)
+#define LFS_HAVE_INOTIFY /* stat cache invalidated by inotify */
+#endif
+
+#if !defined(_WIN32) && !defined(LFS_NO_STATS)
+#define LFS_HAVE_STATS /* per function call counters and latencies */
+#endif
+
+#if defined(__linux__) && !defined(LFS_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define LFS_HAVE_URING /* batch system calls through io_uring */
+#endif
+#endif
+
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -60,9 +141,37 @@
   #include <sys/types.h>
   #include <utime.h>
   #include <sys/param.h> /* for MAXPATHLEN */
+  #include <sys/mman.h>
+  #include <pthread.h>
+  #include <stdint.h>
+  #include <sys/file.h> /* flock */
   #define LFS_MAXPATHLEN MAXPATHLEN
 #endif
 
+#ifdef __linux__
+  #include <sys/syscall.h>
+  #include <sys/sysmacros.h>
+  #include <sys/ioctl.h>
+  #include <sys/sendfile.h>
+  #include <linux/fs.h> /* FICLONE */
+#endif
+
+#ifdef LFS_HAVE_BOX
+  #include <linux/openat2.h>
+  #include <sys/inotify.h>
+#endif
+
+#ifdef LFS_HAVE_INOTIFY
+  #include <stddef.h>
+  #include <poll.h>
+  #include <sys/inotify.h>
+#endif
+
+#ifdef LFS_HAVE_URING
+  #include <sys/eventfd.h>
+  #include <linux/io_uring.h>
+#endif
+
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -81,27 +190,94 @@
 #endif
 
 #if LUA_VERSION_NUM < 502
-#  define luaL_newlib(L,l) (lua_newtable(L), luaL_register(L,NULL,l))
+#  define luaL_setfuncs(L,l,n) luaL_openlib(L,NULL,l,n)
+#  define lua_absindex(L,i) ((i) > 0 || (i) <= LUA_REGISTRYINDEX ? (i) : lua_gettop(L) + (i) + 1)
+#else
+#  ifndef lua_objlen
+#    define lua_objlen(L,i) lua_rawlen(L, (i))
+#  endif
 #endif
 
 /* Define 'strerror' for systems that do not implement it */
 #ifdef NO_STRERROR
 #define strerror(_)     "System unable to describe the error"
+#else
+/*
+** strerror may describe an error in a buffer shared by all threads, so
+** states running on other threads could overwrite the message. Describe
+** it in one of the caller instead, which lasts until the end of the block.
+*/
+#define LFS_ERRLEN 128
+
+static const char *lfs_strerror (int err, char *buf) {
+#ifdef _WIN32
+        strerror_s (buf, LFS_ERRLEN, err);
+        return buf;
+#elif defined(__GLIBC__) && defined(_GNU_SOURCE)
+        return strerror_r (err, buf, LFS_ERRLEN);  /* the GNU one */
+#else
+        if (strerror_r (err, buf, LFS_ERRLEN) != 0)
+                snprintf (buf, LFS_ERRLEN, "Unknown error %d", err);
+        return buf;
+#endif
+}
+#define strerror(err)   lfs_strerror (err, (char[LFS_ERRLEN]){ 0 })
 #endif
 
 #define DIR_METATABLE "directory metatable"
+#define DIR_BATCH 1024 /* default number of entries returned by dir:read */
 typedef struct dir_data {
         int  closed;
+        int  batch;
+        int  error;       /* errno of a read that ended a batch early */
 #ifdef _WIN32
         intptr_t hFile;
+        struct _finddata_t c_file;
         char pattern[MAX_PATH+1];
+#elif defined(LFS_HAVE_GETDENTS)
+        int fd;
+        char *buf;        /* raw linux_dirent64 records */
+        size_t bufsize;
+        size_t pos, end;  /* unread part of buf */
 #else
         DIR *dir;
 #endif
 } dir_data;
 
+#ifdef _WIN32
+ #define DT_UNKNOWN 0
+ #define DT_DIR     4
+ #define DT_REG     8
+#endif
+
+#ifdef LFS_HAVE_GETDENTS
+/* Layout of the records filled in by getdents64 */
+struct lfs_dirent64 {
+        uint64_t       d_ino;
+        int64_t        d_off;
+        unsigned short d_reclen;
+        unsigned char  d_type;
+        char           d_name[1];
+};
+#define DIR_BUFSIZE_MIN 32768
+#define DIR_BUFSIZE_MAX 1048576
+#endif
+
 #define LOCK_METATABLE "lock metatable"
 
+#ifndef _WIN32
+enum { LOCK_FCNTL, LOCK_FLOCK, LOCK_DIR, LOCK_KINDS };
+
+/* Contention counters of a kind of lock */
+typedef struct lfs_LockStats {
+        unsigned long acquired, contended, timeouts;
+        double waited;  /* seconds */
+} lfs_LockStats;
+#endif
+
+#define LFS_MAXTHREADS 64 /* upper bound for the threads option */
+#define LFS_MAXFIELDS  32 /* upper bound for the fields option */
+
 #ifdef _WIN32
  #ifdef __BORLANDC__
   #define lfs_setmode(file, m)   (setmode(_fileno(file), m))
@@ -143,177 +319,2323 @@ static int pushresult(lua_State *L, int i, const char *info)
         return 1;
 }
 
-
 /*
-** This function changes the working (current) directory
+** Read fields of an optional table of options.
 */
-static int change_dir (lua_State *L) {
-        const char *path = luaL_checkstring(L, 1);
-        if (chdir(path)) {
-                lua_pushnil (L);
-                lua_pushfstring (L,"Unable to change working directory to '%s'\n%s\n",
-                                path, chdir_error);
-                return 2;
-        } else {
-                lua_pushboolean (L, 1);
-                return 1;
+static lua_Integer opt_integer (lua_State *L, int idx, const char *name, lua_Integer def)
+{
+        lua_Integer v = def;
+        if (lua_istable(L, idx)) {
+                lua_getfield(L, idx, name);
+                if (!lua_isnil(L, -1)) {
+                        if (!lua_isnumber(L, -1))
+                                luaL_error(L, "option '%s' must be a number", name);
+                        v = lua_tointeger(L, -1);
+                }
+                lua_pop(L, 1);
         }
+        return v;
 }
 
-/*
-** This function returns the current directory
-** If unable to get the current directory, it returns nil
-**  and a string describing the error
-*/
-static int get_dir (lua_State *L) {
-#ifdef NO_GETCWD
-    lua_pushnil(L);
-    lua_pushstring(L, "Function 'getcwd' not provided by system");
-    return 2;
-#else
-    char *path = NULL;
-    /* Passing (NULL, 0) is not guaranteed to work. Use a temp buffer and size instead. */
-    size_t size = LFS_MAXPATHLEN; /* initial buffer size */
-    int result;
-    while (1) {
-        path = realloc(path, size);
-        if (!path) /* failed to allocate */
-            return pusherror(L, "get_dir realloc() failed");
-        if (getcwd(path, size) != NULL) {
-            /* success, push the path to the Lua stack */
-            lua_pushstring(L, path);
-            result = 1;
-            break;
+static lua_Number opt_number (lua_State *L, int idx, const char *name, lua_Number def)
+{
+        lua_Number v = def;
+        if (lua_istable(L, idx)) {
+                lua_getfield(L, idx, name);
+                if (!lua_isnil(L, -1)) {
+                        if (!lua_isnumber(L, -1))
+                                luaL_error(L, "option '%s' must be a number", name);
+                        v = lua_tonumber(L, -1);
+                }
+                lua_pop(L, 1);
         }
-        if (errno != ERANGE) { /* unexpected error */
-            result = pusherror(L, "get_dir getcwd() failed");
-            break;
+        return v;
+}
+
+static int opt_boolean (lua_State *L, int idx, const char *name, int def)
+{
+        int v = def;
+        if (lua_istable(L, idx)) {
+                lua_getfield(L, idx, name);
+                if (!lua_isnil(L, -1))
+                        v = lua_toboolean(L, -1);
+                lua_pop(L, 1);
         }
-        /* ERANGE = insufficient buffer capacity, double size and retry */
-        size *= 2;
-    }
-    free(path);
-    return result;
+        return v;
+}
+
+
+#ifndef _WIN32
+/*
+** Closes fd on a failure path. Returns -1.
+*/
+static int close_keep_errno (int fd) {
+        int en = errno;
+        close (fd);
+        errno = en;
+        return -1;
+}
 #endif
+
+#if defined(LFS_HAVE_BOX) || defined(LFS_HAVE_INOTIFY)
+/*
+** FNV-1a hash of s, starting from h.
+*/
+static size_t str_hash (size_t h, const char *s) {
+        while (*s)
+                h = (h ^ (unsigned char)*s++) * 16777619U;
+        return h;
 }
+#endif
 
+#ifdef __linux__
 /*
-** Check if the given element on the stack is a file and returns it.
+** Name under /proc of an open descriptor, to hand it to calls that only
+** take paths.
 */
-static FILE *check_file (lua_State *L, int idx, const char *funcname) {
-#if LUA_VERSION_NUM == 501
-        FILE **fh = (FILE **)luaL_checkudata (L, idx, "FILE*");
-        if (*fh == NULL) {
-                luaL_error (L, "%s: closed file", funcname);
-                return 0;
-        } else
-                return *fh;
-#elif LUA_VERSION_NUM >= 502 && LUA_VERSION_NUM <= 503
-        luaL_Stream *fh = (luaL_Stream *)luaL_checkudata (L, idx, "FILE*");
-        if (fh->closef == 0 || fh->f == NULL) {
-                luaL_error (L, "%s: closed file", funcname);
-                return 0;
-        } else
-                return fh->f;
+static void fd_path (int fd, char *buf) {
+        sprintf (buf, "/proc/self/fd/%d", fd);
+}
+#endif
+
+#ifdef LFS_HAVE_BOX
+typedef struct dirfd_entry {
+        struct dirfd_entry *next;   /* hash chain */
+        struct dirfd_entry *newer, *older;
+        size_t hash;
+        int fd;
+        char path[1];               /* relative to the root of the box */
+} dirfd_entry;
+
+/*
+** Directory descriptors kept open by path, in an LRU list.
+*/
+typedef struct lfs_Dirfds {
+        dirfd_entry **buckets;
+        dirfd_entry *newest, *oldest;
+        size_t budget, count, mask;
+        int notify;                 /* inotify of the cached directories and those above, or -1 */
+        unsigned long hits, misses, evictions, invalidations;
+} lfs_Dirfds;
+#endif
+
+#ifdef LFS_HAVE_STATS
+#define STATS_BUCKETS 40   /* latencies below 2^40 ns, about 18 minutes */
+#define STATS_ERRNOS  8    /* errno values told apart per function */
+#define STATS_DIR_ITER 0   /* entry of the iterator of lfs.dir, then fslib */
+
+/* Counters of a library function */
+typedef struct stats_entry {
+        const char *name;
+        lua_CFunction func;
+        unsigned long calls, errors;
+        uint64_t bytes;
+        uint64_t nanoseconds;             /* spent in the calls that returned */
+        uint64_t buckets[STATS_BUCKETS];  /* calls by log2 of their latency in ns */
+        int errnos[STATS_ERRNOS];         /* 0 for a free slot */
+        unsigned long errcounts[STATS_ERRNOS + 1];  /* the last for the others */
+} stats_entry;
+
+typedef struct lfs_Stats {
+        uint64_t bytes;        /* counted by the running function */
+        size_t n;
+        stats_entry entry[1];
+} lfs_Stats;
+
+#define stats_bytes(L, n) (lfs_state (L)->stats->bytes += (uint64_t)(n))
 #else
-#error unsupported Lua version
+#define stats_bytes(L, n) ((void)0)
+#endif
+
+/*
+** Per Lua state data. It is the first upvalue of every library function.
+*/
+#define STATE_METATABLE "lfs state metatable"
+typedef struct lfs_State {
+        struct lfs_Cache *cache;  /* stat cache, NULL while disabled */
+        struct lfs_Pool *pool;    /* memory of the buffers, NULL until one is made */
+        struct lfs_Memo *memo;    /* digests of lfs.hashtree, NULL until it runs */
+#ifndef _WIN32
+        lfs_LockStats locks[LOCK_KINDS];
+        char *cwd;                /* current directory, relative to root in the box */
+        size_t cwdlen;
+#endif
+#ifdef LFS_HAVE_STATS
+        lfs_Stats *stats;         /* NULL until the functions are registered */
 #endif
+#ifdef LFS_HAVE_BOX
+        int root;                 /* the box */
+        lfs_Dirfds dirfds;        /* only used by the thread running Lua */
+#elif !defined(_WIN32)
+        int cwdfd;                /* current directory, for the *at calls */
+#endif
+} lfs_State;
+
+#define lfs_state(L) ((lfs_State *)lua_touserdata (L, lua_upvalueindex (1)))
+
+
+#ifdef LFS_HAVE_BOX
+/*
+** The box.
+** Paths are resolved under the root directory opened when the library is
+** loaded, by openat2 with RESOLVE_BENEATH, so the kernel refuses any way
+** out of it ("..", symbolic links, mount points) at the cost of a single
+** lookup. Absolute paths start at the root and relative ones at the box
+** current directory; the operations then use the *at calls.
+*/
+
+/*
+** Writes the form of path relative to the root in buf, of LFS_MAXPATHLEN
+** bytes. Returns buf, or NULL with errno set.
+*/
+static char *box_path (lfs_State *S, const char *path, char *buf) {
+        size_t n = 0, len;
+        if (*path == '\0') {
+                errno = ENOENT;
+                return NULL;
+        }
+        if (*path == '/') {
+                while (*path == '/')
+                        path++;
+        } else if (S->cwdlen > 0) {
+                if (S->cwdlen + 1 >= LFS_MAXPATHLEN) {
+                        errno = ENAMETOOLONG;
+                        return NULL;
+                }
+                memcpy (buf, S->cwd, S->cwdlen);
+                buf[S->cwdlen] = '/';
+                n = S->cwdlen + 1;
+        }
+        len = strlen (path);
+        if (n + len >= LFS_MAXPATHLEN) {
+                errno = ENAMETOOLONG;
+                return NULL;
+        }
+        memcpy (buf + n, path, len + 1);
+        if (n + len == 0)
+                strcpy (buf, ".");
+        return buf;
+}
+
+/*
+** Opens a path relative to dirfd without leaving it, with the permissions
+** mode if it is created.
+*/
+static int box_create (int dirfd, const char *rel, int flags, mode_t mode) {
+        struct open_how how;
+        int fd;
+        memset (&how, 0, sizeof(how));
+        how.flags = (uint64_t)(flags | O_CLOEXEC);
+        if (flags & O_CREAT)
+                how.mode = (uint64_t)mode;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        do {
+                fd = (int)syscall (SYS_openat2, dirfd, rel, &how, sizeof(how));
+        } while (fd < 0 && errno == EAGAIN);
+        if (fd < 0 && errno == EXDEV)
+                errno = EACCES;  /* the path leads out of the box */
+        return fd;
 }
 
+#define box_openat(dirfd, rel, flags) box_create (dirfd, rel, flags, 0)
 
 /*
-**
+** Opens path inside the box.
+** Returns a descriptor, or -1 with errno set.
 */
-static int _file_lock (lua_State *L, FILE *fh, const char *mode, const long start, long len, const char *funcname) {
-        int code;
-#ifdef _WIN32
-        /* lkmode valid values are:
-           LK_LOCK    Locks the specified bytes. If the bytes cannot be locked, the program immediately tries again after 1 second. If, after 10 attempts, the bytes cannot be locked, the constant returns an error.
-           LK_NBLCK   Locks the specified bytes. If the bytes cannot be locked, the constant returns an error.
-           LK_NBRLCK  Same as _LK_NBLCK.
-           LK_RLCK    Same as _LK_LOCK.
-           LK_UNLCK   Unlocks the specified bytes, which must have been previously locked.
+static int box_open (lfs_State *S, const char *path, int flags) {
+        char buf[LFS_MAXPATHLEN];
+        if (box_path (S, path, buf) == NULL)
+                return -1;
+        return box_openat (S->root, buf, flags);
+}
 
-           Regions should be locked only briefly and should be unlocked before closing a file or exiting the program.
+/*
+** Directory descriptor cache.
+** Deep paths cost the kernel a lookup per component on every call, so the
+** directories holding the files named by the main thread are kept open,
+** by path, up to a budget of descriptors; operations then resolve just
+** the last component from there. A directory is only kept when its path
+** names it without links or "..", and it and every directory above it up
+** to the root are watched with inotify: a move or removal of any of them,
+** by whatever means, drops the whole cache before its next use, so that a
+** path never resolves in a directory that moved, inside the box or out.
+** lfs.rmdir drops the entries of the directories it removes, and a failed
+** lookup in a directory that has been removed since drops the whole cache
+** and retries. The cache is only used once lfs.cachestats (or
+** LFS_DIRFD_BUDGET) gives it a budget.
+*/
+static void dirfd_remove (lfs_Dirfds *D, dirfd_entry *e) {
+        dirfd_entry **p = &D->buckets[e->hash & D->mask];
+        while (*p != e)
+                p = &(*p)->next;
+        *p = e->next;
+        if (e->newer) e->newer->older = e->older; else D->newest = e->older;
+        if (e->older) e->older->newer = e->newer; else D->oldest = e->newer;
+        close (e->fd);
+        D->count--;
+        free (e);
+}
 
-           http://msdn.microsoft.com/library/default.asp?url=/library/en-us/vclib/html/_crt__locking.asp
-        */
-        int lkmode;
-        switch (*mode) {
-                case 'r': lkmode = LK_NBLCK; break;
-                case 'w': lkmode = LK_NBLCK; break;
-                case 'u': lkmode = LK_UNLCK; break;
-                default : return luaL_error (L, "%s: invalid mode", funcname);
-        }
-        if (!len) {
-                fseek (fh, 0L, SEEK_END);
-                len = ftell (fh);
+static void dirfd_clear (lfs_Dirfds *D) {
+        int en = errno;
+        while (D->newest)
+                dirfd_remove (D, D->newest);
+        if (D->notify >= 0) {
+                close (D->notify);  /* and its watches */
+                D->notify = -1;
         }
-        fseek (fh, start, SEEK_SET);
-#ifdef __BORLANDC__
-        code = locking (fileno(fh), lkmode, len);
-#else
-        code = _locking (fileno(fh), lkmode, len);
-#endif
-#else
-        struct flock f;
-        switch (*mode) {
-                case 'w': f.l_type = F_WRLCK; break;
-                case 'r': f.l_type = F_RDLCK; break;
-                case 'u': f.l_type = F_UNLCK; break;
-                default : return luaL_error (L, "%s: invalid mode", funcname);
+        errno = en;
+}
+
+/*
+** Drops the whole cache if a directory it watches moved or went away
+** since the last call.
+*/
+static void dirfd_sync (lfs_Dirfds *D) {
+        union { struct inotify_event ev; char buf[4096]; } u;
+        if (D->notify >= 0 && read (D->notify, u.buf, sizeof(u.buf)) > 0) {
+                D->invalidations += D->count;
+                dirfd_clear (D);
         }
-        f.l_whence = SEEK_SET;
-        f.l_start = (off_t)start;
-        f.l_len = (off_t)len;
-        code = fcntl (fileno(fh), F_SETLK, &f);
-#endif
-        return (code != -1);
 }
 
-#ifdef _WIN32
-typedef struct lfs_Lock {
-  HANDLE fd;
-} lfs_Lock;
-static int lfs_lock_dir(lua_State *L) {
-  size_t pathl; HANDLE fd;
-  lfs_Lock *lock;
-  char *ln;
-  const char *lockfile = "/lockfile.lfs";
-  const char *path = luaL_checklstring(L, 1, &pathl);
-  ln = (char*)malloc(pathl + strlen(lockfile) + 1);
-  if(!ln) {
-    lua_pushnil(L); lua_pushstring(L, strerror(errno)); return 2;
-  }
-  strcpy(ln, path); strcat(ln, lockfile);
-  if((fd = CreateFile(ln, GENERIC_WRITE, 0, NULL, CREATE_NEW,
-                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, NULL)) == INVALID_HANDLE_VALUE) {
-        int en = GetLastError();
-        free(ln); lua_pushnil(L);
-        if(en == ERROR_FILE_EXISTS || en == ERROR_SHARING_VIOLATION)
-                lua_pushstring(L, "File exists");
-        else
-                lua_pushstring(L, strerror(en));
-        return 2;
-  }
-  free(ln);
-  lock = (lfs_Lock*)lua_newuserdata(L, sizeof(lfs_Lock));
-  lock->fd = fd;
-  luaL_getmetatable (L, LOCK_METATABLE);
-  lua_setmetatable (L, -2);
-  return 1;
+/*
+** Watches the directory open at fd and each one above it up to the root,
+** checking on the way up that rel names them, without links or "..".
+** Returns 0, or -1 if the directory must not be cached.
+*/
+static int dirfd_watch (lfs_State *S, int fd, const char *rel) {
+        lfs_Dirfds *D = &S->dirfds;
+        char buf[LFS_MAXPATHLEN], proc[32], *name;
+        STAT_STRUCT root, self, named;
+        size_t len = strlen (rel);
+        int cur = fd, up, res = -1;
+        if (len >= sizeof(buf) || fstat (S->root, &root) != 0)
+                return -1;
+        if (D->notify < 0 && (D->notify = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)) < 0)
+                return -1;
+        memcpy (buf, rel, len + 1);
+        for (;;) {
+                /* the last component of buf names cur */
+                while (len > 0 && buf[len - 1] == '/')
+                        buf[--len] = '\0';
+                if (fstat (cur, &self) != 0)
+                        break;
+                if (self.st_dev == root.st_dev && self.st_ino == root.st_ino) {
+                        res = len == 0 || strcmp (buf, ".") == 0 ? 0 : -1;
+                        break;
+                }
+                name = strrchr (buf, '/');
+                name = name ? name + 1 : buf;
+                if (len == 0 || strcmp (name, "..") == 0)
+                        break;
+                if (strcmp (name, ".") != 0) {
+                        fd_path (cur, proc);
+                        if (inotify_add_watch (D->notify, proc, IN_MOVE_SELF | IN_DELETE_SELF | IN_ONLYDIR) < 0 ||
+                            (up = openat (cur, "..", O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+                                break;
+                        if (cur != fd)
+                                close (cur);
+                        cur = up;
+                        if (fstatat (cur, name, &named, AT_SYMLINK_NOFOLLOW) != 0 ||
+                            named.st_dev != self.st_dev || named.st_ino != self.st_ino)
+                                break;
+                }
+                len = (size_t)(name - buf);
+                buf[len] = '\0';
+        }
+        if (cur != fd)
+                close (cur);
+        return res;
 }
-static int lfs_unlock_dir(lua_State *L) {
-  lfs_Lock *lock = (lfs_Lock *)luaL_checkudata(L, 1, LOCK_METATABLE);
-  if(lock->fd != INVALID_HANDLE_VALUE) {    
-    CloseHandle(lock->fd);
-    lock->fd=INVALID_HANDLE_VALUE;
-  }
-  return 0;
+
+/*
+** Sets the number of descriptors kept open, dropping the current ones.
+** Returns 0, or -1 with errno set.
+*/
+static int dirfd_budget (lfs_Dirfds *D, size_t budget) {
+        dirfd_entry **buckets = NULL;
+        size_t nb = 16;
+        dirfd_clear (D);
+        while (nb < budget)
+                nb <<= 1;
+        if (budget > 0 &&
+            (buckets = (dirfd_entry **)calloc (nb, sizeof(dirfd_entry *))) == NULL)
+                return -1;
+        free (D->buckets);
+        D->buckets = buckets;
+        D->mask = nb - 1;
+        D->budget = budget;
+        return 0;
 }
-#else
+
+/*
+** Opens the directory rel, relative to the root, through the cache.
+** *cached tells whether the descriptor belongs to the cache or must be
+** closed by the caller; with cached NULL the cache is not used.
+*/
+static int dirfd_get (lfs_State *S, const char *rel, int *cached) {
+        lfs_Dirfds *D = &S->dirfds;
+        dirfd_entry *e;
+        size_t h, len;
+        int fd;
+        if (cached == NULL || D->budget == 0) {
+                if (cached)
+                        *cached = 0;
+                return box_openat (S->root, rel, O_PATH | O_DIRECTORY);
+        }
+        dirfd_sync (D);
+        h = str_hash (2166136261U, rel);
+        for (e = D->buckets[h & D->mask]; e; e = e->next)
+                if (e->hash == h && strcmp (e->path, rel) == 0)
+                        break;
+        if (e) {
+                if (e->newer) { /* move to the front */
+                        e->newer->older = e->older;
+                        if (e->older) e->older->newer = e->newer; else D->oldest = e->newer;
+                        e->older = D->newest;
+                        e->newer = NULL;
+                        D->newest->newer = e;
+                        D->newest = e;
+                }
+                D->hits++;
+                *cached = 1;
+                return e->fd;
+        }
+        D->misses++;
+        *cached = 0;
+        if ((fd = box_openat (S->root, rel, O_PATH | O_DIRECTORY)) < 0)
+                return -1;
+        len = strlen (rel);
+        if (dirfd_watch (S, fd, rel) != 0 ||
+            (e = (dirfd_entry *)malloc (sizeof(dirfd_entry) + len)) == NULL)
+                return fd;
+        memcpy (e->path, rel, len + 1);
+        e->hash = h;
+        e->fd = fd;
+        e->next = D->buckets[h & D->mask];
+        D->buckets[h & D->mask] = e;
+        e->newer = NULL;
+        e->older = D->newest;
+        if (D->newest) D->newest->newer = e; else D->oldest = e;
+        D->newest = e;
+        if (++D->count > D->budget) {
+                D->evictions++;
+                dirfd_remove (D, D->oldest);
+        }
+        *cached = 1;
+        return fd;
+}
+
+/*
+** Drops the entries of path, a directory that no longer exists, and of
+** the directories under it.
+*/
+static void dirfd_invalidate (lfs_State *S, const char *path) {
+        lfs_Dirfds *D = &S->dirfds;
+        char rel[LFS_MAXPATHLEN];
+        dirfd_entry *e, *older;
+        const char *last;
+        size_t len;
+        if (D->count == 0 || box_path (S, path, rel) == NULL)
+                return;
+        len = strlen (rel);
+        while (len > 1 && rel[len - 1] == '/')
+                rel[--len] = '\0';
+        last = strrchr (rel, '/');
+        last = last ? last + 1 : rel;
+        if (strcmp (last, ".") == 0 || strcmp (last, "..") == 0) {
+                D->invalidations += D->count;
+                dirfd_clear (D);
+                return;
+        }
+        for (e = D->newest; e; e = older) {
+                older = e->older;
+                if (strncmp (e->path, rel, len) == 0 &&
+                    (e->path[len] == '\0' || e->path[len] == '/')) {
+                        D->invalidations++;
+                        dirfd_remove (D, e);
+                }
+        }
+}
+
+/*
+** Opens the directory holding path and copies the last component of path
+** to name, of NAME_MAX+1 bytes; "." when path names a directory through
+** "." or "..", which the *at calls then apply to the directory itself.
+** The descriptor comes from the cache as told by dirfd_get.
+*/
+static int box_parent (lfs_State *S, const char *path, char *name, int *cached) {
+        char buf[LFS_MAXPATHLEN], *slash, *last;
+        size_t len;
+        if (cached)
+                *cached = 0;
+        if (box_path (S, path, buf) == NULL)
+                return -1;
+        len = strlen (buf);
+        while (len > 1 && buf[len - 1] == '/')
+                buf[--len] = '\0';
+        slash = strrchr (buf, '/');
+        last = slash ? slash + 1 : buf;
+        if (strcmp (last, ".") == 0 || strcmp (last, "..") == 0) {
+                strcpy (name, ".");
+                return dirfd_get (S, buf, cached);
+        }
+        if (strlen (last) > NAME_MAX) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        strcpy (name, last);
+        if (slash == NULL)
+                return dirfd_get (S, ".", cached);
+        *slash = '\0';
+        return dirfd_get (S, buf, cached);
+}
+
+/*
+** Releases the descriptor of box_parent after an operation that returned
+** res. Returns 1 if the operation must be retried, because it failed in a
+** cached directory that has been removed since.
+*/
+static int box_done (lfs_State *S, int fd, int cached, int res) {
+        struct stat st;
+        int en = errno, retry = 0;
+        if (fd < 0)
+                return 0;
+        if (!cached)
+                close (fd);
+        else if (res < 0 && en == ENOENT && fstat (fd, &st) == 0 && st.st_nlink == 0) {
+                S->dirfds.invalidations += S->dirfds.count;
+                dirfd_clear (&S->dirfds);
+                retry = 1;
+        }
+        errno = en;
+        return retry;
+}
+
+/*
+** Gets the attributes of path, following symbolic links if follow is set.
+** Safe to call from any thread.
+*/
+static int box_stat (lfs_State *S, const char *path, int follow, STAT_STRUCT *info) {
+        int fd = box_open (S, path, O_PATH | (follow ? 0 : O_NOFOLLOW));
+        if (fd < 0)
+                return -1;
+        if (fstatat (fd, "", info, AT_EMPTY_PATH) != 0)
+                return close_keep_errno (fd);
+        close (fd);
+        return 0;
+}
+
+/*
+** Same as box_stat, through the directory descriptor cache.
+*/
+static int box_fstatat (lfs_State *S, const char *path, int follow, STAT_STRUCT *info) {
+        char name[NAME_MAX + 1];
+        int fd, cached, res;
+        do {
+                fd = box_parent (S, path, name, &cached);
+                res = fd < 0 ? -1 : fstatat (fd, name, info, AT_SYMLINK_NOFOLLOW);
+        } while (box_done (S, fd, cached, res));
+        if (res == 0 && follow && S_ISLNK (info->st_mode))
+                return box_stat (S, path, 1, info);  /* followed from the root */
+        return res;
+}
+
+/*
+** Opens path, not with O_PATH, through the directory descriptor cache.
+*/
+static int box_lookup (lfs_State *S, const char *path, int flags) {
+        char name[NAME_MAX + 1];
+        int fd, cached, res;
+        do {
+                fd = box_parent (S, path, name, &cached);
+                res = fd < 0 ? -1 : box_openat (fd, name, flags | O_NOFOLLOW);
+        } while (box_done (S, fd, cached, res));
+        if (res < 0 && (errno == ELOOP || (errno == ENOTDIR && (flags & O_DIRECTORY))))
+                /* a symbolic link, followed from the root to stay confined */
+                return box_open (S, path, flags);
+        return res;
+}
+
+/*
+** Sets the box current directory to the directory open at fd, and the one
+** of the process too if process is set. Returns 0, or -1 with errno set.
+*/
+static int box_chdir (lfs_State *S, int fd, const char *rel, int process) {
+        char link[32], root[LFS_MAXPATHLEN], dir[LFS_MAXPATHLEN], *cwd;
+        ssize_t rl, dl;
+        const char *p;
+        size_t len;
+        fd_path (S->root, link);
+        rl = readlink (link, root, sizeof(root) - 1);
+        fd_path (fd, link);
+        dl = readlink (link, dir, sizeof(dir) - 1);
+        if (rl > 0 && dl >= rl && memcmp (root, dir, (size_t)rl) == 0 &&
+            (dl == rl || dir[rl] == '/' || rl == 1)) {
+                /* canonical name, as the kernel sees it */
+                dir[dl] = '\0';
+                p = dir + rl;
+        } else
+                p = rel;  /* no /proc: keep the name that was used */
+        while (*p == '/')
+                p++;
+        len = strlen (p);
+        if (len == 1 && *p == '.')
+                len = 0;
+        if ((cwd = (char *)malloc (len + 1)) == NULL)
+                return -1;
+        if (process && fchdir (fd) != 0) {
+                free (cwd);
+                return -1;
+        }
+        memcpy (cwd, p, len);
+        cwd[len] = '\0';
+        free (S->cwd);
+        S->cwd = cwd;
+        S->cwdlen = len;
+        return 0;
+}
+#elif !defined(_WIN32)
+/*
+** Working directory.
+** Each state has its own current directory, kept open in cwdfd to resolve
+** relative paths with the *at calls, and by name in cwd for lfs.currentdir
+** and the calls that only take paths. States on different threads can so
+** change directory without affecting each other; lfs.chdir only moves the
+** process, for io.open and os.remove, when asked to.
+*/
+#ifdef O_PATH
+#define CWD_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define CWD_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+#define box_stat(S, path, follow, info) \
+        fstatat ((S)->cwdfd, path, info, (follow) ? 0 : AT_SYMLINK_NOFOLLOW)
+#define box_fstatat box_stat
+
+/*
+** Returns the current directory of the process in a new string of *len
+** bytes, or NULL with errno set.
+*/
+static char *cwd_load (size_t *len) {
+#ifdef NO_GETCWD
+        (void)len;
+        errno = ENOSYS;
+        return NULL;
+#else
+        /* Passing (NULL, 0) is not guaranteed to work. Use a temp buffer and size instead. */
+        size_t size = LFS_MAXPATHLEN; /* initial buffer size */
+        char *path = NULL, *p;
+        while ((p = (char *)realloc (path, size)) != NULL) {
+                path = p;
+                if (getcwd (path, size) != NULL) {
+                        *len = strlen (path);
+                        return path;
+                }
+                if (errno != ERANGE)
+                        break;
+                /* ERANGE = insufficient buffer capacity, double size and retry */
+                size *= 2;
+        }
+        free (path);
+        return NULL;
+#endif
+}
+
+/*
+** Writes path, when relative, after the current directory of S in buf, of
+** LFS_MAXPATHLEN bytes. Returns path itself when it is absolute (or the
+** name of the current directory is not known), buf, or NULL with errno set.
+*/
+static const char *cwd_path (lfs_State *S, const char *path, char *buf) {
+        size_t n = S->cwdlen, len = strlen (path);
+        if (*path == '/' || S->cwd == NULL)
+                return path;
+        if (n == 1)
+                n = 0;  /* the root */
+        if (n + len + 2 > LFS_MAXPATHLEN) {
+                errno = ENAMETOOLONG;
+                return NULL;
+        }
+        memcpy (buf, S->cwd, n);
+        buf[n] = '/';
+        memcpy (buf + n + 1, path, len + 1);
+        return buf;
+}
+
+/*
+** Drops the empty, "." and ".." components of the absolute path p.
+*/
+static void cwd_clean (char *p) {
+        char *in = p, *out = p, *seg;
+        size_t n;
+        while (*in) {
+                while (*in == '/')
+                        in++;
+                for (seg = in; *in && *in != '/'; in++)
+                        ;
+                n = (size_t)(in - seg);
+                if (n == 0 || (n == 1 && seg[0] == '.'))
+                        continue;
+                if (n == 2 && seg[0] == '.' && seg[1] == '.') {
+                        while (out > p && *--out != '/')
+                                ;
+                        continue;
+                }
+                *out++ = '/';
+                memmove (out, seg, n);
+                out += n;
+        }
+        if (out == p)
+                *out++ = '/';
+        *out = '\0';
+}
+
+/*
+** Sets the current directory of S to path, and the one of the process too
+** if process is set. Returns 0, or -1 with errno set.
+*/
+static int cwd_change (lfs_State *S, const char *path, int process) {
+        char buf[LFS_MAXPATHLEN], *cwd = NULL;
+        const char *name = NULL;
+        int fd = openat (S->cwdfd, path, CWD_FLAGS);
+        if (fd < 0)
+                return -1;
+#ifdef __linux__
+        {
+                /* canonical name, as the kernel sees it */
+                char link[32];
+                ssize_t n;
+                fd_path (fd, link);
+                if ((n = readlink (link, buf, sizeof(buf) - 1)) > 0 && buf[0] == '/') {
+                        buf[n] = '\0';
+                        name = buf;
+                }
+        }
+#endif
+        if (name == NULL && (name = cwd_path (S, path, buf)) != NULL && *name == '/') {
+                /* no /proc: the name that was used */
+                if (name != buf && strlen (name) < sizeof(buf))
+                        name = strcpy (buf, name);
+                if (name == buf)
+                        cwd_clean (buf);
+        }
+        if (name != NULL && *name == '/' && (cwd = strdup (name)) == NULL)
+                return close_keep_errno (fd);
+        if (process && fchdir (fd) != 0) {
+                free (cwd);
+                return close_keep_errno (fd);
+        }
+        if (S->cwdfd >= 0)
+                close (S->cwdfd);
+        S->cwdfd = fd;
+        free (S->cwd);
+        S->cwd = cwd;  /* NULL if unknown, for lfs.currentdir to ask again */
+        S->cwdlen = cwd ? strlen (cwd) : 0;
+        return 0;
+}
+#else
+#define box_stat(S, path, follow, info) \
+        ((void)(S), ((follow) ? STAT_FUNC : LSTAT_FUNC) (path, info))
+#define box_fstatat box_stat
+#endif
+
+
+#ifdef LFS_HAVE_INOTIFY
+/*
+** Stat cache.
+** Results of lfs.attributes and lfs.symlinkattributes are kept by path in
+** an LRU list. Each directory of a cached path has a record with an inotify
+** watch: an event on a name drops the entry of that name, and marks the
+** record of the directory of that name dead, which makes every entry under
+** it stale; entries are checked for a dead directory above them when they
+** are found. A directory entry also has a watch of its own. A thread
+** consumes the events as they come, so lookups take no system call; lfs
+** functions that change the file system also consume them before
+** returning, so their effects are seen at once.
+*/
+#define CACHE_WATCH (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                     IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define CACHE_LOST  (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT | IN_Q_OVERFLOW)
+#define CACHE_MAX   4096  /* default max_entries */
+
+typedef struct cache_watch {
+        struct cache_watch *next;  /* hash chain */
+        int wd;
+        size_t refs;               /* entries (or lookups) using the watch */
+        unsigned long gen;         /* events seen on the watch */
+} cache_watch;
+
+typedef struct cache_dir {
+        struct cache_dir *next;     /* chain by path */
+        struct cache_dir *wnext;    /* chain by the watch of up and name */
+        struct cache_dir *snext;    /* chain by own watch */
+        struct cache_dir *up;       /* NULL for "." and "/" */
+        cache_watch *watch;
+        size_t refs;                /* entries, directories and lookups in it */
+        size_t hash, whash;
+        int dead;                   /* the path may name another directory */
+        const char *name;           /* last component of path */
+        char path[1];
+} cache_dir;
+
+typedef struct cache_entry {
+        struct cache_entry *next;   /* chain by path */
+        struct cache_entry *wnext;  /* chain by parent watch and name */
+        struct cache_entry *snext;  /* chain by own watch */
+        struct cache_entry *newer, *older;
+        cache_dir *dir;             /* the parent directory */
+        cache_watch *self;          /* NULL unless a directory */
+        size_t hash, whash;
+        int follow;
+        double expires;
+        STAT_STRUCT info;
+        const char *name;           /* last component of path */
+        char path[1];
+} cache_entry;
+
+typedef struct lfs_Cache {
+        pthread_mutex_t lock;
+        pthread_t thread;
+        int fd;                     /* inotify */
+        int wake[2];                /* written to stop the thread */
+        size_t max, count, nwatches;
+        size_t mask;                /* number of buckets - 1 */
+        double ttl;                 /* seconds, 0 for no limit */
+        cache_entry **bypath, **byname, **byself;
+        cache_dir **dirs, **dirnames, **dirself;  /* the live records */
+        cache_watch **watches;
+        cache_entry *newest, *oldest;
+        unsigned long gen;          /* events on unknown watches and flushes */
+        unsigned long hits, misses, evictions, invalidations;
+} lfs_Cache;
+
+static double cache_now (void) {
+        struct timespec ts;
+        clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+        return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static cache_watch *cache_find_watch (lfs_Cache *c, int wd) {
+        cache_watch *w = c->watches[(size_t)wd & c->mask];
+        while (w && w->wd != wd)
+                w = w->next;
+        return w;
+}
+
+/*
+** Returns the record of watch wd with one more reference, or NULL.
+*/
+static cache_watch *cache_ref_watch (lfs_Cache *c, int wd) {
+        cache_watch *w = cache_find_watch (c, wd);
+        if (w == NULL) {
+                if ((w = (cache_watch *)malloc (sizeof(cache_watch))) == NULL)
+                        return NULL;
+                w->wd = wd;
+                w->refs = 0;
+                w->gen = 0;
+                w->next = c->watches[(size_t)wd & c->mask];
+                c->watches[(size_t)wd & c->mask] = w;
+                c->nwatches++;
+        }
+        w->refs++;
+        return w;
+}
+
+static void cache_unref_watch (lfs_Cache *c, cache_watch *w) {
+        cache_watch **p;
+        if (w == NULL || --w->refs > 0)
+                return;
+        for (p = &c->watches[(size_t)w->wd & c->mask]; *p != w; p = &(*p)->next)
+                ;
+        *p = w->next;
+        inotify_rm_watch (c->fd, w->wd);
+        c->nwatches--;
+        free (w);
+}
+
+static void cache_unchain (cache_entry **p, cache_entry *e, size_t offset) {
+        while (*p != e)
+                p = (cache_entry **)((char *)*p + offset);
+        *p = *(cache_entry **)((char *)e + offset);
+}
+
+static void cache_dir_unchain (cache_dir **p, cache_dir *d, size_t offset) {
+        while (*p != d)
+                p = (cache_dir **)((char *)*p + offset);
+        *p = *(cache_dir **)((char *)d + offset);
+}
+
+/*
+** Forgets the record of a directory whose path may now name another one,
+** making the entries under it stale.
+*/
+static void cache_dir_kill (lfs_Cache *c, cache_dir *d) {
+        if (d->dead)
+                return;
+        d->dead = 1;
+        cache_dir_unchain (&c->dirs[d->hash & c->mask], d, offsetof(cache_dir, next));
+        if (d->up)
+                cache_dir_unchain (&c->dirnames[d->whash & c->mask], d, offsetof(cache_dir, wnext));
+        cache_dir_unchain (&c->dirself[(size_t)d->watch->wd & c->mask], d, offsetof(cache_dir, snext));
+}
+
+static void cache_dir_unref (lfs_Cache *c, cache_dir *d) {
+        while (d != NULL && --d->refs == 0) {
+                cache_dir *up = d->up;
+                cache_dir_kill (c, d);
+                cache_unref_watch (c, d->watch);
+                free (d);
+                d = up;
+        }
+}
+
+static int cache_dir_stale (const cache_dir *d) {
+        for (; d != NULL; d = d->up)
+                if (d->dead)
+                        return 1;
+        return 0;
+}
+
+static void cache_remove (lfs_Cache *c, cache_entry *e) {
+        cache_unchain (&c->bypath[e->hash & c->mask], e, offsetof(cache_entry, next));
+        cache_unchain (&c->byname[e->whash & c->mask], e, offsetof(cache_entry, wnext));
+        if (e->self)
+                cache_unchain (&c->byself[(size_t)e->self->wd & c->mask], e, offsetof(cache_entry, snext));
+        if (e->newer) e->newer->older = e->older; else c->newest = e->older;
+        if (e->older) e->older->newer = e->newer; else c->oldest = e->newer;
+        cache_dir_unref (c, e->dir);
+        cache_unref_watch (c, e->self);
+        c->count--;
+        free (e);
+}
+
+static void cache_clear (lfs_Cache *c) {
+        while (c->newest)
+                cache_remove (c, c->newest);
+        c->gen++;
+}
+
+/*
+** Drops the entries affected by the pending inotify events.
+** Must be called with the lock held.
+*/
+static void cache_drain (lfs_Cache *c) {
+        union {
+                struct inotify_event ev;
+                char buf[4096];
+        } u;
+        ssize_t n;
+        while ((n = read (c->fd, u.buf, sizeof(u.buf))) > 0) {
+                char *p;
+                for (p = u.buf; p < u.buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+                        struct inotify_event *ev = (struct inotify_event *)p;
+                        cache_watch *w = ev->wd < 0 ? NULL : cache_find_watch (c, ev->wd);
+                        cache_entry *e, *next;
+                        if (w == NULL) {
+                                if (ev->mask & IN_Q_OVERFLOW)
+                                        cache_clear (c);
+                                c->gen++;
+                                continue;
+                        }
+                        w->gen++;
+                        if (ev->len == 0 && (ev->mask & (CACHE_LOST | IN_ATTRIB))) {
+                                /* gone, or maybe no longer searchable */
+                                cache_dir *d, *dnext;
+                                for (d = c->dirself[(size_t)ev->wd & c->mask]; d; d = dnext) {
+                                        dnext = d->snext;
+                                        if (d->watch == w)
+                                                cache_dir_kill (c, d);
+                                }
+                        }
+                        /* the directory changed */
+                        for (e = c->byself[(size_t)ev->wd & c->mask]; e; e = next) {
+                                next = e->snext;
+                                if (e->self == w) {
+                                        c->invalidations++;
+                                        cache_remove (c, e);
+                                }
+                        }
+                        /* an entry in the directory changed */
+                        if (ev->len > 0) {
+                                size_t h = str_hash ((size_t)ev->wd * 2166136261U, ev->name);
+                                cache_dir *d, *dnext;
+                                for (e = c->byname[h & c->mask]; e; e = next) {
+                                        next = e->wnext;
+                                        if (e->whash == h && e->dir->watch == w && strcmp (e->name, ev->name) == 0) {
+                                                c->invalidations++;
+                                                cache_remove (c, e);
+                                        }
+                                }
+                                /* and so did what is under it */
+                                for (d = c->dirnames[h & c->mask]; d; d = dnext) {
+                                        dnext = d->wnext;
+                                        if (d->whash == h && d->up->watch == w && strcmp (d->name, ev->name) == 0)
+                                                cache_dir_kill (c, d);
+                                }
+                        }
+                }
+        }
+}
+
+static void *cache_thread (void *arg) {
+        lfs_Cache *c = (lfs_Cache *)arg;
+        struct pollfd p[2];
+        p[0].fd = c->fd;
+        p[0].events = POLLIN;
+        p[1].fd = c->wake[0];
+        p[1].events = POLLIN;
+        for (;;) {
+                if (poll (p, 2, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+                if (p[1].revents)
+                        break;
+                pthread_mutex_lock (&c->lock);
+                cache_drain (c);
+                pthread_mutex_unlock (&c->lock);
+        }
+        return NULL;
+}
+
+/*
+** Consumes pending events, so changes already made are not served from
+** the cache. Preserves errno.
+*/
+static void cache_sync (lfs_State *S) {
+        if (S->cache) {
+                int en = errno;
+                pthread_mutex_lock (&S->cache->lock);
+                cache_drain (S->cache);
+                pthread_mutex_unlock (&S->cache->lock);
+                errno = en;
+        }
+}
+
+/*
+** Drops every entry.
+*/
+static void cache_reset (lfs_State *S) {
+        if (S->cache) {
+                pthread_mutex_lock (&S->cache->lock);
+                cache_clear (S->cache);
+                pthread_mutex_unlock (&S->cache->lock);
+        }
+}
+
+static void cache_free (lfs_Cache *c) {
+        if (write (c->wake[1], "", 1) == 1)
+                pthread_join (c->thread, NULL);
+        cache_clear (c);
+        close (c->fd);
+        close (c->wake[0]);
+        close (c->wake[1]);
+        pthread_mutex_destroy (&c->lock);
+        free (c->bypath);
+        free (c->byname);
+        free (c->byself);
+        free (c->dirs);
+        free (c->dirnames);
+        free (c->dirself);
+        free (c->watches);
+        free (c);
+}
+
+static lfs_Cache *cache_new (size_t max, double ttl) {
+        lfs_Cache *c = (lfs_Cache *)calloc (1, sizeof(lfs_Cache));
+        size_t nb = 64;
+        int en;
+        if (c == NULL)
+                return NULL;
+        while (nb < max)
+                nb <<= 1;
+        c->max = max;
+        c->ttl = ttl;
+        c->mask = nb - 1;
+        c->bypath = (cache_entry **)calloc (nb, sizeof(cache_entry *));
+        c->byname = (cache_entry **)calloc (nb, sizeof(cache_entry *));
+        c->byself = (cache_entry **)calloc (nb, sizeof(cache_entry *));
+        c->dirs = (cache_dir **)calloc (nb, sizeof(cache_dir *));
+        c->dirnames = (cache_dir **)calloc (nb, sizeof(cache_dir *));
+        c->dirself = (cache_dir **)calloc (nb, sizeof(cache_dir *));
+        c->watches = (cache_watch **)calloc (nb, sizeof(cache_watch *));
+        if (!c->bypath || !c->byname || !c->byself || !c->dirs || !c->dirnames || !c->dirself || !c->watches)
+                goto nomem;
+        if ((c->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)) < 0)
+                goto fail;
+        if (pipe2 (c->wake, O_CLOEXEC) != 0) {
+                en = errno;
+                close (c->fd);
+                errno = en;
+                goto fail;
+        }
+        pthread_mutex_init (&c->lock, NULL);
+        if ((en = pthread_create (&c->thread, NULL, cache_thread, c)) != 0) {
+                pthread_mutex_destroy (&c->lock);
+                close (c->fd);
+                close (c->wake[0]);
+                close (c->wake[1]);
+                errno = en;
+                goto fail;
+        }
+        return c;
+nomem:
+        errno = ENOMEM;
+fail:
+        en = errno;
+        free (c->bypath);
+        free (c->byname);
+        free (c->byself);
+        free (c->dirs);
+        free (c->dirnames);
+        free (c->dirself);
+        free (c->watches);
+        free (c);
+        errno = en;
+        return NULL;
+}
+
+/*
+** Splits path into its parent directory (copied to parent) and last
+** component. Returns the offset of the last component, or -1 if the path
+** cannot be cached.
+*/
+static int cache_split (const char *path, char *parent) {
+        const char *slash = strrchr (path, '/');
+        const char *name = slash ? slash + 1 : path;
+        size_t len = slash ? (size_t)(slash - path) : 0;
+        if (*name == '\0' || strcmp (name, ".") == 0 || strcmp (name, "..") == 0 ||
+            len >= LFS_MAXPATHLEN)
+                return -1;
+        if (slash == NULL)
+                strcpy (parent, ".");
+        else if (len == 0)
+                strcpy (parent, "/");
+        else {
+                memcpy (parent, path, len);
+                parent[len] = '\0';
+        }
+        return (int)(name - path);
+}
+
+/*
+** Adds the watch of the directory path.
+*/
+static int cache_add_watch (lfs_State *S, const char *path) {
+#ifdef LFS_HAVE_BOX
+        char rel[LFS_MAXPATHLEN], link[32];
+        int wd, cached = 0;
+        int fd = box_path (S, path, rel) ? dirfd_get (S, rel, &cached) : -1;
+        if (fd < 0)
+                return -1;
+        fd_path (fd, link);
+        wd = inotify_add_watch (S->cache->fd, link, CACHE_WATCH);
+        box_done (S, fd, cached, wd);
+        return wd;
+#else
+        char buf[LFS_MAXPATHLEN];
+        if ((path = cwd_path (S, path, buf)) == NULL)
+                return -1;
+        return inotify_add_watch (S->cache->fd, path, CACHE_WATCH);
+#endif
+}
+
+static cache_dir *cache_find_dir (lfs_Cache *c, const char *path, size_t h) {
+        cache_dir *d;
+        for (d = c->dirs[h & c->mask]; d; d = d->next)
+                if (d->hash == h && strcmp (d->path, path) == 0)
+                        break;
+        return d;
+}
+
+/*
+** Returns the record of directory path, in directory up and named from
+** offset off, with one more reference, or NULL. Must be called with the
+** lock held, which is released while the watch is added.
+*/
+static cache_dir *cache_dir_child (lfs_State *S, cache_dir *up, const char *path, size_t off) {
+        lfs_Cache *c = S->cache;
+        size_t h = str_hash (2166136261U, path);
+        unsigned long gen, ugen;
+        cache_watch *w;
+        cache_dir *d = cache_find_dir (c, path, h), *old;
+        int wd;
+        if (d != NULL && d->up == up) {
+                d->refs++;
+                return d;
+        }
+        gen = c->gen;
+        ugen = up ? up->watch->gen : 0;
+        pthread_mutex_unlock (&c->lock);
+        wd = cache_add_watch (S, path);
+        pthread_mutex_lock (&c->lock);
+        if (wd < 0 || (w = cache_ref_watch (c, wd)) == NULL)
+                return NULL;
+        /* what the watch is on is only known if nothing happened meanwhile */
+        if (c->gen != gen || (up && (cache_dir_stale (up) || up->watch->gen != ugen)) ||
+            (d = (cache_dir *)malloc (sizeof(cache_dir) + strlen (path))) == NULL) {
+                cache_unref_watch (c, w);
+                return NULL;
+        }
+        strcpy (d->path, path);
+        d->name = d->path + off;
+        d->hash = h;
+        d->up = up;
+        d->watch = w;
+        d->refs = 1;
+        d->dead = 0;
+        /* a record of the same path under another directory is replaced */
+        while ((old = cache_find_dir (c, path, h)) != NULL)
+                cache_dir_kill (c, old);
+        d->next = c->dirs[h & c->mask];
+        c->dirs[h & c->mask] = d;
+        if (up != NULL) {
+                up->refs++;
+                d->whash = str_hash ((size_t)up->watch->wd * 2166136261U, d->name);
+                d->wnext = c->dirnames[d->whash & c->mask];
+                c->dirnames[d->whash & c->mask] = d;
+        }
+        d->snext = c->dirself[(size_t)wd & c->mask];
+        c->dirself[(size_t)wd & c->mask] = d;
+        return d;
+}
+
+/*
+** Returns the record of directory path with one more reference, making
+** those of the directories above it as needed, or NULL if path cannot be
+** cached ("." and ".." are only taken at its start).
+*/
+static cache_dir *cache_get_dir (lfs_State *S, const char *path) {
+        lfs_Cache *c = S->cache;
+        char prefix[LFS_MAXPATHLEN];
+        cache_dir *d, *next;
+        size_t pos = 0, end;
+        pthread_mutex_lock (&c->lock);
+        d = cache_find_dir (c, path, str_hash (2166136261U, path));
+        if (d != NULL && !cache_dir_stale (d)) {
+                d->refs++;
+                pthread_mutex_unlock (&c->lock);
+                return d;
+        }
+        /* from the top: "/", or "." for relative paths */
+        if (path[0] == '/')
+                pos = 1;
+        else if (path[0] == '.' && (path[1] == '/' || path[1] == '\0'))
+                pos = path[1] ? 2 : 1;
+        d = cache_dir_child (S, NULL, path[0] == '/' ? "/" : ".", 0);
+        while (d != NULL && path[pos] != '\0') {
+                const char *slash = strchr (path + pos, '/');
+                end = slash ? (size_t)(slash - path) : strlen (path);
+                memcpy (prefix, path, end);
+                prefix[end] = '\0';
+                if (end == pos || strcmp (prefix + pos, ".") == 0 || strcmp (prefix + pos, "..") == 0)
+                        next = NULL;
+                else
+                        next = cache_dir_child (S, d, prefix, pos);
+                cache_dir_unref (c, d);
+                d = next;
+                pos = slash ? end + 1 : end;
+        }
+        pthread_mutex_unlock (&c->lock);
+        return d;
+}
+
+/*
+** Gets the attributes of path, following symbolic links if follow is set,
+** through the cache when it is enabled.
+*/
+static int cached_stat (lfs_State *S, const char *path, int follow, STAT_STRUCT *info) {
+        lfs_Cache *c = S->cache;
+        char parent[LFS_MAXPATHLEN];
+        cache_watch *sw = NULL;
+        cache_dir *d;
+        unsigned long gen, pgen, sgen = 0;
+        cache_entry *e;
+        size_t h;
+        int off, wd, res, keep = 1;
+        if (c == NULL)
+                return box_fstatat (S, path, follow, info);
+        h = str_hash (2166136261U + (size_t)follow, path);
+        pthread_mutex_lock (&c->lock);
+        for (e = c->bypath[h & c->mask]; e; e = e->next)
+                if (e->hash == h && e->follow == follow && strcmp (e->path, path) == 0)
+                        break;
+        if (e && cache_dir_stale (e->dir)) {
+                c->invalidations++;  /* a directory above it changed */
+                cache_remove (c, e);
+                e = NULL;
+        } else if (e && c->ttl > 0 && cache_now () > e->expires) {
+                cache_remove (c, e);
+                e = NULL;
+        }
+        if (e) {
+                if (e->newer) { /* move to the front */
+                        e->newer->older = e->older;
+                        if (e->older) e->older->newer = e->newer; else c->oldest = e->newer;
+                        e->older = c->newest;
+                        e->newer = NULL;
+                        c->newest->newer = e;
+                        c->newest = e;
+                }
+                *info = e->info;
+                c->hits++;
+                pthread_mutex_unlock (&c->lock);
+                return 0;
+        }
+        c->misses++;
+        pthread_mutex_unlock (&c->lock);
+        if ((off = cache_split (path, parent)) < 0 ||
+            (d = cache_get_dir (S, parent)) == NULL)
+                return box_fstatat (S, path, follow, info);
+        /* events from now on must be seen before the entry is stored */
+        pthread_mutex_lock (&c->lock);
+        gen = c->gen;
+        pgen = d->watch->gen;
+        pthread_mutex_unlock (&c->lock);
+        res = box_fstatat (S, path, 0, info);
+        if (res == 0 && follow && S_ISLNK (info->st_mode)) {
+                /* the target is not watched */
+                res = box_fstatat (S, path, 1, info);
+                keep = 0;
+        } else if (res == 0 && S_ISDIR (info->st_mode)) {
+                if ((wd = cache_add_watch (S, path)) < 0)
+                        keep = 0;
+                else {
+                        pthread_mutex_lock (&c->lock);
+                        sw = cache_ref_watch (c, wd);
+                        sgen = sw ? sw->gen : 0;
+                        pthread_mutex_unlock (&c->lock);
+                        res = box_fstatat (S, path, 0, info);
+                }
+        }
+        pthread_mutex_lock (&c->lock);
+        if (res == 0 && keep && (sw || !S_ISDIR (info->st_mode)) && c->gen == gen &&
+            d->watch->gen == pgen && !cache_dir_stale (d) && (!sw || sw->gen == sgen) &&
+            (e = (cache_entry *)malloc (sizeof(cache_entry) + strlen (path))) != NULL) {
+                strcpy (e->path, path);
+                e->name = e->path + off;
+                e->hash = h;
+                e->whash = str_hash ((size_t)d->watch->wd * 2166136261U, e->name);
+                e->follow = follow;
+                e->expires = c->ttl > 0 ? cache_now () + c->ttl : 0;
+                e->info = *info;
+                e->dir = d;
+                e->self = sw;
+                e->next = c->bypath[h & c->mask];
+                c->bypath[h & c->mask] = e;
+                e->wnext = c->byname[e->whash & c->mask];
+                c->byname[e->whash & c->mask] = e;
+                if (sw) {
+                        e->snext = c->byself[(size_t)sw->wd & c->mask];
+                        c->byself[(size_t)sw->wd & c->mask] = e;
+                }
+                e->newer = NULL;
+                e->older = c->newest;
+                if (c->newest) c->newest->newer = e; else c->oldest = e;
+                c->newest = e;
+                if (++c->count > c->max) {
+                        c->evictions++;
+                        cache_remove (c, c->oldest);
+                }
+        } else {
+                cache_dir_unref (c, d);
+                cache_unref_watch (c, sw);
+        }
+        pthread_mutex_unlock (&c->lock);
+        return res;
+}
+
+
+/*
+** Enables the stat cache, replacing the current one.
+** @param #1 Table with options (optional): max_entries and ttl (seconds).
+*/
+static int cache_enable (lua_State *L) {
+        lfs_State *S = lfs_state (L);
+        lua_Integer max = opt_integer (L, 1, "max_entries", CACHE_MAX);
+        lua_Number ttl = opt_number (L, 1, "ttl", 0);
+        luaL_argcheck (L, max > 0, 1, "invalid max_entries");
+        luaL_argcheck (L, ttl >= 0, 1, "invalid ttl");
+        if (S->cache) {
+                cache_free (S->cache);
+                S->cache = NULL;
+        }
+        if ((S->cache = cache_new ((size_t)max, (double)ttl)) == NULL)
+                return pusherror (L, "cannot enable the cache");
+        lua_pushboolean (L, 1);
+        return 1;
+}
+
+static int cache_disable (lua_State *L) {
+        lfs_State *S = lfs_state (L);
+        if (S->cache) {
+                cache_free (S->cache);
+                S->cache = NULL;
+        }
+        return 0;
+}
+
+static int cache_flush (lua_State *L) {
+        cache_reset (lfs_state (L));
+        return 0;
+}
+
+/*
+** Takes into account the changes made so far by other means, without
+** waiting for the background thread.
+*/
+static int cache_sync_events (lua_State *L) {
+        cache_sync (lfs_state (L));
+        return 0;
+}
+
+/*
+** Returns a table with the counters of the cache.
+*/
+static int cache_stats (lua_State *L) {
+        lfs_Cache *c = lfs_state (L)->cache;
+        lua_createtable (L, 0, 7);
+        lua_pushboolean (L, c != NULL);
+        lua_setfield (L, -2, "enabled");
+        if (c) {
+                pthread_mutex_lock (&c->lock);
+                lua_pushinteger (L, (lua_Integer)c->hits);
+                lua_setfield (L, -2, "hits");
+                lua_pushinteger (L, (lua_Integer)c->misses);
+                lua_setfield (L, -2, "misses");
+                lua_pushinteger (L, (lua_Integer)c->evictions);
+                lua_setfield (L, -2, "evictions");
+                lua_pushinteger (L, (lua_Integer)c->invalidations);
+                lua_setfield (L, -2, "invalidations");
+                lua_pushinteger (L, (lua_Integer)c->count);
+                lua_setfield (L, -2, "entries");
+                lua_pushinteger (L, (lua_Integer)c->nwatches);
+                lua_setfield (L, -2, "watches");
+                pthread_mutex_unlock (&c->lock);
+        }
+        return 1;
+}
+
+static const struct luaL_Reg cachelib[] = {
+        {"enable", cache_enable},
+        {"disable", cache_disable},
+        {"flush", cache_flush},
+        {"sync", cache_sync_events},
+        {"stats", cache_stats},
+        {NULL, NULL},
+};
+#else
+#define cache_sync(S) ((void)(S))
+#define cache_reset(S) ((void)(S))
+#define cached_stat(S, path, follow, info) box_fstatat (S, path, follow, info)
+#endif
+
+
+#ifndef _WIN32
+/*
+** Buffer pool.
+** The memory of lfs.buffer objects comes from free lists kept per state,
+** one per power of two from POOL_MINSIZE up, so a program reading chunks
+** of the same size reuses the same blocks. Up to LFS_POOL_BUDGET bytes
+** are kept free. Buffers may outlive the state when Lua closes, so the
+** pool counts its users and goes away with the last.
+*/
+#define POOL_MINSHIFT 12  /* 4 KiB */
+#define POOL_CLASSES  20  /* up to 2 GiB */
+
+typedef struct lfs_Pool {
+        void *free[POOL_CLASSES];  /* free blocks, linked by their first word */
+        size_t pooled;             /* bytes in the free lists */
+        size_t bytes, peakbytes;   /* bytes held by buffers */
+        size_t buffers, peakbuffers;
+        size_t reused, allocated;
+        size_t refs;               /* the state, while open, and each buffer */
+        int closed;
+} lfs_Pool;
+
+/*
+** Takes a block of size class cls.
+** Returns it, or NULL if there is not enough memory.
+*/
+static void *pool_alloc (lfs_Pool *P, int cls) {
+        size_t size = (size_t)1 << (cls + POOL_MINSHIFT);
+        void *p = P->free[cls];
+        if (p != NULL) {
+                P->free[cls] = *(void **)p;
+                P->pooled -= size;
+                P->reused++;
+        } else if ((p = malloc (size)) == NULL) {
+                return NULL;
+        } else
+                P->allocated++;
+        P->refs++;
+        P->bytes += size;
+        if (P->bytes > P->peakbytes)
+                P->peakbytes = P->bytes;
+        if (++P->buffers > P->peakbuffers)
+                P->peakbuffers = P->buffers;
+        return p;
+}
+
+/*
+** Gives back a block of size class cls, freeing the pool when it was
+** its last user.
+*/
+static void pool_free (lfs_Pool *P, void *p, int cls) {
+        size_t size = (size_t)1 << (cls + POOL_MINSHIFT);
+        P->bytes -= size;
+        P->buffers--;
+        if (P->closed || P->pooled + size > LFS_POOL_BUDGET)
+                free (p);
+        else {
+                *(void **)p = P->free[cls];
+                P->free[cls] = p;
+                P->pooled += size;
+        }
+        if (--P->refs == 0)
+                free (P);
+}
+
+/*
+** Empties the free lists and drops the reference of the state.
+*/
+static void pool_close (lfs_Pool *P) {
+        int cls;
+        for (cls = 0; cls < POOL_CLASSES; cls++) {
+                while (P->free[cls] != NULL) {
+                        void *p = P->free[cls];
+                        P->free[cls] = *(void **)p;
+                        free (p);
+                }
+        }
+        P->pooled = 0;
+        P->closed = 1;
+        if (--P->refs == 0)
+                free (P);
+}
+
+
+/*
+** Digest memo.
+** lfs.hashtree keeps the digest of each file it read, with the size and
+** modification time the file had, in a table per state keyed by device,
+** inode and algorithm (open addressing, inode 0 marks an empty slot).
+** Once full, a clock sweep drops the digests not used since it last
+** passed them.
+*/
+typedef struct lfs_MemoEntry {
+        dev_t dev;
+        ino_t ino;
+        int algo;
+        int used;      /* looked up or stored since the hand passed */
+        int64_t size, mtime;
+        unsigned char digest[32];
+} lfs_MemoEntry;
+
+typedef struct lfs_Memo {
+        lfs_MemoEntry *slot;
+        size_t size;   /* number of slots, a power of two */
+        size_t count;
+        size_t hand;   /* next slot the sweep looks at */
+} lfs_Memo;
+
+static void memo_free (lfs_Memo *m) {
+        free (m->slot);
+        free (m);
+}
+#endif
+
+
+static int state_gc (lua_State *L) {
+        lfs_State *S = (lfs_State *)luaL_checkudata (L, 1, STATE_METATABLE);
+#ifdef LFS_HAVE_INOTIFY
+        if (S->cache) {
+                cache_free (S->cache);
+                S->cache = NULL;
+        }
+#endif
+#ifndef _WIN32
+        if (S->pool) {
+                pool_close (S->pool);
+                S->pool = NULL;
+        }
+        if (S->memo) {
+                memo_free (S->memo);
+                S->memo = NULL;
+        }
+#endif
+#ifdef LFS_HAVE_STATS
+        free (S->stats);
+        S->stats = NULL;
+#endif
+#ifndef _WIN32
+        free (S->cwd);
+        S->cwd = NULL;
+#endif
+#ifdef LFS_HAVE_BOX
+        if (S->root >= 0) {
+                close (S->root);
+                S->root = -1;
+        }
+        dirfd_clear (&S->dirfds);
+        free (S->dirfds.buckets);
+        S->dirfds.buckets = NULL;
+        S->dirfds.budget = 0;
+#elif !defined(_WIN32)
+        if (S->cwdfd >= 0) {
+                close (S->cwdfd);
+                S->cwdfd = AT_FDCWD;
+        }
+#endif
+        (void)S;
+        return 0;
+}
+
+/*
+** Pushes a new per state data block.
+*/
+static void state_create (lua_State *L) {
+        lfs_State *S = (lfs_State *)lua_newuserdata (L, sizeof(lfs_State));
+        S->cache = NULL;
+        S->pool = NULL;
+        S->memo = NULL;
+#ifndef _WIN32
+        memset (S->locks, 0, sizeof(S->locks));
+        S->cwd = NULL;
+        S->cwdlen = 0;
+#endif
+#ifdef LFS_HAVE_STATS
+        S->stats = NULL;
+#endif
+#ifdef LFS_HAVE_BOX
+        S->root = -1;
+        memset (&S->dirfds, 0, sizeof(S->dirfds));
+        S->dirfds.notify = -1;
+#elif !defined(_WIN32)
+        S->cwdfd = AT_FDCWD;
+#endif
+        luaL_newmetatable (L, STATE_METATABLE);
+        lua_pushcfunction (L, state_gc);
+        lua_setfield (L, -2, "__gc");
+        lua_setmetatable (L, -2);
+#ifdef LFS_HAVE_BOX
+        S->root = open (LFB_ROOT, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (S->root < 0)
+                luaL_error (L, "cannot open the root directory '%s': %s", LFB_ROOT, strerror (errno));
+        if ((S->cwd = (char *)calloc (1, 1)) == NULL ||
+            dirfd_budget (&S->dirfds, LFS_DIRFD_BUDGET) != 0)
+                luaL_error (L, "not enough memory");
+        {
+                int fd = box_openat (S->root, ".", O_PATH | O_DIRECTORY);
+                if (fd < 0)
+                        luaL_error (L, "cannot confine paths to '%s': %s", LFB_ROOT,
+                                    errno == ENOSYS ? "openat2 is not available" : strerror (errno));
+                close (fd);
+        }
+#elif !defined(_WIN32)
+        /* failing these, paths resolve from the current directory of the process */
+        if ((S->cwdfd = open (".", CWD_FLAGS)) < 0)
+                S->cwdfd = AT_FDCWD;
+        S->cwd = cwd_load (&S->cwdlen);
+#endif
+}
+
+#ifndef _WIN32
+#define ANCHOR_REGISTRY "lfs anchors"
+
+/*
+** Keeps the state of the running function alive as long as the object
+** at idx, which holds a pointer to it, in a table with weak keys.
+*/
+static void state_anchor (lua_State *L, int idx) {
+        idx = lua_absindex (L, idx);
+        lua_getfield (L, LUA_REGISTRYINDEX, ANCHOR_REGISTRY);
+        if (lua_isnil (L, -1)) {
+                lua_pop (L, 1);
+                lua_newtable (L);
+                lua_createtable (L, 0, 1);
+                lua_pushliteral (L, "k");
+                lua_setfield (L, -2, "__mode");
+                lua_setmetatable (L, -2);
+                lua_pushvalue (L, -1);
+                lua_setfield (L, LUA_REGISTRYINDEX, ANCHOR_REGISTRY);
+        }
+        lua_pushvalue (L, idx);
+        lua_pushvalue (L, lua_upvalueindex (1));
+        lua_rawset (L, -3);
+        lua_pop (L, 1);
+}
+#endif
+
+
+#ifdef LFS_HAVE_STATS
+/*
+** Statistics.
+** The functions of fslib, and the iterator of lfs.dir, are registered as
+** closures of stats_call, which counts each call, times it with the
+** monotonic clock and adds its latency to a histogram with a bucket per
+** power of two nanoseconds. A result of nil, message and errno counts as
+** an error. Compiling with LFS_NO_STATS registers the functions directly.
+*/
+static uint64_t stats_now (void) {
+        struct timespec ts;
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void stats_error (stats_entry *e, int err) {
+        int i;
+        e->errors++;
+        for (i = 0; err != 0 && i < STATS_ERRNOS; i++)
+                if (e->errnos[i] == err || e->errnos[i] == 0) {
+                        e->errnos[i] = err;
+                        e->errcounts[i]++;
+                        return;
+                }
+        e->errcounts[STATS_ERRNOS]++;
+}
+
+static int stats_call (lua_State *L) {
+        lfs_Stats *st = lfs_state (L)->stats;
+        stats_entry *e = &st->entry[lua_tointeger (L, lua_upvalueindex (2))];
+        uint64_t start, ns;
+        int n, k;
+        e->calls++;
+        st->bytes = 0;
+        start = stats_now ();
+        n = e->func (L);
+        ns = stats_now () - start;
+        k = ns == 0 ? 0 : 63 - __builtin_clzll (ns);
+        e->buckets[k < STATS_BUCKETS ? k : STATS_BUCKETS - 1]++;
+        e->nanoseconds += ns;
+        e->bytes += st->bytes;
+        if (n >= 2 && lua_isnil (L, -n))
+                stats_error (e, n >= 3 && lua_type (L, 2 - n) == LUA_TNUMBER ? (int)lua_tointeger (L, 2 - n) : 0);
+        return n;
+}
+
+/*
+** Pushes a table with the counters of e.
+*/
+static void stats_push (lua_State *L, const stats_entry *e) {
+        int i, last = -1;
+        lua_createtable (L, 0, 6);
+        lua_pushinteger (L, (lua_Integer)e->calls);
+        lua_setfield (L, -2, "calls");
+        lua_pushinteger (L, (lua_Integer)e->errors);
+        lua_setfield (L, -2, "errors");
+        lua_pushinteger (L, (lua_Integer)e->bytes);
+        lua_setfield (L, -2, "bytes");
+        lua_pushnumber (L, (lua_Number)e->nanoseconds * 1e-9);
+        lua_setfield (L, -2, "time");
+        lua_newtable (L);
+        for (i = 0; i <= STATS_ERRNOS; i++)
+                if (e->errcounts[i] > 0) {
+                        lua_pushinteger (L, (lua_Integer)e->errcounts[i]);
+                        if (i < STATS_ERRNOS)
+                                lua_rawseti (L, -2, e->errnos[i]);
+                        else
+                                lua_setfield (L, -2, "other");
+                }
+        lua_setfield (L, -2, "errnos");
+        for (i = 0; i < STATS_BUCKETS; i++)
+                if (e->buckets[i] > 0)
+                        last = i;
+        lua_createtable (L, last + 1, 0);
+        for (i = 0; i <= last; i++) {
+                lua_pushinteger (L, (lua_Integer)e->buckets[i]);
+                lua_rawseti (L, -2, i + 1);
+        }
+        lua_setfield (L, -2, "histogram");
+}
+
+/*
+** Pushes the Prometheus text exposition of the counters in st.
+*/
+static void stats_prometheus (lua_State *L, const lfs_Stats *st) {
+        luaL_Buffer b;
+        char line[256];
+        size_t i;
+        int k;
+        luaL_buffinit (L, &b);
+        luaL_addstring (&b, "# HELP lfs_calls_total Calls of lfs functions.\n"
+                            "# TYPE lfs_calls_total counter\n");
+        for (i = 0; i < st->n; i++)
+                if (st->entry[i].calls > 0) {
+                        snprintf (line, sizeof(line), "lfs_calls_total{function=\"%s\"} %lu\n",
+                                  st->entry[i].name, st->entry[i].calls);
+                        luaL_addstring (&b, line);
+                }
+        luaL_addstring (&b, "# HELP lfs_errors_total Calls of lfs functions that returned an error, by errno.\n"
+                            "# TYPE lfs_errors_total counter\n");
+        for (i = 0; i < st->n; i++)
+                for (k = 0; k <= STATS_ERRNOS; k++)
+                        if (st->entry[i].errcounts[k] > 0) {
+                                char err[16];
+                                if (k < STATS_ERRNOS)
+                                        snprintf (err, sizeof(err), "%d", st->entry[i].errnos[k]);
+                                else
+                                        strcpy (err, "other");
+                                snprintf (line, sizeof(line), "lfs_errors_total{function=\"%s\",errno=\"%s\"} %lu\n",
+                                          st->entry[i].name, err, st->entry[i].errcounts[k]);
+                                luaL_addstring (&b, line);
+                        }
+        luaL_addstring (&b, "# HELP lfs_bytes_total Bytes copied or read by lfs functions.\n"
+                            "# TYPE lfs_bytes_total counter\n");
+        for (i = 0; i < st->n; i++)
+                if (st->entry[i].bytes > 0) {
+                        snprintf (line, sizeof(line), "lfs_bytes_total{function=\"%s\"} %llu\n",
+                                  st->entry[i].name, (unsigned long long)st->entry[i].bytes);
+                        luaL_addstring (&b, line);
+                }
+        luaL_addstring (&b, "# HELP lfs_call_duration_seconds Latency of the calls of lfs functions.\n"
+                            "# TYPE lfs_call_duration_seconds histogram\n");
+        for (i = 0; i < st->n; i++) {
+                const stats_entry *e = &st->entry[i];
+                unsigned long long count = 0;
+                int last = -1;
+                for (k = 0; k < STATS_BUCKETS; k++)
+                        if (e->buckets[k] > 0)
+                                last = k;
+                if (last < 0)
+                        continue;
+                for (k = 0; k <= last; k++) {
+                        count += e->buckets[k];
+                        snprintf (line, sizeof(line), "lfs_call_duration_seconds_bucket{function=\"%s\",le=\"%.9g\"} %llu\n",
+                                  e->name, (double)(2ULL << k) * 1e-9, count);
+                        luaL_addstring (&b, line);
+                }
+                snprintf (line, sizeof(line), "lfs_call_duration_seconds_bucket{function=\"%s\",le=\"+Inf\"} %llu\n"
+                          "lfs_call_duration_seconds_sum{function=\"%s\"} %.9f\n"
+                          "lfs_call_duration_seconds_count{function=\"%s\"} %llu\n",
+                          e->name, count, e->name, (double)e->nanoseconds * 1e-9, e->name, count);
+                luaL_addstring (&b, line);
+        }
+        luaL_pushresult (&b);
+}
+
+/*
+** Returns the counters of the functions called since the library was
+** loaded or lfs.resetstats was called.
+** @param #1 String with the format (optional): "table", for a table by
+**           function name, or "prometheus", for the text exposition.
+*/
+static int stats_get (lua_State *L) {
+        static const char *const formats[] = {"table", "prometheus", NULL};
+        const lfs_Stats *st = lfs_state (L)->stats;
+        size_t i;
+        if (luaL_checkoption (L, 1, "table", formats) == 1) {
+                stats_prometheus (L, st);
+                return 1;
+        }
+        lua_newtable (L);
+        for (i = 0; i < st->n; i++)
+                if (st->entry[i].calls > 0) {
+                        stats_push (L, &st->entry[i]);
+                        lua_setfield (L, -2, st->entry[i].name);
+                }
+        return 1;
+}
+
+/*
+** Sets every counter to zero.
+*/
+static int stats_reset (lua_State *L) {
+        lfs_Stats *st = lfs_state (L)->stats;
+        size_t i;
+        for (i = 0; i < st->n; i++) {
+                stats_entry *e = &st->entry[i];
+                const char *name = e->name;
+                lua_CFunction func = e->func;
+                memset (e, 0, sizeof(stats_entry));
+                e->name = name;
+                e->func = func;
+        }
+        return 0;
+}
+#endif
+
+/*
+** This function changes the working (current) directory
+** @param #1 Directory path.
+** @param #2 Table with options (optional): process, to move the process too.
+*/
+static int change_dir (lua_State *L) {
+        const char *path = luaL_checkstring(L, 1);
+#ifndef _WIN32
+        int process = opt_boolean (L, 2, "process", 0);
+#endif
+#ifdef LFS_HAVE_BOX
+        lfs_State *S = lfs_state (L);
+        char rel[LFS_MAXPATHLEN];
+        int fd = -1, fail = box_path (S, path, rel) == NULL
+                || (fd = box_openat (S->root, rel, O_PATH | O_DIRECTORY)) < 0
+                || box_chdir (S, fd, rel, process) != 0;
+        if (fd >= 0)
+                close_keep_errno (fd);
+        if (fail) {
+#elif !defined(_WIN32)
+        if (cwd_change (lfs_state (L), path, process)) {
+#else
+        if (chdir(path)) {
+#endif
+                lua_pushnil (L);
+                lua_pushfstring (L,"Unable to change working directory to '%s'\n%s\n",
+                                path, chdir_error);
+                return 2;
+        } else {
+                /* relative paths in the cache now mean other files */
+                cache_reset (lfs_state (L));
+                lua_pushboolean (L, 1);
+                return 1;
+        }
+}
+
+/*
+** This function returns the current directory
+** If unable to get the current directory, it returns nil
+**  and a string describing the error
+*/
+static int get_dir (lua_State *L) {
+#ifdef LFS_HAVE_BOX
+    lfs_State *S = lfs_state (L);
+    lua_pushliteral(L, "/");
+    lua_pushlstring(L, S->cwd, S->cwdlen);
+    lua_concat(L, 2);
+    return 1;
+#elif !defined(_WIN32)
+    lfs_State *S = lfs_state (L);
+    if (S->cwd == NULL && (S->cwd = cwd_load (&S->cwdlen)) == NULL)
+        return pusherror(L, "get_dir getcwd() failed");
+    lua_pushlstring(L, S->cwd, S->cwdlen);
+    return 1;
+#elif defined(NO_GETCWD)
+    lua_pushnil(L);
+    lua_pushstring(L, "Function 'getcwd' not provided by system");
+    return 2;
+#else
+    char *path = NULL;
+    /* Passing (NULL, 0) is not guaranteed to work. Use a temp buffer and size instead. */
+    size_t size = LFS_MAXPATHLEN; /* initial buffer size */
+    int result;
+    while (1) {
+        path = realloc(path, size);
+        if (!path) /* failed to allocate */
+            return pusherror(L, "get_dir realloc() failed");
+        if (getcwd(path, size) != NULL) {
+            /* success, push the path to the Lua stack */
+            lua_pushstring(L, path);
+            result = 1;
+            break;
+        }
+        if (errno != ERANGE) { /* unexpected error */
+            result = pusherror(L, "get_dir getcwd() failed");
+            break;
+        }
+        /* ERANGE = insufficient buffer capacity, double size and retry */
+        size *= 2;
+    }
+    free(path);
+    return result;
+#endif
+}
+
+/*
+** Returns a table with the counters of the directory descriptor cache.
+** @param #1 Number of descriptors to keep open (optional). Setting it
+**   closes the cached ones; 0 disables the cache.
+*/
+static int dirfd_stats (lua_State *L) {
+        unsigned long hits = 0, misses = 0, evictions = 0, invalidations = 0;
+        size_t budget = 0, count = 0;
+#ifdef LFS_HAVE_BOX
+        lfs_Dirfds *D = &lfs_state (L)->dirfds;
+        if (!lua_isnoneornil (L, 1)) {
+                lua_Integer n = luaL_checkinteger (L, 1);
+                luaL_argcheck (L, n >= 0 && n <= 0x7fffffff, 1, "invalid budget");
+                if (dirfd_budget (D, (size_t)n) != 0)
+                        return pusherror (L, "cannot set the budget");
+        }
+        hits = D->hits;
+        misses = D->misses;
+        evictions = D->evictions;
+        invalidations = D->invalidations;
+        budget = D->budget;
+        count = D->count;
+#endif
+        lua_createtable (L, 0, 7);
+        lua_pushinteger (L, (lua_Integer)budget);
+        lua_setfield (L, -2, "budget");
+        lua_pushinteger (L, (lua_Integer)count);
+        lua_setfield (L, -2, "entries");
+        lua_pushinteger (L, (lua_Integer)hits);
+        lua_setfield (L, -2, "hits");
+        lua_pushinteger (L, (lua_Integer)misses);
+        lua_setfield (L, -2, "misses");
+        lua_pushinteger (L, (lua_Integer)evictions);
+        lua_setfield (L, -2, "evictions");
+        lua_pushinteger (L, (lua_Integer)invalidations);
+        lua_setfield (L, -2, "invalidations");
+        lua_pushnumber (L, hits + misses > 0 ? (lua_Number)hits / (lua_Number)(hits + misses) : 0);
+        lua_setfield (L, -2, "hit_rate");
+        return 1;
+}
+
+/*
+** Check if the given element on the stack is a file and returns it.
+*/
+static FILE *check_file (lua_State *L, int idx, const char *funcname) {
+#if LUA_VERSION_NUM == 501
+        FILE **fh = (FILE **)luaL_checkudata (L, idx, "FILE*");
+        if (*fh == NULL) {
+                luaL_error (L, "%s: closed file", funcname);
+                return 0;
+        } else
+                return *fh;
+#elif LUA_VERSION_NUM >= 502 && LUA_VERSION_NUM <= 503
+        luaL_Stream *fh = (luaL_Stream *)luaL_checkudata (L, idx, "FILE*");
+        if (fh->closef == 0 || fh->f == NULL) {
+                luaL_error (L, "%s: closed file", funcname);
+                return 0;
+        } else
+                return fh->f;
+#else
+#error unsupported Lua version
+#endif
+}
+
+
+#ifndef _WIN32
+/*
+** Lock waits.
+** A lock that is held by someone else is waited for in the blocking call
+** (F_OFD_SETLKW, flock without LOCK_NB), so that the kernel wakes the
+** waiter as soon as it is released. When the wait has a deadline, the call
+** is made on a helper thread while the caller waits on a condition
+** variable until then; past it, the helper is cancelled, which interrupts
+** the call whatever the application does with its own signals. As the
+** lock belongs to the open file, taking it again without waiting then
+** tells whether the helper got it before it was cancelled.
+*/
+#ifdef F_OFD_SETLK
+#define LOCK_SETLK  F_OFD_SETLK   /* owned by the open file, not the process */
+#define LOCK_SETLKW F_OFD_SETLKW
+#else
+#define LOCK_SETLK  F_SETLK
+#define LOCK_SETLKW F_SETLKW
+#endif
+
+/* Takes a lock on fd, waiting for it or not. Returns -1 with errno set */
+typedef int (*lock_fn) (int fd, void *arg, int wait);
+
+typedef struct lock_waiter {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        lock_fn fn;
+        void *arg;
+        int fd;
+        int done;
+        int res;   /* errno of the wait, 0 once the lock is taken */
+} lock_waiter;
+
+static double lock_now (void) {
+        struct timespec ts;
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void lock_deadline (struct timespec *ts, double seconds) {
+        clock_gettime (CLOCK_MONOTONIC, ts);
+        ts->tv_sec += (time_t)seconds;
+        ts->tv_nsec += (long)((seconds - (double)(time_t)seconds) * 1e9);
+        if (ts->tv_nsec >= 1000000000L) {
+                ts->tv_sec++;
+                ts->tv_nsec -= 1000000000L;
+        }
+}
+
+static int lock_busy (int err) {
+        return err == EAGAIN || err == EACCES || err == EWOULDBLOCK;
+}
+
+static void *lock_helper (void *arg) {
+        lock_waiter *w = (lock_waiter *)arg;
+        int type, res;
+        do {
+                /* only the call itself can be cancelled */
+                pthread_setcanceltype (PTHREAD_CANCEL_ASYNCHRONOUS, &type);
+                res = w->fn (w->fd, w->arg, 1) == 0 ? 0 : errno;
+                pthread_setcanceltype (PTHREAD_CANCEL_DEFERRED, &type);
+        } while (res == EINTR);
+        pthread_mutex_lock (&w->lock);
+        w->res = res;
+        w->done = 1;
+        pthread_cond_signal (&w->cond);
+        pthread_mutex_unlock (&w->lock);
+        return NULL;
+}
+
+/*
+** Waits up to timeout seconds for fn to take the lock.
+** Returns 0 or an errno value, EAGAIN if the time is over.
+*/
+static int lock_wait_timed (int fd, lock_fn fn, void *arg, double timeout) {
+        pthread_condattr_t attr;
+        struct timespec deadline;
+        pthread_t thread;
+        lock_waiter w;
+        int res, done;
+        pthread_condattr_init (&attr);
+        pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+        pthread_cond_init (&w.cond, &attr);
+        pthread_condattr_destroy (&attr);
+        pthread_mutex_init (&w.lock, NULL);
+        w.fn = fn;
+        w.arg = arg;
+        w.fd = fd;
+        w.done = 0;
+        w.res = 0;
+        lock_deadline (&deadline, timeout);
+        if ((res = pthread_create (&thread, NULL, lock_helper, &w)) == 0) {
+                pthread_mutex_lock (&w.lock);
+                while (!w.done && pthread_cond_timedwait (&w.cond, &w.lock, &deadline) != ETIMEDOUT)
+                        ;
+                done = w.done;
+                pthread_mutex_unlock (&w.lock);
+                if (!done)
+                        pthread_cancel (thread);
+                pthread_join (thread, NULL);
+                if (done)
+                        res = w.res;
+                else if ((res = fn (fd, arg, 0) == 0 ? 0 : errno) != 0 && lock_busy (res))
+                        res = EAGAIN;  /* not taken before the cancellation either */
+        }
+        pthread_mutex_destroy (&w.lock);
+        pthread_cond_destroy (&w.cond);
+        return res;
+}
+
+/*
+** Takes a lock with fn, waiting up to timeout seconds (not at all if 0,
+** forever if negative) while it is held, and counts it in st.
+** Returns 0 or an errno value.
+*/
+static int lock_acquire (lfs_LockStats *st, int fd, lock_fn fn, void *arg, double timeout) {
+        double start;
+        int res = fn (fd, arg, 0) == 0 ? 0 : errno;
+        if (res == 0 || !lock_busy (res)) {
+                st->acquired += res == 0;
+                return res;
+        }
+        st->contended++;
+        if (timeout != 0) {
+                start = lock_now ();
+                if (timeout < 0)
+                        while ((res = fn (fd, arg, 1) == 0 ? 0 : errno) == EINTR)
+                                ;
+                else
+                        res = lock_wait_timed (fd, fn, arg, timeout);
+                st->waited += lock_now () - start;
+        }
+        if (res == 0)
+                st->acquired++;
+        else if (lock_busy (res))
+                st->timeouts++;
+        return res;
+}
+
+static int lock_fcntl (int fd, void *arg, int wait) {
+        return fcntl (fd, wait ? LOCK_SETLKW : LOCK_SETLK, (struct flock *)arg);
+}
+
+static int lock_flock (int fd, void *arg, int wait) {
+        return flock (fd, *(int *)arg | (wait ? 0 : LOCK_NB));
+}
+
+/*
+** Creates the lockfile ln, relative to dirfd, waiting up to timeout
+** seconds while it exists, like lock_acquire. The wait is on inotify
+** events of the directory dir, or in growing sleeps without inotify.
+** Returns 0 or an errno value.
+*/
+static int lock_dir_take (lfs_LockStats *st, int dirfd, const char *dir, const char *ln, double timeout) {
+        double start, left, pause = 0.001;
+        int res = EEXIST, ifd = -1;
+        if (symlinkat ("lock", dirfd, ln) == 0) {
+                st->acquired++;
+                return 0;
+        }
+        if (errno != EEXIST)
+                return errno;
+        st->contended++;
+        start = lock_now ();
+#ifdef LFS_HAVE_INOTIFY
+        if (timeout != 0 && (ifd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)) >= 0 &&
+            inotify_add_watch (ifd, dir, IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR) < 0)
+                ifd = close_keep_errno (ifd);
+#else
+        (void)dir;
+#endif
+        while (timeout != 0) {
+                /* the watch is in place before the lockfile is tried again */
+                if (symlinkat ("lock", dirfd, ln) == 0) {
+                        res = 0;
+                        break;
+                }
+                if ((res = errno) != EEXIST)
+                        break;
+                left = start + timeout - lock_now ();
+                if (timeout > 0 && left <= 0)
+                        break;
+#ifdef LFS_HAVE_INOTIFY
+                if (ifd >= 0) {
+                        union { struct inotify_event ev; char buf[4096]; } u;
+                        struct pollfd p;
+                        p.fd = ifd;
+                        p.events = POLLIN;
+                        if (poll (&p, 1, timeout < 0 || left > 3600 ? 3600000 : (int)(left * 1000) + 1) > 0)
+                                while (read (ifd, u.buf, sizeof(u.buf)) > 0)
+                                        ;
+                        continue;
+                }
+#endif
+                {
+                        struct timespec ts;
+                        if (timeout > 0 && pause > left)
+                                pause = left;
+                        ts.tv_sec = 0;
+                        ts.tv_nsec = (long)(pause * 1e9);
+                        nanosleep (&ts, NULL);
+                        if (pause < 0.1)
+                                pause *= 2;
+                }
+        }
+        if (ifd >= 0)
+                close (ifd);
+        st->waited += lock_now () - start;
+        if (res == 0)
+                st->acquired++;
+        else if (res == EEXIST)
+                st->timeouts++;
+        return res;
+}
+#endif
+
+
+/*
+** Reads the timeout option of the lock functions from the table at idx,
+** if there is one.
+*/
+static double lock_timeout (lua_State *L, int idx) {
+        return lua_istable (L, idx) ? (double)opt_number (L, idx, "timeout", 0) : 0;
+}
+
+/*
+**
+*/
+static int _file_lock (lua_State *L, FILE *fh, const char *mode, lua_Integer start, lua_Integer len, const char *funcname, double timeout) {
+        int code;
+#ifdef _WIN32
+        /* lkmode valid values are:
+           LK_LOCK    Locks the specified bytes. If the bytes cannot be locked, the program immediately tries again after 1 second. If, after 10 attempts, the bytes cannot be locked, the constant returns an error.
+           LK_NBLCK   Locks the specified bytes. If the bytes cannot be locked, the constant returns an error.
+           LK_NBRLCK  Same as _LK_NBLCK.
+           LK_RLCK    Same as _LK_LOCK.
+           LK_UNLCK   Unlocks the specified bytes, which must have been previously locked.
+
+           Regions should be locked only briefly and should be unlocked before closing a file or exiting the program.
+
+           http://msdn.microsoft.com/library/default.asp?url=/library/en-us/vclib/html/_crt__locking.asp
+        */
+        int lkmode;
+        (void)timeout;
+        switch (*mode) {
+                case 'r': lkmode = LK_NBLCK; break;
+                case 'w': lkmode = LK_NBLCK; break;
+                case 'u': lkmode = LK_UNLCK; break;
+                default : return luaL_error (L, "%s: invalid mode", funcname);
+        }
+        if (!len) {
+                fseek (fh, 0L, SEEK_END);
+                len = ftell (fh);
+        }
+        fseek (fh, (long)start, SEEK_SET);
+#ifdef __BORLANDC__
+        code = locking (fileno(fh), lkmode, (long)len);
+#else
+        code = _locking (fileno(fh), lkmode, (long)len);
+#endif
+#else
+        struct flock f;
+        memset (&f, 0, sizeof(f));  /* l_pid must be 0 for OFD locks */
+        switch (*mode) {
+                case 'w': f.l_type = F_WRLCK; break;
+                case 'r': f.l_type = F_RDLCK; break;
+                case 'u': f.l_type = F_UNLCK; break;
+                default : return luaL_error (L, "%s: invalid mode", funcname);
+        }
+        f.l_whence = SEEK_SET;
+        f.l_start = (off_t)start;
+        f.l_len = (off_t)len;
+        if (f.l_type == F_UNLCK)
+                code = fcntl (fileno(fh), LOCK_SETLK, &f);
+        else if ((errno = lock_acquire (&lfs_state (L)->locks[LOCK_FCNTL], fileno(fh), lock_fcntl, &f, timeout)) != 0)
+                code = -1;
+        else
+                code = 0;
+#endif
+        return (code != -1);
+}
+
+#ifdef _WIN32
+typedef struct lfs_Lock {
+  HANDLE fd;
+} lfs_Lock;
+static int lfs_lock_dir(lua_State *L) {
+  size_t pathl; HANDLE fd;
+  lfs_Lock *lock;
+  char *ln;
+  const char *lockfile = "/lockfile.lfs";
+  const char *path = luaL_checklstring(L, 1, &pathl);
+  ln = (char*)malloc(pathl + strlen(lockfile) + 1);
+  if(!ln) {
+    lua_pushnil(L); lua_pushstring(L, strerror(errno)); return 2;
+  }
+  strcpy(ln, path); strcat(ln, lockfile);
+  if((fd = CreateFile(ln, GENERIC_WRITE, 0, NULL, CREATE_NEW,
+                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, NULL)) == INVALID_HANDLE_VALUE) {
+        int en = GetLastError();
+        free(ln); lua_pushnil(L);
+        if(en == ERROR_FILE_EXISTS || en == ERROR_SHARING_VIOLATION)
+                lua_pushstring(L, "File exists");
+        else
+                lua_pushstring(L, strerror(en));
+        return 2;
+  }
+  free(ln);
+  lock = (lfs_Lock*)lua_newuserdata(L, sizeof(lfs_Lock));
+  lock->fd = fd;
+  luaL_getmetatable (L, LOCK_METATABLE);
+  lua_setmetatable (L, -2);
+  return 1;
+}
+static int lfs_unlock_dir(lua_State *L) {
+  lfs_Lock *lock = (lfs_Lock *)luaL_checkudata(L, 1, LOCK_METATABLE);
+  if(lock->fd != INVALID_HANDLE_VALUE) {    
+    CloseHandle(lock->fd);
+    lock->fd=INVALID_HANDLE_VALUE;
+  }
+  return 0;
+}
+#else
 typedef struct lfs_Lock {
   char *ln;
+  int dirfd; /* ln is relative to it */
 } lfs_Lock;
 static int lfs_lock_dir(lua_State *L) {
   lfs_Lock *lock;
@@ -321,594 +2643,8766 @@ static int lfs_lock_dir(lua_State *L) {
   char *ln;
   const char *lockfile = "/lockfile.lfs";
   const char *path = luaL_checklstring(L, 1, &pathl);
+  const char *dir = path; /* watched while waiting */
+  double timeout = lock_timeout(L, lua_istable(L, 2) ? 2 : 3);
+  int dirfd;
+#ifdef __linux__
+  char fdname[32];
+#endif
   lock = (lfs_Lock*)lua_newuserdata(L, sizeof(lfs_Lock));
+#ifdef LFS_HAVE_BOX
+  /* keep the directory open and name the lockfile from there */
+  if((dirfd = box_open(lfs_state(L), path, O_PATH | O_DIRECTORY)) < 0) {
+    lua_pushnil(L); lua_pushstring(L, strerror(errno)); return 2;
+  }
+  fd_path(dirfd, fdname);
+  dir = fdname;
+  path = ".";
+  pathl = 1;
+#else
+  /* the same, so that lfs.chdir does not move the lockfile */
+  if((dirfd = openat(lfs_state(L)->cwdfd, path, CWD_FLAGS)) < 0) {
+    lua_pushnil(L); lua_pushstring(L, strerror(errno)); return 2;
+  }
+#ifdef __linux__
+  fd_path(dirfd, fdname);
+  dir = fdname;
+#endif
+  path = ".";
+  pathl = 1;
+#endif
   ln = (char*)malloc(pathl + strlen(lockfile) + 1);
   if(!ln) {
+    if(dirfd >= 0) close(dirfd);
     lua_pushnil(L); lua_pushstring(L, strerror(errno)); return 2;
   }
   strcpy(ln, path); strcat(ln, lockfile);
-  if(symlink("lock", ln) == -1) {
+  if((errno = lock_dir_take(&lfs_state(L)->locks[LOCK_DIR], dirfd, dir, ln, timeout)) != 0) {
+    if(dirfd >= 0) close_keep_errno(dirfd);
     free(ln); lua_pushnil(L);
     lua_pushstring(L, strerror(errno)); return 2;
   }
+  cache_sync (lfs_state (L));
   lock->ln = ln;
+  lock->dirfd = dirfd;
   luaL_getmetatable (L, LOCK_METATABLE);
   lua_setmetatable (L, -2);
   return 1;
 }
-static int lfs_unlock_dir(lua_State *L) {
-  lfs_Lock *lock = (lfs_Lock *)luaL_checkudata(L, 1, LOCK_METATABLE);
-  if(lock->ln) {
-    unlink(lock->ln);
-    free(lock->ln);
-    lock->ln = NULL;
-  }
-  return 0;
+static int lfs_unlock_dir(lua_State *L) {
+  lfs_Lock *lock = (lfs_Lock *)luaL_checkudata(L, 1, LOCK_METATABLE);
+  if(lock->ln) {
+    unlinkat(lock->dirfd, lock->ln, 0);
+    free(lock->ln);
+    lock->ln = NULL;
+    if(lock->dirfd >= 0) close(lock->dirfd);
+  }
+  return 0;
+}
+#endif
+
+static int lfs_g_setmode (lua_State *L, FILE *f, int arg) {
+  static const int mode[] = {_O_BINARY, _O_TEXT};
+  static const char *const modenames[] = {"binary", "text", NULL};
+  int op = luaL_checkoption(L, arg, NULL, modenames);
+  int res = lfs_setmode(f, mode[op]);
+  if (res != -1) {
+    int i;
+    lua_pushboolean(L, 1);
+    for (i = 0; modenames[i] != NULL; i++) {
+      if (mode[i] == res) {
+        lua_pushstring(L, modenames[i]);
+        return 2;
+      }
+    }
+    lua_pushnil(L);
+    return 2;
+  } else {
+    return pusherror(L, NULL);
+  }
+}
+
+static int lfs_f_setmode(lua_State *L) {
+  return lfs_g_setmode(L, check_file(L, 1, "setmode"), 2);
+}
+
+/*
+** Locks a file.
+** @param #1 File handle.
+** @param #2 String with lock mode ('w'rite, 'r'ead).
+** @param #3 Number with start position (optional).
+** @param #4 Number with length (optional).
+** @param #5 Table with options (optional, and may take the place of #3
+**           or #4): timeout, the seconds to wait while the lock is held.
+*/
+static int file_lock (lua_State *L) {
+        FILE *fh = check_file (L, 1, "lock");
+        const char *mode = luaL_checkstring (L, 2);
+        const lua_Integer start = lua_istable (L, 3) ? 0 : luaL_optinteger (L, 3, 0);
+        lua_Integer len = lua_istable (L, 3) || lua_istable (L, 4) ? 0 : luaL_optinteger (L, 4, 0);
+        if (_file_lock (L, fh, mode, start, len, "lock", lock_timeout (L, lua_gettop (L)))) {
+                lua_pushboolean (L, 1);
+                return 1;
+        } else {
+                lua_pushnil (L);
+                lua_pushfstring (L, "%s", strerror(errno));
+                return 2;
+        }
+}
+
+
+/*
+** Unlocks a file.
+** @param #1 File handle.
+** @param #2 Number with start position (optional).
+** @param #3 Number with length (optional).
+*/
+static int file_unlock (lua_State *L) {
+        FILE *fh = check_file (L, 1, "unlock");
+        const lua_Integer start = luaL_optinteger (L, 2, 0);
+        lua_Integer len = luaL_optinteger (L, 3, 0);
+        if (_file_lock (L, fh, "u", start, len, "unlock", 0)) {
+                lua_pushboolean (L, 1);
+                return 1;
+        } else {
+                lua_pushnil (L);
+                lua_pushfstring (L, "%s", strerror(errno));
+                return 2;
+        }
+}
+
+
+#ifndef _WIN32
+/*
+** Locks or unlocks a whole file with flock.
+** @param #1 File handle.
+** @param #2 String with lock mode ('w'rite/exclusive, 'r'ead/shared,
+**           'u'nlock).
+** @param #3 Table with options (optional): timeout, as for lfs.lock.
+*/
+static int file_flock (lua_State *L) {
+        FILE *fh = check_file (L, 1, "flock");
+        const char *mode = luaL_checkstring (L, 2);
+        double timeout = lock_timeout (L, 3);
+        int op, res;
+        switch (*mode) {
+                case 'w': op = LOCK_EX; break;
+                case 'r': op = LOCK_SH; break;
+                case 'u': op = LOCK_UN; break;
+                default : return luaL_error (L, "flock: invalid mode");
+        }
+        if (op == LOCK_UN)
+                res = flock (fileno(fh), LOCK_UN) == 0 ? 0 : errno;
+        else
+                res = lock_acquire (&lfs_state (L)->locks[LOCK_FLOCK], fileno(fh), lock_flock, &op, timeout);
+        if (res != 0) {
+                errno = res;
+                return pusherror (L, NULL);
+        }
+        lua_pushboolean (L, 1);
+        return 1;
+}
+
+
+/*
+** Returns a table with the contention counters of lfs.lock, lfs.flock
+** and lfs.lock_dir, by function name.
+*/
+static int lock_stats (lua_State *L) {
+        static const char *const names[LOCK_KINDS] = {"lock", "flock", "lock_dir"};
+        lfs_State *S = lfs_state (L);
+        int i;
+        lua_createtable (L, 0, LOCK_KINDS);
+        for (i = 0; i < LOCK_KINDS; i++) {
+                const lfs_LockStats *st = &S->locks[i];
+                lua_createtable (L, 0, 4);
+                lua_pushinteger (L, (lua_Integer)st->acquired);
+                lua_setfield (L, -2, "acquired");
+                lua_pushinteger (L, (lua_Integer)st->contended);
+                lua_setfield (L, -2, "contended");
+                lua_pushinteger (L, (lua_Integer)st->timeouts);
+                lua_setfield (L, -2, "timeouts");
+                lua_pushnumber (L, (lua_Number)st->waited);
+                lua_setfield (L, -2, "waited");
+                lua_setfield (L, -2, names[i]);
+        }
+        return 1;
+}
+#endif
+
+
+/*
+** Creates a link.
+** @param #1 Object to link to.
+** @param #2 Name of link.
+** @param #3 True if link is symbolic (optional).
+*/
+static int make_link(lua_State *L)
+{
+#ifdef LFS_HAVE_BOX
+        lfs_State *S = lfs_state (L);
+        const char *oldpath = luaL_checkstring(L, 1);
+        const char *newpath = luaL_checkstring(L, 2);
+        char oldname[NAME_MAX + 1], newname[NAME_MAX + 1];
+        int res, ofd, nfd, cached;
+        do {
+                res = -1;
+                ofd = -1;
+                nfd = box_parent (S, newpath, newname, &cached);
+                if (nfd >= 0) {
+                        if (lua_toboolean(L,3))
+                                /* the target is only followed by later
+                                   lookups, which are confined */
+                                res = symlinkat (oldpath, nfd, newname);
+                        /* uncached, so it cannot evict nfd */
+                        else if ((ofd = box_parent (S, oldpath, oldname, NULL)) >= 0)
+                                res = linkat (ofd, oldname, nfd, newname, 0);
+                        if (ofd >= 0)
+                                close_keep_errno (ofd);
+                }
+        } while (box_done (S, nfd, cached, res));
+        cache_sync (S);
+        return pushresult(L, res, NULL);
+#elif !defined(_WIN32)
+        lfs_State *S = lfs_state (L);
+        const char *oldpath = luaL_checkstring(L, 1);
+        const char *newpath = luaL_checkstring(L, 2);
+        int res = lua_toboolean(L,3) ? symlinkat (oldpath, S->cwdfd, newpath)
+                                     : linkat (S->cwdfd, oldpath, S->cwdfd, newpath, 0);
+        cache_sync (S);
+        return pushresult(L, res, NULL);
+#else
+        errno = ENOSYS; /* = "Function not implemented" */
+        return pushresult(L, -1, "make_link is not supported on Windows");
+#endif
+}
+
+
+/*
+** Creates a directory.
+** @param #1 Directory path.
+*/
+static int make_dir (lua_State *L) {
+        const char *path = luaL_checkstring (L, 1);
+        int fail;
+#ifdef LFS_HAVE_BOX
+        lfs_State *S = lfs_state (L);
+        char name[NAME_MAX + 1];
+        int fd, cached;
+        do {
+                fd = box_parent (S, path, name, &cached);
+                fail = fd < 0 ? -1 : mkdirat (fd, name, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP |
+                                                        S_IWGRP | S_IXGRP | S_IROTH | S_IXOTH );
+        } while (box_done (S, fd, cached, fail));
+#elif defined(_WIN32)
+        fail = _mkdir (path);
+#else
+        fail =  mkdirat (lfs_state (L)->cwdfd, path, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP |
+                                                     S_IWGRP | S_IXGRP | S_IROTH | S_IXOTH );
+#endif
+        cache_sync (lfs_state (L));
+        if (fail) {
+                lua_pushnil (L);
+        lua_pushfstring (L, "%s", strerror(errno));
+                return 2;
+        }
+        lua_pushboolean (L, 1);
+        return 1;
+}
+
+
+/*
+** Removes a directory.
+** @param #1 Directory path.
+*/
+static int remove_dir (lua_State *L) {
+        const char *path = luaL_checkstring (L, 1);
+        int fail;
+
+#ifdef LFS_HAVE_BOX
+        lfs_State *S = lfs_state (L);
+        char name[NAME_MAX + 1];
+        int fd, cached;
+        do {
+                fd = box_parent (S, path, name, &cached);
+                fail = fd < 0 ? -1 : unlinkat (fd, name, AT_REMOVEDIR);
+        } while (box_done (S, fd, cached, fail));
+        if (!fail)
+                dirfd_invalidate (S, path);
+#elif !defined(_WIN32)
+        fail = unlinkat (lfs_state (L)->cwdfd, path, AT_REMOVEDIR);
+#else
+        fail = rmdir (path);
+#endif
+        cache_sync (lfs_state (L));
+
+        if (fail) {
+                lua_pushnil (L);
+                lua_pushfstring (L, "%s", strerror(errno));
+                return 2;
+        }
+        lua_pushboolean (L, 1);
+        return 1;
+}
+
+
+#ifdef _WIN32
+ #ifndef S_ISDIR
+   #define S_ISDIR(mode)  (mode&_S_IFDIR)
+ #endif
+ #ifndef S_ISREG
+   #define S_ISREG(mode)  (mode&_S_IFREG)
+ #endif
+ #ifndef S_ISLNK
+   #define S_ISLNK(mode)  (0)
+ #endif
+ #ifndef S_ISSOCK
+   #define S_ISSOCK(mode)  (0)
+ #endif
+ #ifndef S_ISFIFO
+   #define S_ISFIFO(mode)  (0)
+ #endif
+ #ifndef S_ISCHR
+   #define S_ISCHR(mode)  (mode&_S_IFCHR)
+ #endif
+ #ifndef S_ISBLK
+   #define S_ISBLK(mode)  (0)
+ #endif
+#endif
+/*
+** Convert the inode protection mode to a string.
+*/
+#ifdef _WIN32
+static const char *mode2string (unsigned short mode) {
+#else
+static const char *mode2string (mode_t mode) {
+#endif
+  if ( S_ISREG(mode) )
+    return "file";
+  else if ( S_ISDIR(mode) )
+    return "directory";
+  else if ( S_ISLNK(mode) )
+        return "link";
+  else if ( S_ISSOCK(mode) )
+    return "socket";
+  else if ( S_ISFIFO(mode) )
+        return "named pipe";
+  else if ( S_ISCHR(mode) )
+        return "char device";
+  else if ( S_ISBLK(mode) )
+        return "block device";
+  else
+        return "other";
+}
+
+
+/*
+** Fetches the next entry of a directory.
+** Returns 1 with name, type and inode set, 0 when there are no more entries
+** (the directory is closed) and -1 on errors (errno is set).
+** The type is a DT_* constant, or DT_UNKNOWN when the system does not tell.
+*/
+static int dir_next_entry (dir_data *d, const char **name, int *type, lua_Integer *ino) {
+#ifdef _WIN32
+        if (d->hFile == 0L) { /* first entry */
+                if ((d->hFile = _findfirst (d->pattern, &d->c_file)) == -1L) {
+                        d->closed = 1;
+                        return -1;
+                }
+        } else if (_findnext (d->hFile, &d->c_file) == -1L) {
+                /* no more entries => close directory */
+                _findclose (d->hFile);
+                d->closed = 1;
+                return 0;
+        }
+        *name = d->c_file.name;
+        *type = (d->c_file.attrib & _A_SUBDIR) ? DT_DIR : DT_REG;
+        *ino = 0;
+        return 1;
+#elif defined(LFS_HAVE_GETDENTS)
+        struct lfs_dirent64 *entry;
+        if (d->pos >= d->end) {
+                long n = syscall (SYS_getdents64, d->fd, d->buf, d->bufsize);
+                if (n <= 0) {
+                        int en = errno;
+                        /* no more entries (or error) => close directory */
+                        close (d->fd);
+                        d->closed = 1;
+                        errno = en;
+                        return n == 0 ? 0 : -1;
+                }
+                d->pos = 0;
+                d->end = (size_t)n;
+        }
+        entry = (struct lfs_dirent64 *)(d->buf + d->pos);
+        d->pos += entry->d_reclen;
+        *name = entry->d_name;
+        *type = entry->d_type;
+        *ino = (lua_Integer)entry->d_ino;
+        return 1;
+#else
+        struct dirent *entry;
+        errno = 0;
+        if ((entry = readdir (d->dir)) == NULL) {
+                int en = errno;
+                /* no more entries (or error) => close directory */
+                closedir (d->dir);
+                d->closed = 1;
+                errno = en;
+                return en == 0 ? 0 : -1;
+        }
+        *name = entry->d_name;
+#ifdef _DIRENT_HAVE_D_TYPE
+        *type = entry->d_type;
+#else
+        *type = DT_UNKNOWN;
+#endif
+        *ino = (lua_Integer)entry->d_ino;
+        return 1;
+#endif
+}
+
+
+/*
+** Reports the error that ended the last batch of dir:read.
+*/
+static int dir_pending_error (lua_State *L, dir_data *d) {
+        errno = d->error;
+        d->error = 0;
+        return pusherror (L, NULL);
+}
+
+
+/*
+** Directory iterator
+*/
+static int dir_iter (lua_State *L) {
+        const char *name;
+        int type;
+        lua_Integer ino;
+        dir_data *d = (dir_data *)luaL_checkudata (L, 1, DIR_METATABLE);
+        if (d->error)
+                return dir_pending_error (L, d);
+        luaL_argcheck (L, d->closed == 0, 1, "closed directory");
+        switch (dir_next_entry (d, &name, &type, &ino)) {
+                case 1:
+                        lua_pushstring (L, name);
+                        return 1;
+                case 0:
+                        return 0;
+                default:
+                        lua_pushnil (L);
+                        lua_pushstring (L, strerror (errno));
+                        return 2;
+        }
+}
+
+
+/*
+** Converts a directory entry type to the strings used by lfs.attributes.
+** Entries the file system reports as DT_UNKNOWN are lstat'ed.
+*/
+static const char *dirtype2string (dir_data *d, const char *name, int type) {
+        switch (type) {
+                case DT_REG:  return "file";
+                case DT_DIR:  return "directory";
+#ifndef _WIN32
+                case DT_LNK:  return "link";
+                case DT_SOCK: return "socket";
+                case DT_FIFO: return "named pipe";
+                case DT_CHR:  return "char device";
+                case DT_BLK:  return "block device";
+                default: {
+                        struct stat info;
+#ifdef LFS_HAVE_GETDENTS
+                        int fd = d->fd;
+#else
+                        int fd = dirfd (d->dir);
+#endif
+                        if (fstatat (fd, name, &info, AT_SYMLINK_NOFOLLOW) == 0)
+                                return mode2string (info.st_mode);
+                        return "other";
+                }
+#else
+                default:
+                        (void)d; (void)name;
+                        return "other";
+#endif
+        }
+}
+
+
+/*
+** Reads a batch of directory entries.
+** @param #1 Directory object.
+** @param #2 Maximum number of entries (optional, defaults to the batch
+**           size given to lfs.dir).
+** Returns three arrays with the names, types and inodes of the entries,
+** or nil when there are no more entries. An error after some entries is
+** returned by the next call, so the batch read so far is not lost.
+*/
+static int dir_read (lua_State *L) {
+        const char *name;
+        int type, res = 1;
+        lua_Integer ino, i = 0;
+        dir_data *d = (dir_data *)luaL_checkudata (L, 1, DIR_METATABLE);
+        lua_Integer max = luaL_optinteger (L, 2, d->batch);
+        luaL_argcheck (L, max > 0, 2, "batch size must be positive");
+        if (d->error)
+                return dir_pending_error (L, d);
+        if (d->closed)
+                return 0;
+        lua_settop (L, 2);
+        lua_createtable (L, (int)(max < DIR_BATCH ? max : DIR_BATCH), 0);
+        lua_createtable (L, (int)(max < DIR_BATCH ? max : DIR_BATCH), 0);
+        lua_createtable (L, (int)(max < DIR_BATCH ? max : DIR_BATCH), 0);
+        while (i < max && (res = dir_next_entry (d, &name, &type, &ino)) == 1) {
+                i++;
+                lua_pushstring (L, name);
+                lua_rawseti (L, 3, i);
+                /* fstatat of DT_UNKNOWN entries must happen before the
+                   buffer is refilled, so resolve the type right now */
+                lua_pushstring (L, dirtype2string (d, name, type));
+                lua_rawseti (L, 4, i);
+                lua_pushinteger (L, ino);
+                lua_rawseti (L, 5, i);
+        }
+        if (res == -1) {
+                if (i == 0)
+                        return pusherror (L, NULL);
+                d->error = errno;  /* for the next call, after this batch */
+        }
+        if (i == 0)
+                return 0;
+        return 3;
+}
+
+
+/*
+** Closes directory iterators
+*/
+static int dir_close (lua_State *L) {
+        dir_data *d = (dir_data *)lua_touserdata (L, 1);
+#ifdef _WIN32
+        if (!d->closed && d->hFile) {
+                _findclose (d->hFile);
+        }
+#elif defined(LFS_HAVE_GETDENTS)
+        if (!d->closed && d->fd >= 0) {
+                close (d->fd);
+        }
+        free (d->buf);
+        d->buf = NULL;
+#else
+        if (!d->closed && d->dir) {
+                closedir (d->dir);
+        }
+#endif
+        d->closed = 1;
+        return 0;
+}
+
+
+/*
+** Factory of directory iterators
+** @param #1 Directory path.
+** @param #2 Table with options (optional): batch, the default number of
+**           entries returned by dir:read.
+*/
+static int dir_iter_factory (lua_State *L) {
+        const char *path = luaL_checkstring (L, 1);
+        lua_Integer batch = DIR_BATCH;
+        dir_data *d;
+        if (lua_istable (L, 2)) {
+                lua_getfield (L, 2, "batch");
+                batch = luaL_optinteger (L, -1, DIR_BATCH);
+                luaL_argcheck (L, batch > 0 && batch <= 0x7fffffff, 2, "batch size must be positive");
+                lua_pop (L, 1);
+        }
+#ifdef LFS_HAVE_STATS
+        lua_pushvalue (L, lua_upvalueindex (1));
+        lua_pushinteger (L, STATS_DIR_ITER);
+        lua_pushcclosure (L, stats_call, 2);
+#else
+        lua_pushcfunction (L, dir_iter);
+#endif
+        d = (dir_data *) lua_newuserdata (L, sizeof(dir_data));
+        luaL_getmetatable (L, DIR_METATABLE);
+        lua_setmetatable (L, -2);
+        d->closed = 0;
+        d->batch = (int)batch;
+        d->error = 0;
+#ifdef _WIN32
+        d->hFile = 0L;
+        if (strlen(path) > MAX_PATH-2)
+          luaL_error (L, "path too long: %s", path);
+        else
+          sprintf (d->pattern, "%s/*", path);
+#elif defined(LFS_HAVE_GETDENTS)
+        d->buf = NULL;
+        d->pos = d->end = 0;
+        /* roughly 32 bytes per record, so a batch usually takes one syscall */
+        d->bufsize = (size_t)batch * 32;
+        if (d->bufsize < DIR_BUFSIZE_MIN)
+          d->bufsize = DIR_BUFSIZE_MIN;
+        else if (d->bufsize > DIR_BUFSIZE_MAX)
+          d->bufsize = DIR_BUFSIZE_MAX;
+#ifdef LFS_HAVE_BOX
+        d->fd = box_lookup (lfs_state (L), path, O_RDONLY | O_DIRECTORY);
+#else
+        d->fd = openat (lfs_state (L)->cwdfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+        if (d->fd < 0)
+          luaL_error (L, "cannot open %s: %s", path, strerror (errno));
+        d->buf = (char *)malloc (d->bufsize);
+        if (d->buf == NULL)
+          luaL_error (L, "cannot open %s: %s", path, strerror (errno));
+#else
+        {
+#ifdef LFS_HAVE_BOX
+          int fd = box_lookup (lfs_state (L), path, O_RDONLY | O_DIRECTORY);
+#else
+          int fd = openat (lfs_state (L)->cwdfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+          d->dir = fd < 0 ? NULL : fdopendir (fd);
+          if (d->dir == NULL && fd >= 0)
+            close_keep_errno (fd);
+        }
+        if (d->dir == NULL)
+          luaL_error (L, "cannot open %s: %s", path, strerror (errno));
+#endif
+        return 2;
+}
+
+
+/*
+** Creates directory metatable.
+*/
+static int dir_create_meta (lua_State *L) {
+        luaL_newmetatable (L, DIR_METATABLE);
+
+        /* Method table */
+        lua_newtable(L);
+        lua_pushcfunction (L, dir_iter);
+        lua_setfield(L, -2, "next");
+        lua_pushcfunction (L, dir_read);
+        lua_setfield(L, -2, "read");
+        lua_pushcfunction (L, dir_close);
+        lua_setfield(L, -2, "close");
+
+        /* Metamethods */
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction (L, dir_close);
+        lua_setfield (L, -2, "__gc");
+        return 1;
+}
+
+
+/*
+** Creates lock metatable.
+*/
+static int lock_create_meta (lua_State *L) {
+        luaL_newmetatable (L, LOCK_METATABLE);
+
+        /* Method table */
+        lua_newtable(L);
+        lua_pushcfunction(L, lfs_unlock_dir);
+        lua_setfield(L, -2, "free");
+
+        /* Metamethods */
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, lfs_unlock_dir);
+        lua_setfield(L, -2, "__gc");
+        return 1;
+}
+
+
+#ifdef LFS_HAVE_BOX
+/*
+** Sets the times of a file inside the box, following symbolic links.
+*/
+static int box_utime (lfs_State *S, const char *file, const struct utimbuf *buf) {
+        struct timespec ts[2], *times = NULL;
+        char name[NAME_MAX + 1];
+        STAT_STRUCT info;
+        int res, fd, cached;
+        if (buf) {
+                ts[0].tv_sec = buf->actime;
+                ts[1].tv_sec = buf->modtime;
+                ts[0].tv_nsec = ts[1].tv_nsec = 0;
+                times = ts;
+        }
+        do {
+                /* from the cached parent, unless it is a symbolic link */
+                fd = box_parent (S, file, name, &cached);
+                res = fd < 0 ? -1 : fstatat (fd, name, &info, AT_SYMLINK_NOFOLLOW);
+                if (res == 0 && !S_ISLNK (info.st_mode))
+                        res = utimensat (fd, name, times, AT_SYMLINK_NOFOLLOW);
+                else if (res == 0)
+                        res = 1;
+        } while (box_done (S, fd, cached, res));
+        if (res <= 0)
+                return res;
+        if ((fd = box_open (S, file, O_PATH)) < 0)
+                return -1;
+        res = utimensat (fd, "", times, AT_EMPTY_PATH);
+        if (res != 0 && errno == EINVAL) {
+                /* older kernels do not take an empty path here */
+                char link[32];
+                fd_path (fd, link);
+                res = utimensat (AT_FDCWD, link, times, 0);
+        }
+        if (res != 0)
+                return close_keep_errno (fd);
+        close (fd);
+        return 0;
+}
+#elif !defined(_WIN32)
+/*
+** Sets the times of a file from the current directory, following symbolic
+** links.
+*/
+static int box_utime (lfs_State *S, const char *file, const struct utimbuf *buf) {
+        struct timespec ts[2];
+        if (buf == NULL)
+                return utimensat (S->cwdfd, file, NULL, 0);
+        ts[0].tv_sec = buf->actime;
+        ts[1].tv_sec = buf->modtime;
+        ts[0].tv_nsec = ts[1].tv_nsec = 0;
+        return utimensat (S->cwdfd, file, ts, 0);
+}
+#else
+#define box_utime(S, file, buf) ((void)(S), utime (file, buf))
+#endif
+
+/*
+** Set access time and modification values for file
+*/
+static int file_utime (lua_State *L) {
+        const char *file = luaL_checkstring (L, 1);
+        struct utimbuf utb, *buf;
+
+        if (lua_gettop (L) == 1) /* set to current date/time */
+                buf = NULL;
+        else {
+                utb.actime = (time_t)luaL_optnumber (L, 2, 0);
+                utb.modtime = (time_t) luaL_optinteger (L, 3, utb.actime);
+                buf = &utb;
+        }
+        if (box_utime (lfs_state (L), file, buf)) {
+                lua_pushnil (L);
+                lua_pushfstring (L, "%s", strerror (errno));
+                return 2;
+        }
+        cache_sync (lfs_state (L));
+        lua_pushboolean (L, 1);
+        return 1;
+}
+
+
+/* inode protection mode */
+static void push_st_mode (lua_State *L, STAT_STRUCT *info) {
+        lua_pushstring (L, mode2string (info->st_mode));
+}
+/* device inode resides on */
+static void push_st_dev (lua_State *L, STAT_STRUCT *info) {
+        lua_pushinteger (L, (lua_Integer) info->st_dev);
+}
+/* inode's number */
+static void push_st_ino (lua_State *L, STAT_STRUCT *info) {
+        lua_pushinteger (L, (lua_Integer) info->st_ino);
+}
+/* number of hard links to the file */
+static void push_st_nlink (lua_State *L, STAT_STRUCT *info) {
+        lua_pushinteger (L, (lua_Integer)info->st_nlink);
+}
+/* user-id of owner */
+static void push_st_uid (lua_State *L, STAT_STRUCT *info) {
+        lua_pushinteger (L, (lua_Integer)info->st_uid);
+}
+/* group-id of owner */
+static void push_st_gid (lua_State *L, STAT_STRUCT *info) {
+        lua_pushinteger (L, (lua_Integer)info->st_gid);
+}
+/* device type, for special file inode */
+static void push_st_rdev (lua_State *L, STAT_STRUCT *info) {
+        lua_pushinteger (L, (lua_Integer) info->st_rdev);
+}
+/* time of last access */
+static void push_st_atime (lua_State *L, STAT_STRUCT *info) {
+        lua_pushinteger (L, (lua_Integer) info->st_atime);
+}
+/* time of last data modification */
+static void push_st_mtime (lua_State *L, STAT_STRUCT *info) {
+        lua_pushinteger (L, (lua_Integer) info->st_mtime);
+}
+/* time of last file status change */
+static void push_st_ctime (lua_State *L, STAT_STRUCT *info) {
+        lua_pushinteger (L, (lua_Integer) info->st_ctime);
+}
+/* file size, in bytes */
+static void push_st_size (lua_State *L, STAT_STRUCT *info) {
+        lua_pushinteger (L, (lua_Integer)info->st_size);
+}
+#ifndef _WIN32
+/* blocks allocated for file */
+static void push_st_blocks (lua_State *L, STAT_STRUCT *info) {
+        lua_pushinteger (L, (lua_Integer)info->st_blocks);
+}
+/* optimal file system I/O blocksize */
+static void push_st_blksize (lua_State *L, STAT_STRUCT *info) {
+        lua_pushinteger (L, (lua_Integer)info->st_blksize);
+}
+#endif
+
+ /*
+** Convert the inode protection mode to a permission list, in perms of
+** PERMS_LEN bytes.
+*/
+#define PERMS_LEN 10
+
+#ifdef _WIN32
+static const char *perm2string (unsigned short mode, char *perms) {
+  int i;
+  for (i=0;i<9;i++) perms[i]='-';
+  if (mode  & _S_IREAD)
+   { perms[0] = 'r'; perms[3] = 'r'; perms[6] = 'r'; }
+  if (mode  & _S_IWRITE)
+   { perms[1] = 'w'; perms[4] = 'w'; perms[7] = 'w'; }
+  if (mode  & _S_IEXEC)
+   { perms[2] = 'x'; perms[5] = 'x'; perms[8] = 'x'; }
+  perms[9] = '\0';
+  return perms;
+}
+#else
+static const char *perm2string (mode_t mode, char *perms) {
+  int i;
+  for (i=0;i<9;i++) perms[i]='-';
+  if (mode & S_IRUSR) perms[0] = 'r';
+  if (mode & S_IWUSR) perms[1] = 'w';
+  if (mode & S_IXUSR) perms[2] = 'x';
+  if (mode & S_IRGRP) perms[3] = 'r';
+  if (mode & S_IWGRP) perms[4] = 'w';
+  if (mode & S_IXGRP) perms[5] = 'x';
+  if (mode & S_IROTH) perms[6] = 'r';
+  if (mode & S_IWOTH) perms[7] = 'w';
+  if (mode & S_IXOTH) perms[8] = 'x';
+  perms[9] = '\0';
+  return perms;
+}
+#endif
+
+/* permssions string */
+static void push_st_perm (lua_State *L, STAT_STRUCT *info) {
+    char perms[PERMS_LEN];
+    lua_pushstring (L, perm2string (info->st_mode, perms));
+}
+
+typedef void (*_push_function) (lua_State *L, STAT_STRUCT *info);
+
+struct _stat_members {
+        const char *name;
+        _push_function push;
+};
+
+static const struct _stat_members members[] = {
+        { "mode",         push_st_mode },
+        { "dev",          push_st_dev },
+        { "ino",          push_st_ino },
+        { "nlink",        push_st_nlink },
+        { "uid",          push_st_uid },
+        { "gid",          push_st_gid },
+        { "rdev",         push_st_rdev },
+        { "access",       push_st_atime },
+        { "modification", push_st_mtime },
+        { "change",       push_st_ctime },
+        { "size",         push_st_size },
+        { "permissions",  push_st_perm },
+#ifndef _WIN32
+        { "blocks",       push_st_blocks },
+        { "blksize",      push_st_blksize },
+#endif
+        { NULL, NULL }
+};
+
+/*
+** Get file or symbolic link information
+*/
+static int _file_info_ (lua_State *L, int follow) {
+        STAT_STRUCT info;
+        const char *file = luaL_checkstring (L, 1);
+        int i;
+
+        if (cached_stat (lfs_state (L), file, follow, &info)) {
+                lua_pushnil(L);
+                lua_pushfstring(L, "cannot obtain information from file '%s': %s", file, strerror(errno));
+                return 2;
+        }
+        if (lua_isstring (L, 2)) {
+                const char *member = lua_tostring (L, 2);
+                for (i = 0; members[i].name; i++) {
+                        if (strcmp(members[i].name, member) == 0) {
+                                /* push member value and return */
+                                members[i].push (L, &info);
+                                return 1;
+                        }
+                }
+                /* member not found */
+                return luaL_error(L, "invalid attribute name '%s'", member);
+        }
+        /* creates a table if none is given, removes extra arguments */
+        lua_settop(L, 2);
+        if (!lua_istable (L, 2)) {
+                lua_newtable (L);
+        }
+        /* stores all members in table on top of the stack */
+        for (i = 0; members[i].name; i++) {
+                lua_pushstring (L, members[i].name);
+                members[i].push (L, &info);
+                lua_rawset (L, -3);
+        }
+        return 1;
+}
+
+
+/*
+** Get file information using stat.
+*/
+static int file_info (lua_State *L) {
+        return _file_info_ (L, 1);
+}
+
+
+/*
+** Push the symlink target to the top of the stack.
+** Assumes the file name is at position 1 of the stack.
+** Returns 1 if successful (with the target on top of the stack),
+** 0 on failure (with stack unchanged, and errno set).
+*/
+static int push_link_target(lua_State *L) {
+#ifdef _WIN32
+        errno = ENOSYS;
+        return 0;
+#else
+        const char *file = luaL_checkstring(L, 1);
+        char *target = NULL;
+        int tsize, size = 256; /* size = initial buffer capacity */
+#ifdef LFS_HAVE_BOX
+        int fd = box_open(lfs_state(L), file, O_PATH | O_NOFOLLOW);
+        if (fd < 0)
+                return 0;
+#endif
+        while (1) {
+            target = realloc(target, size);
+            if (!target) /* failed to allocate */
+                break;
+#ifdef LFS_HAVE_BOX
+            tsize = readlinkat(fd, "", target, size);
+#else
+            tsize = readlinkat(lfs_state(L)->cwdfd, file, target, size);
+#endif
+            if (tsize < 0) { /* a readlink() error occurred */
+                free(target);
+                target = NULL;
+                break;
+            }
+            if (tsize < size)
+                break;
+            /* possibly truncated readlink() result, double size and retry */
+            size *= 2;
+        }
+#ifdef LFS_HAVE_BOX
+        close_keep_errno(fd);
+#endif
+        if (!target)
+            return 0;
+        target[tsize] = '\0';
+        lua_pushlstring(L, target, tsize);
+        free(target);
+        return 1;
+#endif
+}
+
+/*
+** Get symbolic link information using lstat.
+*/
+static int link_info (lua_State *L) {
+        int ret;
+        if (lua_isstring (L, 2) && (strcmp(lua_tostring(L, 2), "target") == 0)) {
+                int ok = push_link_target(L);
+                return ok ? 1 : pusherror(L, "could not obtain link target");
+        }
+        ret = _file_info_ (L, 0);
+        if (ret == 1 && lua_type(L, -1) == LUA_TTABLE) {
+                int ok;
+                lua_getfield(L, -1, "mode");
+                ok = strcmp(lua_tostring(L, -1), "link") == 0;
+                lua_pop(L, 1);
+                if (ok && push_link_target(L)) {
+                        lua_setfield(L, -2, "target");
+                }
+        }
+        return ret;
+}
+
+
+/*
+** Reads the array of attribute names at index idx into sel.
+** Returns the number of selected members, or -1 to select all of them
+** (when there is no array).
+*/
+static int check_fields (lua_State *L, int idx, unsigned char *sel) {
+        int n = 0, i;
+        if (lua_isnoneornil (L, idx))
+                return -1;
+        luaL_checktype (L, idx, LUA_TTABLE);
+        idx = lua_absindex (L, idx);
+        for (;;) {
+                const char *name;
+                lua_rawgeti (L, idx, n + 1);
+                if (lua_isnil (L, -1))
+                        break;
+                name = luaL_checkstring (L, -1);
+                for (i = 0; members[i].name; i++)
+                        if (strcmp (members[i].name, name) == 0)
+                                break;
+                if (members[i].name == NULL)
+                        return luaL_error (L, "invalid attribute name '%s'", name);
+                if (n == LFS_MAXFIELDS)
+                        return luaL_error (L, "too many attribute names");
+                sel[n++] = (unsigned char)i;
+                lua_pop (L, 1);
+        }
+        lua_pop (L, 1);
+        return n;
+}
+
+
+/*
+** Stores the selected members of info in the table on top of the stack.
+*/
+static void set_fields (lua_State *L, STAT_STRUCT *info, const unsigned char *sel, int nsel) {
+        int i;
+        if (nsel < 0) {
+                for (i = 0; members[i].name; i++) {
+                        members[i].push (L, info);
+                        lua_setfield (L, -2, members[i].name);
+                }
+        } else {
+                for (i = 0; i < nsel; i++) {
+                        members[sel[i]].push (L, info);
+                        lua_setfield (L, -2, members[sel[i]].name);
+                }
+        }
+}
+
+
+#ifndef _WIN32
+/*
+** Set of (device, inode) pairs, used to detect files seen before.
+** Open addressing with linear probing; inode 0 marks an empty slot.
+*/
+typedef struct lfs_InoKey {
+        dev_t dev;
+        ino_t ino;
+} lfs_InoKey;
+
+typedef struct lfs_InoSet {
+        lfs_InoKey *slot;
+        size_t size;   /* number of slots, a power of two */
+        size_t count;
+} lfs_InoSet;
+
+static size_t inoset_hash (dev_t dev, ino_t ino) {
+        uint64_t h = ((uint64_t)dev * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)ino;
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        return (size_t)h;
+}
+
+/*
+** Adds a pair to the set.
+** Returns 1 if it was added, 0 if it was already there and -1 when out
+** of memory.
+*/
+static int inoset_add (lfs_InoSet *s, dev_t dev, ino_t ino) {
+        size_t i;
+        if (ino == 0)
+                ino = (ino_t)-1; /* keep 0 as the empty marker */
+        if ((s->count + 1) * 4 > s->size * 3) { /* keep load under 75% */
+                size_t n = s->size ? s->size * 2 : 1024, j;
+                lfs_InoKey *slot = (lfs_InoKey *)calloc (n, sizeof(lfs_InoKey));
+                if (slot == NULL)
+                        return -1;
+                for (j = 0; j < s->size; j++) {
+                        if (s->slot[j].ino == 0)
+                                continue;
+                        i = inoset_hash (s->slot[j].dev, s->slot[j].ino) & (n - 1);
+                        while (slot[i].ino != 0)
+                                i = (i + 1) & (n - 1);
+                        slot[i] = s->slot[j];
+                }
+                free (s->slot);
+                s->slot = slot;
+                s->size = n;
+        }
+        i = inoset_hash (dev, ino) & (s->size - 1);
+        while (s->slot[i].ino != 0) {
+                if (s->slot[i].ino == ino && s->slot[i].dev == dev)
+                        return 0;
+                i = (i + 1) & (s->size - 1);
+        }
+        s->slot[i].dev = dev;
+        s->slot[i].ino = ino;
+        s->count++;
+        return 1;
+}
+
+static void inoset_free (lfs_InoSet *s) {
+        free (s->slot);
+        s->slot = NULL;
+        s->size = s->count = 0;
+}
+
+
+/*
+** Default number of worker threads: one per online processor.
+*/
+static int default_threads (void) {
+        long n = sysconf (_SC_NPROCESSORS_ONLN);
+        return n < 1 ? 1 : (n > LFS_MAXTHREADS ? LFS_MAXTHREADS : (int)n);
+}
+
+
+/*
+** Runs fn(arg, i) for every i in [0, n) on up to nthreads threads.
+*/
+typedef void (*lfs_Task) (void *arg, size_t i);
+
+typedef struct lfs_Parallel {
+        lfs_Task fn;
+        void *arg;
+        size_t n;
+        size_t next;  /* next index to hand out, updated atomically */
+} lfs_Parallel;
+
+static void *parallel_worker (void *arg) {
+        lfs_Parallel *p = (lfs_Parallel *)arg;
+        size_t i;
+        while ((i = __atomic_fetch_add (&p->next, 1, __ATOMIC_RELAXED)) < p->n)
+                p->fn (p->arg, i);
+        return NULL;
+}
+
+static void run_parallel (int nthreads, size_t n, lfs_Task fn, void *arg) {
+        pthread_t threads[LFS_MAXTHREADS];
+        lfs_Parallel p;
+        int i, started = 0;
+        p.fn = fn;
+        p.arg = arg;
+        p.n = n;
+        p.next = 0;
+        if ((size_t)nthreads > n)
+                nthreads = (int)n;
+        /* the calling thread is one of the workers */
+        for (i = 1; i < nthreads; i++)
+                if (pthread_create (&threads[started], NULL, parallel_worker, &p) == 0)
+                        started++;
+        parallel_worker (&p);
+        for (i = 0; i < started; i++)
+                pthread_join (threads[i], NULL);
+}
+
+
+/*
+** Tree walker.
+** A pool of worker threads takes directories from a shared stack, reads
+** them and stats every entry with fstatat relative to the directory
+** descriptor. Subdirectories are opened with openat on the same descriptor
+** and pushed back on the stack. Entries are handed to the consumer in
+** batches through a bounded queue, so workers stall if it falls behind.
+** With inodeorder, the entries of a directory are stat'ed by increasing
+** d_ino, so that cold inode tables are read in order rather than at
+** random, and then emitted in directory order.
+*/
+#define WALK_METATABLE "walker metatable"
+#define WALK_BATCH 1024
+#define WALK_MAXBATCH 65536  /* entries per batch at most */
+#define WALK_MAXFDS 256      /* descriptors held by queued directories */
+#define WALK_BUFSIZE 65536   /* per-thread getdents64 buffer */
+
+typedef struct walk_entry {
+        STAT_STRUCT info;
+        size_t path;  /* offset of the path in the arena of the batch */
+        int depth;
+        int err;      /* errno if the entry could not be read, 0 otherwise */
+} walk_entry;
+
+typedef struct walk_batch {
+        struct walk_batch *next;
+        walk_entry *e;
+        size_t n, cap;
+        char *arena;
+        size_t used, size;
+} walk_batch;
+
+typedef struct walk_dir {
+        struct walk_dir *next;
+        int fd;       /* open descriptor, or -1 to reopen it by path */
+        int depth;
+        char path[1];
+} walk_dir;
+
+typedef struct walk_options {
+        int threads;
+        int maxdepth;  /* negative for no limit */
+        int follow;    /* follow symbolic links */
+        int onefs;     /* stay on the file system of the root */
+        int inodeorder;
+        int batch;
+} walk_options;
+
+typedef struct lfs_Walk {
+        pthread_mutex_t lock;
+        pthread_cond_t work;      /* directories were queued */
+        pthread_cond_t room;      /* the consumer took a batch */
+        pthread_cond_t ready;     /* a batch was queued, or the walk ended */
+        walk_dir *todo;           /* directories waiting to be read */
+        walk_batch *head, *tail;  /* batches waiting for the consumer */
+        int queued, maxqueued;
+        int busy;                 /* workers reading a directory */
+        int fds;                  /* descriptors held by queued directories */
+        int running;              /* workers that did not finish yet */
+        int cancel;
+        int err;                  /* errno that cut the walk short, or 0 */
+        int nthreads;
+        pthread_t threads[LFS_MAXTHREADS];
+        walk_options opt;
+        dev_t dev;                /* device of the root */
+        lfs_InoSet seen;          /* directories visited, when following links */
+#ifdef LFS_HAVE_BOX
+        int box;                  /* root of the box */
+        char *base;               /* the walked root, relative to box */
+        size_t rootlen;           /* length of the walked root as given */
+#else
+        int cwd;                  /* current directory of the state when it started */
+#endif
+} lfs_Walk;
+
+
+static walk_batch *walk_batch_new (size_t cap) {
+        walk_batch *b = (walk_batch *)calloc (1, sizeof(walk_batch));
+        if (b == NULL)
+                return NULL;
+        b->e = (walk_entry *)malloc (cap * sizeof(walk_entry));
+        b->size = cap * 32;
+        b->arena = (char *)malloc (b->size);
+        if (b->e == NULL || b->arena == NULL) {
+                free (b->e);
+                free (b->arena);
+                free (b);
+                return NULL;
+        }
+        b->cap = cap;
+        return b;
+}
+
+static void walk_batch_free (walk_batch *b) {
+        if (b) {
+                free (b->e);
+                free (b->arena);
+                free (b);
+        }
+}
+
+/*
+** Appends an entry named dir/name to a batch (name may be NULL).
+** Returns 0 when out of memory.
+*/
+static int walk_batch_add (walk_batch *b, const char *dir, const char *name,
+                           int depth, int err, const STAT_STRUCT *info) {
+        size_t dl = strlen (dir), nl = name ? strlen (name) : 0;
+        size_t need = dl + nl + 2;
+        walk_entry *e = &b->e[b->n];
+        if (b->used + need > b->size) {
+                size_t size = b->size * 2 > b->used + need ? b->size * 2 : b->used + need;
+                char *arena = (char *)realloc (b->arena, size);
+                if (arena == NULL)
+                        return 0;
+                b->arena = arena;
+                b->size = size;
+        }
+        e->path = b->used;
+        memcpy (b->arena + b->used, dir, dl);
+        b->used += dl;
+        if (name) {
+                if (dl == 0 || dir[dl - 1] != '/')
+                        b->arena[b->used++] = '/';
+                memcpy (b->arena + b->used, name, nl);
+                b->used += nl;
+        }
+        b->arena[b->used++] = '\0';
+        e->depth = depth;
+        e->err = err;
+        if (info)
+                e->info = *info;
+        b->n++;
+        return 1;
+}
+
+/*
+** Hands a full batch to the consumer, waiting for room in the queue.
+** Returns 0 if the walk was cancelled (the batch is then discarded).
+*/
+static int walk_push_batch (lfs_Walk *w, walk_batch *b) {
+        int ok;
+        pthread_mutex_lock (&w->lock);
+        while (w->queued >= w->maxqueued && !w->cancel)
+                pthread_cond_wait (&w->room, &w->lock);
+        ok = !w->cancel;
+        if (ok) {
+                b->next = NULL;
+                if (w->tail)
+                        w->tail->next = b;
+                else
+                        w->head = b;
+                w->tail = b;
+                w->queued++;
+                pthread_cond_signal (&w->ready);
+        }
+        pthread_mutex_unlock (&w->lock);
+        if (!ok)
+                walk_batch_free (b);
+        return ok;
+}
+
+/*
+** Stops the walk on error en, which the consumer gets once the batches
+** already queued are taken. Returns 0.
+*/
+static int walk_fail (lfs_Walk *w, int en) {
+        pthread_mutex_lock (&w->lock);
+        if (w->err == 0)
+                w->err = en;
+        w->cancel = 1;
+        pthread_cond_broadcast (&w->work);
+        pthread_cond_broadcast (&w->room);
+        pthread_mutex_unlock (&w->lock);
+        return 0;
+}
+
+/*
+** Appends an entry to the current batch of a worker, flushing it when full.
+** Returns 0 if the walk must stop.
+*/
+static int walk_emit (lfs_Walk *w, walk_batch **b, const char *dir, const char *name,
+                      int depth, int err, const STAT_STRUCT *info) {
+        if (*b == NULL && (*b = walk_batch_new (w->opt.batch)) == NULL)
+                return walk_fail (w, ENOMEM);
+        if (!walk_batch_add (*b, dir, name, depth, err, info))
+                return walk_fail (w, ENOMEM);
+        if ((*b)->n == (*b)->cap) {
+                walk_batch *full = *b;
+                *b = NULL;
+                return walk_push_batch (w, full);
+        }
+        return 1;
+}
+
+static walk_dir *walk_dir_new (const char *dir, const char *name, int fd, int depth) {
+        size_t dl = strlen (dir), nl = name ? strlen (name) : 0;
+        walk_dir *d = (walk_dir *)malloc (sizeof(walk_dir) + dl + nl + 1);
+        if (d == NULL)
+                return NULL;
+        memcpy (d->path, dir, dl);
+        if (name) {
+                if (dl == 0 || dir[dl - 1] != '/')
+                        d->path[dl++] = '/';
+                memcpy (d->path + dl, name, nl);
+        }
+        d->path[dl + nl] = '\0';
+        d->fd = fd;
+        d->depth = depth;
+        d->next = NULL;
+        return d;
+}
+
+/* Names read from one directory, before they are stat'ed */
+typedef struct walk_names {
+        char *arena;
+        size_t used, size;
+        size_t *off;
+        size_t n, cap;
+        uint64_t *ino;  /* d_ino of each name, kept by walk_list when not NULL */
+} walk_names;
+
+/* An entry to stat, in the order of its inode */
+typedef struct walk_order {
+        uint64_t ino;
+        size_t i;
+} walk_order;
+
+static int walk_order_cmp (const void *a, const void *b) {
+        uint64_t x = ((const walk_order *)a)->ino, y = ((const walk_order *)b)->ino;
+        return x < y ? -1 : x > y;
+}
+
+static int walk_names_add (walk_names *nm, const char *name) {
+        size_t len = strlen (name) + 1;
+        if (nm->n == nm->cap) {
+                size_t cap = nm->cap ? nm->cap * 2 : 256;
+                size_t *off = (size_t *)realloc (nm->off, cap * sizeof(size_t));
+                if (off == NULL)
+                        return 0;
+                nm->off = off;
+                if (nm->ino != NULL) {
+                        uint64_t *ino = (uint64_t *)realloc (nm->ino, cap * sizeof(uint64_t));
+                        if (ino == NULL)
+                                return 0;
+                        nm->ino = ino;
+                }
+                nm->cap = cap;
+        }
+        if (nm->used + len > nm->size) {
+                size_t size = nm->size ? nm->size * 2 : 8192;
+                char *arena;
+                while (size < nm->used + len)
+                        size *= 2;
+                if ((arena = (char *)realloc (nm->arena, size)) == NULL)
+                        return 0;
+                nm->arena = arena;
+                nm->size = size;
+        }
+        memcpy (nm->arena + nm->used, name, len);
+        nm->off[nm->n++] = nm->used;
+        nm->used += len;
+        return 1;
+}
+
+/*
+** Reads all entry names of the open directory fd.
+** Returns 0 on success or an errno value.
+*/
+static int walk_list (int fd, char *buf, walk_names *nm) {
+#ifdef LFS_HAVE_GETDENTS
+        for (;;) {
+                long n = syscall (SYS_getdents64, fd, buf, WALK_BUFSIZE), pos;
+                if (n < 0)
+                        return errno;
+                if (n == 0)
+                        return 0;
+                for (pos = 0; pos < n; ) {
+                        struct lfs_dirent64 *entry = (struct lfs_dirent64 *)(buf + pos);
+                        const char *name = entry->d_name;
+                        pos += entry->d_reclen;
+                        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                                continue;
+                        if (!walk_names_add (nm, name))
+                                return ENOMEM;
+                        if (nm->ino != NULL)
+                                nm->ino[nm->n - 1] = entry->d_ino;
+                }
+        }
+#else
+        struct dirent *entry;
+        DIR *dir;
+        int dfd = dup (fd);
+        (void)buf;
+        if (dfd < 0 || (dir = fdopendir (dfd)) == NULL) {
+                int en = errno;
+                if (dfd >= 0)
+                        close (dfd);
+                return en;
+        }
+        errno = 0;
+        while ((entry = readdir (dir)) != NULL) {
+                const char *name = entry->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                        continue;
+                if (!walk_names_add (nm, name)) {
+                        closedir (dir);
+                        return ENOMEM;
+                }
+                if (nm->ino != NULL)
+                        nm->ino[nm->n - 1] = (uint64_t)entry->d_ino;
+        }
+        closedir (dir);
+        return errno;
+#endif
+}
+
+/*
+** Opens the directory path, or the entry name in it when name is not NULL,
+** following symbolic links unless flags has O_NOFOLLOW. In the box, the
+** lookup starts again from its root, as links may lead anywhere in it.
+*/
+static int walk_open (lfs_Walk *w, const char *path, const char *name, int flags) {
+#ifdef LFS_HAVE_BOX
+        char rel[LFS_MAXPATHLEN];
+        const char *sub = path + w->rootlen;  /* below the walked root */
+        size_t bl = strlen (w->base), sl = strlen (sub);
+        size_t nl = name ? strlen (name) : 0;
+        if (bl + sl + nl + 2 >= LFS_MAXPATHLEN) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        memcpy (rel, w->base, bl);
+        if (sl > 0 && *sub != '/')
+                rel[bl++] = '/';
+        memcpy (rel + bl, sub, sl);
+        bl += sl;
+        if (name) {
+                rel[bl++] = '/';
+                memcpy (rel + bl, name, nl);
+                bl += nl;
+        }
+        rel[bl] = '\0';
+        return box_openat (w->box, rel, flags);
+#else
+        (void)name;
+        return openat (w->cwd, path, flags | O_CLOEXEC);
+#endif
+}
+
+/*
+** Stats the entry name of the directory open at fd.
+** Returns 0 or an errno value.
+*/
+static int walk_stat (lfs_Walk *w, walk_dir *dir, int fd, const char *name, STAT_STRUCT *info) {
+        int res;
+#ifdef LFS_HAVE_BOX
+        res = fstatat (fd, name, info, AT_SYMLINK_NOFOLLOW);
+        if (res == 0 && w->opt.follow && S_ISLNK (info->st_mode)) {
+                /* only links are resolved again from the box root */
+                int efd = walk_open (w, dir->path, name, O_PATH);
+                res = efd < 0 ? -1 : fstatat (efd, "", info, AT_EMPTY_PATH);
+                if (efd >= 0)
+                        close_keep_errno (efd);
+        }
+#else
+        (void)dir;
+        res = fstatat (fd, name, info, w->opt.follow ? 0 : AT_SYMLINK_NOFOLLOW);
+#endif
+        return res != 0 ? errno : 0;
+}
+
+/*
+** Stats the entries in nm by increasing inode.
+** Returns an array with the attributes of each, in the order of nm and
+** followed by an array with their errno values, or NULL without memory.
+*/
+static STAT_STRUCT *walk_stat_sorted (lfs_Walk *w, walk_dir *dir, int fd, walk_names *nm) {
+        STAT_STRUCT *info = (STAT_STRUCT *)malloc (nm->n * (sizeof(STAT_STRUCT) + sizeof(int)));
+        walk_order *order = (walk_order *)malloc (nm->n * sizeof(walk_order));
+        size_t i;
+        if (info == NULL || order == NULL) {
+                free (info);
+                free (order);
+                return NULL;
+        }
+        for (i = 0; i < nm->n; i++) {
+                order[i].ino = nm->ino[i];
+                order[i].i = i;
+        }
+        qsort (order, nm->n, sizeof(walk_order), walk_order_cmp);
+        for (i = 0; i < nm->n; i++) {
+                size_t k = order[i].i;
+                ((int *)(info + nm->n))[k] = walk_stat (w, dir, fd, nm->arena + nm->off[k], &info[k]);
+        }
+        free (order);
+        return info;
+}
+
+/*
+** Reads one directory: emits its entries and collects its subdirectories
+** in *children. Up to allowance subdirectories keep an open descriptor.
+** Returns the number of descriptors kept, or -1 if the walk must stop.
+*/
+static int walk_read_dir (lfs_Walk *w, walk_dir *dir, char *buf, walk_names *nm,
+                          walk_batch **batch, walk_dir **children, int allowance) {
+        int fd = dir->fd, used = 0, err, nofollow = w->opt.follow ? 0 : O_NOFOLLOW;
+        int depth = dir->depth + 1;
+        STAT_STRUCT *sorted = NULL;
+        size_t i;
+        if (fd < 0)
+                fd = walk_open (w, dir->path, NULL, O_RDONLY | O_DIRECTORY | nofollow);
+        if (fd < 0)
+                return walk_emit (w, batch, dir->path, NULL, dir->depth, errno, NULL) ? 0 : -1;
+        if (w->opt.maxdepth >= 0 && depth > w->opt.maxdepth) {
+                close (fd);  /* maxdepth 0: the root is opened, not listed */
+                return 0;
+        }
+        nm->used = nm->n = 0;
+        err = walk_list (fd, buf, nm);
+        if (err != 0 && !walk_emit (w, batch, dir->path, NULL, dir->depth, err, NULL)) {
+                close (fd);
+                return -1;
+        }
+        if (nm->ino != NULL && nm->n > 1)
+                sorted = walk_stat_sorted (w, dir, fd, nm);  /* or stat as listed */
+        for (i = 0; i < nm->n; i++) {
+                const char *name = nm->arena + nm->off[i];
+                STAT_STRUCT info;
+                int descend, res;
+                if (sorted != NULL) {
+                        info = sorted[i];
+                        res = ((int *)(sorted + nm->n))[i];
+                } else
+                        res = walk_stat (w, dir, fd, name, &info);
+                if (res != 0) {
+                        if (!walk_emit (w, batch, dir->path, name, depth, res, NULL))
+                                break;
+                        continue;
+                }
+                if (!walk_emit (w, batch, dir->path, name, depth, 0, &info))
+                        break;
+                descend = S_ISDIR (info.st_mode)
+                        && (w->opt.maxdepth < 0 || depth < w->opt.maxdepth)
+                        && (!w->opt.onefs || info.st_dev == w->dev);
+                if (descend && w->opt.follow) {
+                        pthread_mutex_lock (&w->lock);
+                        descend = inoset_add (&w->seen, info.st_dev, info.st_ino) == 1;
+                        pthread_mutex_unlock (&w->lock);
+                }
+                if (descend) {
+                        int cfd = -1;
+                        walk_dir *child;
+                        if (used < allowance) {
+#ifdef LFS_HAVE_BOX
+                                if (w->opt.follow)
+                                        cfd = walk_open (w, dir->path, name, O_RDONLY | O_DIRECTORY);
+                                else
+#endif
+                                cfd = openat (fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | nofollow);
+                                if (cfd >= 0)
+                                        used++;
+                        }
+                        if ((child = walk_dir_new (dir->path, name, cfd, depth)) == NULL) {
+                                if (cfd >= 0) {
+                                        close (cfd);
+                                        used--;
+                                }
+                                walk_fail (w, ENOMEM);  /* rather than skip the subtree */
+                                break;
+                        }
+                        child->next = *children;
+                        *children = child;
+                }
+        }
+        free (sorted);
+        close (fd);
+        return i < nm->n ? -1 : used;
+}
+
+static void *walk_worker (void *arg) {
+        lfs_Walk *w = (lfs_Walk *)arg;
+        walk_batch *batch = NULL;
+        walk_names nm;
+        char *buf = (char *)malloc (WALK_BUFSIZE);
+        memset (&nm, 0, sizeof(nm));
+        /* any non-NULL ino makes walk_names_add grow it with the names */
+        if (w->opt.inodeorder && (nm.ino = (uint64_t *)malloc (sizeof(uint64_t))) == NULL) {
+                free (buf);
+                buf = NULL;
+        }
+        if (buf == NULL)
+                walk_fail (w, ENOMEM);
+        pthread_mutex_lock (&w->lock);
+        while (buf != NULL) {
+                walk_dir *dir, *children = NULL;
+                int allowance, used;
+                while (w->todo == NULL && w->busy > 0 && !w->cancel)
+                        pthread_cond_wait (&w->work, &w->lock);
+                if (w->cancel || w->todo == NULL)
+                        break;
+                dir = w->todo;
+                w->todo = dir->next;
+                if (dir->fd >= 0)
+                        w->fds--;
+                allowance = WALK_MAXFDS - w->fds;
+                allowance = allowance < 0 ? 0 : (allowance > 64 ? 64 : allowance);
+                w->fds += allowance;
+                w->busy++;
+                pthread_mutex_unlock (&w->lock);
+
+                used = walk_read_dir (w, dir, buf, &nm, &batch, &children, allowance);
+                free (dir);
+
+                pthread_mutex_lock (&w->lock);
+                w->fds -= allowance - (used < 0 ? 0 : used);
+                w->busy--;
+                if (used < 0)
+                        w->cancel = 1;
+                while (children) {
+                        walk_dir *next = children->next;
+                        children->next = w->todo;
+                        w->todo = children;
+                        children = next;
+                }
+                pthread_cond_broadcast (&w->work);
+        }
+        /* no more work: wake the others so they can finish too */
+        pthread_cond_broadcast (&w->work);
+        pthread_mutex_unlock (&w->lock);
+        if (batch != NULL && batch->n > 0)
+                walk_push_batch (w, batch);
+        else
+                walk_batch_free (batch);
+        pthread_mutex_lock (&w->lock);
+        w->running--;
+        pthread_cond_broadcast (&w->ready);
+        pthread_mutex_unlock (&w->lock);
+        free (buf);
+        free (nm.arena);
+        free (nm.off);
+        free (nm.ino);
+        return NULL;
+}
+
+/*
+** Stops the workers and frees the walker.
+*/
+static void walk_stop (lfs_Walk *w) {
+        int i;
+        pthread_mutex_lock (&w->lock);
+        w->cancel = 1;
+        pthread_cond_broadcast (&w->work);
+        pthread_cond_broadcast (&w->room);
+        pthread_mutex_unlock (&w->lock);
+        for (i = 0; i < w->nthreads; i++)
+                pthread_join (w->threads[i], NULL);
+        while (w->todo) {
+                walk_dir *next = w->todo->next;
+                if (w->todo->fd >= 0)
+                        close (w->todo->fd);
+                free (w->todo);
+                w->todo = next;
+        }
+        while (w->head) {
+                walk_batch *next = w->head->next;
+                walk_batch_free (w->head);
+                w->head = next;
+        }
+        inoset_free (&w->seen);
+#ifdef LFS_HAVE_BOX
+        if (w->box >= 0)
+                close (w->box);
+        free (w->base);
+#else
+        if (w->cwd >= 0)
+                close (w->cwd);
+#endif
+        pthread_mutex_destroy (&w->lock);
+        pthread_cond_destroy (&w->work);
+        pthread_cond_destroy (&w->room);
+        pthread_cond_destroy (&w->ready);
+        free (w);
+}
+
+/*
+** Starts walking the tree under root.
+** Returns NULL with errno set on failure.
+*/
+static lfs_Walk *walk_start (lfs_State *S, const char *root, const walk_options *opt) {
+        lfs_Walk *w;
+        STAT_STRUCT info;
+        walk_dir *dir;
+        int fd, i, en;
+#ifdef LFS_HAVE_BOX
+        char rel[LFS_MAXPATHLEN];
+        if (box_path (S, root, rel) == NULL || (fd = box_openat (S->root, rel, O_RDONLY | O_DIRECTORY)) < 0)
+                return NULL;
+#else
+        if ((fd = openat (S->cwdfd, root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+                return NULL;
+#endif
+        if (fstat (fd, &info) != 0
+            || (w = (lfs_Walk *)calloc (1, sizeof(lfs_Walk))) == NULL) {
+                en = errno;
+                close (fd);
+                errno = en;
+                return NULL;
+        }
+        if ((dir = walk_dir_new (root, NULL, fd, 0)) == NULL) {
+                close (fd);
+                free (w);
+                errno = ENOMEM;
+                return NULL;
+        }
+        pthread_mutex_init (&w->lock, NULL);
+        pthread_cond_init (&w->work, NULL);
+        pthread_cond_init (&w->room, NULL);
+        pthread_cond_init (&w->ready, NULL);
+#ifdef LFS_HAVE_BOX
+        /* the walk may outlive the state */
+        w->box = fcntl (S->root, F_DUPFD_CLOEXEC, 0);
+        w->base = strdup (rel);
+        w->rootlen = strlen (root);
+        if (w->box < 0 || w->base == NULL) {
+                en = w->box < 0 ? errno : ENOMEM;
+                w->todo = dir;
+                walk_stop (w);
+                errno = en;
+                return NULL;
+        }
+#else
+        /* so is the current directory, which lfs.chdir closes */
+        w->cwd = S->cwdfd >= 0 ? fcntl (S->cwdfd, F_DUPFD_CLOEXEC, 0) : AT_FDCWD;
+        if (w->cwd == -1) {
+                en = errno;
+                w->todo = dir;
+                walk_stop (w);
+                errno = en;
+                return NULL;
+        }
+#endif
+        w->opt = *opt;
+        w->dev = info.st_dev;
+        w->todo = dir;
+        w->fds = 1;
+        w->maxqueued = 2 * opt->threads + 2;
+        if (opt->follow)
+                inoset_add (&w->seen, info.st_dev, info.st_ino);
+        pthread_mutex_lock (&w->lock);
+        for (i = 0; i < opt->threads; i++) {
+                if ((en = pthread_create (&w->threads[w->nthreads], NULL, walk_worker, w)) != 0)
+                        break;
+                w->nthreads++;
+                w->running++;
+        }
+        pthread_mutex_unlock (&w->lock);
+        if (w->nthreads == 0) {
+                walk_stop (w);
+                errno = en;
+                return NULL;
+        }
+        return w;
+}
+
+/*
+** Waits for the next batch of entries.
+** Returns NULL when the walk is over.
+*/
+static walk_batch *walk_next (lfs_Walk *w) {
+        walk_batch *b;
+        pthread_mutex_lock (&w->lock);
+        while (w->head == NULL && w->running > 0)
+                pthread_cond_wait (&w->ready, &w->lock);
+        if ((b = w->head) != NULL) {
+                if ((w->head = b->next) == NULL)
+                        w->tail = NULL;
+                w->queued--;
+                pthread_cond_signal (&w->room);
+        }
+        pthread_mutex_unlock (&w->lock);
+        return b;
+}
+
+/*
+** Reads the walk options from the table at index idx.
+*/
+static void check_walk_options (lua_State *L, int idx, walk_options *opt) {
+        lua_Integer threads = opt_integer (L, idx, "threads", default_threads ());
+        lua_Integer maxdepth = opt_integer (L, idx, "maxdepth", -1);
+        lua_Integer batch = opt_integer (L, idx, "batch", WALK_BATCH);
+        luaL_argcheck (L, threads > 0 && threads <= LFS_MAXTHREADS, idx, "invalid number of threads");
+        luaL_argcheck (L, maxdepth <= INT_MAX, idx, "maxdepth too large");
+        luaL_argcheck (L, batch > 0 && batch <= WALK_MAXBATCH, idx, "invalid batch size");
+        opt->threads = (int)threads;
+        opt->maxdepth = maxdepth < 0 ? -1 : (int)maxdepth;
+        opt->follow = opt_boolean (L, idx, "follow", 0);
+        opt->onefs = opt_boolean (L, idx, "onefs", 0);
+        opt->inodeorder = opt_boolean (L, idx, "inodeorder", 0);
+        opt->batch = (int)batch;
+}
+
+
+typedef struct walk_data {
+        lfs_Walk *w;
+        int nsel;
+        unsigned char sel[LFS_MAXFIELDS];
+} walk_data;
+
+/*
+** Returns the next batch of a walk: an array of tables with the path and
+** depth of each entry plus its attributes, or an error message for entries
+** that could not be read. Returns nil when the walk is over, and raises an
+** error if it was cut short.
+*/
+static int walk_iter (lua_State *L) {
+        walk_data *d = (walk_data *)luaL_checkudata (L, 1, WALK_METATABLE);
+        walk_batch *b;
+        size_t i;
+        int err;
+        luaL_argcheck (L, d->w != NULL, 1, "closed walker");
+        if ((b = walk_next (d->w)) == NULL) {
+                err = d->w->err;
+                walk_stop (d->w);
+                d->w = NULL;
+                if (err != 0)
+                        return luaL_error (L, "walk stopped: %s", strerror (err));
+                return 0;
+        }
+        lua_createtable (L, (int)b->n, 0);
+        for (i = 0; i < b->n; i++) {
+                walk_entry *e = &b->e[i];
+                lua_createtable (L, 0, e->err ? 3 : (d->nsel < 0 ? 16 : d->nsel + 2));
+                lua_pushstring (L, b->arena + e->path);
+                lua_setfield (L, -2, "path");
+                lua_pushinteger (L, e->depth);
+                lua_setfield (L, -2, "depth");
+                if (e->err) {
+                        lua_pushstring (L, strerror (e->err));
+                        lua_setfield (L, -2, "error");
+                } else
+                        set_fields (L, &e->info, d->sel, d->nsel);
+                lua_rawseti (L, -2, (int)i + 1);
+        }
+        walk_batch_free (b);
+        return 1;
+}
+
+static int walk_close (lua_State *L) {
+        walk_data *d = (walk_data *)luaL_checkudata (L, 1, WALK_METATABLE);
+        if (d->w) {
+                walk_stop (d->w);
+                d->w = NULL;
+        }
+        return 0;
+}
+
+/*
+** Walks a directory tree with a pool of threads.
+** @param #1 Root directory.
+** @param #2 Table with options (optional): threads, maxdepth, follow,
+**           onefs, batch and fields.
+** Returns an iterator and the walker object, like lfs.dir.
+*/
+static int walk_factory (lua_State *L) {
+        const char *root = luaL_checkstring (L, 1);
+        walk_options opt;
+        walk_data *d;
+        check_walk_options (L, 2, &opt);
+        lua_pushcfunction (L, walk_iter);
+        d = (walk_data *)lua_newuserdata (L, sizeof(walk_data));
+        d->w = NULL;
+        if (lua_istable (L, 2)) {
+                lua_getfield (L, 2, "fields");
+                d->nsel = check_fields (L, -1, d->sel);
+                lua_pop (L, 1);
+        } else
+                d->nsel = -1;
+        luaL_getmetatable (L, WALK_METATABLE);
+        lua_setmetatable (L, -2);
+        if ((d->w = walk_start (lfs_state (L), root, &opt)) == NULL)
+                return pusherror (L, root);
+        return 2;
+}
+
+static void walk_create_meta (lua_State *L) {
+        luaL_newmetatable (L, WALK_METATABLE);
+
+        /* Method table */
+        lua_newtable (L);
+        lua_pushcfunction (L, walk_iter);
+        lua_setfield (L, -2, "next");
+        lua_pushcfunction (L, walk_close);
+        lua_setfield (L, -2, "close");
+
+        /* Metamethods */
+        lua_setfield (L, -2, "__index");
+        lua_pushcfunction (L, walk_close);
+        lua_setfield (L, -2, "__gc");
+        lua_pop (L, 1);
+}
+#endif
+
+
+#ifndef _WIN32
+/*
+** Tree creation and removal.
+** lfs.mkdirs creates the components of a path one by one with mkdirat on
+** the descriptor of the previous one. lfs.rmtree empties directories with
+** unlinkat on their descriptors: a pool of threads takes directories from
+** a shared stack, removes their files and pushes their subdirectories; a
+** directory is removed by whichever thread removes its last entry.
+*/
+#ifdef O_PATH
+#define TREE_PATH O_PATH  /* descriptors only used as bases of *at calls */
+#else
+#define TREE_PATH O_RDONLY
+#endif
+
+#define DEFAULT_DIR_MODE (S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP | S_IROTH | S_IXOTH)
+#define TREE_OPEN_MAX 32  /* levels a recursive walk keeps open */
+
+/*
+** Opens the directory holding path and copies its last component to name,
+** of NAME_MAX+1 bytes. Paths ending in "." or ".." are refused.
+*/
+static int tree_parent (lfs_State *S, const char *path, char *name) {
+#ifdef LFS_HAVE_BOX
+        int fd = box_parent (S, path, name, NULL);
+        if (fd >= 0 && strcmp (name, ".") == 0) {
+                close (fd);
+                errno = EINVAL;
+                return -1;
+        }
+        return fd;
+#else
+        char dir[LFS_MAXPATHLEN];
+        const char *last;
+        size_t len = strlen (path), nl;
+        while (len > 1 && path[len - 1] == '/')
+                len--;
+        if (len >= LFS_MAXPATHLEN) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        memcpy (dir, path, len);
+        dir[len] = '\0';
+        last = strrchr (dir, '/');
+        last = last ? last + 1 : dir;
+        nl = strlen (last);
+        if (nl == 0 || strcmp (last, ".") == 0 || strcmp (last, "..") == 0) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (nl > NAME_MAX) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        memcpy (name, last, nl + 1);
+        if (last == dir)
+                strcpy (dir, ".");
+        else if (last == dir + 1)
+                dir[1] = '\0';  /* in the root directory */
+        else
+                dir[last - dir - 1] = '\0';
+        return openat (S->cwdfd, dir, TREE_PATH | O_DIRECTORY | O_CLOEXEC);
+#endif
+}
+
+/*
+** Opens rel under root without following links on the way: a directory
+** of a deep path may be swapped for a link to elsewhere meanwhile.
+** Returns a descriptor, or -1 with errno set.
+*/
+static int tree_openat (int root, const char *rel, int flags) {
+#ifdef LFS_HAVE_BOX
+        struct open_how how;
+        int fd;
+        memset (&how, 0, sizeof(how));
+        how.flags = (uint64_t)(flags | O_NOFOLLOW | O_CLOEXEC);
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+        do {
+                fd = (int)syscall (SYS_openat2, root, rel, &how, sizeof(how));
+        } while (fd < 0 && errno == EAGAIN);
+        if (fd < 0 && errno == EXDEV)
+                errno = EACCES;
+        return fd;
+#else
+        char name[LFS_MAXPATHLEN];
+        const char *p = rel, *end;
+        int fd = root, next;
+        for (;;) {
+                end = strchr (p, '/');
+                if ((end ? (size_t)(end - p) : strlen (p)) >= sizeof(name)) {
+                        errno = ENAMETOOLONG;
+                        next = -1;
+                } else if (end) {
+                        memcpy (name, p, (size_t)(end - p));
+                        name[end - p] = '\0';
+                        next = openat (fd, name, TREE_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                } else
+                        next = openat (fd, p, flags | O_NOFOLLOW | O_CLOEXEC);
+                if (fd != root)
+                        close_keep_errno (fd);
+                if (next < 0 || end == NULL)
+                        return next;
+                fd = next;
+                p = end + 1;
+        }
+#endif
+}
+
+/*
+** Opens again the directory rel under root, closed during a deep walk to
+** save descriptors, and checks that it still is the one of info.
+** Returns a descriptor, or -1 with errno set.
+*/
+static int tree_reopen (int root, const char *rel, const STAT_STRUCT *info) {
+        STAT_STRUCT now;
+        int fd = tree_openat (root, rel, O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
+                return -1;
+        if (fstat (fd, &now) != 0)
+                return close_keep_errno (fd);
+        if (now.st_dev != info->st_dev || now.st_ino != info->st_ino) {
+                close (fd);
+                errno = ENOENT;  /* moved away meanwhile */
+                return -1;
+        }
+        return fd;
+}
+
+
+/*
+** Creates a directory and the missing directories above it.
+** @param #1 Directory path.
+** @param #2 Permissions of the new directories (optional).
+*/
+static int make_dirs (lua_State *L) {
+        const char *path = luaL_checkstring (L, 1);
+        mode_t mode = (mode_t)luaL_optinteger (L, 2, DEFAULT_DIR_MODE);
+        lfs_State *S = lfs_state (L);
+        char buf[LFS_MAXPATHLEN], *p, *end;
+        int fd, top, fail = 0;
+#ifdef LFS_HAVE_BOX
+        if (box_path (S, path, buf) == NULL)
+                return pusherror (L, path);
+        top = fd = S->root;
+#else
+        if (strlen (path) >= LFS_MAXPATHLEN) {
+                errno = ENAMETOOLONG;
+                return pusherror (L, path);
+        }
+        strcpy (buf, path);
+        top = fd = *path == '/' ? open ("/", TREE_PATH | O_DIRECTORY | O_CLOEXEC) : S->cwdfd;
+        if (fd == -1)
+                return pusherror (L, path);
+#endif
+        for (p = buf; *p; p = end) {
+                int last, next;
+                while (*p == '/')
+                        p++;
+                for (end = p; *end && *end != '/'; end++)
+                        ;
+                last = *end == '\0' || end[strspn (end, "/")] == '\0';
+                if (*end)
+                        *end++ = '\0';
+                if (*p == '\0' || strcmp (p, ".") == 0)
+                        continue;
+                if (strcmp (p, "..") != 0 && mkdirat (fd, p, mode) != 0) {
+                        STAT_STRUCT info;
+                        if (errno != EEXIST) {
+                                fail = 1;
+                                break;
+                        }
+                        if (last) {  /* it must be a directory */
+                                if (fstatat (fd, p, &info, 0) != 0)
+                                        fail = 1;
+                                else if (!S_ISDIR (info.st_mode)) {
+                                        errno = EEXIST;
+                                        fail = 1;
+                                }
+                                break;
+                        }
+                }
+                if (last)
+                        break;
+#ifdef LFS_HAVE_BOX
+                /* ".." and links may lead anywhere in the box */
+                next = -1;
+                if (strcmp (p, "..") != 0)
+                        next = openat (fd, p, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (next < 0) {
+                        char *q;
+                        for (q = buf; q < p; q++)
+                                if (*q == '\0')
+                                        *q = '/';
+                        next = box_openat (S->root, buf, O_PATH | O_DIRECTORY);
+                }
+#else
+                next = openat (fd, p, TREE_PATH | O_DIRECTORY | O_CLOEXEC);
+#endif
+                if (fd != top)
+                        close (fd);
+                if ((fd = next) < 0) {
+                        fail = 1;
+                        break;
+                }
+        }
+        if (fd >= 0 && fd != top)
+                close_keep_errno (fd);
+#ifndef LFS_HAVE_BOX
+        if (top >= 0 && top != S->cwdfd)
+                close_keep_errno (top);
+#endif
+        cache_sync (S);
+        if (fail)
+                return pusherror (L, path);
+        lua_pushboolean (L, 1);
+        return 1;
+}
+
+
+typedef struct rm_dir {
+        struct rm_dir *next;    /* in the stack of directories to read */
+        struct rm_dir *parent;
+        int fd;                 /* open descriptor, or -1 to reopen it by path */
+        int pending;            /* entries left, plus one while it is read */
+        int failed;             /* something inside could not be removed */
+        char path[1];           /* relative to the removed directory */
+} rm_dir;
+
+typedef struct rm_fail {
+        struct rm_fail *next;
+        int err;
+        char path[1];
+} rm_fail;
+
+typedef struct lfs_Rmtree {
+        pthread_mutex_t lock;
+        pthread_cond_t work;    /* directories were queued */
+        rm_dir *todo;
+        int busy;               /* workers reading a directory */
+        int fds;                /* descriptors held by directories */
+        int root;               /* the removed directory */
+        int failed;             /* something in it could not be removed */
+        rm_fail *fails;
+} lfs_Rmtree;
+
+/*
+** Records that the entry name of directory d, or d itself when name is
+** NULL, could not be removed.
+*/
+static void rm_failed (lfs_Rmtree *t, rm_dir *d, const char *name, int err) {
+        size_t dl = strlen (d->path), nl = name ? strlen (name) : 0;
+        rm_fail *f = (rm_fail *)malloc (sizeof(rm_fail) + dl + nl + 1);
+        if (f == NULL)
+                return;
+        f->err = err;
+        memcpy (f->path, d->path, dl);
+        if (name) {
+                if (dl > 0)
+                        f->path[dl++] = '/';
+                memcpy (f->path + dl, name, nl);
+                dl += nl;
+        }
+        f->path[dl] = '\0';
+        pthread_mutex_lock (&t->lock);
+        f->next = t->fails;
+        t->fails = f;
+        pthread_mutex_unlock (&t->lock);
+}
+
+static int rm_open (lfs_Rmtree *t, rm_dir *d, int flags) {
+        if (d->parent == NULL)
+                return t->root;
+        if (d->fd >= 0)
+                return d->fd;
+        return tree_openat (t->root, d->path, flags);
+}
+
+static void rm_close (lfs_Rmtree *t, rm_dir *d, int fd) {
+        if (fd >= 0 && fd != t->root && fd != d->fd)
+                close (fd);
+}
+
+/*
+** Removes the emptied directory d, then its parent if d was its last
+** entry, and so on up.
+*/
+static void rm_finish (lfs_Rmtree *t, rm_dir *d) {
+        while (d->parent) {
+                rm_dir *p = d->parent;
+                const char *name = strrchr (d->path, '/');
+                name = name ? name + 1 : d->path;
+                if (d->fd >= 0) {
+                        close (d->fd);
+                        __atomic_fetch_sub (&t->fds, 1, __ATOMIC_RELAXED);
+                }
+                if (!d->failed) {
+                        int fd = rm_open (t, p, TREE_PATH | O_DIRECTORY);
+                        if (fd < 0 || unlinkat (fd, name, AT_REMOVEDIR) != 0) {
+                                rm_failed (t, d, NULL, errno);
+                                d->failed = 1;
+                        }
+                        rm_close (t, p, fd);
+                }
+                if (d->failed)
+                        __atomic_store_n (&p->failed, 1, __ATOMIC_RELAXED);
+                free (d);
+                if (__atomic_sub_fetch (&p->pending, 1, __ATOMIC_ACQ_REL) != 0)
+                        return;
+                d = p;
+        }
+        /* the root is removed by the caller */
+        t->failed = d->failed;
+        free (d);
+}
+
+static rm_dir *rm_dir_new (rm_dir *parent, const char *name, int fd) {
+        size_t pl = strlen (parent->path), nl = strlen (name);
+        rm_dir *d = (rm_dir *)malloc (sizeof(rm_dir) + pl + nl + 1);
+        if (d == NULL)
+                return NULL;
+        d->parent = parent;
+        d->fd = fd;
+        d->pending = 1;
+        d->failed = 0;
+        memcpy (d->path, parent->path, pl);
+        if (pl > 0)
+                d->path[pl++] = '/';
+        memcpy (d->path + pl, name, nl + 1);
+        return d;
+}
+
+/*
+** Removes the files of directory d and returns its subdirectories, which
+** keep an open descriptor while there are fewer than WALK_MAXFDS.
+*/
+static rm_dir *rm_read (lfs_Rmtree *t, rm_dir *d, char *buf, walk_names *nm) {
+        rm_dir *children = NULL;
+        int fd = rm_open (t, d, O_RDONLY | O_DIRECTORY), err;
+        size_t i;
+        if (fd < 0) {
+                rm_failed (t, d, NULL, errno);
+                d->failed = 1;
+                nm->n = 0;
+        } else {
+                nm->used = nm->n = 0;
+                if ((err = walk_list (fd, buf, nm)) != 0) {
+                        rm_failed (t, d, NULL, err);
+                        d->failed = 1;
+                }
+        }
+        for (i = 0; i < nm->n; i++) {
+                const char *name = nm->arena + nm->off[i];
+                STAT_STRUCT info;
+                rm_dir *child;
+                int cfd = -1;
+                if (unlinkat (fd, name, 0) == 0)
+                        continue;
+                err = errno;
+                if (err != EISDIR && (err != EPERM || fstatat (fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0 ||
+                                      !S_ISDIR (info.st_mode))) {
+                        rm_failed (t, d, name, err);
+                        d->failed = 1;
+                        continue;
+                }
+                if (__atomic_add_fetch (&t->fds, 1, __ATOMIC_RELAXED) <= WALK_MAXFDS)
+                        cfd = openat (fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (cfd < 0)
+                        __atomic_fetch_sub (&t->fds, 1, __ATOMIC_RELAXED);
+                if ((child = rm_dir_new (d, name, cfd)) == NULL) {
+                        rm_failed (t, d, name, errno);
+                        if (cfd >= 0) {
+                                close (cfd);
+                                __atomic_fetch_sub (&t->fds, 1, __ATOMIC_RELAXED);
+                        }
+                        d->failed = 1;
+                        continue;
+                }
+                d->pending++;
+                child->next = children;
+                children = child;
+        }
+        if (fd >= 0 && fd != d->fd && fd != t->root) {
+                if (children && __atomic_add_fetch (&t->fds, 1, __ATOMIC_RELAXED) <= WALK_MAXFDS)
+                        d->fd = fd;  /* the base to remove the subdirectories */
+                else {
+                        if (children)
+                                __atomic_fetch_sub (&t->fds, 1, __ATOMIC_RELAXED);
+                        close (fd);
+                }
+        }
+        if (__atomic_sub_fetch (&d->pending, 1, __ATOMIC_ACQ_REL) == 0)
+                rm_finish (t, d);
+        return children;
+}
+
+static void *rm_worker (void *arg) {
+        lfs_Rmtree *t = (lfs_Rmtree *)arg;
+        walk_names nm;
+        char *buf = (char *)malloc (WALK_BUFSIZE);
+        memset (&nm, 0, sizeof(nm));
+        pthread_mutex_lock (&t->lock);
+        while (buf != NULL) {
+                rm_dir *d, *children;
+                while (t->todo == NULL && t->busy > 0)
+                        pthread_cond_wait (&t->work, &t->lock);
+                if (t->todo == NULL)
+                        break;
+                d = t->todo;
+                t->todo = d->next;
+                t->busy++;
+                pthread_mutex_unlock (&t->lock);
+
+                children = rm_read (t, d, buf, &nm);
+
+                pthread_mutex_lock (&t->lock);
+                t->busy--;
+                while (children) {
+                        rm_dir *next = children->next;
+                        children->next = t->todo;
+                        t->todo = children;
+                        children = next;
+                }
+                pthread_cond_broadcast (&t->work);
+        }
+        pthread_cond_broadcast (&t->work);
+        pthread_mutex_unlock (&t->lock);
+        free (buf);
+        free (nm.arena);
+        free (nm.off);
+        return NULL;
+}
+
+/*
+** Removes the contents of the directory open at fd with nthreads threads.
+** Returns 0, or -1 if something could not be removed.
+*/
+static int rm_contents (lfs_Rmtree *t, int fd, int nthreads) {
+        pthread_t threads[LFS_MAXTHREADS];
+        int i, started = 0;
+        rm_dir *root = (rm_dir *)malloc (sizeof(rm_dir));
+        if (root == NULL)
+                return -1;
+        root->parent = NULL;
+        root->next = NULL;
+        root->fd = -1;
+        root->pending = 1;
+        root->failed = 0;
+        root->path[0] = '\0';
+        t->root = fd;
+        t->todo = root;
+        /* the calling thread is one of the workers */
+        for (i = 1; i < nthreads; i++)
+                if (pthread_create (&threads[started], NULL, rm_worker, t) == 0)
+                        started++;
+        rm_worker (t);
+        for (i = 0; i < started; i++)
+                pthread_join (threads[i], NULL);
+        if (t->todo != NULL) {  /* out of memory for the buffers */
+                while (t->todo) {
+                        rm_dir *next = t->todo->next;
+                        if (t->todo->fd >= 0)
+                                close (t->todo->fd);
+                        free (t->todo);
+                        t->todo = next;
+                }
+                errno = ENOMEM;
+                return -1;
+        }
+        return t->failed ? -1 : 0;
+}
+
+/*
+** Removes a directory and everything under it, or a single file.
+** @param #1 Path.
+** @param #2 Table with options (optional): threads.
+** Returns true, or nil, an error message, an error code and an array of
+** the entries that could not be removed, each a table with the fields
+** path and error.
+*/
+static int remove_tree (lua_State *L) {
+        const char *path = luaL_checkstring (L, 1);
+        int nthreads = (int)opt_integer (L, 2, "threads", default_threads ());
+        lfs_State *S = lfs_state (L);
+        char name[NAME_MAX + 1];
+        lfs_Rmtree t;
+        int pfd, fd, fail, en, n = 0;
+        luaL_argcheck (L, nthreads > 0 && nthreads <= LFS_MAXTHREADS, 2, "invalid number of threads");
+        memset (&t, 0, sizeof(t));
+        if ((pfd = tree_parent (S, path, name)) < 0)
+                return pusherror (L, path);
+        fd = openat (pfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)  /* not a directory, or a link */
+                fail = errno == ENOTDIR || errno == ELOOP ? unlinkat (pfd, name, 0) : -1;
+        else {
+                pthread_mutex_init (&t.lock, NULL);
+                pthread_cond_init (&t.work, NULL);
+                fail = rm_contents (&t, fd, nthreads);
+                close_keep_errno (fd);
+                if (!fail && (fail = unlinkat (pfd, name, AT_REMOVEDIR)) != 0) {
+                        rm_dir root;
+                        root.path[0] = '\0';
+                        rm_failed (&t, &root, NULL, errno);
+                }
+                pthread_mutex_destroy (&t.lock);
+                pthread_cond_destroy (&t.work);
+        }
+        en = errno;
+        close (pfd);
+#ifdef LFS_HAVE_BOX
+        dirfd_invalidate (S, path);
+#endif
+        cache_sync (S);
+        if (!fail) {
+                lua_pushboolean (L, 1);
+                return 1;
+        }
+        if (t.fails == NULL) {
+                errno = en;
+                return pusherror (L, path);
+        }
+        /* report the failures */
+        lua_pushnil (L);
+        lua_pushfstring (L, "%s%s%s: %s", path, t.fails->path[0] ? "/" : "", t.fails->path,
+                         strerror (t.fails->err));
+        lua_pushinteger (L, t.fails->err);
+        lua_newtable (L);
+        while (t.fails) {
+                rm_fail *f = t.fails;
+                t.fails = f->next;
+                lua_createtable (L, 0, 2);
+                lua_pushfstring (L, "%s%s%s", path, f->path[0] ? "/" : "", f->path);
+                lua_setfield (L, -2, "path");
+                lua_pushstring (L, strerror (f->err));
+                lua_setfield (L, -2, "error");
+                lua_rawseti (L, -2, ++n);
+                free (f);
+        }
+        return 4;
+}
+#endif
+
+
+#ifndef _WIN32
+/*
+** Copies.
+** File data is copied by the cheapest means the file systems allow: a
+** reflink sharing the blocks (FICLONE), then copy_file_range and sendfile,
+** which keep the data in the kernel, and read and write as a last resort.
+** lfs.copytree recreates the directories and symbolic links as it reads
+** the source tree, copies the files with a pool of threads, and sets the
+** attributes of the directories last, as adding files changes them.
+*/
+#define COPY_CHUNK   0x40000000  /* bytes per copy_file_range or sendfile call */
+#define COPY_BUFSIZE 131072
+
+enum { COPY_CLONE, COPY_RANGE, COPY_SENDFILE, COPY_READ, COPY_SYMLINK };
+static const char *const copy_methods[] = {
+        "clone", "copy_file_range", "sendfile", "read", "symlink"
+};
+
+/*
+** Copies the size bytes of in to the empty file out. Stores the means
+** used in *method and the bytes copied in *copied.
+** Returns 0, or -1 with errno set.
+*/
+static int copy_data (int in, int out, off_t size, int *method, off_t *copied) {
+        char *buf;
+        ssize_t n;
+        *copied = 0;
+#ifdef FICLONE
+        *method = COPY_CLONE;
+        if (ioctl (out, FICLONE, in) == 0) {
+                *copied = size;
+                return 0;
+        }
+#endif
+#ifdef SYS_copy_file_range
+        *method = COPY_RANGE;
+        while ((n = (ssize_t)syscall (SYS_copy_file_range, in, NULL, out, NULL, (size_t)COPY_CHUNK, 0)) > 0)
+                *copied += n;
+        /* some file systems report no data for files that have some */
+        if (n == 0 && (*copied > 0 || size == 0))
+                return 0;
+        if (n < 0 && (*copied > 0 || (errno != EXDEV && errno != EINVAL &&
+                                      errno != ENOSYS && errno != EOPNOTSUPP)))
+                return -1;
+#endif
+#ifdef __linux__
+        *method = COPY_SENDFILE;
+        while ((n = sendfile (out, in, NULL, COPY_CHUNK)) > 0)
+                *copied += n;
+        if (n == 0 && (*copied > 0 || size == 0))
+                return 0;
+        if (n < 0 && (*copied > 0 || (errno != EINVAL && errno != ENOSYS)))
+                return -1;
+#endif
+        *method = COPY_READ;
+        if ((buf = (char *)malloc (COPY_BUFSIZE)) == NULL)
+                return -1;
+        while ((n = read (in, buf, COPY_BUFSIZE)) != 0) {
+                ssize_t done = 0, w;
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+                while (done < n) {
+                        if ((w = write (out, buf + done, (size_t)(n - done))) < 0) {
+                                if (errno == EINTR)
+                                        continue;
+                                break;
+                        }
+                        done += w;
+                }
+                if (done < n) {
+                        n = -1;
+                        break;
+                }
+                *copied += n;
+        }
+        free (buf);
+        return n < 0 ? -1 : 0;
+}
+
+static void copy_times (const STAT_STRUCT *info, struct timespec *times) {
+#ifdef __linux__
+        times[0] = info->st_atim;
+        times[1] = info->st_mtim;
+#else
+        times[0].tv_sec = info->st_atime;
+        times[1].tv_sec = info->st_mtime;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+#endif
+}
+
+/*
+** Copies the data of in to out, with the permissions and times of info if
+** preserve is set.
+** Returns 0, or -1 with errno set.
+*/
+static int copy_fd (int in, int out, const STAT_STRUCT *info, int preserve,
+                    int *method, off_t *copied) {
+        struct timespec times[2];
+        if (copy_data (in, out, info->st_size, method, copied) != 0)
+                return -1;
+        if (!preserve)
+                return 0;
+        copy_times (info, times);
+        return fchmod (out, info->st_mode & 07777) != 0 || futimens (out, times) != 0 ? -1 : 0;
+}
+
+/*
+** Recreates the symbolic link sname of directory sfd as dname in dfd,
+** replacing what is there unless it is a directory.
+** Returns 0, or -1 with errno set.
+*/
+static int copy_link (int sfd, const char *sname, int dfd, const char *dname,
+                      const STAT_STRUCT *info, int preserve) {
+        char target[LFS_MAXPATHLEN];
+        struct timespec times[2];
+        ssize_t len = readlinkat (sfd, sname, target, sizeof(target) - 1);
+        if (len < 0)
+                return -1;
+        target[len] = '\0';
+        if (symlinkat (target, dfd, dname) != 0) {
+                if (errno != EEXIST || unlinkat (dfd, dname, 0) != 0 ||
+                    symlinkat (target, dfd, dname) != 0)
+                        return -1;
+        }
+        if (!preserve)
+                return 0;
+        copy_times (info, times);
+        return utimensat (dfd, dname, times, AT_SYMLINK_NOFOLLOW);
+}
+
+/*
+** Opens the file name of directory dfd to copy to it: it is created, or
+** emptied unless it is the source file, described by info.
+** Returns a descriptor, or -1 with errno set.
+*/
+static int copy_open (int dfd, const char *name, const STAT_STRUCT *info) {
+        STAT_STRUCT dinfo;
+        int fd;
+#ifdef LFS_HAVE_BOX
+        fd = box_create (dfd, name, O_WRONLY | O_CREAT | O_NOFOLLOW, info->st_mode & 0777);
+#else
+        fd = openat (dfd, name, O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, info->st_mode & 0777);
+#endif
+        if (fd < 0)
+                return -1;
+        if (fstat (fd, &dinfo) == 0 && dinfo.st_dev == info->st_dev && dinfo.st_ino == info->st_ino) {
+                close (fd);
+                errno = EINVAL;  /* copying a file onto itself */
+                return -1;
+        }
+        if (ftruncate (fd, 0) != 0) {
+                close_keep_errno (fd);
+                return -1;
+        }
+        return fd;
+}
+
+
+/*
+** Copies a file.
+** @param #1 Source path.
+** @param #2 Destination path.
+** @param #3 Table with options (optional): preserve, false to not copy
+**           the permissions and times, and follow, to copy the file a
+**           symbolic link points to instead of the link.
+** Returns the number of bytes copied and the means used.
+*/
+static int file_copy (lua_State *L) {
+        const char *src = luaL_checkstring (L, 1);
+        const char *dst = luaL_checkstring (L, 2);
+        int preserve = opt_boolean (L, 3, "preserve", 1);
+        int follow = opt_boolean (L, 3, "follow", 0);
+        lfs_State *S = lfs_state (L);
+        char sname[NAME_MAX + 1], dname[NAME_MAX + 1];
+        int sfd, dfd, in = -1, out, method = COPY_SYMLINK, res = -1;
+        const char *failed = dst;
+        off_t copied = 0;
+        STAT_STRUCT info;
+        if ((sfd = tree_parent (S, src, sname)) < 0)
+                return pusherror (L, src);
+        if ((dfd = tree_parent (S, dst, dname)) < 0) {
+                close_keep_errno (sfd);
+                return pusherror (L, dst);
+        }
+        if (fstatat (sfd, sname, &info, AT_SYMLINK_NOFOLLOW) != 0)
+                failed = src;
+        else if (S_ISLNK (info.st_mode) && !follow)
+                res = copy_link (sfd, sname, dfd, dname, &info, preserve);
+        else {
+#ifdef LFS_HAVE_BOX
+                /* links may lead anywhere in the box */
+                in = S_ISLNK (info.st_mode) ? box_open (S, src, O_RDONLY) :
+                     openat (sfd, sname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+#else
+                in = openat (sfd, sname, O_RDONLY | O_CLOEXEC);
+#endif
+                if (in < 0 || fstat (in, &info) != 0)
+                        failed = src;
+                else if (!S_ISREG (info.st_mode)) {
+                        errno = S_ISDIR (info.st_mode) ? EISDIR : EINVAL;
+                        failed = src;
+                } else if ((out = copy_open (dfd, dname, &info)) >= 0) {
+                        res = copy_fd (in, out, &info, preserve, &method, &copied);
+                        if (close (out) != 0)
+                                res = -1;
+                }
+                if (in >= 0)
+                        close_keep_errno (in);
+        }
+        close_keep_errno (sfd);
+        close_keep_errno (dfd);
+        cache_sync (S);
+        if (res != 0)
+                return pusherror (L, failed);
+        stats_bytes (L, copied);
+        lua_pushinteger (L, (lua_Integer)copied);
+        lua_pushstring (L, copy_methods[method]);
+        return 2;
+}
+
+
+typedef struct copy_job {
+        STAT_STRUCT info;     /* of the source */
+        size_t path;          /* offset of the path in the arena */
+        off_t copied;
+        int method;
+        int err;              /* errno if it could not be copied, 0 otherwise */
+} copy_job;
+
+typedef struct lfs_Copy {
+        int src, dst;         /* the roots */
+        int preserve;
+        int depth;            /* of the directory being read */
+        STAT_STRUCT dinfo;    /* of the destination root */
+        copy_job *jobs;       /* every entry, in the order they were found */
+        size_t n, cap;
+        char *arena;          /* paths relative to the roots */
+        size_t used, size;
+} lfs_Copy;
+
+/*
+** Records the entry name of the directory of job dir, or the root when
+** dir is NULL.
+** Returns its job, or NULL when out of memory.
+*/
+static copy_job *copy_add (lfs_Copy *c, const copy_job *dir, const char *name) {
+        size_t off = dir ? dir->path : 0, dl = dir ? strlen (c->arena + off) : 0;
+        size_t nl = strlen (name), len = dl + nl + 2;
+        copy_job *j;
+        if (c->n == c->cap) {
+                size_t cap = c->cap ? c->cap * 2 : 256;
+                copy_job *jobs = (copy_job *)realloc (c->jobs, cap * sizeof(copy_job));
+                if (jobs == NULL)
+                        return NULL;
+                c->jobs = jobs;
+                c->cap = cap;
+        }
+        if (c->used + len > c->size) {
+                size_t size = c->size ? c->size * 2 : 8192;
+                char *arena;
+                while (size < c->used + len)
+                        size *= 2;
+                if ((arena = (char *)realloc (c->arena, size)) == NULL)
+                        return NULL;
+                c->arena = arena;
+                c->size = size;
+        }
+        j = &c->jobs[c->n++];
+        j->path = c->used;
+        memmove (c->arena + c->used, c->arena + off, dl);
+        if (dl > 0 && nl > 0)
+                c->arena[c->used + dl++] = '/';
+        memcpy (c->arena + c->used + dl, name, nl + 1);
+        c->used += dl + nl + 1;
+        j->copied = 0;
+        j->method = COPY_READ;
+        j->err = 0;
+        return j;
+}
+
+/*
+** Reads the source directory rel, open at sfd, creating its directories
+** and links in the destination directory open at dfd and recording its
+** files to be copied later. Closes both descriptors unless rel is the
+** root; below TREE_OPEN_MAX levels, they are closed while a subdirectory
+** is read and opened again afterwards.
+** Returns 0, or -1 when out of memory.
+*/
+static int copy_dir (lfs_Copy *c, int sfd, int dfd, size_t rel, char *buf) {
+        walk_names nm;
+        STAT_STRUCT sinfo, dinfo;
+        size_t i;
+        int err, res = 0;
+        memset (&nm, 0, sizeof(nm));
+        c->depth++;
+        if ((err = walk_list (sfd, buf, &nm)) != 0) {
+                c->jobs[rel].err = err;
+                if (err == ENOMEM)
+                        res = -1;
+        }
+        for (i = 0; res == 0 && i < nm.n; i++) {
+                const char *name = nm.arena + nm.off[i];
+                size_t k = c->n;
+                copy_job *j = copy_add (c, &c->jobs[rel], name);
+                int csfd, cdfd;
+                if (j == NULL) {
+                        res = -1;
+                        break;
+                }
+                if (fstatat (sfd, name, &j->info, AT_SYMLINK_NOFOLLOW) != 0)
+                        j->err = errno;
+                else if (S_ISLNK (j->info.st_mode)) {
+                        j->method = COPY_SYMLINK;
+                        if (copy_link (sfd, name, dfd, name, &j->info, c->preserve) != 0)
+                                j->err = errno;
+                } else if (S_ISDIR (j->info.st_mode)) {
+                        if (j->info.st_dev == c->dinfo.st_dev && j->info.st_ino == c->dinfo.st_ino) {
+                                j->err = EINVAL;  /* the copy itself */
+                                continue;
+                        }
+                        /* writable until the files are in */
+                        if (mkdirat (dfd, name, (j->info.st_mode & 07777) | S_IRWXU) != 0 && errno != EEXIST) {
+                                j->err = errno;
+                                continue;
+                        }
+                        csfd = openat (sfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                        cdfd = csfd < 0 ? -1 : openat (dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                        if (cdfd < 0) {
+                                c->jobs[k].err = errno;
+                                if (csfd >= 0)
+                                        close (csfd);
+                                continue;
+                        }
+                        if (c->depth > TREE_OPEN_MAX) {
+                                if (fstat (sfd, &sinfo) != 0 || fstat (dfd, &dinfo) != 0) {
+                                        c->jobs[rel].err = errno;
+                                        close (csfd);
+                                        close (cdfd);
+                                        break;
+                                }
+                                close (sfd);
+                                close (dfd);
+                                sfd = dfd = -1;
+                        }
+                        res = copy_dir (c, csfd, cdfd, k, buf);
+                        if (res == 0 && sfd < 0) {
+                                const char *path = c->arena + c->jobs[rel].path;
+                                if ((sfd = tree_reopen (c->src, path, &sinfo)) < 0 ||
+                                    (dfd = tree_reopen (c->dst, path, &dinfo)) < 0) {
+                                        c->jobs[rel].err = errno;
+                                        break;
+                                }
+                        }
+                } else if (!S_ISREG (j->info.st_mode))
+                        j->err = EINVAL;  /* devices, sockets and pipes */
+        }
+        free (nm.arena);
+        free (nm.off);
+        if (rel != 0) {
+                if (sfd >= 0)
+                        close (sfd);
+                if (dfd >= 0)
+                        close (dfd);
+        }
+        c->depth--;
+        return res;
+}
+
+/*
+** Copies the regular file of job i.
+*/
+static void copy_task (void *arg, size_t i) {
+        lfs_Copy *c = (lfs_Copy *)arg;
+        copy_job *j = &c->jobs[i];
+        const char *rel = c->arena + j->path;
+        int in, out;
+        if (j->err || !S_ISREG (j->info.st_mode))
+                return;
+#ifdef LFS_HAVE_BOX
+        in = box_openat (c->src, rel, O_RDONLY | O_NOFOLLOW);
+#else
+        in = openat (c->src, rel, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+#endif
+        if (in < 0 || (out = copy_open (c->dst, rel, &j->info)) < 0) {
+                j->err = errno;
+                if (in >= 0)
+                        close (in);
+                return;
+        }
+        if (copy_fd (in, out, &j->info, c->preserve, &j->method, &j->copied) != 0)
+                j->err = errno;
+        if (close (out) != 0 && j->err == 0)
+                j->err = errno;
+        close (in);
+}
+
+/*
+** Sets the permissions and times of the copied directories, the deepest
+** first.
+*/
+static void copy_dir_attributes (lfs_Copy *c) {
+        size_t i = c->n;
+        while (i-- > 0) {
+                copy_job *j = &c->jobs[i];
+                const char *rel = c->arena + j->path;
+                struct timespec times[2];
+                int fd;
+                if (!S_ISDIR (j->info.st_mode) || j->err == EINVAL)
+                        continue;
+#ifdef LFS_HAVE_BOX
+                fd = box_openat (c->dst, *rel ? rel : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+#else
+                fd = openat (c->dst, *rel ? rel : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+#endif
+                if (fd < 0)
+                        continue;
+                copy_times (&j->info, times);
+                if ((fchmod (fd, j->info.st_mode & 07777) != 0 || futimens (fd, times) != 0) && j->err == 0)
+                        j->err = errno;
+                close (fd);
+        }
+}
+
+/*
+** Copies a directory tree.
+** @param #1 Source directory.
+** @param #2 Destination directory, created if needed.
+** @param #3 Table with options (optional): threads and preserve.
+** Returns the number of bytes copied and an array with a table for each
+** file and symbolic link, with the fields path (in the destination), bytes
+** and method, or error if it could not be copied. When something could not
+** be copied, returns nil, an error message, an error code and that array.
+*/
+static int tree_copy (lua_State *L) {
+        const char *src = luaL_checkstring (L, 1);
+        const char *dst = luaL_checkstring (L, 2);
+        int nthreads = (int)opt_integer (L, 3, "threads", default_threads ());
+        lfs_State *S = lfs_state (L);
+        char name[NAME_MAX + 1], *buf = NULL;
+        copy_job *first = NULL;
+        lua_Integer total = 0;
+        lfs_Copy c;
+        int pfd, res = -1, n = 0;
+        size_t i;
+        luaL_argcheck (L, nthreads > 0 && nthreads <= LFS_MAXTHREADS, 3, "invalid number of threads");
+        memset (&c, 0, sizeof(c));
+        c.preserve = opt_boolean (L, 3, "preserve", 1);
+        c.dst = -1;
+#ifdef LFS_HAVE_BOX
+        c.src = box_open (S, src, O_RDONLY | O_DIRECTORY);
+#else
+        c.src = openat (S->cwdfd, src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+        if (c.src < 0)
+                return pusherror (L, src);
+        if ((pfd = tree_parent (S, dst, name)) >= 0) {
+                if (mkdirat (pfd, name, S_IRWXU) == 0 || errno == EEXIST)
+                        c.dst = openat (pfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                close_keep_errno (pfd);
+        }
+        if (c.dst < 0 || fstat (c.dst, &c.dinfo) != 0 ||
+            (buf = (char *)malloc (WALK_BUFSIZE)) == NULL ||
+            copy_add (&c, NULL, "") == NULL || fstat (c.src, &c.jobs[0].info) != 0)
+                goto done;
+        if (c.jobs[0].info.st_dev == c.dinfo.st_dev && c.jobs[0].info.st_ino == c.dinfo.st_ino) {
+                errno = EINVAL;  /* onto itself */
+                goto done;
+        }
+        if (copy_dir (&c, c.src, c.dst, 0, buf) != 0)
+                goto done;
+        run_parallel (nthreads, c.n, copy_task, &c);
+        copy_dir_attributes (&c);
+        res = 0;
+done:
+        {
+                int en = errno;
+                free (buf);
+                close (c.src);
+                if (c.dst >= 0)
+                        close (c.dst);
+                errno = en;
+        }
+        cache_sync (S);
+        if (res != 0) {
+                free (c.jobs);
+                free (c.arena);
+                return pusherror (L, c.dst < 0 ? dst : src);
+        }
+        lua_newtable (L);
+        for (i = 0; i < c.n; i++) {
+                copy_job *j = &c.jobs[i];
+                if (S_ISDIR (j->info.st_mode) && j->err == 0)
+                        continue;
+                lua_createtable (L, 0, 3);
+                lua_pushfstring (L, "%s/%s", dst, c.arena + j->path);
+                lua_setfield (L, -2, "path");
+                if (j->err) {
+                        if (first == NULL)
+                                first = j;
+                        lua_pushstring (L, strerror (j->err));
+                        lua_setfield (L, -2, "error");
+                } else {
+                        total += (lua_Integer)j->copied;
+                        lua_pushinteger (L, (lua_Integer)j->copied);
+                        lua_setfield (L, -2, "bytes");
+                        lua_pushstring (L, copy_methods[j->method]);
+                        lua_setfield (L, -2, "method");
+                }
+                lua_rawseti (L, -2, ++n);
+        }
+        if (first) {
+                lua_pushnil (L);
+                lua_pushfstring (L, "%s/%s: %s", src, c.arena + first->path, strerror (first->err));
+                lua_pushinteger (L, first->err);
+                lua_pushvalue (L, -4);
+        } else {
+                lua_pushinteger (L, total);
+                lua_pushvalue (L, -2);
+        }
+        stats_bytes (L, total);
+        free (c.jobs);
+        free (c.arena);
+        return first ? 4 : 2;
+}
+#endif
+
+
+#ifndef _WIN32
+/*
+** Memory maps.
+** lfs.mmap maps a whole file and returns an object that reads it in place:
+** only sub and byte copy bytes out, find and lines return positions, and
+** the kernel brings pages in as they are touched. The view_ functions work
+** on any span of memory; searches go through memchr and memmem, which the
+** C library implements with vector instructions.
+*/
+#define MAP_METATABLE "map metatable"
+
+typedef struct lfs_Map {
+        char *base;  /* NULL for empty files */
+        size_t len;
+        int writable;
+        int closed;
+} lfs_Map;
+
+/*
+** Converts a position as the string functions take it, negative ones
+** counting from the end, to one in [0, len + 1].
+*/
+static size_t view_pos (lua_Integer pos, size_t len) {
+        if (pos >= 0)
+                return (size_t)pos > len ? len + 1 : (size_t)pos;
+        if ((size_t)-(pos + 1) >= len)
+                return 0;
+        return len - (size_t)-(pos + 1);
+}
+
+/*
+** Reads the positions i and j at idx and idx + 1, j defaulting to def,
+** into the offsets [*start, *end) of a span of len bytes.
+*/
+static void view_range (lua_State *L, int idx, size_t len, lua_Integer def,
+                        size_t *start, size_t *end) {
+        size_t i = view_pos (luaL_optinteger (L, idx, 1), len);
+        size_t j = view_pos (luaL_optinteger (L, idx + 1, def), len);
+        *start = i < 1 ? 0 : i - 1;
+        *end = j > len ? len : j;
+        if (*start > *end)
+                *start = *end;
+}
+
+/*
+** Pushes bytes i to j of a span, like string.sub.
+*/
+static int view_sub (lua_State *L, const char *p, size_t len, int idx) {
+        size_t start, end;
+        view_range (L, idx, len, -1, &start, &end);
+        lua_pushlstring (L, start < end ? p + start : "", end - start);
+        return 1;
+}
+
+/*
+** Pushes the values of bytes i to j of a span, like string.byte.
+*/
+static int view_byte (lua_State *L, const char *p, size_t len, int idx) {
+        size_t start, end, k;
+        view_range (L, idx, len, luaL_optinteger (L, idx, 1), &start, &end);
+        if (end - start >= (size_t)INT_MAX || !lua_checkstack (L, (int)(end - start)))
+                return luaL_error (L, "string slice too long");
+        for (k = start; k < end; k++)
+                lua_pushinteger (L, (unsigned char)p[k]);
+        return (int)(end - start);
+}
+
+/*
+** Finds the literal string at idx in a span, from the position at
+** idx + 1, like string.find with plain set.
+** Pushes the positions of its first and last bytes, or nil.
+*/
+static int view_find (lua_State *L, const char *p, size_t len, int idx) {
+        lua_Integer init = luaL_optinteger (L, idx + 1, 1);
+        size_t n, start = view_pos (init, len);
+        const char *s = luaL_checklstring (L, idx, &n);
+        const char *q;
+        if (start < 1)
+                start = 1;
+        if (init > 0 && (size_t)init > len + 1) {
+                lua_pushnil (L);
+                return 1;
+        }
+        start--;
+        if (n == 0)
+                q = p ? p + start : "";
+        else if (n > len - start)
+                q = NULL;
+        else if (n == 1)
+                q = (const char *)memchr (p + start, *s, len - start);
+        else
+                q = (const char *)memmem (p + start, len - start, s, n);
+        if (q == NULL) {
+                lua_pushnil (L);
+                return 1;
+        }
+        start = n == 0 ? start : (size_t)(q - p);
+        lua_pushinteger (L, (lua_Integer)start + 1);
+        lua_pushinteger (L, (lua_Integer)(start + n));
+        return 2;
+}
+
+/*
+** Step of a lines iterator over a span, whose second upvalue holds the
+** offset of the next line. Pushes the positions of the first and last
+** bytes of the line, without the newline, or nothing at the end.
+*/
+static int view_lines_next (lua_State *L, const char *p, size_t len) {
+        size_t pos = (size_t)lua_tointeger (L, lua_upvalueindex (2)), end;
+        const char *nl;
+        if (pos >= len)
+                return 0;
+        nl = (const char *)memchr (p + pos, '\n', len - pos);
+        end = nl ? (size_t)(nl - p) : len;
+        lua_pushinteger (L, (lua_Integer)(nl ? end + 1 : end));
+        lua_replace (L, lua_upvalueindex (2));
+        lua_pushinteger (L, (lua_Integer)pos + 1);
+        lua_pushinteger (L, (lua_Integer)end);
+        return 2;
+}
+
+static lfs_Map *check_map (lua_State *L, int idx) {
+        lfs_Map *m = (lfs_Map *)luaL_checkudata (L, idx, MAP_METATABLE);
+        luaL_argcheck (L, !m->closed, idx, "closed map");
+        return m;
+}
+
+static int map_sub (lua_State *L) {
+        lfs_Map *m = check_map (L, 1);
+        return view_sub (L, m->base, m->len, 2);
+}
+
+static int map_byte (lua_State *L) {
+        lfs_Map *m = check_map (L, 1);
+        return view_byte (L, m->base, m->len, 2);
+}
+
+static int map_find (lua_State *L) {
+        lfs_Map *m = check_map (L, 1);
+        return view_find (L, m->base, m->len, 2);
+}
+
+static int map_lines_iter (lua_State *L) {
+        lfs_Map *m = check_map (L, lua_upvalueindex (1));
+        return view_lines_next (L, m->base, m->len);
+}
+
+/*
+** Returns an iterator over the lines of a map, which gives the positions
+** of the first and last byte of each, without the newline.
+*/
+static int map_lines (lua_State *L) {
+        check_map (L, 1);
+        lua_settop (L, 1);
+        lua_pushinteger (L, 0);
+        lua_pushcclosure (L, map_lines_iter, 2);
+        return 1;
+}
+
+static int map_len (lua_State *L) {
+        lua_pushinteger (L, (lua_Integer)check_map (L, 1)->len);
+        return 1;
+}
+
+/*
+** Stores a string at position i of a map opened for writing.
+*/
+static int map_write (lua_State *L) {
+        lfs_Map *m = check_map (L, 1);
+        lua_Integer i = luaL_checkinteger (L, 2);
+        size_t n;
+        const char *s = luaL_checklstring (L, 3, &n);
+        luaL_argcheck (L, m->writable, 1, "map not opened for writing");
+        luaL_argcheck (L, i >= 1 && (size_t)(i - 1) <= m->len && n <= m->len - (size_t)(i - 1),
+                       2, "out of range");
+        if (n > 0)
+                memcpy (m->base + i - 1, s, n);
+        return 0;
+}
+
+/*
+** Writes the changes to a map opened for writing to its file.
+*/
+static int map_sync (lua_State *L) {
+        lfs_Map *m = check_map (L, 1);
+        if (m->len > 0 && msync (m->base, m->len, MS_SYNC) != 0)
+                return pusherror (L, NULL);
+        lua_pushboolean (L, 1);
+        return 1;
+}
+
+/*
+** Tells the kernel how bytes i to j of a map (all by default) will be
+** used: normal, sequential, random, willneed or dontneed.
+*/
+static int map_advise (lua_State *L) {
+        static const char *const names[] = {
+                "normal", "sequential", "random", "willneed", "dontneed", NULL
+        };
+        static const int advice[] = {
+                MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED
+        };
+        lfs_Map *m = check_map (L, 1);
+        int op = luaL_checkoption (L, 2, NULL, names);
+        size_t page = (size_t)sysconf (_SC_PAGESIZE), start, end;
+        view_range (L, 3, m->len, -1, &start, &end);
+        start -= start % page;  /* madvise takes whole pages */
+        if (start < end && madvise (m->base + start, end - start, advice[op]) != 0)
+                return pusherror (L, NULL);
+        lua_pushboolean (L, 1);
+        return 1;
+}
+
+static int map_close (lua_State *L) {
+        lfs_Map *m = (lfs_Map *)luaL_checkudata (L, 1, MAP_METATABLE);
+        if (!m->closed && m->base != NULL)
+                munmap (m->base, m->len);
+        m->base = NULL;
+        m->len = 0;
+        m->closed = 1;
+        return 0;
+}
+
+/*
+** Maps a file in memory.
+** @param #1 File path.
+** @param #2 "r" to read it (default), or "w" to also change it in place.
+** Returns a map object.
+*/
+static int map_open (lua_State *L) {
+        const char *path = luaL_checkstring (L, 1);
+        const char *mode = luaL_optstring (L, 2, "r");
+        int writable = strcmp (mode, "w") == 0, fd;
+        STAT_STRUCT info;
+        lfs_Map *m;
+        luaL_argcheck (L, writable || strcmp (mode, "r") == 0, 2, "invalid mode");
+        m = (lfs_Map *)lua_newuserdata (L, sizeof(lfs_Map));
+        m->base = NULL;
+        m->len = 0;
+        m->writable = writable;
+        m->closed = 1;
+        luaL_getmetatable (L, MAP_METATABLE);
+        lua_setmetatable (L, -2);
+#ifdef LFS_HAVE_BOX
+        fd = box_open (lfs_state (L), path, writable ? O_RDWR : O_RDONLY);
+#else
+        fd = openat (lfs_state (L)->cwdfd, path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+#endif
+        if (fd < 0)
+                return pusherror (L, path);
+        if (fstat (fd, &info) != 0) {
+                close_keep_errno (fd);
+                return pusherror (L, path);
+        }
+        if (!S_ISREG (info.st_mode)) {
+                close (fd);
+                errno = S_ISDIR (info.st_mode) ? EISDIR : EINVAL;
+                return pusherror (L, path);
+        }
+        if (info.st_size > 0) {
+                void *p = mmap (NULL, (size_t)info.st_size, PROT_READ | (writable ? PROT_WRITE : 0),
+                                MAP_SHARED, fd, 0);
+                if (p == MAP_FAILED) {
+                        close_keep_errno (fd);
+                        return pusherror (L, path);
+                }
+                m->base = (char *)p;
+                m->len = (size_t)info.st_size;
+        }
+        close (fd);  /* the mapping holds the file */
+        m->closed = 0;
+        return 1;
+}
+
+static void map_create_meta (lua_State *L) {
+        luaL_newmetatable (L, MAP_METATABLE);
+
+        /* Method table */
+        lua_newtable (L);
+        lua_pushcfunction (L, map_advise);
+        lua_setfield (L, -2, "advise");
+        lua_pushcfunction (L, map_byte);
+        lua_setfield (L, -2, "byte");
+        lua_pushcfunction (L, map_close);
+        lua_setfield (L, -2, "close");
+        lua_pushcfunction (L, map_find);
+        lua_setfield (L, -2, "find");
+        lua_pushcfunction (L, map_len);
+        lua_setfield (L, -2, "len");
+        lua_pushcfunction (L, map_lines);
+        lua_setfield (L, -2, "lines");
+        lua_pushcfunction (L, map_sub);
+        lua_setfield (L, -2, "sub");
+        lua_pushcfunction (L, map_sync);
+        lua_setfield (L, -2, "sync");
+        lua_pushcfunction (L, map_write);
+        lua_setfield (L, -2, "write");
+
+        /* Metamethods */
+        lua_setfield (L, -2, "__index");
+        lua_pushcfunction (L, map_len);
+        lua_setfield (L, -2, "__len");
+        lua_pushcfunction (L, map_close);
+        lua_setfield (L, -2, "__gc");
+        lua_pop (L, 1);
+}
+#endif
+
+#ifndef _WIN32
+/*
+** Buffers.
+** lfs.buffer objects hold bytes read from files outside Lua: they can be
+** searched and sliced like maps, written back, and made into a string
+** only when asked, so a loop reading chunks creates no garbage.
+*/
+#define BUFFER_METATABLE "buffer metatable"
+
+typedef struct lfs_Buffer {
+        lfs_State *state;  /* for the paths given to its methods, anchored */
+        lfs_Pool *pool;
+        char *data;  /* NULL once released */
+        size_t len;
+        size_t cap;
+        int cls;
+} lfs_Buffer;
+
+static lfs_Buffer *check_buffer (lua_State *L, int idx) {
+        lfs_Buffer *b = (lfs_Buffer *)luaL_checkudata (L, idx, BUFFER_METATABLE);
+        luaL_argcheck (L, b->data != NULL, idx, "released buffer");
+        return b;
+}
+
+/*
+** Opens the path at idx with flags, for the methods of b, or takes the
+** descriptor there, which must be open.
+** Returns a descriptor, or -1 with errno set; *owned tells whether it
+** must be closed.
+*/
+static int buffer_target (lua_State *L, lfs_Buffer *b, int idx, int flags, int *owned) {
+        if (lua_type (L, idx) == LUA_TNUMBER) {
+                lua_Integer fd = lua_tointeger (L, idx);
+                *owned = 0;
+                if (fd < 0 || fd > INT_MAX || fcntl ((int)fd, F_GETFD) == -1) {
+                        errno = EBADF;
+                        return -1;
+                }
+                return (int)fd;
+        }
+        *owned = 1;
+#ifdef LFS_HAVE_BOX
+        {
+                char buf[LFS_MAXPATHLEN];
+                if (box_path (b->state, luaL_checkstring (L, idx), buf) == NULL)
+                        return -1;
+                return box_create (b->state->root, buf, flags, 0666);
+        }
+#else
+        return openat (b->state->cwdfd, luaL_checkstring (L, idx), flags | O_CLOEXEC, 0666);
+#endif
+}
+
+/*
+** Replaces the contents of a buffer with bytes read from a file.
+** @param #2 File path or descriptor.
+** @param #3 Offset to read at (optional); a descriptor is read from its
+**           current position by default, and a path from its start.
+** @param #4 Number of bytes to read (optional, default the capacity).
+** Returns the number of bytes read, 0 at the end of the file.
+*/
+static int buffer_read_from (lua_State *L) {
+        lfs_Buffer *b = check_buffer (L, 1);
+        off_t off = (off_t)luaL_optinteger (L, 3, 0);
+        lua_Integer want = luaL_optinteger (L, 4, (lua_Integer)b->cap);
+        int positioned, owned, fd;
+        size_t n = 0;
+        luaL_argcheck (L, off >= 0, 3, "negative offset");
+        luaL_argcheck (L, want >= 0 && (size_t)want <= b->cap, 4, "larger than the buffer");
+        /* the arguments are checked first: errors raised past here would leak fd */
+        if ((fd = buffer_target (L, b, 2, O_RDONLY, &owned)) < 0)
+                return pusherror (L, lua_tostring (L, 2));
+        positioned = !lua_isnoneornil (L, 3) || owned;
+        while (n < (size_t)want) {
+                ssize_t r = positioned ? pread (fd, b->data + n, (size_t)want - n, off + (off_t)n) :
+                                         read (fd, b->data + n, (size_t)want - n);
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r < 0) {
+                        if (owned)
+                                close_keep_errno (fd);
+                        return pusherror (L, lua_tostring (L, 2));
+                }
+                n += (size_t)r;
+                if (r == 0 || !positioned)  /* pipes and sockets return what they have */
+                        break;
+        }
+        if (owned)
+                close (fd);
+        b->len = n;
+        lua_pushinteger (L, (lua_Integer)n);
+        return 1;
+}
+
+/*
+** Writes the contents of a buffer to a file.
+** @param #2 File path or descriptor; a path is created if needed.
+** @param #3 Offset to write at (optional); a descriptor is written at its
+**           current position by default, and a path is replaced.
+** Returns the number of bytes written.
+*/
+static int buffer_write_to (lua_State *L) {
+        lfs_Buffer *b = check_buffer (L, 1);
+        off_t off = (off_t)luaL_optinteger (L, 3, 0);
+        int at = !lua_isnoneornil (L, 3), owned, fd;
+        size_t n = 0;
+        luaL_argcheck (L, off >= 0, 3, "negative offset");
+        if ((fd = buffer_target (L, b, 2, O_WRONLY | O_CREAT | (at ? 0 : O_TRUNC), &owned)) < 0)
+                return pusherror (L, lua_tostring (L, 2));
+        while (n < b->len) {
+                ssize_t r = at || owned ? pwrite (fd, b->data + n, b->len - n, off + (off_t)n) :
+                                          write (fd, b->data + n, b->len - n);
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r < 0) {
+                        if (owned) {
+                                close_keep_errno (fd);
+                                cache_sync (b->state);
+                        }
+                        return pusherror (L, lua_tostring (L, 2));
+                }
+                n += (size_t)r;
+        }
+        if (owned) {
+                int res = close (fd);
+                cache_sync (b->state);  /* the file at the path changed */
+                if (res != 0)
+                        return pusherror (L, lua_tostring (L, 2));
+        }
+        lua_pushinteger (L, (lua_Integer)n);
+        return 1;
+}
+
+/*
+** Adds a string at the end of a buffer.
+*/
+static int buffer_append (lua_State *L) {
+        lfs_Buffer *b = check_buffer (L, 1);
+        size_t n;
+        const char *s = luaL_checklstring (L, 2, &n);
+        luaL_argcheck (L, n <= b->cap - b->len, 2, "larger than the space left");
+        memcpy (b->data + b->len, s, n);
+        b->len += n;
+        return 0;
+}
+
+static int buffer_clear (lua_State *L) {
+        check_buffer (L, 1)->len = 0;
+        return 0;
+}
+
+static int buffer_sub (lua_State *L) {
+        lfs_Buffer *b = check_buffer (L, 1);
+        return view_sub (L, b->data, b->len, 2);
+}
+
+static int buffer_byte (lua_State *L) {
+        lfs_Buffer *b = check_buffer (L, 1);
+        return view_byte (L, b->data, b->len, 2);
+}
+
+static int buffer_find (lua_State *L) {
+        lfs_Buffer *b = check_buffer (L, 1);
+        return view_find (L, b->data, b->len, 2);
+}
+
+static int buffer_lines_iter (lua_State *L) {
+        lfs_Buffer *b = check_buffer (L, lua_upvalueindex (1));
+        return view_lines_next (L, b->data, b->len);
+}
+
+/*
+** Returns an iterator over the lines of a buffer, like map:lines.
+*/
+static int buffer_lines (lua_State *L) {
+        check_buffer (L, 1);
+        lua_settop (L, 1);
+        lua_pushinteger (L, 0);
+        lua_pushcclosure (L, buffer_lines_iter, 2);
+        return 1;
+}
+
+static int buffer_tostring (lua_State *L) {
+        lfs_Buffer *b = check_buffer (L, 1);
+        lua_pushlstring (L, b->data, b->len);
+        return 1;
+}
+
+static int buffer_len (lua_State *L) {
+        lua_pushinteger (L, (lua_Integer)check_buffer (L, 1)->len);
+        return 1;
+}
+
+static int buffer_capacity (lua_State *L) {
+        lua_pushinteger (L, (lua_Integer)check_buffer (L, 1)->cap);
+        return 1;
+}
+
+/*
+** Gives the memory of a buffer back to the pool.
+*/
+static int buffer_release (lua_State *L) {
+        lfs_Buffer *b = (lfs_Buffer *)luaL_checkudata (L, 1, BUFFER_METATABLE);
+        if (b->data != NULL) {
+                pool_free (b->pool, b->data, b->cls);
+                b->data = NULL;
+                b->len = b->cap = 0;
+        }
+        return 0;
+}
+
+/*
+** Creates a buffer.
+** @param #1 Capacity in bytes, rounded up to a power of two of 4 KiB or more.
+** Returns a buffer object.
+*/
+static int buffer_new (lua_State *L) {
+        lua_Integer cap = luaL_checkinteger (L, 1);
+        lfs_State *S = lfs_state (L);
+        lfs_Buffer *b;
+        int cls = 0;
+        luaL_argcheck (L, cap > 0 && (cap - 1) >> (POOL_MINSHIFT + POOL_CLASSES - 1) == 0,
+                       1, "invalid capacity");
+        while (((lua_Integer)1 << (cls + POOL_MINSHIFT)) < cap)
+                cls++;
+        if (S->pool == NULL) {
+                if ((S->pool = (lfs_Pool *)calloc (1, sizeof(lfs_Pool))) == NULL)
+                        return luaL_error (L, "not enough memory");
+                S->pool->refs = 1;
+        }
+        b = (lfs_Buffer *)lua_newuserdata (L, sizeof(lfs_Buffer));
+        b->state = S;
+        b->pool = S->pool;
+        b->data = NULL;
+        b->len = b->cap = 0;
+        b->cls = cls;
+        luaL_getmetatable (L, BUFFER_METATABLE);
+        lua_setmetatable (L, -2);
+        state_anchor (L, -1);
+        if ((b->data = (char *)pool_alloc (S->pool, cls)) == NULL)
+                return luaL_error (L, "not enough memory");
+        b->cap = (size_t)1 << (cls + POOL_MINSHIFT);
+        return 1;
+}
+
+/*
+** Returns a table with the counters of the buffer pool.
+*/
+static int buffer_stats (lua_State *L) {
+        static const lfs_Pool none;
+        const lfs_Pool *P = lfs_state (L)->pool ? lfs_state (L)->pool : &none;
+        lua_createtable (L, 0, 7);
+        lua_pushinteger (L, (lua_Integer)P->buffers);
+        lua_setfield (L, -2, "buffers");
+        lua_pushinteger (L, (lua_Integer)P->bytes);
+        lua_setfield (L, -2, "bytes");
+        lua_pushinteger (L, (lua_Integer)P->peakbuffers);
+        lua_setfield (L, -2, "peakbuffers");
+        lua_pushinteger (L, (lua_Integer)P->peakbytes);
+        lua_setfield (L, -2, "peakbytes");
+        lua_pushinteger (L, (lua_Integer)P->pooled);
+        lua_setfield (L, -2, "pooled");
+        lua_pushinteger (L, (lua_Integer)P->reused);
+        lua_setfield (L, -2, "reused");
+        lua_pushinteger (L, (lua_Integer)P->allocated);
+        lua_setfield (L, -2, "allocated");
+        return 1;
+}
+
+static void buffer_create_meta (lua_State *L) {
+        luaL_newmetatable (L, BUFFER_METATABLE);
+
+        /* Method table */
+        lua_newtable (L);
+        lua_pushcfunction (L, buffer_append);
+        lua_setfield (L, -2, "append");
+        lua_pushcfunction (L, buffer_byte);
+        lua_setfield (L, -2, "byte");
+        lua_pushcfunction (L, buffer_capacity);
+        lua_setfield (L, -2, "capacity");
+        lua_pushcfunction (L, buffer_clear);
+        lua_setfield (L, -2, "clear");
+        lua_pushcfunction (L, buffer_find);
+        lua_setfield (L, -2, "find");
+        lua_pushcfunction (L, buffer_len);
+        lua_setfield (L, -2, "len");
+        lua_pushcfunction (L, buffer_lines);
+        lua_setfield (L, -2, "lines");
+        lua_pushcfunction (L, buffer_read_from);
+        lua_setfield (L, -2, "read_from");
+        lua_pushcfunction (L, buffer_release);
+        lua_setfield (L, -2, "release");
+        lua_pushcfunction (L, buffer_sub);
+        lua_setfield (L, -2, "sub");
+        lua_pushcfunction (L, buffer_tostring);
+        lua_setfield (L, -2, "tostring");
+        lua_pushcfunction (L, buffer_write_to);
+        lua_setfield (L, -2, "write_to");
+
+        /* Metamethods */
+        lua_setfield (L, -2, "__index");
+        lua_pushcfunction (L, buffer_len);
+        lua_setfield (L, -2, "__len");
+        lua_pushcfunction (L, buffer_tostring);
+        lua_setfield (L, -2, "__tostring");
+        lua_pushcfunction (L, buffer_release);
+        lua_setfield (L, -2, "__gc");
+        lua_pop (L, 1);
+}
+#endif
+
+#ifndef _WIN32
+/*
+** Atomic files.
+** A file is written unnamed (O_TMPFILE), or under a temporary name where
+** that is not supported, and only linked or renamed to its path once it
+** is complete, so readers find either the old contents or the new ones.
+*/
+#ifdef __APPLE__
+#define atomic_datasync fsync  /* no fdatasync */
+#else
+#define atomic_datasync fdatasync
+#endif
+
+typedef struct atomic_file {
+        int pfd;                   /* parent directory */
+        int fd;                    /* the new contents */
+        int named;                 /* the file is at tmp until published */
+        char name[NAME_MAX + 1];   /* in the parent directory */
+        char tmp[NAME_MAX + 1];
+} atomic_file;
+
+/*
+** Picks a name for a temporary file next to a->name.
+** Returns 0, or -1 with errno set if the name would be too long.
+*/
+static int atomic_tmpname (atomic_file *a, unsigned attempt) {
+        struct timespec ts;
+        unsigned r;
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        r = (unsigned)ts.tv_nsec ^ ((unsigned)getpid () << 16) ^ (unsigned)(uintptr_t)a ^ attempt * 2654435761u;
+        if (strlen (a->name) + 15 > NAME_MAX) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        sprintf (a->tmp, ".%s.%08x.tmp", a->name, r);
+        return 0;
+}
+
+/*
+** Creates the file that will replace a->name in the directory open at
+** a->pfd, with the permissions mode; unnamed unless named is set.
+** Returns 0, or -1 with errno set.
+*/
+static int atomic_create (atomic_file *a, mode_t mode, int named) {
+        unsigned i;
+        a->fd = -1;
+        a->named = 0;
+#ifdef O_TMPFILE
+        if (!named) {
+                if ((a->fd = openat (a->pfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, mode)) >= 0)
+                        return 0;
+                if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+                        return -1;
+        }
+#else
+        (void)named;
+#endif
+        for (i = 0; i < 64; i++) {
+                if (atomic_tmpname (a, i) != 0)
+                        break;
+                a->fd = openat (a->pfd, a->tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode);
+                if (a->fd >= 0) {
+                        a->named = 1;
+                        return 0;
+                }
+                if (errno != EEXIST)
+                        break;
+        }
+        return -1;
+}
+
+/*
+** Opens the file that will replace path, with the permissions mode.
+** Returns 0, or -1 with errno set.
+*/
+static int atomic_open (lfs_State *S, const char *path, mode_t mode, atomic_file *a) {
+        a->fd = -1;
+        a->named = 0;
+        if ((a->pfd = tree_parent (S, path, a->name)) < 0)
+                return -1;
+        if (atomic_create (a, mode, 0) != 0)
+                return close_keep_errno (a->pfd);
+        return 0;
+}
+
+/*
+** Gives the unnamed file of a the name as in its parent directory.
+*/
+static int atomic_link (atomic_file *a, const char *as) {
+        char link[32];
+        /* AT_EMPTY_PATH would need CAP_DAC_READ_SEARCH */
+        fd_path (a->fd, link);
+        return linkat (AT_FDCWD, link, a->pfd, as, AT_SYMLINK_FOLLOW);
+}
+
+/*
+** Puts the file of a at its path, replacing what is there.
+** Returns 0, or -1 with errno set.
+*/
+static int atomic_publish (atomic_file *a) {
+        unsigned i;
+        if (!a->named) {
+                if (atomic_link (a, a->name) == 0)
+                        return 0;  /* there was nothing there */
+                if (errno != EEXIST)
+                        return -1;
+                /* name it, then rename it over the old file */
+                for (i = 0; ; i++) {
+                        if (i == 64 || atomic_tmpname (a, i) != 0)
+                                return -1;
+                        if (atomic_link (a, a->tmp) == 0)
+                                break;
+                        if (errno != EEXIST)
+                                return -1;
+                }
+                a->named = 1;
+        }
+        if (renameat (a->pfd, a->tmp, a->pfd, a->name) != 0)
+                return -1;
+        a->named = 0;
+        return 0;
+}
+
+/*
+** Syncs the directory open at pfd.
+*/
+static int atomic_syncdir (int pfd) {
+        int fd = openat (pfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || fsync (fd) != 0)
+                return fd < 0 ? -1 : close_keep_errno (fd);
+        close (fd);
+        return 0;
+}
+
+/*
+** Closes the file of a, and removes it if it was not published, keeping
+** errno and the parent descriptor.
+*/
+static void atomic_discard (atomic_file *a) {
+        int en = errno;
+        if (a->fd >= 0)
+                close (a->fd);
+        if (a->named)
+                unlinkat (a->pfd, a->tmp, 0);
+        a->fd = -1;
+        a->named = 0;
+        errno = en;
+}
+
+/*
+** Closes the descriptors of a, as atomic_discard does, and its parent.
+*/
+static void atomic_close (atomic_file *a) {
+        int en;
+        atomic_discard (a);
+        en = errno;
+        close (a->pfd);
+        errno = en;
+}
+#endif
+
+#ifndef _WIN32
+/*
+** Snapshots.
+** lfs.snapshot records the files of a tree in parallel arrays (inode,
+** device, size, modification time in nanoseconds and mode) and one arena
+** of relative paths, in a fraction of the memory of a Lua table. Each
+** directory is listed in sorted order and walked depth first, so the
+** paths come out sorted by snap_cmp, the contents of a directory follow
+** it, and two snapshots are compared by a single merge. The same arrays
+** are written to a file by save, and lfs.loadsnapshot maps them back as
+** they are.
+*/
+#define SNAP_METATABLE "snapshot metatable"
+#define SNAP_MAGIC     "LFSSNAP2"
+#define SNAP_ORDER     UINT64_C(0x0102030405060708)
+
+/* Start of a snapshot file, followed by the arrays and the arena */
+typedef struct snap_header {
+        char magic[8];
+        uint64_t order;  /* tells the byte order of the writer */
+        uint64_t n;
+        uint64_t arena;
+        int64_t stamp;
+} snap_header;
+
+typedef struct lfs_Snap {
+        uint64_t *ino, *dev;
+        int64_t *size, *mtime;
+        uint64_t *name;  /* offset of each path in the arena */
+        uint32_t *mode;
+        char *arena;
+        size_t n, cap, used, asize;
+        int64_t stamp;   /* time the walk started, in nanoseconds */
+        void *map;       /* the file when loaded, NULL when built */
+        size_t maplen;
+        lfs_State *state;  /* for the paths given to its methods */
+} lfs_Snap;
+
+/* State of a walk */
+typedef struct snap_scan {
+        const lfs_Snap *old;  /* directories that need not be read again */
+        char *buf;
+        long bad;             /* offset of the path that failed, -1 for the root */
+        size_t dirs, rescanned;
+        int root;             /* where the walk started */
+        int depth;            /* of the directory being read */
+} snap_scan;
+
+/*
+** Compares two paths of a snapshot, ordering "/" before any other byte
+** so that a directory and its contents sort together.
+*/
+static int snap_cmp (const char *a, const char *b) {
+        int ca, cb;
+        for (;; a++, b++) {
+                ca = *a == '/' ? 1 : *a == '\0' ? 0 : (unsigned char)*a + 1;
+                cb = *b == '/' ? 1 : *b == '\0' ? 0 : (unsigned char)*b + 1;
+                if (ca != cb || ca == 0)
+                        return ca - cb;
+        }
+}
+
+static int snap_namecmp (const void *a, const void *b) {
+        return strcmp (*(const char *const *)a, *(const char *const *)b);
+}
+
+static void snap_free (lfs_Snap *s) {
+        lfs_State *S = s->state;
+        if (s->map != NULL)
+                munmap (s->map, s->maplen);
+        else {
+                free (s->ino);
+                free (s->dev);
+                free (s->size);
+                free (s->mtime);
+                free (s->name);
+                free (s->mode);
+                free (s->arena);
+        }
+        memset (s, 0, sizeof(*s));
+        s->state = S;
+}
+
+/*
+** Returns the index of path, or -1.
+*/
+static long snap_search (const lfs_Snap *s, const char *path) {
+        size_t lo = 0, hi = s->n;
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                int c = snap_cmp (s->arena + s->name[mid], path);
+                if (c == 0)
+                        return (long)mid;
+                if (c < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return -1;
+}
+
+/*
+** Returns the index just past the contents of the directory k.
+*/
+static size_t snap_end (const lfs_Snap *s, size_t k) {
+        const char *dir = s->arena + s->name[k];
+        size_t dl = strlen (dir), lo = k + 1, hi = s->n;
+        while (lo < hi) {  /* the contents are the entries starting with dir/ */
+                size_t mid = lo + (hi - lo) / 2;
+                const char *p = s->arena + s->name[mid];
+                if (dl == 0 || (strncmp (p, dir, dl) == 0 && p[dl] == '/'))
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+/*
+** Adds the entry name of the directory whose path is at offset dir of
+** the arena, dirlen bytes long (0 for the root), without its attributes.
+** Returns its index, or -1 when out of memory.
+*/
+static long snap_push (lfs_Snap *s, size_t dir, size_t dirlen, const char *name) {
+        size_t nl = strlen (name), len = dirlen + (dirlen > 0) + nl + 1, k;
+        void *p;
+        if (s->n == s->cap) {
+                size_t cap = s->cap ? s->cap * 2 : 1024;
+                if ((p = realloc (s->ino, cap * sizeof(uint64_t))) == NULL)
+                        return -1;
+                s->ino = (uint64_t *)p;
+                if ((p = realloc (s->dev, cap * sizeof(uint64_t))) == NULL)
+                        return -1;
+                s->dev = (uint64_t *)p;
+                if ((p = realloc (s->size, cap * sizeof(int64_t))) == NULL)
+                        return -1;
+                s->size = (int64_t *)p;
+                if ((p = realloc (s->mtime, cap * sizeof(int64_t))) == NULL)
+                        return -1;
+                s->mtime = (int64_t *)p;
+                if ((p = realloc (s->name, cap * sizeof(uint64_t))) == NULL)
+                        return -1;
+                s->name = (uint64_t *)p;
+                if ((p = realloc (s->mode, cap * sizeof(uint32_t))) == NULL)
+                        return -1;
+                s->mode = (uint32_t *)p;
+                s->cap = cap;
+        }
+        if (s->used + len > s->asize) {
+                size_t size = s->asize ? s->asize * 2 : 65536;
+                while (size < s->used + len)
+                        size *= 2;
+                if ((p = realloc (s->arena, size)) == NULL)
+                        return -1;
+                s->arena = (char *)p;
+                s->asize = size;
+        }
+        k = s->n++;
+        s->name[k] = s->used;
+        memmove (s->arena + s->used, s->arena + dir, dirlen);
+        if (dirlen > 0)
+                s->arena[s->used + dirlen++] = '/';
+        memcpy (s->arena + s->used + dirlen, name, nl + 1);
+        s->used += len;
+        return (long)k;
+}
+
+static int64_t snap_mtime (const STAT_STRUCT *info) {
+#ifdef __linux__
+        return (int64_t)info->st_mtim.tv_sec * 1000000000 + info->st_mtim.tv_nsec;
+#else
+        return (int64_t)info->st_mtime * 1000000000;
+#endif
+}
+
+static void snap_stat (lfs_Snap *s, size_t k, const STAT_STRUCT *info) {
+        s->ino[k] = (uint64_t)info->st_ino;
+        s->dev[k] = (uint64_t)info->st_dev;
+        s->size[k] = (int64_t)info->st_size;
+        s->mtime[k] = snap_mtime (info);
+        s->mode[k] = (uint32_t)info->st_mode;
+}
+
+static void snap_copy (lfs_Snap *s, size_t k, const lfs_Snap *old, size_t c) {
+        s->ino[k] = old->ino[c];
+        s->dev[k] = old->dev[c];
+        s->size[k] = old->size[c];
+        s->mtime[k] = old->mtime[c];
+        s->mode[k] = old->mode[c];
+}
+
+/*
+** Returns the index in old of the directory path when its contents can
+** be taken from there: it is the same directory with the same time of
+** modification, older by a second than the walk of old, since changes
+** made sooner after it may not have moved the time.
+*/
+static long snap_reusable (const lfs_Snap *old, const char *path, const STAT_STRUCT *info) {
+        long k = old ? snap_search (old, path) : -1;
+        if (k < 0 || !S_ISDIR (old->mode[k]) || old->ino[k] != (uint64_t)info->st_ino ||
+            old->dev[k] != (uint64_t)info->st_dev || old->mtime[k] != snap_mtime (info) ||
+            old->mtime[k] > old->stamp - 1000000000)
+                return -1;
+        return k;
+}
+
+/*
+** Records the contents of the directory open at fd, whose path is at
+** offset dir of the arena, dirlen bytes long. When from is not -1, the
+** names are those of the directory from of sc->old, with the attributes
+** recorded there but for subdirectories, which are checked again.
+** Entries removed meanwhile are left out. Closes fd unless it is the
+** root; below TREE_OPEN_MAX levels, it is closed while a subdirectory is
+** read and opened again afterwards.
+** Returns 0, or an errno value with the path that failed in sc->bad.
+*/
+static int snap_dir (lfs_Snap *s, int fd, size_t dir, size_t dirlen, long from, snap_scan *sc) {
+        const lfs_Snap *old = sc->old;
+        walk_names nm;
+        const char **names = NULL;
+        STAT_STRUCT self;
+        size_t i = 0, end = 0, skip = dirlen + (dirlen > 0);
+        int err = 0;
+        memset (&nm, 0, sizeof(nm));
+        sc->dirs++;
+        sc->depth++;
+        if (from >= 0) {
+                i = (size_t)from + 1;
+                end = snap_end (old, (size_t)from);
+        } else {
+                sc->rescanned++;
+                if ((err = walk_list (fd, sc->buf, &nm)) == 0 && nm.n > 0) {
+                        if ((names = (const char **)malloc (nm.n * sizeof(*names))) == NULL)
+                                err = ENOMEM;
+                        for (i = 0; names && i < nm.n; i++)
+                                names[i] = nm.arena + nm.off[i];
+                        if (names != NULL)
+                                qsort (names, nm.n, sizeof(*names), snap_namecmp);
+                }
+                i = 0;
+                end = nm.n;
+                if (err != 0)
+                        sc->bad = dirlen > 0 ? (long)dir : -1;
+        }
+        while (err == 0 && i < end) {
+                const char *name;
+                STAT_STRUCT info;
+                long k;
+                int cfd;
+                if (from >= 0) {
+                        size_t c = i;
+                        name = old->arena + old->name[c] + skip;
+                        if (S_ISDIR (old->mode[c]))
+                                i = snap_end (old, c);
+                        else {
+                                i++;
+                                if ((k = snap_push (s, dir, dirlen, name)) < 0)
+                                        err = ENOMEM;
+                                else
+                                        snap_copy (s, (size_t)k, old, c);
+                                continue;
+                        }
+                } else
+                        name = names[i++];
+                if (fstatat (fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+                        if (errno == ENOENT)
+                                continue;
+                        err = errno;
+                        sc->bad = dirlen > 0 ? (long)dir : -1;
+                        break;
+                }
+                if ((k = snap_push (s, dir, dirlen, name)) < 0) {
+                        err = ENOMEM;
+                        break;
+                }
+                snap_stat (s, (size_t)k, &info);
+                if (!S_ISDIR (info.st_mode))
+                        continue;
+                if ((cfd = openat (fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+                        if (errno == ENOENT)
+                                continue;
+                        err = errno;
+                        sc->bad = (long)s->name[k];
+                        break;
+                }
+                if (sc->depth > TREE_OPEN_MAX) {
+                        if (fstat (fd, &self) != 0) {
+                                err = errno;
+                                sc->bad = (long)dir;
+                                close (cfd);
+                                break;
+                        }
+                        close (fd);
+                        fd = -1;
+                }
+                err = snap_dir (s, cfd, s->name[k], strlen (s->arena + s->name[k]),
+                                snap_reusable (old, s->arena + s->name[k], &info), sc);
+                if (err == 0 && fd < 0 && (fd = tree_reopen (sc->root, s->arena + dir, &self)) < 0) {
+                        err = errno;
+                        sc->bad = (long)dir;
+                }
+        }
+        if (dirlen > 0 && fd >= 0)
+                close (fd);
+        sc->depth--;
+        free (names);
+        free (nm.arena);
+        free (nm.off);
+        return err;
+}
+
+/*
+** Walks the directory open at fd into s, recording the directory itself
+** first, with an empty path, when old is given.
+** Returns 0, or an errno value with the path that failed in sc->bad.
+*/
+static int snap_walk (lfs_Snap *s, int fd, const lfs_Snap *old, snap_scan *sc) {
+        struct timespec now;
+        STAT_STRUCT info;
+        long from = -1, k;
+        int err;
+        memset (sc, 0, sizeof(*sc));
+        sc->old = old;
+        sc->bad = -1;
+        sc->root = fd;
+        clock_gettime (CLOCK_REALTIME, &now);
+        s->stamp = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        if (old != NULL) {
+                if (fstat (fd, &info) != 0)
+                        return errno;
+                if ((k = snap_push (s, 0, 0, "")) < 0)
+                        return ENOMEM;
+                snap_stat (s, (size_t)k, &info);
+                from = snap_reusable (old, "", &info);
+        }
+        if ((sc->buf = (char *)malloc (WALK_BUFSIZE)) == NULL)
+                return ENOMEM;
+        err = snap_dir (s, fd, 0, 0, from, sc);
+        free (sc->buf);
+        return err;
+}
+
+/*
+** Pushes the error of a walk of root into s.
+*/
+static int snap_error (lua_State *L, const char *root, const lfs_Snap *s, const snap_scan *sc, int err) {
+        lua_pushnil (L);
+        if (err == ENOMEM || sc->bad < 0)
+                lua_pushfstring (L, "%s: %s", root, strerror (err));
+        else
+                lua_pushfstring (L, "%s/%s: %s", root, s->arena + sc->bad, strerror (err));
+        lua_pushinteger (L, err);
+        return 3;
+}
+
+static int snap_write (int fd, const void *p, size_t len) {
+        const char *b = (const char *)p;
+        while (len > 0) {
+                ssize_t r = write (fd, b, len);
+                if (r < 0 && errno == EINTR)
+                        continue;
+                if (r < 0)
+                        return -1;
+                b += r;
+                len -= (size_t)r;
+        }
+        return 0;
+}
+
+/*
+** Writes s to path as an atomic file, synced before it replaces the old
+** one. Returns 0, or -1 with errno set.
+*/
+static int snap_store (lfs_State *S, const lfs_Snap *s, const char *path) {
+        atomic_file a;
+        snap_header h;
+        int res;
+        if (atomic_open (S, path, 0666, &a) != 0)
+                return -1;
+        memset (&h, 0, sizeof(h));
+        memcpy (h.magic, SNAP_MAGIC, sizeof(h.magic));
+        h.order = SNAP_ORDER;
+        h.n = s->n;
+        h.arena = s->used;
+        h.stamp = s->stamp;
+        res = snap_write (a.fd, &h, sizeof(h)) != 0 ||
+              snap_write (a.fd, s->ino, s->n * sizeof(uint64_t)) != 0 ||
+              snap_write (a.fd, s->dev, s->n * sizeof(uint64_t)) != 0 ||
+              snap_write (a.fd, s->size, s->n * sizeof(int64_t)) != 0 ||
+              snap_write (a.fd, s->mtime, s->n * sizeof(int64_t)) != 0 ||
+              snap_write (a.fd, s->name, s->n * sizeof(uint64_t)) != 0 ||
+              snap_write (a.fd, s->mode, s->n * sizeof(uint32_t)) != 0 ||
+              snap_write (a.fd, s->arena, s->used) != 0 ||
+              atomic_datasync (a.fd) != 0 || atomic_publish (&a) != 0 ||
+              atomic_syncdir (a.pfd) != 0 ? -1 : 0;
+        atomic_close (&a);
+        return res;
+}
+
+/*
+** Maps the snapshot file path into the empty s. The arrays are used
+** where they lie in the file; only the bounds of the paths are checked.
+** Returns 0, or -1 with errno set.
+*/
+static int snap_map (lfs_State *S, lfs_Snap *s, const char *path) {
+        const snap_header *h;
+        STAT_STRUCT info;
+        size_t i, arrays = 5 * sizeof(uint64_t) + sizeof(uint32_t);
+        char *p;
+        int fd;
+#ifdef LFS_HAVE_BOX
+        fd = box_open (S, path, O_RDONLY);
+#else
+        fd = openat (S->cwdfd, path, O_RDONLY | O_CLOEXEC);
+#endif
+        if (fd < 0)
+                return -1;
+        if (fstat (fd, &info) != 0) {
+                close_keep_errno (fd);
+                return -1;
+        }
+        if (info.st_size < (off_t)sizeof(snap_header)) {
+                close (fd);
+                errno = EINVAL;
+                return -1;
+        }
+        p = (char *)mmap (NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close_keep_errno (fd);
+        if (p == MAP_FAILED)
+                return -1;
+        s->map = p;
+        s->maplen = (size_t)info.st_size;
+        h = (const snap_header *)p;
+        if (memcmp (h->magic, SNAP_MAGIC, sizeof(h->magic)) != 0 || h->order != SNAP_ORDER ||
+            h->n > (s->maplen - sizeof(*h)) / arrays ||
+            h->arena != s->maplen - sizeof(*h) - h->n * arrays ||
+            (h->arena > 0 && p[s->maplen - 1] != '\0')) {
+                snap_free (s);
+                errno = EINVAL;
+                return -1;
+        }
+        s->n = (size_t)h->n;
+        s->stamp = h->stamp;
+        s->ino = (uint64_t *)(p + sizeof(*h));
+        s->dev = s->ino + s->n;
+        s->size = (int64_t *)(s->dev + s->n);
+        s->mtime = s->size + s->n;
+        s->name = (uint64_t *)(s->mtime + s->n);
+        s->mode = (uint32_t *)(s->name + s->n);
+        s->arena = (char *)(s->mode + s->n);
+        s->used = (size_t)h->arena;
+        for (i = 0; i < s->n; i++) {
+                if (s->name[i] >= s->used) {
+                        snap_free (s);
+                        errno = EINVAL;
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+/*
+** Pushes a table with the attributes of entry k.
+*/
+static void snap_push_info (lua_State *L, const lfs_Snap *s, size_t k) {
+        char perms[PERMS_LEN];
+        lua_createtable (L, 0, 6);
+        lua_pushinteger (L, (lua_Integer)s->ino[k]);
+        lua_setfield (L, -2, "ino");
+        lua_pushinteger (L, (lua_Integer)s->dev[k]);
+        lua_setfield (L, -2, "dev");
+        lua_pushinteger (L, (lua_Integer)s->size[k]);
+        lua_setfield (L, -2, "size");
+        lua_pushinteger (L, (lua_Integer)s->mtime[k]);
+        lua_setfield (L, -2, "mtime_ns");
+        lua_pushstring (L, mode2string ((mode_t)s->mode[k]));
+        lua_setfield (L, -2, "mode");
+        lua_pushstring (L, perm2string ((mode_t)s->mode[k], perms));
+        lua_setfield (L, -2, "permissions");
+}
+
+static lfs_Snap *check_snap (lua_State *L, int idx) {
+        return (lfs_Snap *)luaL_checkudata (L, idx, SNAP_METATABLE);
+}
+
+static lfs_Snap *snap_new (lua_State *L) {
+        lfs_Snap *s = (lfs_Snap *)lua_newuserdata (L, sizeof(lfs_Snap));
+        memset (s, 0, sizeof(*s));
+        s->state = lfs_state (L);
+        luaL_getmetatable (L, SNAP_METATABLE);
+        lua_setmetatable (L, -2);
+        return s;
+}
+
+/*
+** Records a directory tree.
+** @param #1 Root directory.
+** Returns a snapshot object.
+*/
+static int snap_create (lua_State *L) {
+        const char *root = luaL_checkstring (L, 1);
+        lfs_Snap *s = snap_new (L);
+        snap_scan sc;
+        int fd, err;
+#ifdef LFS_HAVE_BOX
+        fd = box_open (s->state, root, O_RDONLY | O_DIRECTORY);
+#else
+        fd = openat (s->state->cwdfd, root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+        if (fd < 0)
+                return pusherror (L, root);
+        err = snap_walk (s, fd, NULL, &sc);
+        close (fd);
+        if (err != 0) {
+                snap_error (L, root, s, &sc, err);
+                snap_free (s);
+                return 3;
+        }
+        return 1;
+}
+
+/*
+** Writes a snapshot to a file, to be loaded by lfs.loadsnapshot on a
+** machine of the same byte order.
+** @param #2 File path, replaced at once.
+*/
+static int snap_save (lua_State *L) {
+        lfs_Snap *s = check_snap (L, 1);
+        const char *path = luaL_checkstring (L, 2);
+        if (snap_store (s->state, s, path) != 0)
+                return pusherror (L, path);
+        lua_pushboolean (L, 1);
+        return 1;
+}
+
+/*
+** Maps a snapshot written by save.
+** @param #1 File path.
+** Returns a snapshot object.
+*/
+static int snap_load (lua_State *L) {
+        const char *path = luaL_checkstring (L, 1);
+        lfs_Snap *s = snap_new (L);
+        if (snap_map (s->state, s, path) != 0)
+                return pusherror (L, path);
+        return 1;
+}
+
+static int snap_len (lua_State *L) {
+        lua_pushinteger (L, (lua_Integer)check_snap (L, 1)->n);
+        return 1;
+}
+
+/*
+** Returns the path of entry i and a table with its ino, dev, size,
+** mtime_ns, mode and permissions.
+*/
+static int snap_entry (lua_State *L) {
+        lfs_Snap *s = check_snap (L, 1);
+        lua_Integer i = luaL_checkinteger (L, 2);
+        if (i < 1 || (size_t)i > s->n)
+                return 0;
+        lua_pushstring (L, s->arena + s->name[i - 1]);
+        snap_push_info (L, s, (size_t)i - 1);
+        return 2;
+}
+
+/*
+** Returns the index of a path, found by binary search, or nil.
+*/
+static int snap_find (lua_State *L) {
+        long k = snap_search (check_snap (L, 1), luaL_checkstring (L, 2));
+        if (k < 0)
+                lua_pushnil (L);
+        else
+                lua_pushinteger (L, (lua_Integer)k + 1);
+        return 1;
+}
+
+static void snap_push_path (lua_State *L, const lfs_Snap *s, size_t k, int *n) {
+        lua_pushstring (L, s->arena + s->name[k]);
+        lua_rawseti (L, -2, ++*n);
+}
+
+/*
+** Compares a snapshot with a newer one.
+** @param #2 The newer snapshot.
+** Returns a table with the arrays added, removed and modified, of paths,
+** and renamed, of tables with the fields from and to: paths removed and
+** added for the same inode with the same file type and, but for
+** directories, the same modification time.
+*/
+static int snap_diff (lua_State *L) {
+        lfs_Snap *a = check_snap (L, 1), *b = check_snap (L, 2);
+        size_t i = 0, j = 0, nr = 0, na = 0, k, mask = 0, *removed, *added, *slots = NULL;
+        unsigned char *matched;
+        int n;
+        removed = (size_t *)malloc ((a->n + b->n + 1) * sizeof(size_t));
+        matched = (unsigned char *)calloc (a->n + 1, 1);
+        if (removed == NULL || matched == NULL) {
+                free (removed);
+                free (matched);
+                return luaL_error (L, "not enough memory");
+        }
+        added = removed + a->n;
+        lua_createtable (L, 0, 4);
+        lua_newtable (L);  /* modified */
+        n = 0;
+        while (i < a->n || j < b->n) {
+                int c = i == a->n ? 1 : j == b->n ? -1 :
+                        snap_cmp (a->arena + a->name[i], b->arena + b->name[j]);
+                if (c < 0)
+                        removed[nr++] = i++;
+                else if (c > 0)
+                        added[na++] = j++;
+                else {
+                        if (a->ino[i] != b->ino[j] || a->dev[i] != b->dev[j] || a->size[i] != b->size[j] ||
+                            a->mtime[i] != b->mtime[j] || a->mode[i] != b->mode[j])
+                                snap_push_path (L, b, j, &n);
+                        i++;
+                        j++;
+                }
+        }
+        lua_setfield (L, -2, "modified");
+        /* renames: removed entries by inode, looked up for each added one */
+        if (nr > 0 && na > 0) {
+                size_t size = 16;
+                while (size < nr * 2)
+                        size *= 2;
+                if ((slots = (size_t *)calloc (size, sizeof(size_t))) != NULL) {
+                        mask = size - 1;
+                        for (k = 0; k < nr; k++) {
+                                size_t h = (size_t)((a->ino[removed[k]] ^ a->dev[removed[k]] * 31) & mask);
+                                while (slots[h] != 0)
+                                        h = (h + 1) & mask;
+                                slots[h] = k + 1;
+                        }
+                }
+        }
+        lua_newtable (L);  /* renamed */
+        n = 0;
+        for (k = 0; slots != NULL && k < na; k++) {
+                size_t bj = added[k];
+                size_t h = (size_t)((b->ino[bj] ^ b->dev[bj] * 31) & mask);
+                for (; slots[h] != 0; h = (h + 1) & mask) {
+                        size_t r = slots[h] - 1, ai = removed[r];
+                        if (matched[r] || a->ino[ai] != b->ino[bj] || a->dev[ai] != b->dev[bj] ||
+                            (a->mode[ai] & S_IFMT) != (b->mode[bj] & S_IFMT) ||
+                            (!S_ISDIR (a->mode[ai]) && a->mtime[ai] != b->mtime[bj]))
+                                continue;  /* not the same file, or an inode reused */
+                        matched[r] = 1;
+                        lua_createtable (L, 0, 2);
+                        lua_pushstring (L, a->arena + a->name[ai]);
+                        lua_setfield (L, -2, "from");
+                        lua_pushstring (L, b->arena + b->name[bj]);
+                        lua_setfield (L, -2, "to");
+                        lua_rawseti (L, -2, ++n);
+                        added[k] = (size_t)-1;
+                        break;
+                }
+        }
+        lua_setfield (L, -2, "renamed");
+        lua_newtable (L);
+        n = 0;
+        for (k = 0; k < na; k++)
+                if (added[k] != (size_t)-1)
+                        snap_push_path (L, b, added[k], &n);
+        lua_setfield (L, -2, "added");
+        lua_newtable (L);
+        n = 0;
+        for (k = 0; k < nr; k++)
+                if (!matched[k])
+                        snap_push_path (L, a, removed[k], &n);
+        lua_setfield (L, -2, "removed");
+        free (slots);
+        free (matched);
+        free (removed);
+        return 1;
+}
+
+static int snap_gc (lua_State *L) {
+        snap_free (check_snap (L, 1));
+        return 0;
+}
+
+static void snap_create_meta (lua_State *L) {
+        luaL_newmetatable (L, SNAP_METATABLE);
+
+        /* Method table */
+        lua_newtable (L);
+        lua_pushcfunction (L, snap_diff);
+        lua_setfield (L, -2, "diff");
+        lua_pushcfunction (L, snap_entry);
+        lua_setfield (L, -2, "entry");
+        lua_pushcfunction (L, snap_find);
+        lua_setfield (L, -2, "find");
+        lua_pushcfunction (L, snap_len);
+        lua_setfield (L, -2, "len");
+        lua_pushcfunction (L, snap_save);
+        lua_setfield (L, -2, "save");
+
+        /* Metamethods */
+        lua_setfield (L, -2, "__index");
+        lua_pushcfunction (L, snap_len);
+        lua_setfield (L, -2, "__len");
+        lua_pushcfunction (L, snap_gc);
+        lua_setfield (L, -2, "__gc");
+        lua_pop (L, 1);
+}
+#endif
+
+#ifndef _WIN32
+/*
+** Indexes.
+** lfs.index.open keeps a snapshot of a tree in a file, the root first
+** with an empty path, and brings it up to date when opened: directories
+** whose time of modification has not changed are not read again, their
+** entries being taken from the file, so only the directories themselves
+** are stat'ed. Lookups are then served from the mapped file.
+*/
+#define INDEX_METATABLE "index metatable"
+
+typedef struct lfs_Index {
+        lfs_Snap snap;  /* the mapped index file */
+        size_t dirs, rescanned;
+        int closed;
+} lfs_Index;
+
+static lfs_Index *check_index (lua_State *L, int idx) {
+        lfs_Index *x = (lfs_Index *)luaL_checkudata (L, idx, INDEX_METATABLE);
+        luaL_argcheck (L, !x->closed, idx, "closed index");
+        return x;
+}
+
+/*
+** Returns the index of the relative path at idx, where "." and "" are
+** the root and trailing slashes are ignored, or -1.
+*/
+static long index_search (lua_State *L, lfs_Index *x, int idx) {
+        size_t len;
+        const char *path = luaL_checklstring (L, idx, &len);
+        while (len > 0 && path[len - 1] == '/')
+                len--;
+        if (len == 1 && path[0] == '.')
+                len = 0;
+        if (path[len] != '\0') {
+                lua_pushlstring (L, path, len);
+                path = lua_tostring (L, -1);
+        }
+        return snap_search (&x->snap, path);
+}
+
+/*
+** Returns a table with the attributes of a path, as snap:entry, or nil.
+*/
+static int index_stat (lua_State *L) {
+        lfs_Index *x = check_index (L, 1);
+        long k = index_search (L, x, 2);
+        if (k < 0)
+                return 0;
+        snap_push_info (L, &x->snap, (size_t)k);
+        return 1;
+}
+
+/*
+** Returns an array with the names in a directory, in sorted order, or nil.
+*/
+static int index_list (lua_State *L) {
+        lfs_Index *x = check_index (L, 1);
+        const lfs_Snap *s = &x->snap;
+        long k = index_search (L, x, 2);
+        size_t i, end, skip;
+        int n = 0;
+        if (k < 0 || !S_ISDIR (s->mode[k]))
+                return 0;
+        skip = strlen (s->arena + s->name[k]);
+        skip += skip > 0;
+        end = snap_end (s, (size_t)k);
+        lua_newtable (L);
+        for (i = (size_t)k + 1; i < end; i = S_ISDIR (s->mode[i]) ? snap_end (s, i) : i + 1) {
+                lua_pushstring (L, s->arena + s->name[i] + skip);
+                lua_rawseti (L, -2, ++n);
+        }
+        return 1;
+}
+
+static int index_len (lua_State *L) {
+        lua_pushinteger (L, (lua_Integer)check_index (L, 1)->snap.n);
+        return 1;
+}
+
+/*
+** Returns a table with the number of entries, of directories, and of
+** directories read again when the index was opened.
+*/
+static int index_stats (lua_State *L) {
+        lfs_Index *x = check_index (L, 1);
+        lua_createtable (L, 0, 3);
+        lua_pushinteger (L, (lua_Integer)x->snap.n);
+        lua_setfield (L, -2, "entries");
+        lua_pushinteger (L, (lua_Integer)x->dirs);
+        lua_setfield (L, -2, "directories");
+        lua_pushinteger (L, (lua_Integer)x->rescanned);
+        lua_setfield (L, -2, "rescanned");
+        return 1;
+}
+
+static int index_close (lua_State *L) {
+        lfs_Index *x = (lfs_Index *)luaL_checkudata (L, 1, INDEX_METATABLE);
+        if (!x->closed) {
+                snap_free (&x->snap);
+                x->closed = 1;
+        }
+        return 0;
+}
+
+/*
+** Opens the index of a tree, bringing it up to date.
+** @param #1 Root directory.
+** @param #2 Index file, created or replaced.
+** @param #3 Table with options (optional): full, to read every directory
+**           again.
+** Returns an index object.
+*/
+static int index_open (lua_State *L) {
+        const char *root = luaL_checkstring (L, 1);
+        const char *file = luaL_checkstring (L, 2);
+        int full = opt_boolean (L, 3, "full", 0), fd, err;
+        lfs_State *S = lfs_state (L);
+        lfs_Index *x;
+        lfs_Snap old, s;
+        snap_scan sc;
+        x = (lfs_Index *)lua_newuserdata (L, sizeof(lfs_Index));
+        memset (x, 0, sizeof(*x));
+        x->snap.state = S;
+        x->closed = 1;
+        luaL_getmetatable (L, INDEX_METATABLE);
+        lua_setmetatable (L, -2);
+#ifdef LFS_HAVE_BOX
+        fd = box_open (S, root, O_RDONLY | O_DIRECTORY);
+#else
+        fd = openat (S->cwdfd, root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+        if (fd < 0)
+                return pusherror (L, root);
+        memset (&old, 0, sizeof(old));
+        memset (&s, 0, sizeof(s));
+        old.state = s.state = S;
+        if (!full && snap_map (S, &old, file) != 0)
+                snap_free (&old);  /* missing or unreadable: all is read */
+        err = snap_walk (&s, fd, &old, &sc);
+        close (fd);
+        snap_free (&old);
+        if (err != 0) {
+                snap_error (L, root, &s, &sc, err);
+                snap_free (&s);
+                return 3;
+        }
+        err = snap_store (S, &s, file);
+        snap_free (&s);
+        if (err != 0 || snap_map (S, &x->snap, file) != 0)
+                return pusherror (L, file);
+        x->dirs = sc.dirs;
+        x->rescanned = sc.rescanned;
+        x->closed = 0;
+        return 1;
+}
+
+static const struct luaL_Reg indexlib[] = {
+        {"open", index_open},
+        {NULL, NULL},
+};
+
+static void index_create_meta (lua_State *L) {
+        luaL_newmetatable (L, INDEX_METATABLE);
+
+        /* Method table */
+        lua_newtable (L);
+        lua_pushcfunction (L, index_close);
+        lua_setfield (L, -2, "close");
+        lua_pushcfunction (L, index_len);
+        lua_setfield (L, -2, "len");
+        lua_pushcfunction (L, index_list);
+        lua_setfield (L, -2, "list");
+        lua_pushcfunction (L, index_stat);
+        lua_setfield (L, -2, "stat");
+        lua_pushcfunction (L, index_stats);
+        lua_setfield (L, -2, "stats");
+
+        /* Metamethods */
+        lua_setfield (L, -2, "__index");
+        lua_pushcfunction (L, index_len);
+        lua_setfield (L, -2, "__len");
+        lua_pushcfunction (L, index_close);
+        lua_setfield (L, -2, "__gc");
+        lua_pop (L, 1);
+}
+#endif
+
+
+#ifndef _WIN32
+/*
+** Globs.
+** lfs.glob expands the braces of a pattern into alternatives, splits each
+** at its slashes and starts at the directory named by its leading literal
+** components. The walk then carries the set of (alternative, component)
+** states still alive: names are matched in C as the directory is read,
+** directories are entered only when some state goes on in them, and
+** directories reached by literal components alone are not read at all.
+** Only the matching paths reach Lua.
+*/
+#define GLOB_MAXPATTERNS 1024  /* alternatives after brace expansion */
+#define GLOB_MAXDEPTH    256   /* components of a path matched against excludes */
+
+typedef struct glob_pat {
+        size_t first, n;  /* components, in lfs_Glob.comps */
+        size_t lit;       /* leading literal components, opened directly */
+        int absolute;
+        int dironly;      /* ends in "/": only directories match */
+} glob_pat;
+
+typedef struct glob_state {
+        size_t pat, comp;
+} glob_state;
+
+typedef struct lfs_Glob {
+        lfs_State *S;
+        walk_names comps;    /* components of all patterns */
+        glob_pat *pats;      /* the patterns, then the excludes */
+        size_t npats, ninclude, cap;
+        size_t maxstates;    /* components of the patterns, bounding a set */
+        walk_names found;
+        lfs_InoKey *stack;   /* directories entered, when following links */
+        size_t depth, stackcap;
+        char *buf;           /* getdents buffer */
+        int hidden, follow, err;
+        char path[LFS_MAXPATHLEN];
+} lfs_Glob;
+
+/*
+** Matches a name against a pattern component with *, ? and [...]
+** classes, where a backslash quotes the next character. Unless period
+** is 0, a leading dot must be matched by a dot.
+*/
+static int glob_match (const char *p, const char *s, int period) {
+        const char *star = NULL, *back = NULL;
+        if (period && *s == '.' && *p != '.')
+                return 0;
+        while (*s) {
+                if (*p == '*') {
+                        star = ++p;
+                        back = s;
+                        continue;
+                }
+                if (*p == '?') {
+                        p++;
+                        s++;
+                        continue;
+                }
+                if (*p == '[') {
+                        const char *c = p + 1;
+                        int neg = 0, hit = 0;
+                        if (*c == '!' || *c == '^') {
+                                neg = 1;
+                                c++;
+                        }
+                        do {  /* a ] first is literal */
+                                unsigned char lo = (unsigned char)*c, hi = lo;
+                                if (*c == '\0')
+                                        break;
+                                if (c[1] == '-' && c[2] != ']' && c[2] != '\0') {
+                                        hi = (unsigned char)c[2];
+                                        c += 2;
+                                }
+                                if ((unsigned char)*s >= lo && (unsigned char)*s <= hi)
+                                        hit = 1;
+                                c++;
+                        } while (*c != ']');
+                        if (*c == ']') {
+                                if (hit != neg) {
+                                        p = c + 1;
+                                        s++;
+                                        continue;
+                                }
+                        } else if (*s == '[') {  /* no closing ]: a plain [ */
+                                p++;
+                                s++;
+                                continue;
+                        }
+                } else {
+                        if (*p == '\\' && p[1] != '\0')
+                                p++;
+                        if (*p == *s) {
+                                p++;
+                                s++;
+                                continue;
+                        }
+                }
+                if (star == NULL)
+                        return 0;
+                p = star;  /* let the last * take one more character */
+                s = ++back;
+        }
+        while (*p == '*')
+                p++;
+        return *p == '\0';
+}
+
+static int glob_wild (const char *p) {
+        return strpbrk (p, "*?[\\") != NULL;
+}
+
+static const char *glob_comp (const lfs_Glob *g, size_t pat, size_t comp) {
+        return g->comps.arena + g->comps.off[g->pats[pat].first + comp];
+}
+
+#define glob_isstar(c) ((c)[0] == '*' && (c)[1] == '*' && (c)[2] == '\0')
+
+/*
+** Splits one alternative of a pattern into components.
+** Returns 0, or an errno value.
+*/
+static int glob_add (lfs_Glob *g, const char *pattern) {
+        char *copy = strdup (pattern), *c, *next;
+        glob_pat *p;
+        if (copy == NULL)
+                return ENOMEM;
+        if (g->npats == g->cap) {
+                size_t cap = g->cap ? g->cap * 2 : 16;
+                glob_pat *pats = (glob_pat *)realloc (g->pats, cap * sizeof(glob_pat));
+                if (pats == NULL) {
+                        free (copy);
+                        return ENOMEM;
+                }
+                g->pats = pats;
+                g->cap = cap;
+        }
+        p = &g->pats[g->npats];
+        p->first = g->comps.n;
+        p->n = p->lit = 0;
+        p->absolute = copy[0] == '/';
+        p->dironly = copy[0] != '\0' && copy[strlen (copy) - 1] == '/';
+        for (c = copy; c != NULL; c = next) {
+                if ((next = strchr (c, '/')) != NULL)
+                        *next++ = '\0';
+                if (*c == '\0' || (p->n > 0 && glob_isstar (c) &&
+                    glob_isstar (g->comps.arena + g->comps.off[g->comps.n - 1])))
+                        continue;  /* empty, or ** after ** */
+                if (!walk_names_add (&g->comps, c)) {
+                        free (copy);
+                        return ENOMEM;
+                }
+                if (p->lit == p->n && !glob_wild (c) && !glob_isstar (c))
+                        p->lit++;
+                p->n++;
+        }
+        free (copy);
+        if (p->n == 0)
+                return 0;  /* matches nothing */
+        if (p->lit == p->n)
+                p->lit--;  /* the last component is looked up, not opened */
+        g->npats++;
+        return 0;
+}
+
+/*
+** Expands the braces of pattern and adds each alternative.
+** Returns 0, or an errno value.
+*/
+static int glob_braces (lfs_Glob *g, const char *pattern) {
+        size_t i, len = strlen (pattern);
+        for (i = 0; i < len; i++) {
+                size_t j, start, depth = 0, commas = 0;
+                if (pattern[i] == '\\' && i + 1 < len) {
+                        i++;
+                        continue;
+                }
+                if (pattern[i] != '{')
+                        continue;
+                for (j = i; j < len; j++) {  /* the matching } */
+                        if (pattern[j] == '\\' && j + 1 < len)
+                                j++;
+                        else if (pattern[j] == '{')
+                                depth++;
+                        else if (pattern[j] == ',' && depth == 1)
+                                commas++;
+                        else if (pattern[j] == '}' && --depth == 0)
+                                break;
+                }
+                if (j == len || commas == 0)
+                        continue;  /* not an alternation */
+                for (start = i + 1; start <= j; ) {
+                        size_t end = start, alt;
+                        char *each;
+                        int err;
+                        for (depth = 0; end < j; end++) {  /* the end of this alternative */
+                                if (pattern[end] == '\\' && end + 1 < j)
+                                        end++;
+                                else if (pattern[end] == '{')
+                                        depth++;
+                                else if (pattern[end] == '}')
+                                        depth--;
+                                else if (pattern[end] == ',' && depth == 0)
+                                        break;
+                        }
+                        alt = end - start;
+                        if (g->npats >= GLOB_MAXPATTERNS)
+                                return E2BIG;
+                        if ((each = (char *)malloc (len)) == NULL)
+                                return ENOMEM;
+                        memcpy (each, pattern, i);
+                        memcpy (each + i, pattern + start, alt);
+                        memcpy (each + i + alt, pattern + j + 1, len - j);  /* with the '\0' */
+                        err = glob_braces (g, each);
+                        free (each);
+                        if (err != 0)
+                                return err;
+                        start = end + 1;
+                }
+                return 0;
+        }
+        return g->npats >= GLOB_MAXPATTERNS ? E2BIG : glob_add (g, pattern);
+}
+
+/*
+** Matches the components of pattern pat from i against those of a path
+** from j, where ** takes any number of them.
+*/
+static int glob_path_match (const lfs_Glob *g, size_t pat, size_t i, char **comps, size_t n, size_t j) {
+        const glob_pat *p = &g->pats[pat];
+        for (; i < p->n; i++, j++) {
+                const char *c = glob_comp (g, pat, i);
+                if (glob_isstar (c)) {
+                        for (; j <= n; j++)
+                                if (glob_path_match (g, pat, i + 1, comps, n, j))
+                                        return 1;
+                        return 0;
+                }
+                if (j == n || !glob_match (c, comps[j], 0))
+                        return 0;
+        }
+        return j == n;
+}
+
+/*
+** Tells whether the path in g->path matches an exclude pattern. Relative
+** excludes also match absolute paths, from their first component.
+*/
+static int glob_excluded (const lfs_Glob *g) {
+        char copy[LFS_MAXPATHLEN], *comps[GLOB_MAXDEPTH], *c, *next;
+        size_t k, n = 0;
+        if (g->npats == g->ninclude)
+                return 0;
+        strcpy (copy, g->path);
+        for (c = copy; c != NULL && n < GLOB_MAXDEPTH; c = next) {
+                if ((next = strchr (c, '/')) != NULL)
+                        *next++ = '\0';
+                if (*c != '\0')
+                        comps[n++] = c;
+        }
+        for (k = g->ninclude; k < g->npats; k++)
+                if ((!g->pats[k].absolute || g->path[0] == '/') &&
+                    glob_path_match (g, k, 0, comps, n, 0))
+                        return 1;
+        return 0;
+}
+
+/*
+** Adds state (pat, comp) to a set of n, and the states past the ** it
+** may stand on.
+*/
+static void glob_closure (const lfs_Glob *g, glob_state *set, size_t *n, size_t pat, size_t comp) {
+        for (;;) {
+                size_t i;
+                for (i = 0; i < *n; i++)
+                        if (set[i].pat == pat && set[i].comp == comp)
+                                break;
+                if (i == *n) {
+                        set[*n].pat = pat;
+                        set[*n].comp = comp;
+                        (*n)++;
+                }
+                if (comp + 1 >= g->pats[pat].n || !glob_isstar (glob_comp (g, pat, comp)))
+                        return;
+                comp++;
+        }
+}
+
+/*
+** Gathers the names of the directory open at fd that some state of set
+** takes, each after a byte with its DT_* type plus one, or only the literal
+** names of set when no state has wildcards.
+*/
+static void glob_list (lfs_Glob *g, int fd, const glob_state *set, size_t n, walk_names *names) {
+        char entry[NAME_MAX + 2];
+        const char *name;
+        lua_Integer ino;
+        dir_data d;
+        size_t i;
+        int type, literal = 1;
+        for (i = 0; i < n && literal; i++) {
+                const char *c = glob_comp (g, set[i].pat, set[i].comp);
+                literal = !glob_isstar (c) && !glob_wild (c);
+        }
+        if (literal) {
+                entry[0] = DT_UNKNOWN + 1;
+                for (i = 0; i < n; i++) {
+                        size_t k;
+                        name = glob_comp (g, set[i].pat, set[i].comp);
+                        for (k = 0; k < names->n && strcmp (names->arena + names->off[k] + 1, name) != 0; k++)
+                                ;
+                        if (k < names->n || strlen (name) > NAME_MAX)
+                                continue;
+                        strcpy (entry + 1, name);
+                        if (!walk_names_add (names, entry)) {
+                                g->err = ENOMEM;
+                                return;
+                        }
+                }
+                return;
+        }
+        memset (&d, 0, sizeof(d));
+#ifdef LFS_HAVE_GETDENTS
+        if ((d.fd = fcntl (fd, F_DUPFD_CLOEXEC, 0)) < 0)
+                return;
+        d.buf = g->buf;
+        d.bufsize = WALK_BUFSIZE;
+#else
+        {
+                int dfd = fcntl (fd, F_DUPFD_CLOEXEC, 0);
+                if (dfd < 0 || (d.dir = fdopendir (dfd)) == NULL) {
+                        if (dfd >= 0)
+                                close (dfd);
+                        return;
+                }
+        }
+#endif
+        while (dir_next_entry (&d, &name, &type, &ino) == 1) {
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                        continue;
+                for (i = 0; i < n; i++) {
+                        const char *c = glob_comp (g, set[i].pat, set[i].comp);
+                        if (glob_isstar (c) ? g->hidden || name[0] != '.' : glob_match (c, name, !g->hidden))
+                                break;
+                }
+                if (i == n)
+                        continue;
+                entry[0] = (char)(type + 1);  /* never '\0' */
+                strcpy (entry + 1, name);
+                if (!walk_names_add (names, entry)) {
+                        g->err = ENOMEM;
+                        break;
+                }
+        }
+        if (!d.closed) {
+#ifdef LFS_HAVE_GETDENTS
+                close (d.fd);
+#else
+                closedir (d.dir);
+#endif
+        }
+}
+
+/*
+** Matches the directory open at fd, whose path is the pathlen bytes of
+** g->path, against the states of set.
+*/
+static void glob_dir (lfs_Glob *g, int fd, size_t pathlen, const glob_state *set, size_t n) {
+        walk_names names;
+        glob_state *next;
+        size_t k;
+        memset (&names, 0, sizeof(names));
+        if ((next = (glob_state *)malloc (g->maxstates * sizeof(glob_state))) == NULL) {
+                g->err = ENOMEM;
+                return;
+        }
+        glob_list (g, fd, set, n, &names);
+        for (k = 0; k < names.n && g->err == 0; k++) {
+                const char *name = names.arena + names.off[k] + 1;
+                int type = (unsigned char)names.arena[names.off[k]] - 1, dir, linkdir = 0, match = 0, excluded = -1;
+                size_t i, nn = 0, len = pathlen + (pathlen > 0 && g->path[pathlen - 1] != '/');
+                STAT_STRUCT info;
+                if (len + strlen (name) >= LFS_MAXPATHLEN)
+                        continue;
+                if (type != DT_DIR && type != DT_LNK && type != DT_REG) {
+                        if (fstatat (fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+                                continue;  /* not there */
+                        type = S_ISDIR (info.st_mode) ? DT_DIR : S_ISLNK (info.st_mode) ? DT_LNK : DT_REG;
+                }
+                dir = type == DT_DIR;
+                if (type == DT_LNK)
+                        linkdir = fstatat (fd, name, &info, 0) == 0 && S_ISDIR (info.st_mode);
+                for (i = 0; i < n; i++) {
+                        const glob_pat *p = &g->pats[set[i].pat];
+                        const char *c = glob_comp (g, set[i].pat, set[i].comp);
+                        int last = set[i].comp + 1 == p->n;
+                        if (glob_isstar (c)) {
+                                if (!g->hidden && name[0] == '.')
+                                        continue;
+                                if (last && (!p->dironly || dir || linkdir))
+                                        match = 1;
+                                if (dir || (linkdir && g->follow))
+                                        glob_closure (g, next, &nn, set[i].pat, set[i].comp);
+                        } else if (glob_match (c, name, !g->hidden)) {
+                                if (last && (!p->dironly || dir || linkdir))
+                                        match = 1;
+                                else if (!last && (dir || linkdir))
+                                        glob_closure (g, next, &nn, set[i].pat, set[i].comp + 1);
+                        }
+                }
+                if (!match && nn == 0)
+                        continue;
+                if (len > pathlen)
+                        g->path[pathlen] = '/';
+                strcpy (g->path + len, name);
+                len += strlen (name);
+                if (match && (excluded = glob_excluded (g)) == 0 && !walk_names_add (&g->found, g->path))
+                        g->err = ENOMEM;
+                if (nn > 0 && g->err == 0 && (excluded == 0 || (excluded < 0 && !glob_excluded (g)))) {
+#ifdef LFS_HAVE_BOX
+                        int cfd = type == DT_LNK ?  /* may lead up, but not out of the box */
+                                box_open (g->S, g->path, O_RDONLY | O_DIRECTORY) :
+                                box_openat (fd, name, O_RDONLY | O_DIRECTORY);
+#else
+                        int cfd = openat (fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+                        if (cfd >= 0 && (!g->follow || fstat (cfd, &info) == 0)) {
+                                size_t j;
+                                for (j = 0; g->follow && j < g->depth; j++)
+                                        if (g->stack[j].dev == info.st_dev && g->stack[j].ino == info.st_ino)
+                                                break;  /* a loop of links */
+                                if (g->follow && j == g->depth && g->depth == g->stackcap) {
+                                        size_t cap = g->stackcap ? g->stackcap * 2 : 64;
+                                        lfs_InoKey *stack = (lfs_InoKey *)realloc (g->stack, cap * sizeof(lfs_InoKey));
+                                        if (stack == NULL)
+                                                g->err = ENOMEM;
+                                        else {
+                                                g->stack = stack;
+                                                g->stackcap = cap;
+                                        }
+                                }
+                                if (g->err == 0 && (!g->follow || j == g->depth)) {
+                                        if (g->follow) {
+                                                g->stack[g->depth].dev = info.st_dev;
+                                                g->stack[g->depth++].ino = info.st_ino;
+                                        }
+                                        glob_dir (g, cfd, len, next, nn);
+                                        if (g->follow)
+                                                g->depth--;
+                                }
+                        }
+                        if (cfd >= 0)
+                                close (cfd);
+                }
+                g->path[pathlen] = '\0';
+        }
+        free (next);
+        free (names.arena);
+        free (names.off);
+}
+
+static void glob_free (lfs_Glob *g) {
+        free (g->comps.arena);
+        free (g->comps.off);
+        free (g->found.arena);
+        free (g->found.off);
+        free (g->pats);
+        free (g->stack);
+        free (g->buf);
+}
+
+/*
+** Walks the patterns that start at the same directory as pattern i,
+** marking them in done.
+*/
+static void glob_start (lfs_Glob *g, size_t i, char *done) {
+        const glob_pat *p = &g->pats[i];
+        glob_state *set;
+        size_t k, j, n = 0, len = 0;
+        int fd;
+        if (p->absolute)
+                g->path[len++] = '/';
+        for (k = 0; k < p->lit; k++) {
+                const char *c = glob_comp (g, i, k);
+                size_t cl = strlen (c);
+                if (len + cl + 2 >= LFS_MAXPATHLEN) {
+                        done[i] = 1;
+                        return;
+                }
+                if (k > 0)
+                        g->path[len++] = '/';
+                memcpy (g->path + len, c, cl);
+                len += cl;
+        }
+        g->path[len] = '\0';
+        if ((set = (glob_state *)malloc (g->maxstates * sizeof(glob_state))) == NULL) {
+                g->err = ENOMEM;
+                return;
+        }
+        for (j = i; j < g->ninclude; j++) {  /* the same directory */
+                const glob_pat *q = &g->pats[j];
+                if (done[j] || q->absolute != p->absolute || q->lit != p->lit)
+                        continue;
+                for (k = 0; k < p->lit && strcmp (glob_comp (g, i, k), glob_comp (g, j, k)) == 0; k++)
+                        ;
+                if (k < p->lit)
+                        continue;
+                done[j] = 1;
+                glob_closure (g, set, &n, j, q->lit);
+        }
+#ifdef LFS_HAVE_BOX
+        fd = box_open (g->S, len > 0 ? g->path : ".", O_RDONLY | O_DIRECTORY);
+#else
+        fd = openat (g->S->cwdfd, len > 0 ? g->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+        if (fd >= 0) {  /* a missing directory matches nothing */
+                STAT_STRUCT info;
+                g->depth = 0;
+                if (g->follow && g->stack == NULL) {
+                        if ((g->stack = (lfs_InoKey *)malloc (64 * sizeof(lfs_InoKey))) == NULL)
+                                g->err = ENOMEM;
+                        else
+                                g->stackcap = 64;
+                }
+                if (g->follow && g->err == 0 && fstat (fd, &info) == 0) {  /* a loop may lead back here */
+                        g->stack[0].dev = info.st_dev;
+                        g->stack[g->depth++].ino = info.st_ino;
+                }
+                if (g->err == 0)
+                        glob_dir (g, fd, len, set, n);
+                close (fd);
+        }
+        free (set);
+}
+
+static int glob_namecmp (const void *a, const void *b) {
+        return strcmp (*(const char *const *)a, *(const char *const *)b);
+}
+
+/*
+** Expands a pattern into the paths that match it.
+** @param #1 Pattern: * and ? match within a component, [...] is a class
+**           of characters (negated by ! or ^), ** matches any number of
+**           directories, {a,b} gives alternatives and \ quotes a character.
+** @param #2 Table with options (optional): exclude, a pattern or an array
+**           of patterns whose matches are left out, with their contents;
+**           hidden, for wildcards to match names starting with a dot; and
+**           follow, for ** to enter links to directories.
+** Returns a sorted array of paths.
+*/
+static int glob_expand (lua_State *L) {
+        const char *pattern = luaL_checkstring (L, 1);
+        const char **paths = NULL;
+        char *done = NULL;
+        lfs_Glob g;
+        size_t i, n = 0;
+        int nex = 0, k;
+        memset (&g, 0, sizeof(g));
+        g.S = lfs_state (L);
+        g.hidden = opt_boolean (L, 2, "hidden", 0);
+        g.follow = opt_boolean (L, 2, "follow", 0);
+        lua_settop (L, 2);
+        if (lua_istable (L, 2)) {
+                lua_getfield (L, 2, "exclude");
+                if (lua_isstring (L, 3))
+                        nex = -1;
+                else if (lua_istable (L, 3)) {
+                        nex = (int)lua_objlen (L, 3);
+                        for (k = 1; k <= nex; k++) {
+                                lua_rawgeti (L, 3, k);
+                                if (!lua_isstring (L, -1))
+                                        luaL_error (L, "option 'exclude' must be a string or an array of strings");
+                                lua_pop (L, 1);
+                        }
+                } else if (!lua_isnil (L, 3))
+                        luaL_error (L, "option 'exclude' must be a string or an array of strings");
+        }
+        if ((g.err = glob_braces (&g, pattern)) == 0) {
+                g.ninclude = g.npats;
+                g.maxstates = g.comps.n + 1;
+        }
+        for (k = 1; g.err == 0 && k <= (nex < 0 ? 1 : nex); k++) {
+                if (nex > 0)
+                        lua_rawgeti (L, 3, k);
+                g.err = glob_braces (&g, lua_tostring (L, -1));
+                if (nex > 0)
+                        lua_pop (L, 1);
+        }
+        if (g.err == 0 && ((g.buf = (char *)malloc (WALK_BUFSIZE)) == NULL ||
+                           (done = (char *)calloc (g.ninclude + 1, 1)) == NULL))
+                g.err = ENOMEM;
+        for (i = 0; g.err == 0 && i < g.ninclude; i++)
+                if (!done[i])
+                        glob_start (&g, i, done);
+        if (g.err == 0 && g.found.n > 0 &&
+            (paths = (const char **)malloc (g.found.n * sizeof(*paths))) == NULL)
+                g.err = ENOMEM;
+        free (done);
+        if (g.err != 0) {
+                glob_free (&g);
+                if (g.err == E2BIG)
+                        return luaL_argerror (L, 1, "too many alternatives");
+                return luaL_error (L, "not enough memory");
+        }
+        for (i = 0; i < g.found.n; i++)
+                paths[i] = g.found.arena + g.found.off[i];
+        if (g.found.n > 0)
+                qsort (paths, g.found.n, sizeof(*paths), glob_namecmp);
+        lua_createtable (L, (int)g.found.n, 0);
+        for (i = 0; i < g.found.n; i++) {
+                if (i > 0 && strcmp (paths[i], paths[i - 1]) == 0)
+                        continue;  /* found by several alternatives */
+                lua_pushstring (L, paths[i]);
+                lua_rawseti (L, -2, (int)++n);
+        }
+        free (paths);
+        glob_free (&g);
+        return 1;
+}
+#endif
+
+
+#ifndef _WIN32
+/*
+** Hashing.
+** lfs.hash and lfs.hashtree read files through large buffers and hash
+** them in C: CRC-32C, with the SSE4.2 instruction where the processor
+** has it, XXH64 and SHA-256. lfs.hashtree lists the tree first and hashes
+** its files with a pool of threads. Digests are kept per state by device,
+** inode, size and modification time, so files that did not change since
+** the last lfs.hashtree are not read again.
+*/
+#define HASH_BUFSIZE  (1 << 20)
+#define HASH_SMALL    16384   /* files read through a buffer on the stack */
+#define HASH_MEMO_MAX 262144  /* digests kept before dropping the unused */
+
+enum { HASH_XXH64, HASH_CRC32C, HASH_SHA256 };
+static const char *const hash_names[] = { "xxh64", "crc32c", "sha256", NULL };
+static const size_t hash_sizes[] = { 8, 4, 32 };
+
+typedef struct hash_ctx {
+        int algo;
+        uint64_t total;
+        union {
+                uint32_t crc;
+                struct {
+                        uint64_t v[4];
+                        unsigned char mem[32];
+                } xxh;
+                struct {
+                        uint32_t h[8];
+                        unsigned char block[64];
+                } sha;
+        } u;
+} hash_ctx;
+
+static uint32_t hash_le32 (const unsigned char *p) {
+        return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t hash_le64 (const unsigned char *p) {
+        return (uint64_t)hash_le32 (p) | (uint64_t)hash_le32 (p + 4) << 32;
+}
+
+/* CRC-32C, slicing by eight */
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init (void) {
+        uint32_t i, j, c;
+        for (i = 0; i < 256; i++) {
+                for (c = i, j = 0; j < 8; j++)
+                        c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+                crc32c_table[0][i] = c;
+        }
+        for (i = 0; i < 256; i++)
+                for (j = 1; j < 8; j++)
+                        crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+}
+
+static uint32_t crc32c_soft (uint32_t crc, const unsigned char *p, size_t len) {
+        for (; len >= 8; p += 8, len -= 8) {
+                uint32_t lo = crc ^ hash_le32 (p), hi = hash_le32 (p + 4);
+                crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+                      crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+                      crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+                      crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        }
+        while (len-- > 0)
+                crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+        return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target ("sse4.2")))
+static uint32_t crc32c_sse42 (uint32_t crc, const unsigned char *p, size_t len) {
+        uint64_t c = crc;
+        for (; len >= 8; p += 8, len -= 8) {
+                uint64_t w;
+                memcpy (&w, p, 8);
+                c = __builtin_ia32_crc32di (c, w);
+        }
+        crc = (uint32_t)c;
+        while (len-- > 0)
+                crc = __builtin_ia32_crc32qi (crc, *p++);
+        return crc;
+}
+#endif
+
+static uint32_t crc32c (uint32_t crc, const unsigned char *p, size_t len) {
+#if defined(__x86_64__) && defined(__GNUC__)
+        if (__builtin_cpu_supports ("sse4.2"))
+                return crc32c_sse42 (crc, p, len);
+#endif
+        return crc32c_soft (crc, p, len);
+}
+
+/* XXH64, with seed 0 */
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+#define xxh_rotl(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t xxh_round (uint64_t acc, uint64_t input) {
+        acc += input * XXH_P2;
+        acc = xxh_rotl (acc, 31);
+        return acc * XXH_P1;
+}
+
+static uint64_t xxh_merge (uint64_t acc, uint64_t v) {
+        acc ^= xxh_round (0, v);
+        return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxh_stripes (uint64_t *v, const unsigned char *p, size_t n) {
+        for (; n > 0; n--, p += 32) {
+                v[0] = xxh_round (v[0], hash_le64 (p));
+                v[1] = xxh_round (v[1], hash_le64 (p + 8));
+                v[2] = xxh_round (v[2], hash_le64 (p + 16));
+                v[3] = xxh_round (v[3], hash_le64 (p + 24));
+        }
+}
+
+static uint64_t xxh_digest (const hash_ctx *c) {
+        const uint64_t *v = c->u.xxh.v;
+        const unsigned char *p = c->u.xxh.mem;
+        size_t left = (size_t)(c->total & 31);
+        uint64_t h;
+        if (c->total >= 32) {
+                h = xxh_rotl (v[0], 1) + xxh_rotl (v[1], 7) + xxh_rotl (v[2], 12) + xxh_rotl (v[3], 18);
+                h = xxh_merge (xxh_merge (xxh_merge (xxh_merge (h, v[0]), v[1]), v[2]), v[3]);
+        } else
+                h = XXH_P5;
+        h += c->total;
+        for (; left >= 8; left -= 8, p += 8) {
+                h ^= xxh_round (0, hash_le64 (p));
+                h = xxh_rotl (h, 27) * XXH_P1 + XXH_P4;
+        }
+        if (left >= 4) {
+                h ^= (uint64_t)hash_le32 (p) * XXH_P1;
+                h = xxh_rotl (h, 23) * XXH_P2 + XXH_P3;
+                left -= 4;
+                p += 4;
+        }
+        for (; left > 0; left--, p++) {
+                h ^= *p * XXH_P5;
+                h = xxh_rotl (h, 11) * XXH_P1;
+        }
+        h ^= h >> 33;
+        h *= XXH_P2;
+        h ^= h >> 29;
+        h *= XXH_P3;
+        return h ^ (h >> 32);
+}
+
+/* SHA-256 */
+static const uint32_t sha_k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define sha_rotr(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+static void sha_blocks (uint32_t *h, const unsigned char *p, size_t n) {
+        for (; n > 0; n--, p += 64) {
+                uint32_t w[64], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+                int i;
+                for (i = 0; i < 16; i++)
+                        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+                               (uint32_t)p[4 * i + 2] << 8 | (uint32_t)p[4 * i + 3];
+                for (; i < 64; i++)
+                        w[i] = w[i - 16] + (sha_rotr (w[i - 15], 7) ^ sha_rotr (w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+                               w[i - 7] + (sha_rotr (w[i - 2], 17) ^ sha_rotr (w[i - 2], 19) ^ (w[i - 2] >> 10));
+                for (i = 0; i < 64; i++) {
+                        uint32_t t1 = k + (sha_rotr (e, 6) ^ sha_rotr (e, 11) ^ sha_rotr (e, 25)) +
+                                      ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+                        uint32_t t2 = (sha_rotr (a, 2) ^ sha_rotr (a, 13) ^ sha_rotr (a, 22)) +
+                                      ((a & b) ^ (a & c) ^ (b & c));
+                        k = g;
+                        g = f;
+                        f = e;
+                        e = d + t1;
+                        d = c;
+                        c = b;
+                        b = a;
+                        a = t1 + t2;
+                }
+                h[0] += a;
+                h[1] += b;
+                h[2] += c;
+                h[3] += d;
+                h[4] += e;
+                h[5] += f;
+                h[6] += g;
+                h[7] += k;
+        }
+}
+
+static void hash_init (hash_ctx *c, int algo) {
+        static const uint32_t sha_h[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        c->algo = algo;
+        c->total = 0;
+        switch (algo) {
+                case HASH_CRC32C:
+                        pthread_once (&crc32c_once, crc32c_init);
+                        c->u.crc = 0xffffffff;
+                        break;
+                case HASH_XXH64:
+                        c->u.xxh.v[0] = XXH_P1 + XXH_P2;
+                        c->u.xxh.v[1] = XXH_P2;
+                        c->u.xxh.v[2] = 0;
+                        c->u.xxh.v[3] = 0 - XXH_P1;
+                        break;
+                default:
+                        memcpy (c->u.sha.h, sha_h, sizeof(sha_h));
+        }
+}
+
+/*
+** Feeds the len bytes at p to the hash. XXH64 and SHA-256 keep the bytes
+** of an incomplete stripe or block until the next call.
+*/
+static void hash_update (hash_ctx *c, const unsigned char *p, size_t len) {
+        size_t bs = c->algo == HASH_XXH64 ? 32 : 64, used = (size_t)(c->total & (bs - 1)), n;
+        unsigned char *mem = c->algo == HASH_XXH64 ? c->u.xxh.mem : c->u.sha.block;
+        c->total += len;
+        if (c->algo == HASH_CRC32C) {
+                c->u.crc = crc32c (c->u.crc, p, len);
+                return;
+        }
+        if (used > 0) {
+                n = bs - used < len ? bs - used : len;
+                memcpy (mem + used, p, n);
+                p += n;
+                len -= n;
+                if (used + n < bs)
+                        return;
+                if (c->algo == HASH_XXH64)
+                        xxh_stripes (c->u.xxh.v, mem, 1);
+                else
+                        sha_blocks (c->u.sha.h, mem, 1);
+        }
+        if (c->algo == HASH_XXH64)
+                xxh_stripes (c->u.xxh.v, p, len / bs);
+        else
+                sha_blocks (c->u.sha.h, p, len / bs);
+        memcpy (mem, p + len / bs * bs, len % bs);
+}
+
+/*
+** Writes the digest, hash_sizes[algo] bytes in big-endian order, to out.
+*/
+static void hash_final (hash_ctx *c, unsigned char *out) {
+        uint64_t v, bits = c->total * 8;
+        unsigned char pad[72];
+        size_t i, n;
+        switch (c->algo) {
+                case HASH_CRC32C:
+                        v = ~c->u.crc & 0xffffffff;
+                        for (i = 0; i < 4; i++)
+                                out[i] = (unsigned char)(v >> (24 - 8 * i));
+                        break;
+                case HASH_XXH64:
+                        v = xxh_digest (c);
+                        for (i = 0; i < 8; i++)
+                                out[i] = (unsigned char)(v >> (56 - 8 * i));
+                        break;
+                default:
+                        n = 64 - (size_t)((c->total + 8) & 63);  /* to end a block after the length */
+                        memset (pad, 0, sizeof(pad));
+                        pad[0] = 0x80;
+                        for (i = 0; i < 8; i++)
+                                pad[n + i] = (unsigned char)(bits >> (56 - 8 * i));
+                        hash_update (c, pad, n + 8);
+                        for (i = 0; i < 32; i++)
+                                out[i] = (unsigned char)(c->u.sha.h[i / 4] >> (24 - 8 * (i % 4)));
+        }
+}
+
+/*
+** Hashes the file open at fd, of size bytes, into out.
+** Returns 0 or an errno value.
+*/
+static int hash_fd (int fd, int algo, off_t size, unsigned char *out) {
+        unsigned char small[HASH_SMALL], *buf = small;
+        size_t bufsize = HASH_SMALL;
+        hash_ctx c;
+        int err = 0;
+        if (size >= HASH_SMALL) {
+                void *p;
+                if (posix_memalign (&p, 4096, HASH_BUFSIZE) != 0)
+                        return ENOMEM;
+                buf = (unsigned char *)p;
+                bufsize = HASH_BUFSIZE;
+#ifdef POSIX_FADV_SEQUENTIAL
+                posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        }
+        hash_init (&c, algo);
+        for (;;) {
+                ssize_t n = read (fd, buf, bufsize);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        err = n < 0 ? errno : 0;
+                        break;
+                }
+                hash_update (&c, buf, (size_t)n);
+        }
+        if (buf != small)
+                free (buf);
+        if (err == 0)
+                hash_final (&c, out);
+        return err;
+}
+
+static void hash_push (lua_State *L, const unsigned char *digest, int algo) {
+        char hex[64];
+        size_t i;
+        for (i = 0; i < hash_sizes[algo]; i++) {
+                hex[2 * i] = "0123456789abcdef"[digest[i] >> 4];
+                hex[2 * i + 1] = "0123456789abcdef"[digest[i] & 15];
+        }
+        lua_pushlstring (L, hex, 2 * hash_sizes[algo]);
+}
+
+/*
+** Hashes a file.
+** @param #1 File path.
+** @param #2 Algorithm (optional): "xxh64" (the default), "crc32c" or
+**           "sha256".
+** Returns the digest as a string of hexadecimal digits.
+*/
+static int file_hash (lua_State *L) {
+        const char *path = luaL_checkstring (L, 1);
+        int algo = luaL_checkoption (L, 2, hash_names[HASH_XXH64], hash_names);
+        unsigned char digest[32];
+        STAT_STRUCT info;
+        int fd, err;
+#ifdef LFS_HAVE_BOX
+        fd = box_open (lfs_state (L), path, O_RDONLY);
+#else
+        fd = openat (lfs_state (L)->cwdfd, path, O_RDONLY | O_CLOEXEC);
+#endif
+        if (fd < 0)
+                return pusherror (L, path);
+        if (fstat (fd, &info) != 0)
+                err = errno;
+        else if (S_ISDIR (info.st_mode))
+                err = EISDIR;
+        else
+                err = hash_fd (fd, algo, info.st_size, digest);
+        close (fd);
+        if (err != 0) {
+                errno = err;
+                return pusherror (L, path);
+        }
+        stats_bytes (L, info.st_size);
+        hash_push (L, digest, algo);
+        return 1;
+}
+
+
+typedef struct hash_job {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        int64_t mtime;        /* nanoseconds */
+        int err;              /* errno if it could not be hashed, 0 otherwise */
+        int known;            /* the digest came from the memo */
+        unsigned char digest[32];
+} hash_job;
+
+typedef struct lfs_Hashtree {
+        int root;
+        int algo;
+        walk_names paths;     /* relative to the root */
+        hash_job *jobs;       /* one per path */
+        size_t cap;
+        char rel[LFS_MAXPATHLEN];
+} lfs_Hashtree;
+
+static size_t memo_slot (const lfs_Memo *m, dev_t dev, ino_t ino, int algo) {
+        size_t i = (inoset_hash (dev, ino) + (size_t)algo) & (m->size - 1);
+        while (m->slot[i].ino != 0 && (m->slot[i].ino != ino || m->slot[i].dev != dev || m->slot[i].algo != algo))
+                i = (i + 1) & (m->size - 1);
+        return i;
+}
+
+/*
+** Empties slot i, moving back the entries of its probe sequence that
+** follow it.
+*/
+static void memo_remove (lfs_Memo *m, size_t i) {
+        size_t j = i, k;
+        for (;;) {
+                j = (j + 1) & (m->size - 1);
+                if (m->slot[j].ino == 0)
+                        break;
+                k = (inoset_hash (m->slot[j].dev, m->slot[j].ino) + (size_t)m->slot[j].algo) & (m->size - 1);
+                if (i <= j ? i < k && k <= j : i < k || k <= j)
+                        continue;  /* not found through slot i */
+                m->slot[i] = m->slot[j];
+                i = j;
+        }
+        m->slot[i].ino = 0;
+        m->count--;
+}
+
+/*
+** Drops a digest that was not used since the hand last passed it.
+*/
+static void memo_evict (lfs_Memo *m) {
+        for (;;) {
+                lfs_MemoEntry *e = &m->slot[m->hand];
+                size_t i = m->hand;
+                m->hand = (m->hand + 1) & (m->size - 1);
+                if (e->ino == 0)
+                        continue;
+                if (!e->used) {
+                        memo_remove (m, i);
+                        return;
+                }
+                e->used = 0;
+        }
+}
+
+/*
+** Records the digest of job j in the memo, dropping an unused one when
+** it is full.
+** Returns 0, or -1 when out of memory.
+*/
+static int memo_put (lfs_Memo *m, const hash_job *j, int algo) {
+        ino_t ino = j->ino ? j->ino : (ino_t)-1;
+        lfs_MemoEntry *e;
+        if (m->count < HASH_MEMO_MAX && (m->count + 1) * 4 > m->size * 3) {
+                size_t n = m->size ? m->size * 2 : 1024, i;
+                lfs_MemoEntry *old = m->slot;
+                size_t oldsize = m->size;
+                if ((m->slot = (lfs_MemoEntry *)calloc (n, sizeof(lfs_MemoEntry))) == NULL) {
+                        m->slot = old;
+                        return -1;
+                }
+                m->size = n;
+                m->hand = 0;
+                for (i = 0; i < oldsize; i++)
+                        if (old[i].ino != 0)
+                                m->slot[memo_slot (m, old[i].dev, old[i].ino, old[i].algo)] = old[i];
+                free (old);
+        }
+        e = &m->slot[memo_slot (m, j->dev, ino, algo)];
+        if (e->ino == 0 && m->count >= HASH_MEMO_MAX) {
+                memo_evict (m);  /* may move the entries after it */
+                e = &m->slot[memo_slot (m, j->dev, ino, algo)];
+        }
+        if (e->ino == 0)
+                m->count++;
+        e->dev = j->dev;
+        e->ino = ino;
+        e->algo = algo;
+        e->used = 1;
+        e->size = (int64_t)j->size;
+        e->mtime = j->mtime;
+        memcpy (e->digest, j->digest, sizeof(e->digest));
+        return 0;
+}
+
+/*
+** Takes the digest of job j from the memo, if the file did not change.
+*/
+static void memo_get (lfs_Memo *m, hash_job *j, int algo) {
+        lfs_MemoEntry *e;
+        if (m == NULL || m->size == 0)
+                return;
+        e = &m->slot[memo_slot (m, j->dev, j->ino ? j->ino : (ino_t)-1, algo)];
+        if (e->ino != 0 && e->size == (int64_t)j->size && e->mtime == j->mtime) {
+                memcpy (j->digest, e->digest, sizeof(j->digest));
+                e->used = 1;
+                j->known = 1;
+        }
+}
+
+/*
+** Records the path in t->rel, with the attributes of info when it is not
+** NULL, or else the error err.
+** Returns 0, or -1 when out of memory.
+*/
+static int hash_add (lfs_Hashtree *t, const STAT_STRUCT *info, int err) {
+        hash_job *j;
+        if (t->paths.n == t->cap) {
+                size_t cap = t->cap ? t->cap * 2 : 256;
+                hash_job *jobs = (hash_job *)realloc (t->jobs, cap * sizeof(hash_job));
+                if (jobs == NULL)
+                        return -1;
+                t->jobs = jobs;
+                t->cap = cap;
+        }
+        if (!walk_names_add (&t->paths, t->rel))
+                return -1;
+        j = &t->jobs[t->paths.n - 1];
+        memset (j, 0, sizeof(hash_job));
+        j->err = err;
+        if (info != NULL) {
+                j->dev = info->st_dev;
+                j->ino = info->st_ino;
+                j->size = info->st_size;
+                j->mtime = snap_mtime (info);
+        }
+        return 0;
+}
+
+/*
+** Records the regular files under the directory open at fd, whose path
+** takes the len bytes of t->rel.
+** Returns 0, or -1 when out of memory.
+*/
+static int hash_dir (lfs_Hashtree *t, int fd, size_t len, char *buf) {
+        walk_names nm;
+        size_t i;
+        int err, res = 0;
+        memset (&nm, 0, sizeof(nm));
+        if ((err = walk_list (fd, buf, &nm)) != 0)
+                res = err == ENOMEM ? -1 : hash_add (t, NULL, err);
+        for (i = 0; res == 0 && i < nm.n; i++) {
+                const char *name = nm.arena + nm.off[i];
+                size_t nl = strlen (name), sub = len + (len > 0);
+                STAT_STRUCT info;
+                int cfd;
+                if (sub + nl >= LFS_MAXPATHLEN)
+                        continue;
+                if (len > 0)
+                        t->rel[len] = '/';
+                memcpy (t->rel + sub, name, nl + 1);
+                if (fstatat (fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+                        res = hash_add (t, NULL, errno);
+                else if (S_ISREG (info.st_mode))
+                        res = hash_add (t, &info, 0);
+                else if (S_ISDIR (info.st_mode)) {
+#ifdef LFS_HAVE_BOX
+                        cfd = box_openat (fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+#else
+                        cfd = openat (fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+#endif
+                        if (cfd < 0)
+                                res = hash_add (t, NULL, errno);
+                        else {
+                                res = hash_dir (t, cfd, sub + nl, buf);
+                                close (cfd);
+                        }
+                }
+                t->rel[len] = '\0';
+        }
+        free (nm.arena);
+        free (nm.off);
+        return res;
+}
+
+/*
+** Hashes the file of job i.
+*/
+static void hash_task (void *arg, size_t i) {
+        lfs_Hashtree *t = (lfs_Hashtree *)arg;
+        hash_job *j = &t->jobs[i];
+        const char *rel = t->paths.arena + t->paths.off[i];
+        int fd;
+        if (j->err || j->known)
+                return;
+#ifdef LFS_HAVE_BOX
+        fd = box_openat (t->root, rel, O_RDONLY | O_NOFOLLOW);
+#else
+        fd = openat (t->root, rel, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+#endif
+        if (fd < 0) {
+                j->err = errno;
+                return;
+        }
+        j->err = hash_fd (fd, t->algo, j->size, j->digest);
+        close (fd);
+}
+
+/*
+** Hashes the regular files of a directory tree.
+** @param #1 Directory path.
+** @param #2 Algorithm (optional), as for lfs.hash.
+** @param #3 Table with options (optional): threads, and memo (false to
+**           read every file again).
+** Returns a table with the digest of each file, by its path relative to
+** the directory, and a table with the error messages of the paths that
+** could not be read.
+*/
+static int tree_hash (lua_State *L) {
+        const char *root = luaL_checkstring (L, 1);
+        int nthreads = (int)opt_integer (L, 3, "threads", default_threads ());
+        int memo = opt_boolean (L, 3, "memo", 1);
+        lfs_State *S = lfs_state (L);
+        lfs_Hashtree t;
+        char *buf = NULL;
+        size_t i;
+        int res = -1;
+        luaL_argcheck (L, nthreads > 0 && nthreads <= LFS_MAXTHREADS, 3, "invalid number of threads");
+        memset (&t, 0, sizeof(t));
+        t.algo = luaL_checkoption (L, 2, hash_names[HASH_XXH64], hash_names);
+#ifdef LFS_HAVE_BOX
+        t.root = box_open (S, root, O_RDONLY | O_DIRECTORY);
+#else
+        t.root = openat (S->cwdfd, root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+        if (t.root < 0)
+                return pusherror (L, root);
+        if (memo && S->memo == NULL)
+                S->memo = (lfs_Memo *)calloc (1, sizeof(lfs_Memo));
+        if ((buf = (char *)malloc (WALK_BUFSIZE)) != NULL && (!memo || S->memo != NULL) &&
+            hash_dir (&t, t.root, 0, buf) == 0)
+                res = 0;
+        free (buf);
+        if (res == 0) {
+                for (i = 0; memo && i < t.paths.n; i++)
+                        if (t.jobs[i].err == 0)
+                                memo_get (S->memo, &t.jobs[i], t.algo);
+                run_parallel (nthreads, t.paths.n, hash_task, &t);
+                for (i = 0; memo && res == 0 && i < t.paths.n; i++)
+                        if (t.jobs[i].err == 0 && !t.jobs[i].known)
+                                res = memo_put (S->memo, &t.jobs[i], t.algo);
+        }
+        close (t.root);
+        if (res != 0) {
+                free (t.paths.arena);
+                free (t.paths.off);
+                free (t.jobs);
+                return luaL_error (L, "not enough memory");
+        }
+        lua_createtable (L, 0, (int)t.paths.n);
+        lua_newtable (L);
+        for (i = 0; i < t.paths.n; i++) {
+                hash_job *j = &t.jobs[i];
+                lua_pushstring (L, t.paths.arena + t.paths.off[i]);
+                if (j->err)
+                        lua_pushstring (L, strerror (j->err));
+                else
+                        hash_push (L, j->digest, t.algo);
+                lua_rawset (L, j->err ? -3 : -4);
+        }
+        free (t.paths.arena);
+        free (t.paths.off);
+        free (t.jobs);
+        return 2;
+}
+#endif
+
+
+#ifndef _WIN32
+/*
+** Disk usage.
+** lfs.du reads the tree with a pool of threads like lfs.rmtree, adding
+** the allocated and apparent sizes of the entries of each directory to
+** the report of its nearest ancestor within the requested depth. Files
+** with several links are counted once, through a set of (device, inode)
+** pairs; the reports are added up to the root at the end.
+*/
+typedef struct du_report {
+        struct du_report *next;    /* every report, the newest first */
+        struct du_report *parent;
+        int depth;
+        int64_t allocated, apparent, files, dirs;
+        char path[1];              /* relative to the root */
+} du_report;
+
+typedef struct du_dir {
+        struct du_dir *next;       /* in the stack of directories to read */
+        du_report *report;
+        int fd;                    /* open descriptor, or -1 to reopen it by path */
+        int depth;
+        char path[1];
+} du_dir;
+
+typedef struct lfs_Du {
+        pthread_mutex_t lock;
+        pthread_cond_t work;       /* directories were queued */
+        du_dir *todo;
+        int busy;                  /* workers reading a directory */
+        int fds;                   /* descriptors held by directories */
+        int root;
+        int maxdepth;              /* negative for no limit */
+        int nomem;
+        du_report *reports;
+        rm_fail *fails;
+        lfs_InoSet seen;           /* files with several links */
+} lfs_Du;
+
+static void du_failed (lfs_Du *t, const char *path, const char *name, int err) {
+        size_t pl = strlen (path), nl = name ? strlen (name) : 0;
+        rm_fail *f = (rm_fail *)malloc (sizeof(rm_fail) + pl + nl + 1);
+        if (f == NULL)
+                return;
+        f->err = err;
+        memcpy (f->path, path, pl);
+        if (name) {
+                if (pl > 0)
+                        f->path[pl++] = '/';
+                memcpy (f->path + pl, name, nl);
+                pl += nl;
+        }
+        f->path[pl] = '\0';
+        pthread_mutex_lock (&t->lock);
+        f->next = t->fails;
+        t->fails = f;
+        pthread_mutex_unlock (&t->lock);
+}
+
+/*
+** Makes the directory name of parent, at depth, with a report of its own
+** when depth is within the limit, and counts its own size.
+** Returns it, or NULL when out of memory.
+*/
+static du_dir *du_dir_new (lfs_Du *t, const du_dir *parent, const char *name,
+                           const STAT_STRUCT *info, int fd) {
+        size_t pl = parent ? strlen (parent->path) : 0, nl = strlen (name);
+        du_dir *d = (du_dir *)malloc (sizeof(du_dir) + pl + nl + 1);
+        du_report *r;
+        if (d == NULL)
+                return NULL;
+        d->next = NULL;
+        d->fd = fd;
+        d->depth = parent ? parent->depth + 1 : 0;
+        memcpy (d->path, parent ? parent->path : "", pl);
+        if (pl > 0)
+                d->path[pl++] = '/';
+        memcpy (d->path + pl, name, nl + 1);
+        d->report = parent ? parent->report : NULL;
+        if (t->maxdepth < 0 || d->depth <= t->maxdepth) {
+                if ((r = (du_report *)calloc (1, sizeof(du_report) + pl + nl)) == NULL) {
+                        free (d);
+                        return NULL;
+                }
+                r->parent = d->report;
+                r->depth = d->depth;
+                memcpy (r->path, d->path, pl + nl + 1);
+                pthread_mutex_lock (&t->lock);
+                r->next = t->reports;
+                t->reports = r;
+                pthread_mutex_unlock (&t->lock);
+                d->report = r;
+        }
+        r = d->report;
+        __atomic_fetch_add (&r->allocated, (int64_t)info->st_blocks * 512, __ATOMIC_RELAXED);
+        __atomic_fetch_add (&r->apparent, (int64_t)info->st_size, __ATOMIC_RELAXED);
+        __atomic_fetch_add (&r->dirs, 1, __ATOMIC_RELAXED);
+        return d;
+}
+
+/*
+** Counts the entries of directory d and returns its subdirectories, which
+** keep an open descriptor while there are fewer than WALK_MAXFDS.
+*/
+static du_dir *du_read (lfs_Du *t, du_dir *d, char *buf, walk_names *nm) {
+        du_dir *children = NULL;
+        int64_t allocated = 0, apparent = 0, files = 0;
+        int fd = d->fd, err;
+        size_t i;
+        if (fd >= 0)
+                __atomic_fetch_sub (&t->fds, 1, __ATOMIC_RELAXED);
+        else {
+#ifdef LFS_HAVE_BOX
+                fd = box_openat (t->root, *d->path ? d->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+#else
+                fd = openat (t->root, *d->path ? d->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+#endif
+        }
+        nm->used = nm->n = 0;
+        if (fd < 0)
+                du_failed (t, d->path, NULL, errno);
+        else if ((err = walk_list (fd, buf, nm)) != 0)
+                du_failed (t, d->path, NULL, err);
+        for (i = 0; i < nm->n; i++) {
+                const char *name = nm->arena + nm->off[i];
+                STAT_STRUCT info;
+                du_dir *child;
+                int cfd = -1;
+                if (fstatat (fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+                        du_failed (t, d->path, name, errno);
+                        continue;
+                }
+                if (S_ISDIR (info.st_mode)) {
+                        if (__atomic_add_fetch (&t->fds, 1, __ATOMIC_RELAXED) <= WALK_MAXFDS)
+                                cfd = openat (fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                        if (cfd < 0)
+                                __atomic_fetch_sub (&t->fds, 1, __ATOMIC_RELAXED);
+                        if ((child = du_dir_new (t, d, name, &info, cfd)) == NULL) {
+                                if (cfd >= 0) {
+                                        close (cfd);
+                                        __atomic_fetch_sub (&t->fds, 1, __ATOMIC_RELAXED);
+                                }
+                                __atomic_store_n (&t->nomem, 1, __ATOMIC_RELAXED);
+                                continue;
+                        }
+                        child->next = children;
+                        children = child;
+                        continue;
+                }
+                if (info.st_nlink > 1) {
+                        int added;
+                        pthread_mutex_lock (&t->lock);
+                        added = inoset_add (&t->seen, info.st_dev, info.st_ino);
+                        pthread_mutex_unlock (&t->lock);
+                        if (added < 0)
+                                __atomic_store_n (&t->nomem, 1, __ATOMIC_RELAXED);
+                        if (added <= 0)
+                                continue;  /* counted through another link */
+                }
+                allocated += (int64_t)info.st_blocks * 512;
+                apparent += (int64_t)info.st_size;
+                files++;
+        }
+        __atomic_fetch_add (&d->report->allocated, allocated, __ATOMIC_RELAXED);
+        __atomic_fetch_add (&d->report->apparent, apparent, __ATOMIC_RELAXED);
+        __atomic_fetch_add (&d->report->files, files, __ATOMIC_RELAXED);
+        if (fd >= 0)
+                close (fd);
+        return children;
+}
+
+static void *du_worker (void *arg) {
+        lfs_Du *t = (lfs_Du *)arg;
+        walk_names nm;
+        char *buf = (char *)malloc (WALK_BUFSIZE);
+        memset (&nm, 0, sizeof(nm));
+        pthread_mutex_lock (&t->lock);
+        while (buf != NULL) {
+                du_dir *d, *children;
+                while (t->todo == NULL && t->busy > 0)
+                        pthread_cond_wait (&t->work, &t->lock);
+                if (t->todo == NULL)
+                        break;
+                d = t->todo;
+                t->todo = d->next;
+                t->busy++;
+                pthread_mutex_unlock (&t->lock);
+
+                children = du_read (t, d, buf, &nm);
+                free (d);
+
+                pthread_mutex_lock (&t->lock);
+                t->busy--;
+                while (children) {
+                        du_dir *next = children->next;
+                        children->next = t->todo;
+                        t->todo = children;
+                        children = next;
+                }
+                pthread_cond_broadcast (&t->work);
+        }
+        pthread_cond_broadcast (&t->work);
+        pthread_mutex_unlock (&t->lock);
+        free (buf);
+        free (nm.arena);
+        free (nm.off);
+        return NULL;
+}
+
+/*
+** Pushes a table with the usage of report r.
+*/
+static void du_push (lua_State *L, const du_report *r, int apparent) {
+        lua_createtable (L, 0, 6);
+        lua_pushinteger (L, (lua_Integer)(apparent ? r->apparent : r->allocated));
+        lua_setfield (L, -2, "size");
+        lua_pushinteger (L, (lua_Integer)r->allocated);
+        lua_setfield (L, -2, "allocated");
+        lua_pushinteger (L, (lua_Integer)r->apparent);
+        lua_setfield (L, -2, "apparent");
+        lua_pushinteger (L, (lua_Integer)r->files);
+        lua_setfield (L, -2, "files");
+        lua_pushinteger (L, (lua_Integer)r->dirs);
+        lua_setfield (L, -2, "dirs");
+        lua_pushinteger (L, r->depth);
+        lua_setfield (L, -2, "depth");
+}
+
+/*
+** Computes the disk usage of a directory tree.
+** @param #1 Directory path.
+** @param #2 Table with options (optional): threads, depth, the depth down
+**           to which directories get a report of their own (default 0,
+**           only the root; negative for all), and apparent, for size to
+**           be the apparent size rather than the allocated one.
+** Returns a table with the usage of the root and of the directories down
+** to depth, by path, each with the fields size, allocated, apparent,
+** files, dirs and depth, and a table with the error messages of the paths
+** that could not be read.
+*/
+static int disk_usage (lua_State *L) {
+        const char *path = luaL_checkstring (L, 1);
+        int nthreads = (int)opt_integer (L, 2, "threads", default_threads ());
+        int apparent = opt_boolean (L, 2, "apparent", 0);
+        pthread_t threads[LFS_MAXTHREADS];
+        STAT_STRUCT info;
+        du_report *r;
+        lfs_Du t;
+        int i, started = 0;
+        luaL_argcheck (L, nthreads > 0 && nthreads <= LFS_MAXTHREADS, 2, "invalid number of threads");
+        memset (&t, 0, sizeof(t));
+        t.maxdepth = (int)opt_integer (L, 2, "depth", 0);
+#ifdef LFS_HAVE_BOX
+        t.root = box_open (lfs_state (L), path, O_RDONLY | O_DIRECTORY);
+#else
+        t.root = openat (lfs_state (L)->cwdfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+        if (t.root < 0 || fstat (t.root, &info) != 0) {
+                if (t.root >= 0)
+                        close_keep_errno (t.root);
+                return pusherror (L, path);
+        }
+        pthread_mutex_init (&t.lock, NULL);
+        pthread_cond_init (&t.work, NULL);
+        if ((t.todo = du_dir_new (&t, NULL, "", &info, -1)) == NULL) {
+                pthread_mutex_destroy (&t.lock);
+                pthread_cond_destroy (&t.work);
+                close (t.root);
+                return luaL_error (L, "not enough memory");
+        }
+        /* the calling thread is one of the workers */
+        for (i = 1; i < nthreads; i++)
+                if (pthread_create (&threads[started], NULL, du_worker, &t) == 0)
+                        started++;
+        du_worker (&t);
+        for (i = 0; i < started; i++)
+                pthread_join (threads[i], NULL);
+        pthread_mutex_destroy (&t.lock);
+        pthread_cond_destroy (&t.work);
+        close (t.root);
+        while (t.todo) {  /* out of memory for the buffers */
+                du_dir *next = t.todo->next;
+                if (t.todo->fd >= 0)
+                        close (t.todo->fd);
+                free (t.todo);
+                t.todo = next;
+                t.nomem = 1;
+        }
+        inoset_free (&t.seen);
+        lua_newtable (L);
+        for (r = t.reports; r != NULL; r = r->next) {  /* children before parents */
+                if (r->parent) {
+                        r->parent->allocated += r->allocated;
+                        r->parent->apparent += r->apparent;
+                        r->parent->files += r->files;
+                        r->parent->dirs += r->dirs;
+                }
+                if (*r->path)
+                        lua_pushfstring (L, "%s/%s", path, r->path);
+                else
+                        lua_pushstring (L, path);
+                du_push (L, r, apparent);
+                lua_rawset (L, -3);
+        }
+        lua_newtable (L);
+        while (t.fails) {
+                rm_fail *f = t.fails;
+                t.fails = f->next;
+                lua_pushfstring (L, "%s%s%s", path, f->path[0] ? "/" : "", f->path);
+                lua_pushstring (L, strerror (f->err));
+                lua_rawset (L, -3);
+                free (f);
+        }
+        while (t.reports) {
+                r = t.reports->next;
+                free (t.reports);
+                t.reports = r;
+        }
+        if (t.nomem)
+                return luaL_error (L, "not enough memory");
+        return 2;
+}
+#endif
+
+
+#ifndef _WIN32
+/*
+** Atomic writes.
+** lfs.commit writes a whole set of files before syncing any, syncs them in
+** one pass (a syncfs per file system for large sets), then publishes them
+** and syncs each parent directory once: a few sync calls instead of a
+** write, sync and rename per file. The files of a directory share one
+** descriptor of it, and past COMMIT_OPEN_MAX files they are written
+** under a temporary name and closed, so that large sets stay within the
+** limit of descriptors.
+*/
+#define COMMIT_SYNCFS 8      /* files on a file system from which syncfs is used */
+#define COMMIT_OPEN_MAX 256  /* files kept open until they are published */
+
+enum { SYNC_NONE, SYNC_AUTO, SYNC_DATA, SYNC_FS };
+
+/*
+** Returns the bytes of the string or buffer at idx, or NULL.
+*/
+static const char *atomic_bytes (lua_State *L, int idx, size_t *len) {
+        if (lua_type (L, idx) == LUA_TUSERDATA) {
+                lfs_Buffer *b = (lfs_Buffer *)lua_touserdata (L, idx);
+                int ok = lua_getmetatable (L, idx);
+                if (ok) {
+                        luaL_getmetatable (L, BUFFER_METATABLE);
+                        ok = lua_rawequal (L, -1, -2) && b->data != NULL;
+                        lua_pop (L, 2);
+                }
+                *len = ok ? b->len : 0;
+                return ok ? b->data : NULL;
+        }
+        if (lua_type (L, idx) != LUA_TSTRING)
+                return NULL;
+        return lua_tolstring (L, idx, len);
+}
+
+/*
+** Reads the sync option of the table at idx.
+*/
+static int atomic_sync_option (lua_State *L, int idx, int all) {
+        int how = SYNC_AUTO;
+        if (lua_istable (L, idx)) {
+                lua_getfield (L, idx, "sync");
+                if (lua_isboolean (L, -1))
+                        how = lua_toboolean (L, -1) ? SYNC_AUTO : SYNC_NONE;
+                else if (all && lua_type (L, -1) == LUA_TSTRING && strcmp (lua_tostring (L, -1), "data") == 0)
+                        how = SYNC_DATA;
+                else if (all && lua_type (L, -1) == LUA_TSTRING && strcmp (lua_tostring (L, -1), "fs") == 0)
+                        how = SYNC_FS;
+                else if (!lua_isnil (L, -1))
+                        luaL_error (L, all ? "option 'sync' must be a boolean, \"data\" or \"fs\""
+                                           : "option 'sync' must be a boolean");
+                lua_pop (L, 1);
+        }
+        return how;
+}
+
+/*
+** Replaces a file atomically.
+** @param #1 File path.
+** @param #2 New contents, a string or a buffer.
+** @param #3 Table with options (optional): mode, the permissions of the
+**           file before the umask (default 0666), and sync, false not to
+**           wait for the file and its directory to reach the disk.
+** Returns true.
+*/
+static int write_atomic (lua_State *L) {
+        lfs_State *S = lfs_state (L);
+        const char *path = luaL_checkstring (L, 1);
+        size_t len;
+        const char *data = atomic_bytes (L, 2, &len);
+        mode_t mode = (mode_t)opt_integer (L, 3, "mode", 0666);
+        int sync = atomic_sync_option (L, 3, 0) != SYNC_NONE, fail;
+        atomic_file a;
+        luaL_argcheck (L, data != NULL, 2, "string or buffer expected");
+        if (atomic_open (S, path, mode, &a) != 0)
+                return pusherror (L, path);
+        fail = snap_write (a.fd, data, len) != 0 || (sync && atomic_datasync (a.fd) != 0) ||
+               atomic_publish (&a) != 0 || (sync && atomic_syncdir (a.pfd) != 0);
+        atomic_close (&a);
+        cache_sync (S);
+        if (fail)
+                return pusherror (L, path);
+        stats_bytes (L, len);
+        lua_pushboolean (L, 1);
+        return 1;
+}
+
+typedef struct commit_file {
+        atomic_file a;
+        const char *path, *data;  /* anchored in the table of files */
+        size_t len;
+        int owner;                /* a.pfd is closed with this file */
+        dev_t dev;                /* of the parent, for the owners */
+        ino_t ino;
+} commit_file;
+
+typedef struct commit_dev {
+        dev_t dev;
+        size_t files;
+        int synced;               /* by a syncfs */
+} commit_dev;
+
+/*
+** Returns a descriptor of the file a, opening its temporary name again
+** when it was closed after being written, or -1 with errno set.
+*/
+static int commit_fd (const atomic_file *a) {
+        return a->fd >= 0 ? a->fd : openat (a->pfd, a->tmp, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+static void commit_fd_done (const atomic_file *a, int fd) {
+        if (fd != a->fd)
+                close (fd);
+}
+
+static int commit_stat (const atomic_file *a, STAT_STRUCT *info) {
+        return a->fd >= 0 ? fstat (a->fd, info) : fstatat (a->pfd, a->tmp, info, AT_SYMLINK_NOFOLLOW);
+}
+
+/*
+** Syncs the n files of c as how tells. Returns the number of sync calls,
+** or -1 with errno set and *bad the index of the file that failed.
+*/
+static int commit_sync (commit_file *c, size_t n, int how, size_t *bad) {
+        commit_dev *devs = NULL;
+        size_t i, j, ndevs = 0;
+        int calls = 0, fd = -1, res;
+        STAT_STRUCT info;
+        if (how == SYNC_AUTO || how == SYNC_FS) {
+                if ((devs = (commit_dev *)malloc (n * sizeof(commit_dev))) == NULL)
+                        return -1;
+                for (i = 0; i < n; i++) {
+                        if (commit_stat (&c[i].a, &info) != 0) {
+                                *bad = i;
+                                free (devs);
+                                return -1;
+                        }
+                        for (j = 0; j < ndevs && devs[j].dev != info.st_dev; j++)
+                                ;
+                        if (j == ndevs) {
+                                devs[ndevs].dev = info.st_dev;
+                                devs[ndevs].files = 0;
+                                devs[ndevs++].synced = 0;
+                        }
+                        devs[j].files++;
+                }
+        }
+        for (i = 0; i < n; i++) {
+                if (devs) {
+                        if (commit_stat (&c[i].a, &info) != 0)
+                                goto fail;
+                        for (j = 0; devs[j].dev != info.st_dev; j++)
+                                ;
+#ifdef __linux__
+                        if (how == SYNC_FS || devs[j].files >= COMMIT_SYNCFS) {
+                                /* one syncfs for all the files there */
+                                if (!devs[j].synced) {
+                                        if ((fd = commit_fd (&c[i].a)) < 0)
+                                                goto fail;
+                                        res = syncfs (fd);
+                                        commit_fd_done (&c[i].a, fd);
+                                        if (res != 0)
+                                                goto fail;
+                                        calls++;
+                                        devs[j].synced = 1;
+                                }
+                                continue;
+                        }
+#endif
+                }
+                if ((fd = commit_fd (&c[i].a)) < 0)
+                        goto fail;
+                res = atomic_datasync (fd);
+                commit_fd_done (&c[i].a, fd);
+                if (res != 0)
+                        goto fail;
+                calls++;
+        }
+        free (devs);
+        return calls;
+fail:
+        *bad = i;
+        free (devs);
+        return -1;
+}
+
+/*
+** Syncs the parent directories of the n files of c, once each through the
+** file that holds its descriptor. Returns the number of sync calls, or -1
+** with errno set and *bad the index of the file whose directory failed.
+*/
+static int commit_syncdirs (commit_file *c, size_t n, size_t *bad) {
+        size_t i;
+        int calls = 0;
+        for (i = 0; i < n; i++) {
+                if (!c[i].owner)
+                        continue;
+                if (atomic_syncdir (c[i].a.pfd) != 0) {
+                        *bad = i;
+                        return -1;
+                }
+                calls++;
+        }
+        return calls;
+}
+
+/*
+** Opens the file i of c with the permissions mode, sharing the parent
+** descriptor of an earlier file in the same directory. Past
+** COMMIT_OPEN_MAX files, the file is named, to be closed once written.
+** Returns 0, or -1 with errno set.
+*/
+static int commit_open (lfs_State *S, commit_file *c, size_t i, mode_t mode) {
+        atomic_file *a = &c[i].a;
+        STAT_STRUCT info;
+        size_t j;
+        a->fd = -1;
+        a->named = 0;
+        c[i].owner = 1;
+        if ((a->pfd = tree_parent (S, c[i].path, a->name)) < 0 || fstat (a->pfd, &info) != 0)
+                return a->pfd < 0 ? -1 : close_keep_errno (a->pfd);
+        for (j = 0; j < i; j++)
+                if (c[j].owner && c[j].dev == info.st_dev && c[j].ino == info.st_ino) {
+                        close (a->pfd);
+                        a->pfd = c[j].a.pfd;
+                        c[i].owner = 0;
+                        break;
+                }
+        c[i].dev = info.st_dev;
+        c[i].ino = info.st_ino;
+        if (atomic_create (a, mode, i >= COMMIT_OPEN_MAX) == 0)
+                return 0;
+        if (c[i].owner)
+                close_keep_errno (a->pfd);
+        return -1;
+}
+
+/*
+** Writes a set of files, then syncs and publishes them together.
+** @param #1 Table of the new contents (strings or buffers) by file path.
+** @param #2 Table with options (optional): mode, as in lfs.write_atomic,
+**           and sync: true (default) for a pass of fdatasync, or of syncfs
+**           on the file systems with many of the files; "data" or "fs" for
+**           one of them only; false for none.
+** Returns the number of files written and the number of sync calls made.
+** Each file is replaced atomically, but if one fails to be published,
+** those before it stay.
+*/
+static int write_commit (lua_State *L) {
+        lfs_State *S = lfs_state (L);
+        mode_t mode = (mode_t)opt_integer (L, 2, "mode", 0666);
+        int how = atomic_sync_option (L, 2, 1), calls = 0, res;
+        size_t n = 0, i, opened = 0, bad = 0, total = 0;
+        commit_file *c;
+        luaL_checktype (L, 1, LUA_TTABLE);
+        lua_pushnil (L);
+        while (lua_next (L, 1)) {
+                if (lua_type (L, -2) != LUA_TSTRING)
+                        return luaL_error (L, "paths must be strings");
+                n++;
+                lua_pop (L, 1);
+        }
+        c = (commit_file *)lua_newuserdata (L, (n > 0 ? n : 1) * sizeof(commit_file));
+        lua_pushnil (L);
+        for (i = 0; lua_next (L, 1); i++) {
+                c[i].path = lua_tostring (L, -2);
+                if ((c[i].data = atomic_bytes (L, -1, &c[i].len)) == NULL)
+                        return luaL_error (L, "contents of '%s' must be a string or a buffer", c[i].path);
+                total += c[i].len;
+                lua_pop (L, 1);
+        }
+        /* no Lua errors from here on, with descriptors open */
+        for (res = 0; opened < n; opened++) {
+                atomic_file *a = &c[opened].a;
+                bad = opened;
+                if ((res = commit_open (S, c, opened, mode)) != 0)
+                        break;
+                if ((res = snap_write (a->fd, c[opened].data, c[opened].len)) != 0) {
+                        opened++;
+                        break;
+                }
+                if (opened >= COMMIT_OPEN_MAX && a->named) {
+                        res = close (a->fd);
+                        a->fd = -1;
+                        if (res != 0) {
+                                opened++;
+                                break;
+                        }
+                }
+        }
+        if (res == 0 && how != SYNC_NONE)
+                res = (calls = commit_sync (c, n, how, &bad)) < 0 ? -1 : 0;
+        for (i = 0; res == 0 && i < n; i++)
+                if ((res = atomic_publish (&c[i].a)) != 0)
+                        bad = i;
+        if (res == 0 && how != SYNC_NONE) {
+                int dirs = commit_syncdirs (c, n, &bad);
+                res = dirs < 0 ? -1 : 0;
+                calls += dirs;
+        }
+        for (i = 0; i < opened; i++)
+                atomic_discard (&c[i].a);
+        for (i = 0; i < opened; i++)
+                if (c[i].owner)
+                        close (c[i].a.pfd);
+        cache_sync (S);
+        if (res != 0)
+                return pusherror (L, c[bad].path);
+        stats_bytes (L, total);
+        lua_pushinteger (L, (lua_Integer)n);
+        lua_pushinteger (L, calls);
+        return 2;
+}
+#endif
+
+
+#ifdef LFS_HAVE_URING
+/*
+** Minimal io_uring driver: one submission and one completion ring mapped
+** from the kernel, used without liburing.
+*/
+typedef struct lfs_Ring {
+        int fd;
+        unsigned entries;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sq_ring, *cq_ring;
+        size_t sq_ring_size, cq_ring_size;
+        unsigned queued;  /* sqes filled in but not submitted */
+} lfs_Ring;
+
+static void ring_free (lfs_Ring *r) {
+        if (r->sqes)
+                munmap (r->sqes, r->entries * sizeof(struct io_uring_sqe));
+        if (r->cq_ring && r->cq_ring != r->sq_ring)
+                munmap (r->cq_ring, r->cq_ring_size);
+        if (r->sq_ring)
+                munmap (r->sq_ring, r->sq_ring_size);
+        if (r->fd >= 0)
+                close (r->fd);
+        memset (r, 0, sizeof(lfs_Ring));
+        r->fd = -1;
+}
+
+/*
+** Sets up a ring with room for the given number of submissions.
+** Returns 0 on success or -1 with errno set (ENOSYS and EPERM mean that
+** io_uring is not available to this process).
+*/
+static int ring_init (lfs_Ring *r, unsigned entries) {
+        struct io_uring_params p;
+        int en;
+        memset (r, 0, sizeof(lfs_Ring));
+        memset (&p, 0, sizeof(p));
+        r->fd = (int)syscall (__NR_io_uring_setup, entries, &p);
+        if (r->fd < 0)
+                return -1;
+        fcntl (r->fd, F_SETFD, FD_CLOEXEC);
+        r->entries = p.sq_entries;
+        r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (r->cq_ring_size > r->sq_ring_size)
+                        r->sq_ring_size = r->cq_ring_size;
+                r->cq_ring_size = r->sq_ring_size;
+        }
+        r->sq_ring = mmap (NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+        if (r->sq_ring == MAP_FAILED) {
+                r->sq_ring = NULL;
+                goto fail;
+        }
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+                r->cq_ring = r->sq_ring;
+        else {
+                r->cq_ring = mmap (NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+                if (r->cq_ring == MAP_FAILED) {
+                        r->cq_ring = NULL;
+                        goto fail;
+                }
+        }
+        r->sqes = (struct io_uring_sqe *)mmap (NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+        if (r->sqes == MAP_FAILED) {
+                r->sqes = NULL;
+                goto fail;
+        }
+        r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+        r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+        r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+        r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+        r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+        r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+        r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+        r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+        return 0;
+fail:
+        en = errno;
+        ring_free (r);
+        errno = en;
+        return -1;
+}
+
+/*
+** Returns a cleared submission entry, or NULL if the ring is full.
+*/
+static struct io_uring_sqe *ring_sqe (lfs_Ring *r) {
+        unsigned head = __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE);
+        unsigned tail = *r->sq_tail + r->queued;
+        struct io_uring_sqe *sqe;
+        if (tail - head >= r->entries)
+                return NULL;
+        sqe = &r->sqes[tail & *r->sq_mask];
+        memset (sqe, 0, sizeof(struct io_uring_sqe));
+        r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+        r->queued++;
+        return sqe;
+}
+
+/*
+** Submits the queued entries and waits for at least wait completions.
+** Returns the number of entries submitted, or -1 with errno set.
+*/
+static int ring_submit (lfs_Ring *r, unsigned wait) {
+        unsigned n = r->queued;
+        int res;
+        __atomic_store_n (r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+        r->queued = 0;
+        do {
+                res = (int)syscall (__NR_io_uring_enter, r->fd, n, wait,
+                                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        } while (res < 0 && errno == EINTR);
+        return res;
+}
+
+/*
+** Returns the next completion, or NULL if there is none. The entry must be
+** released with ring_seen before asking for the next one.
+*/
+static struct io_uring_cqe *ring_cqe (lfs_Ring *r) {
+        unsigned head = *r->cq_head;
+        if (head == __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE))
+                return NULL;
+        return &r->cqes[head & *r->cq_mask];
+}
+
+static void ring_seen (lfs_Ring *r) {
+        __atomic_store_n (r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+typedef void (*ring_prep) (struct io_uring_sqe *sqe, size_t i, void *arg);
+
+#define RING_PENDING INT_MIN
+
+/*
+** Runs n operations through the ring, prep filling the entry of each one,
+** and stores their results (negative errno values on failure) in res.
+** Returns 0 when every operation completed, -1 if the ring could not be
+** used at all, and 1 if it failed with operations in flight: the memory
+** they use must then be kept alive, and the rest are marked as failed.
+*/
+static int ring_run (lfs_Ring *r, size_t n, ring_prep prep, void *arg, int *res) {
+        size_t next = 0, done = 0, i;
+        while (done < n) {
+                struct io_uring_sqe *sqe;
+                struct io_uring_cqe *cqe;
+                while (next < n && (sqe = ring_sqe (r)) != NULL) {
+                        prep (sqe, next, arg);
+                        sqe->user_data = next;
+                        res[next++] = RING_PENDING;
+                }
+                if (ring_submit (r, 1) < 0) {
+                        int en = errno;
+                        if (done == 0 && *r->sq_tail - __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE) == (unsigned)next)
+                                return -1;  /* nothing reached the kernel */
+                        for (i = 0; i < n; i++)
+                                if (i >= next || res[i] == RING_PENDING)
+                                        res[i] = -en;
+                        return 1;
+                }
+                while ((cqe = ring_cqe (r)) != NULL) {
+                        res[cqe->user_data] = cqe->res;
+                        ring_seen (r);
+                        done++;
+                }
+        }
+        return 0;
 }
 #endif
 
-static int lfs_g_setmode (lua_State *L, FILE *f, int arg) {
-  static const int mode[] = {_O_BINARY, _O_TEXT};
-  static const char *const modenames[] = {"binary", "text", NULL};
-  int op = luaL_checkoption(L, arg, NULL, modenames);
-  int res = lfs_setmode(f, mode[op]);
-  if (res != -1) {
-    int i;
-    lua_pushboolean(L, 1);
-    for (i = 0; modenames[i] != NULL; i++) {
-      if (mode[i] == res) {
-        lua_pushstring(L, modenames[i]);
+
+
+#ifndef _WIN32
+/*
+** Bulk attributes.
+** Stats are issued as a batch of IORING_OP_STATX operations, or spread over
+** a pool of threads where io_uring is not available. Given the inodes of
+** the paths, as dir:read returns them, each chunk is stat'ed by increasing
+** inode.
+*/
+#define MANY_CHUNK 4096  /* paths stat'ed before building their tables */
+#define MANY_RING  256   /* operations kept in flight */
+
+typedef struct many_job {
+        lfs_State *S;
+        const char **paths;
+        STAT_STRUCT *info;
+        int *err;
+} many_job;
+
+static void many_stat (void *arg, size_t i) {
+        many_job *job = (many_job *)arg;
+        job->err[i] = box_stat (job->S, job->paths[i], 1, &job->info[i]) ? errno : 0;
+}
+
+#ifdef LFS_HAVE_URING
+static void statx2stat (const struct statx *sx, STAT_STRUCT *info) {
+        memset (info, 0, sizeof(STAT_STRUCT));
+        info->st_dev = makedev (sx->stx_dev_major, sx->stx_dev_minor);
+        info->st_ino = (ino_t)sx->stx_ino;
+        info->st_mode = sx->stx_mode;
+        info->st_nlink = sx->stx_nlink;
+        info->st_uid = sx->stx_uid;
+        info->st_gid = sx->stx_gid;
+        info->st_rdev = makedev (sx->stx_rdev_major, sx->stx_rdev_minor);
+        info->st_size = (off_t)sx->stx_size;
+        info->st_blksize = sx->stx_blksize;
+        info->st_blocks = (blkcnt_t)sx->stx_blocks;
+        info->st_atim.tv_sec = sx->stx_atime.tv_sec;
+        info->st_atim.tv_nsec = sx->stx_atime.tv_nsec;
+        info->st_mtim.tv_sec = sx->stx_mtime.tv_sec;
+        info->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+        info->st_ctim.tv_sec = sx->stx_ctime.tv_sec;
+        info->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+
+/* What the operations of a chunk read and write */
+typedef struct many_ring {
+        many_job *job;
+        struct statx *sx;
+        int *res;
+        size_t base;            /* first path of the operations being run */
+#ifdef LFS_HAVE_BOX
+        struct open_how how;
+        int *fd;                /* descriptors, or negative errno values */
+        const char **rel;       /* paths relative to the box */
+        char *joined;           /* relative paths joined to the directory */
+#endif
+} many_ring;
+
+static void many_prep_statx (struct io_uring_sqe *sqe, size_t i, void *arg) {
+        many_ring *m = (many_ring *)arg;
+        i += m->base;
+        sqe->opcode = IORING_OP_STATX;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uint64_t)(uintptr_t)&m->sx[i];
+        sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+#ifdef LFS_HAVE_BOX
+        if (m->fd[i] < 0) {
+                sqe->opcode = IORING_OP_NOP;
+                return;
+        }
+        sqe->fd = m->fd[i];
+        sqe->addr = (uint64_t)(uintptr_t)"";
+        sqe->statx_flags |= AT_EMPTY_PATH;
+#else
+        sqe->fd = m->job->S->cwdfd;
+        sqe->addr = (uint64_t)(uintptr_t)m->job->paths[i];
+#endif
+}
+
+#ifdef LFS_HAVE_BOX
+static void many_prep_open (struct io_uring_sqe *sqe, size_t i, void *arg) {
+        many_ring *m = (many_ring *)arg;
+        i += m->base;
+        sqe->opcode = IORING_OP_OPENAT2;
+        sqe->fd = m->job->S->root;
+        sqe->addr = (uint64_t)(uintptr_t)m->rel[i];
+        sqe->len = sizeof(struct open_how);
+        sqe->off = (uint64_t)(uintptr_t)&m->how;
+}
+
+/*
+** Fills m->rel with the paths of the chunk relative to the box.
+*/
+static int many_rel (many_ring *m, size_t n) {
+        lfs_State *S = m->job->S;
+        size_t i, size = 0;
+        char *p;
+        for (i = 0; i < n; i++)
+                if (m->job->paths[i][0] != '/')
+                        size += S->cwdlen + strlen (m->job->paths[i]) + 2;
+        if (size > 0 && (m->joined = (char *)malloc (size)) == NULL)
+                return -1;
+        for (i = 0, p = m->joined; i < n; i++) {
+                const char *path = m->job->paths[i];
+                if (*path == '/') {
+                        while (*path == '/')
+                                path++;
+                        m->rel[i] = *path ? path : ".";
+                } else if (S->cwdlen == 0 || *path == '\0')
+                        m->rel[i] = path;  /* "" fails as it should */
+                else {
+                        m->rel[i] = p;
+                        memcpy (p, S->cwd, S->cwdlen);
+                        p += S->cwdlen;
+                        *p++ = '/';
+                        strcpy (p, path);
+                        p += strlen (path) + 1;
+                }
+        }
+        return 0;
+}
+#endif
+
+/*
+** Stats n paths through the ring. In the box, paths are opened and stat'ed
+** MANY_RING at a time, so that a chunk does not need a descriptor per path.
+** Returns 0 when every path got a result, -1 if the ring could not be
+** used at all, or 1 if it failed with operations in flight, whose memory
+** is then left allocated. Either way the caller falls back to threads, and
+** must not use the ring again, as its late completions could be taken for
+** those of another chunk.
+*/
+static int many_uring (lfs_Ring *r, many_job *job, size_t n) {
+        many_ring *m = (many_ring *)calloc (1, sizeof(many_ring));
+        size_t i;
+#ifdef LFS_HAVE_BOX
+        size_t base, k;
+#endif
+        int rc = -1;
+        if (m == NULL)
+                return -1;
+        m->job = job;
+        m->sx = (struct statx *)malloc (n * sizeof(struct statx));
+        m->res = (int *)malloc (n * sizeof(int));
+#ifdef LFS_HAVE_BOX
+        m->how.flags = O_PATH | O_CLOEXEC;
+        m->how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        m->fd = (int *)malloc (n * sizeof(int));
+        m->rel = (const char **)malloc (n * sizeof(const char *));
+        if (m->sx == NULL || m->res == NULL || m->fd == NULL || m->rel == NULL || many_rel (m, n) != 0)
+                goto done;
+        for (base = 0, rc = 0; rc == 0 && base < n; base += k) {
+                k = n - base < MANY_RING ? n - base : MANY_RING;
+                m->base = base;
+                if ((rc = ring_run (r, k, many_prep_open, m, m->fd + base)) < 0)
+                        goto done;
+                for (i = base; i < base + k; i++) {
+                        if (m->fd[i] == -EAGAIN) {  /* raced with a rename: retry */
+                                int fd = box_openat (job->S->root, m->rel[i], O_PATH);
+                                m->fd[i] = fd < 0 ? -errno : fd;
+                        } else if (m->fd[i] == -EXDEV)
+                                m->fd[i] = -EACCES;
+                        m->res[i] = -EIO;
+                }
+                if (rc == 0)
+                        rc = ring_run (r, k, many_prep_statx, m, m->res + base);
+                for (i = base; i < base + k; i++) {
+                        if (m->fd[i] < 0)
+                                m->res[i] = m->fd[i];
+                        else
+                                close (m->fd[i]);
+                }
+                if (rc < 0)
+                        goto done;
+        }
+        for (i = base; i < n; i++)
+                m->res[i] = -EIO;  /* the ring failed before their turn */
+#else
+        if (m->sx == NULL || m->res == NULL)
+                goto done;
+        if ((rc = ring_run (r, n, many_prep_statx, m, m->res)) < 0)
+                goto done;
+#endif
+        if (rc > 0)
+                return 1;  /* operations may still be in flight: keep what they use */
+        for (i = 0; i < n; i++) {
+                if (m->res[i] < 0)
+                        job->err[i] = -m->res[i];
+                else {
+                        job->err[i] = 0;
+                        statx2stat (&m->sx[i], &job->info[i]);
+                }
+        }
+done:
+        free (m->sx);
+        free (m->res);
+#ifdef LFS_HAVE_BOX
+        free (m->fd);
+        free (m->rel);
+        free (m->joined);
+#endif
+        free (m);
+        return rc < 0 ? -1 : 0;
+}
+#endif
+
+
+/*
+** Gets the attributes of many files at once.
+** @param #1 Array of file paths.
+** @param #2 Array of attribute names (optional, defaults to all of them).
+** @param #3 Table with options (optional): threads, the size of the thread
+**           pool used without io_uring, uring (false to not use it), and
+**           inodes, an array with the inode of each path.
+** Returns an array with a table of attributes for each path, in the same
+** order, with false where the attributes could not be obtained, and a table
+** with the error messages of these paths, indexed the same way.
+*/
+static int file_info_many (lua_State *L) {
+        unsigned char sel[LFS_MAXFIELDS];
+        int nsel, nthreads, uring, inodes = 0;
+        size_t n, base, i;
+        walk_order *order;
+        many_job job;
+#ifdef LFS_HAVE_URING
+        lfs_Ring ring;
+#endif
+        luaL_checktype (L, 1, LUA_TTABLE);
+        nsel = check_fields (L, 2, sel);
+        nthreads = (int)opt_integer (L, 3, "threads", default_threads ());
+        uring = opt_boolean (L, 3, "uring", 1);
+        luaL_argcheck (L, nthreads > 0 && nthreads <= LFS_MAXTHREADS, 3, "invalid number of threads");
+        job.S = lfs_state (L);
+        n = lua_objlen (L, 1);
+        if (lua_istable (L, 3)) {
+                lua_getfield (L, 3, "inodes");
+                if ((inodes = !lua_isnil (L, -1)) != 0)
+                        luaL_argcheck (L, lua_istable (L, -1), 3, "option 'inodes' must be an array");
+                lua_replace (L, 2);  /* the fields were read */
+        }
+        lua_settop (L, 2);
+        lua_createtable (L, (int)n, 0);  /* results */
+        lua_newtable (L);                /* errors */
+        job.info = (STAT_STRUCT *)lua_newuserdata (L, MANY_CHUNK *
+                        (sizeof(STAT_STRUCT) + sizeof(walk_order) + sizeof(const char *) + sizeof(int)));
+        order = (walk_order *)(job.info + MANY_CHUNK);
+        job.paths = (const char **)(order + MANY_CHUNK);
+        job.err = (int *)(job.paths + MANY_CHUNK);
+#ifdef LFS_HAVE_URING
+        if (!uring || n == 0 || ring_init (&ring, n < MANY_RING ? (unsigned)n : MANY_RING) != 0)
+                uring = 0;
+#else
+        (void)uring;
+#endif
+        for (base = 0; base < n; base += MANY_CHUNK) {
+                size_t m = n - base < MANY_CHUNK ? n - base : MANY_CHUNK;
+                for (i = 0; i < m; i++) {
+                        order[i].i = i;
+                        order[i].ino = 0;
+                        if (inodes) {
+                                lua_rawgeti (L, 2, (int)(base + i + 1));
+                                order[i].ino = (uint64_t)lua_tonumber (L, -1);
+                                lua_pop (L, 1);
+                        }
+                }
+                if (inodes)
+                        qsort (order, m, sizeof(walk_order), walk_order_cmp);
+                for (i = 0; i < m; i++) {
+                        lua_rawgeti (L, 1, (int)(base + order[i].i + 1));
+                        if (lua_type (L, -1) != LUA_TSTRING) {
+#ifdef LFS_HAVE_URING
+                                if (uring)
+                                        ring_free (&ring);
+#endif
+                                return luaL_error (L, "path #%d is not a string", (int)(base + order[i].i + 1));
+                        }
+                        /* the string stays referenced by the array */
+                        job.paths[i] = lua_tostring (L, -1);
+                        lua_pop (L, 1);
+                }
+#ifdef LFS_HAVE_URING
+                if (uring && many_uring (&ring, &job, m) != 0) {
+                        ring_free (&ring);
+                        uring = 0;
+                }
+                if (!uring)
+#endif
+                run_parallel (nthreads, m, many_stat, &job);
+                for (i = 0; i < m; i++) {
+                        if (job.err[i]) {
+                                lua_pushboolean (L, 0);
+                                lua_pushfstring (L, "cannot obtain information from file '%s': %s",
+                                                 job.paths[i], strerror (job.err[i]));
+                                lua_rawseti (L, 4, (int)(base + order[i].i + 1));
+                        } else {
+                                lua_createtable (L, 0, nsel < 0 ? 14 : nsel);
+                                set_fields (L, &job.info[i], sel, nsel);
+                        }
+                        lua_rawseti (L, 3, (int)(base + order[i].i + 1));
+                }
+        }
+#ifdef LFS_HAVE_URING
+        if (uring)
+                ring_free (&ring);
+#endif
+        lua_pop (L, 1);
         return 2;
-      }
-    }
-    lua_pushnil(L);
-    return 2;
-  } else {
-    return pusherror(L, NULL);
-  }
 }
+#endif
 
-static int lfs_f_setmode(lua_State *L) {
-  return lfs_g_setmode(L, check_file(L, 1, "setmode"), 2);
+
+#ifdef LFS_HAVE_URING
+/*
+** Asynchronous operations.
+** lfs.async functions called from a coroutine queue their operation on a
+** ring of their own and yield; lfs.async.poll resumes the coroutine with
+** the results once the operation completes. Completions are signalled on
+** an eventfd for the event loop of the host to wait on. Operations that
+** cannot go through io_uring (not in a coroutine, not supported by the
+** kernel, or no io_uring at all) are carried out at once, without
+** yielding.
+*/
+#define ASYNC_METATABLE "lfs async"
+#define ASYNC_RING      256  /* submission entries */
+
+enum { ASYNC_ATTRIBUTES, ASYNC_MKDIR, ASYNC_RMDIR, ASYNC_REMOVE, ASYNC_RENAME,
+       ASYNC_OPEN, ASYNC_READ, ASYNC_WRITE, ASYNC_CLOSE };
+
+/* by number, as the headers may be older than the kernel, which is probed */
+#define ASYNC_OP_RENAMEAT 35
+#define ASYNC_OP_UNLINKAT 36
+#define ASYNC_OP_MKDIRAT  37
+#define ASYNC_OPS         64  /* opcodes probed */
+
+#ifdef LFS_HAVE_BOX
+#define ASYNC_OP_OPEN IORING_OP_OPENAT2
+#else
+#define ASYNC_OP_OPEN IORING_OP_OPENAT
+#endif
+
+static const int async_opcodes[] = {
+        IORING_OP_STATX, ASYNC_OP_MKDIRAT, ASYNC_OP_UNLINKAT, ASYNC_OP_UNLINKAT,
+        ASYNC_OP_RENAMEAT, ASYNC_OP_OPEN, IORING_OP_READ, IORING_OP_WRITE,
+        IORING_OP_CLOSE
+};
+
+typedef struct async_req {
+        struct async_req *prev, *next;  /* in flight */
+        lfs_State *S;
+        int op;                 /* ASYNC_* */
+        int res;                /* result, -errno on failure */
+        int ref;                /* registry reference of the anchor table */
+        int fd;                 /* read, write and close */
+        int dirfd[2];
+        int owned[2];           /* dirfd[i] must be closed */
+        int flags;
+        mode_t mode;
+        int64_t off;
+        size_t len;
+        const char *data;       /* written data, anchored with the request */
+        struct statx sx;
+#ifdef LFS_HAVE_BOX
+        struct open_how how;
+#endif
+        char path[2][LFS_MAXPATHLEN];  /* relative to dirfd */
+        char orig[LFS_MAXPATHLEN + 1]; /* first path, from the box root */
+        char buf[1];            /* read buffer */
+} async_req;
+
+typedef struct lfs_Async {
+        lfs_Ring ring;
+        int started;            /* set up was tried */
+        int efd;                /* eventfd */
+        int polling;
+        size_t inflight;
+        async_req *queue;       /* operations in flight */
+        unsigned char ops[ASYNC_OPS];  /* supported opcodes */
+} lfs_Async;
+
+#define async_of(L) ((lfs_Async *)lua_touserdata (L, lua_upvalueindex (2)))
+
+/*
+** Enters the ring, submitting what is pending and waiting for wait
+** completions.
+*/
+static int async_enter (lfs_Async *a, unsigned wait) {
+        unsigned n = *a->ring.sq_tail - __atomic_load_n (a->ring.sq_head, __ATOMIC_ACQUIRE);
+        int res;
+        do {
+                res = (int)syscall (__NR_io_uring_enter, a->ring.fd, n, wait,
+                                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        } while (res < 0 && errno == EINTR);
+        return res;
 }
 
 /*
-** Locks a file.
-** @param #1 File handle.
-** @param #2 String with lock mode ('w'rite, 'r'ead).
-** @param #3 Number with start position (optional).
-** @param #4 Number with length (optional).
+** Sets up the ring on first use. Without io_uring the functions run at
+** once and ring.fd stays -1.
 */
-static int file_lock (lua_State *L) {
-        FILE *fh = check_file (L, 1, "lock");
-        const char *mode = luaL_checkstring (L, 2);
-        const long start = (long) luaL_optinteger (L, 3, 0);
-        long len = (long) luaL_optinteger (L, 4, 0);
-        if (_file_lock (L, fh, mode, start, len, "lock")) {
-                lua_pushboolean (L, 1);
-                return 1;
-        } else {
-                lua_pushnil (L);
-                lua_pushfstring (L, "%s", strerror(errno));
-                return 2;
+static lfs_Async *async_get (lua_State *L) {
+        lfs_Async *a = async_of (L);
+        struct io_uring_probe *probe;
+        size_t size = sizeof(struct io_uring_probe) + ASYNC_OPS * sizeof(struct io_uring_probe_op);
+        unsigned i;
+        if (a->started)
+                return a;
+        a->started = 1;
+        if (ring_init (&a->ring, ASYNC_RING) != 0)
+                return a;
+        a->efd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+        probe = (struct io_uring_probe *)calloc (1, size);
+        if (a->efd < 0 || probe == NULL ||
+            syscall (__NR_io_uring_register, a->ring.fd, IORING_REGISTER_EVENTFD, &a->efd, 1) != 0 ||
+            syscall (__NR_io_uring_register, a->ring.fd, IORING_REGISTER_PROBE, probe, ASYNC_OPS) != 0) {
+                free (probe);
+                if (a->efd >= 0)
+                        close (a->efd);
+                a->efd = -1;
+                ring_free (&a->ring);
+                return a;
+        }
+        for (i = 0; i < probe->ops_len && i < ASYNC_OPS; i++)
+                if (probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+                        a->ops[i] = 1;
+        free (probe);
+        return a;
+}
+
+/*
+** Closes the directories held by q, whose results nobody takes, and the
+** file its open produced.
+*/
+static void async_drop (async_req *q) {
+        int i;
+        for (i = 0; i < 2; i++)
+                if (q->owned[i]) {
+                        close (q->dirfd[i]);
+                        q->owned[i] = 0;
+                }
+        if (q->op == ASYNC_OPEN && q->res >= 0) {
+                close (q->res);
+                q->res = -ECANCELED;
         }
 }
 
+static int async_gc (lua_State *L) {
+        lfs_Async *a = (lfs_Async *)luaL_checkudata (L, 1, ASYNC_METATABLE);
+        struct io_uring_sqe *sqe;
+        struct io_uring_cqe *cqe;
+        async_req *q;
+        if (a->ring.fd >= 0) {
+                /* the kernel may still write to the requests: wait for them */
+                for (q = a->queue; q; q = q->next) {
+                        if ((sqe = ring_sqe (&a->ring)) == NULL) {
+                                ring_submit (&a->ring, 0);
+                                if ((sqe = ring_sqe (&a->ring)) == NULL)
+                                        break;
+                        }
+                        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                        sqe->addr = (uint64_t)(uintptr_t)q;
+                }
+                ring_submit (&a->ring, 0);
+                while (a->inflight > 0) {
+                        if ((cqe = ring_cqe (&a->ring)) == NULL) {
+                                if (async_enter (a, 1) < 0)
+                                        break;
+                                continue;
+                        }
+                        if ((q = (async_req *)(uintptr_t)cqe->user_data) != NULL) {
+                                q->res = cqe->res;
+                                async_drop (q);
+                                a->inflight--;
+                        }
+                        ring_seen (&a->ring);
+                }
+                ring_free (&a->ring);
+        }
+        if (a->efd >= 0)
+                close (a->efd);
+        a->efd = -1;
+        return 0;
+}
+
+static void async_create_meta (lua_State *L) {
+        luaL_newmetatable (L, ASYNC_METATABLE);
+        lua_pushcfunction (L, async_gc);
+        lua_setfield (L, -2, "__gc");
+        lua_pop (L, 1);
+}
 
 /*
-** Unlocks a file.
-** @param #1 File handle.
-** @param #2 Number with start position (optional).
-** @param #3 Number with length (optional).
+** Pushes the block of the ring, which is set up on first use.
 */
-static int file_unlock (lua_State *L) {
-        FILE *fh = check_file (L, 1, "unlock");
-        const long start = (long) luaL_optinteger (L, 2, 0);
-        long len = (long) luaL_optinteger (L, 3, 0);
-        if (_file_lock (L, fh, "u", start, len, "unlock")) {
-                lua_pushboolean (L, 1);
-                return 1;
-        } else {
-                lua_pushnil (L);
-                lua_pushfstring (L, "%s", strerror(errno));
-                return 2;
+static void async_create (lua_State *L) {
+        lfs_Async *a = (lfs_Async *)lua_newuserdata (L, sizeof(lfs_Async));
+        memset (a, 0, sizeof(lfs_Async));
+        a->ring.fd = -1;
+        a->efd = -1;
+        luaL_getmetatable (L, ASYNC_METATABLE);
+        lua_setmetatable (L, -2);
+}
+
+/*
+** Pushes a new request with room for len bytes to read.
+*/
+static async_req *async_new (lua_State *L, int op, size_t len) {
+        async_req *q = (async_req *)lua_newuserdata (L, sizeof(async_req) + len);
+        memset (q, 0, sizeof(async_req));
+        q->S = lfs_state (L);
+        q->op = op;
+        q->res = RING_PENDING;
+        q->ref = LUA_NOREF;
+        q->fd = q->dirfd[0] = q->dirfd[1] = -1;
+        q->len = len;
+        return q;
+}
+
+/*
+** Sets the directory and name of the i-th path of an operation that does
+** not follow it. Returns 0, or -1 with errno set.
+*/
+static int async_path (async_req *q, int i, const char *path) {
+#ifdef LFS_HAVE_BOX
+        int fd, cached;
+        if (i == 0) {
+                if (box_path (q->S, path, q->orig + 1) == NULL)
+                        return -1;
+                q->orig[0] = '/';
         }
+        /* the cached descriptor may be closed before the kernel uses it */
+        if ((fd = box_parent (q->S, path, q->path[i], &cached)) >= 0 && cached)
+                fd = fcntl (fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0)
+                return -1;
+        q->dirfd[i] = fd;
+        q->owned[i] = 1;
+#else
+        if (strlen (path) >= LFS_MAXPATHLEN) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        strcpy (q->path[i], path);
+        if (i == 0)
+                strcpy (q->orig, path);
+        q->dirfd[i] = AT_FDCWD;
+        /* the current directory may change before the kernel uses it */
+        if (*path != '/' && q->S->cwdfd >= 0) {
+                if ((q->dirfd[i] = fcntl (q->S->cwdfd, F_DUPFD_CLOEXEC, 0)) < 0)
+                        return -1;
+                q->owned[i] = 1;
+        }
+#endif
+        return 0;
 }
 
+static void async_prep (struct io_uring_sqe *sqe, async_req *q) {
+        sqe->opcode = (uint8_t)async_opcodes[q->op];
+        sqe->fd = q->dirfd[0];
+        sqe->addr = (uint64_t)(uintptr_t)q->path[0];
+        switch (q->op) {
+        case ASYNC_ATTRIBUTES:
+                sqe->len = STATX_BASIC_STATS;
+                sqe->off = (uint64_t)(uintptr_t)&q->sx;
+                sqe->statx_flags = (uint32_t)q->flags;
+                break;
+        case ASYNC_MKDIR:
+                sqe->len = (uint32_t)q->mode;
+                break;
+        case ASYNC_RMDIR:
+        case ASYNC_REMOVE:
+                sqe->rw_flags = (int)q->flags;  /* unlink_flags */
+                break;
+        case ASYNC_RENAME:
+                sqe->len = (uint32_t)q->dirfd[1];
+                sqe->addr2 = (uint64_t)(uintptr_t)q->path[1];
+                break;
+        case ASYNC_OPEN:
+#ifdef LFS_HAVE_BOX
+                sqe->len = sizeof(struct open_how);
+                sqe->off = (uint64_t)(uintptr_t)&q->how;
+#else
+                sqe->open_flags = (uint32_t)q->flags;
+                sqe->len = (uint32_t)q->mode;
+#endif
+                break;
+        case ASYNC_READ:
+        case ASYNC_WRITE:
+                sqe->fd = q->fd;
+                sqe->addr = (uint64_t)(uintptr_t)(q->op == ASYNC_READ ? q->buf : q->data);
+                sqe->len = (uint32_t)q->len;
+                sqe->off = (uint64_t)q->off;
+                break;
+        case ASYNC_CLOSE:
+                sqe->fd = q->fd;
+                sqe->addr = 0;
+                break;
+        }
+}
 
 /*
-** Creates a link.
-** @param #1 Object to link to.
-** @param #2 Name of link.
-** @param #3 True if link is symbolic (optional).
+** Carries out the operation of q at once.
 */
-static int make_link(lua_State *L)
-{
-#ifndef _WIN32
-        const char *oldpath = luaL_checkstring(L, 1);
-        const char *newpath = luaL_checkstring(L, 2);
-        return pushresult(L,
-                (lua_toboolean(L,3) ? symlink : link)(oldpath, newpath), NULL);
+static void async_exec (async_req *q) {
+        long res = -1;
+        switch (q->op) {
+        case ASYNC_ATTRIBUTES:
+                res = statx (q->dirfd[0], q->path[0], q->flags, STATX_BASIC_STATS, &q->sx);
+                break;
+        case ASYNC_MKDIR:
+                res = mkdirat (q->dirfd[0], q->path[0], q->mode);
+                break;
+        case ASYNC_RMDIR:
+        case ASYNC_REMOVE:
+                res = unlinkat (q->dirfd[0], q->path[0], q->flags);
+                break;
+        case ASYNC_RENAME:
+                res = renameat (q->dirfd[0], q->path[0], q->dirfd[1], q->path[1]);
+                break;
+        case ASYNC_OPEN:
+#ifdef LFS_HAVE_BOX
+                res = syscall (SYS_openat2, q->dirfd[0], q->path[0], &q->how, sizeof(q->how));
+#else
+                res = openat (q->dirfd[0], q->path[0], q->flags, q->mode);
+#endif
+                break;
+        case ASYNC_READ:
+                res = q->off < 0 ? read (q->fd, q->buf, q->len) : pread (q->fd, q->buf, q->len, (off_t)q->off);
+                break;
+        case ASYNC_WRITE:
+                res = q->off < 0 ? write (q->fd, q->data, q->len) : pwrite (q->fd, q->data, q->len, (off_t)q->off);
+                break;
+        case ASYNC_CLOSE:
+                res = close (q->fd);
+                break;
+        }
+        q->res = res < 0 ? -errno : (int)res;
+}
+
+/*
+** Pushes the results of the completed operation q.
+*/
+static int async_finish (lua_State *L, async_req *q) {
+        lfs_State *S = q->S;
+        STAT_STRUCT info;
+        int i;
+        for (i = 0; i < 2; i++)
+                if (q->owned[i]) {
+                        close (q->dirfd[i]);
+                        q->owned[i] = 0;
+                }
+        if (q->op == ASYNC_OPEN && q->res == -EAGAIN) {
+                /* raced with a rename: try again at once */
+                async_exec (q);
+        }
+        if (q->op != ASYNC_ATTRIBUTES && q->op != ASYNC_OPEN && q->op != ASYNC_READ)
+                cache_sync (S);
+        if (q->res < 0) {
+                errno = -q->res;
+#ifdef LFS_HAVE_BOX
+                if (q->op == ASYNC_OPEN && errno == EXDEV)
+                        errno = EACCES;  /* the path leads out of the box */
+#endif
+                return pusherror (L, NULL);
+        }
+        switch (q->op) {
+        case ASYNC_ATTRIBUTES:
+                statx2stat (&q->sx, &info);
+#ifdef LFS_HAVE_BOX
+                /* the link is followed from the root, to stay in the box */
+                if (S_ISLNK (info.st_mode) && box_stat (S, q->orig, 1, &info) != 0)
+                        return pusherror (L, NULL);
+#endif
+                lua_createtable (L, 0, 14);
+                set_fields (L, &info, NULL, -1);
+                return 1;
+        case ASYNC_OPEN:
+        case ASYNC_WRITE:
+                lua_pushinteger (L, q->res);
+                return 1;
+        case ASYNC_READ:
+                if (q->res == 0 && q->len > 0)
+                        lua_pushnil (L);  /* end of file */
+                else
+                        lua_pushlstring (L, q->buf, (size_t)q->res);
+                return 1;
+#ifdef LFS_HAVE_BOX
+        case ASYNC_RMDIR:
+        case ASYNC_RENAME:
+                dirfd_invalidate (S, q->orig);
+                break;
+#endif
+        }
+        lua_pushboolean (L, 1);
+        return 1;
+}
+
+#if LUA_VERSION_NUM >= 503
+static int async_cont (lua_State *L, int status, lua_KContext ctx) {
+        async_req *q = (async_req *)lua_touserdata (L, (int)ctx);
+        (void)status;
+        if (q->res == RING_PENDING)
+                return luaL_error (L, "coroutine resumed before its operation completed");
+        return async_finish (L, q);
+}
+#elif LUA_VERSION_NUM == 502
+static int async_cont (lua_State *L) {
+        int ctx = 0;
+        async_req *q;
+        lua_getctx (L, &ctx);
+        q = (async_req *)lua_touserdata (L, ctx);
+        if (q->res == RING_PENDING)
+                return luaL_error (L, "coroutine resumed before its operation completed");
+        return async_finish (L, q);
+}
+#endif
+
+static int async_yieldable (lua_State *L) {
+#if LUA_VERSION_NUM >= 503
+        return lua_isyieldable (L);
+#else
+        int ismain = lua_pushthread (L);
+        lua_pop (L, 1);
+        return !ismain;
+#endif
+}
+
+/*
+** Submits the request on top of the stack and yields, or carries it out
+** at once. data is the index of a value to keep alive with the request,
+** or 0.
+*/
+static int async_start (lua_State *L, async_req *q, int data) {
+        lfs_Async *a = async_get (L);
+        int idx = lua_gettop (L);
+        struct io_uring_sqe *sqe = NULL;
+        if (a->ring.fd >= 0 && a->ops[async_opcodes[q->op]] && async_yieldable (L) &&
+            (sqe = ring_sqe (&a->ring)) == NULL && async_enter (a, 0) >= 0)
+                sqe = ring_sqe (&a->ring);
+        if (sqe == NULL) {
+                async_exec (q);
+                return async_finish (L, q);
+        }
+        lua_createtable (L, 3, 0);
+        lua_pushvalue (L, idx);
+        lua_rawseti (L, -2, 1);
+        lua_pushthread (L);
+        lua_rawseti (L, -2, 2);
+        if (data) {
+                lua_pushvalue (L, data);
+                lua_rawseti (L, -2, 3);
+        }
+        q->ref = luaL_ref (L, LUA_REGISTRYINDEX);
+        async_prep (sqe, q);
+        sqe->user_data = (uint64_t)(uintptr_t)q;
+        /* a failed enter leaves the entry queued for the next one */
+        ring_submit (&a->ring, 0);
+        q->next = a->queue;
+        q->prev = NULL;
+        if (a->queue)
+                a->queue->prev = q;
+        a->queue = q;
+        a->inflight++;
+#if LUA_VERSION_NUM >= 503
+        return lua_yieldk (L, 0, (lua_KContext)idx, async_cont);
+#elif LUA_VERSION_NUM == 502
+        return lua_yieldk (L, 0, idx, async_cont);
 #else
-        errno = ENOSYS; /* = "Function not implemented" */
-        return pushresult(L, -1, "make_link is not supported on Windows");
+        return lua_yield (L, 0);
 #endif
 }
 
 
 /*
-** Creates a directory.
-** @param #1 Directory path.
+** Gets the attributes of a file, following symbolic links.
+** @param #1 File path.
 */
-static int make_dir (lua_State *L) {
+static int async_attributes (lua_State *L) {
         const char *path = luaL_checkstring (L, 1);
-        int fail;
-#ifdef _WIN32
-        fail = _mkdir (path);
+        async_req *q = async_new (L, ASYNC_ATTRIBUTES, 0);
+#ifdef LFS_HAVE_BOX
+        q->flags = AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT;
 #else
-        fail =  mkdir (path, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP |
-                             S_IWGRP | S_IXGRP | S_IROTH | S_IXOTH );
+        q->flags = AT_STATX_SYNC_AS_STAT;
 #endif
-        if (fail) {
-                lua_pushnil (L);
-        lua_pushfstring (L, "%s", strerror(errno));
-                return 2;
-        }
-        lua_pushboolean (L, 1);
-        return 1;
+        if (async_path (q, 0, path) != 0)
+                return pusherror (L, NULL);
+        return async_start (L, q, 0);
 }
 
-
 /*
-** Removes a directory.
+** Creates a directory.
 ** @param #1 Directory path.
 */
-static int remove_dir (lua_State *L) {
+static int async_mkdir (lua_State *L) {
         const char *path = luaL_checkstring (L, 1);
-        int fail;
+        async_req *q = async_new (L, ASYNC_MKDIR, 0);
+        q->mode = S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP | S_IROTH | S_IXOTH;
+        if (async_path (q, 0, path) != 0)
+                return pusherror (L, NULL);
+        return async_start (L, q, 0);
+}
 
-        fail = rmdir (path);
+/*
+** Removes a directory, or a file with remove.
+** @param #1 Path.
+*/
+static int async_unlink (lua_State *L, int op) {
+        const char *path = luaL_checkstring (L, 1);
+        async_req *q = async_new (L, op, 0);
+        q->flags = op == ASYNC_RMDIR ? AT_REMOVEDIR : 0;
+        if (async_path (q, 0, path) != 0)
+                return pusherror (L, NULL);
+        return async_start (L, q, 0);
+}
 
-        if (fail) {
-                lua_pushnil (L);
-                lua_pushfstring (L, "%s", strerror(errno));
-                return 2;
-        }
-        lua_pushboolean (L, 1);
-        return 1;
+static int async_rmdir (lua_State *L) {
+        return async_unlink (L, ASYNC_RMDIR);
 }
 
+static int async_remove (lua_State *L) {
+        return async_unlink (L, ASYNC_REMOVE);
+}
 
 /*
-** Directory iterator
+** Renames a file or directory.
+** @param #1 Old path.
+** @param #2 New path.
 */
-static int dir_iter (lua_State *L) {
-#ifdef _WIN32
-        struct _finddata_t c_file;
-#else
-        struct dirent *entry;
-#endif
-        dir_data *d = (dir_data *)luaL_checkudata (L, 1, DIR_METATABLE);
-        luaL_argcheck (L, d->closed == 0, 1, "closed directory");
-#ifdef _WIN32
-        if (d->hFile == 0L) { /* first entry */
-                if ((d->hFile = _findfirst (d->pattern, &c_file)) == -1L) {
-                        lua_pushnil (L);
-                        lua_pushstring (L, strerror (errno));
-                        d->closed = 1;
-                        return 2;
-                } else {
-                        lua_pushstring (L, c_file.name);
-                        return 1;
-                }
-        } else { /* next entry */
-                if (_findnext (d->hFile, &c_file) == -1L) {
-                        /* no more entries => close directory */
-                        _findclose (d->hFile);
-                        d->closed = 1;
-                        return 0;
-                } else {
-                        lua_pushstring (L, c_file.name);
-                        return 1;
-                }
-        }
-#else
-        if ((entry = readdir (d->dir)) != NULL) {
-                lua_pushstring (L, entry->d_name);
-                return 1;
-        } else {
-                /* no more entries => close directory */
-                closedir (d->dir);
-                d->closed = 1;
-                return 0;
+static int async_rename (lua_State *L) {
+        const char *oldpath = luaL_checkstring (L, 1);
+        const char *newpath = luaL_checkstring (L, 2);
+        async_req *q = async_new (L, ASYNC_RENAME, 0);
+        if (async_path (q, 0, oldpath) != 0 || async_path (q, 1, newpath) != 0) {
+                int en = errno;
+                if (q->owned[0])
+                        close (q->dirfd[0]);
+                q->owned[0] = 0;
+                errno = en;
+                return pusherror (L, NULL);
         }
-#endif
+        return async_start (L, q, 0);
 }
 
-
 /*
-** Closes directory iterators
+** Opens a file.
+** @param #1 File path.
+** @param #2 Mode, as in io.open (optional, defaults to "r").
+** Returns the file descriptor, to be closed with lfs.async.close.
 */
-static int dir_close (lua_State *L) {
-        dir_data *d = (dir_data *)lua_touserdata (L, 1);
-#ifdef _WIN32
-        if (!d->closed && d->hFile) {
-                _findclose (d->hFile);
+static int async_open (lua_State *L) {
+        const char *path = luaL_checkstring (L, 1);
+        const char *mode = luaL_optstring (L, 2, "r"), *m = mode + 1;
+        async_req *q;
+        int flags;
+        switch (mode[0]) {
+        case 'r': flags = 0; break;
+        case 'w': flags = O_CREAT | O_TRUNC; break;
+        case 'a': flags = O_CREAT | O_APPEND; break;
+        default: return luaL_argerror (L, 2, "invalid mode");
         }
+        if (*m == '+') {
+                flags |= O_RDWR;
+                m++;
+        } else if (mode[0] != 'r')
+                flags |= O_WRONLY;
+        while (*m == 'b')
+                m++;
+        luaL_argcheck (L, *m == '\0', 2, "invalid mode");
+        q = async_new (L, ASYNC_OPEN, 0);
+        q->flags = flags | O_CLOEXEC;
+        if (flags & O_CREAT)  /* openat2 refuses a mode otherwise */
+                q->mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+#ifdef LFS_HAVE_BOX
+        q->how.flags = (uint64_t)q->flags;
+        q->how.mode = q->mode;
+        q->how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        q->dirfd[0] = q->S->root;
+        if (box_path (q->S, path, q->path[0]) == NULL)
+                return pusherror (L, NULL);
 #else
-        if (!d->closed && d->dir) {
-                closedir (d->dir);
-        }
+        if (async_path (q, 0, path) != 0)
+                return pusherror (L, NULL);
 #endif
-        d->closed = 1;
-        return 0;
+        return async_start (L, q, 0);
 }
 
+static int check_fd (lua_State *L, int idx) {
+        lua_Integer fd = luaL_checkinteger (L, idx);
+        luaL_argcheck (L, fd >= 0 && fd <= 0x7fffffff, idx, "invalid file descriptor");
+        return (int)fd;
+}
 
 /*
-** Factory of directory iterators
+** Reads from a file descriptor.
+** @param #1 File descriptor.
+** @param #2 Number of bytes.
+** @param #3 Offset (optional, defaults to the current position).
+** Returns the data read, or nil at the end of the file.
 */
-static int dir_iter_factory (lua_State *L) {
-        const char *path = luaL_checkstring (L, 1);
-        dir_data *d;
-        lua_pushcfunction (L, dir_iter);
-        d = (dir_data *) lua_newuserdata (L, sizeof(dir_data));
-        luaL_getmetatable (L, DIR_METATABLE);
-        lua_setmetatable (L, -2);
-        d->closed = 0;
-#ifdef _WIN32
-        d->hFile = 0L;
-        if (strlen(path) > MAX_PATH-2)
-          luaL_error (L, "path too long: %s", path);
-        else
-          sprintf (d->pattern, "%s/*", path);
-#else
-        d->dir = opendir (path);
-        if (d->dir == NULL)
-          luaL_error (L, "cannot open %s: %s", path, strerror (errno));
-#endif
-        return 2;
+static int async_read (lua_State *L) {
+        int fd = check_fd (L, 1);
+        lua_Integer len = luaL_checkinteger (L, 2);
+        lua_Integer off = luaL_optinteger (L, 3, -1);
+        async_req *q;
+        luaL_argcheck (L, len >= 0 && len <= 0x7fffffff, 2, "invalid size");
+        q = async_new (L, ASYNC_READ, (size_t)len);
+        q->fd = fd;
+        q->off = off < 0 ? -1 : (int64_t)off;
+        return async_start (L, q, 0);
 }
 
+/*
+** Writes to a file descriptor.
+** @param #1 File descriptor.
+** @param #2 Data.
+** @param #3 Offset (optional, defaults to the current position).
+** Returns the number of bytes written.
+*/
+static int async_write (lua_State *L) {
+        int fd = check_fd (L, 1);
+        size_t len;
+        const char *data = luaL_checklstring (L, 2, &len);
+        lua_Integer off = luaL_optinteger (L, 3, -1);
+        async_req *q;
+        luaL_argcheck (L, len <= 0x7fffffff, 2, "too much data");
+        q = async_new (L, ASYNC_WRITE, 0);
+        q->fd = fd;
+        q->data = data;
+        q->len = len;
+        q->off = off < 0 ? -1 : (int64_t)off;
+        return async_start (L, q, 2);
+}
 
 /*
-** Creates directory metatable.
+** Closes a file descriptor.
+** @param #1 File descriptor.
 */
-static int dir_create_meta (lua_State *L) {
-        luaL_newmetatable (L, DIR_METATABLE);
+static int async_close (lua_State *L) {
+        int fd = check_fd (L, 1);
+        async_req *q = async_new (L, ASYNC_CLOSE, 0);
+        q->fd = fd;
+        return async_start (L, q, 0);
+}
 
-        /* Method table */
-        lua_newtable(L);
-        lua_pushcfunction (L, dir_iter);
-        lua_setfield(L, -2, "next");
-        lua_pushcfunction (L, dir_close);
-        lua_setfield(L, -2, "close");
+/*
+** Resumes the coroutines whose operations completed.
+** @param #1 True to wait for a completion if there is none yet (optional).
+** Returns the number of coroutines resumed.
+*/
+static int async_poll (lua_State *L) {
+        lfs_Async *a = async_get (L);
+        int wait = lua_toboolean (L, 1), top = lua_gettop (L), n = 0, status;
+        struct io_uring_cqe *cqe;
+        async_req *q;
+        lua_State *co;
+        uint64_t count;
+        if (a->ring.fd < 0 || a->inflight == 0) {
+                lua_pushinteger (L, 0);
+                return 1;
+        }
+        if (a->polling)
+                return luaL_error (L, "lfs.async.poll is not reentrant");
+        if (read (a->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                return pusherror (L, "cannot read the eventfd");
+        if ((ring_cqe (&a->ring) == NULL && async_enter (a, wait ? 1 : 0) < 0) && errno != EBUSY)
+                return pusherror (L, "cannot enter the ring");
+        a->polling = 1;
+        while ((cqe = ring_cqe (&a->ring)) != NULL) {
+                q = (async_req *)(uintptr_t)cqe->user_data;
+                q->res = cqe->res;
+                ring_seen (&a->ring);
+                if (q->prev) q->prev->next = q->next; else a->queue = q->next;
+                if (q->next) q->next->prev = q->prev;
+                a->inflight--;
+                lua_rawgeti (L, LUA_REGISTRYINDEX, q->ref);
+                lua_rawgeti (L, -1, 2);
+                co = lua_tothread (L, -1);
+                luaL_unref (L, LUA_REGISTRYINDEX, q->ref);
+                q->ref = LUA_NOREF;
+                if (lua_status (co) != LUA_YIELD) {
+                        /* resumed by someone else: nobody waits for it */
+                        async_drop (q);
+                        lua_settop (L, top);
+                        continue;
+                }
+#if LUA_VERSION_NUM >= 502
+                status = lua_resume (co, L, 0);
+#else
+                status = lua_resume (co, async_finish (co, q));
+#endif
+                n++;
+                if (status != 0 && status != LUA_YIELD) {
+                        a->polling = 0;
+                        lua_xmove (co, L, 1);
+                        return lua_error (L);
+                }
+                lua_settop (L, top);
+        }
+        a->polling = 0;
+        lua_pushinteger (L, n);
+        return 1;
+}
 
-        /* Metamethods */
-        lua_setfield(L, -2, "__index");
-        lua_pushcfunction (L, dir_close);
-        lua_setfield (L, -2, "__gc");
+/*
+** Returns the eventfd signalled when operations complete.
+*/
+static int async_eventfd (lua_State *L) {
+        lfs_Async *a = async_get (L);
+        if (a->ring.fd < 0)
+                return pusherror (L, "io_uring is not available");
+        lua_pushinteger (L, a->efd);
         return 1;
 }
 
+static const struct luaL_Reg asynclib[] = {
+        {"attributes", async_attributes},
+        {"close", async_close},
+        {"eventfd", async_eventfd},
+        {"mkdir", async_mkdir},
+        {"open", async_open},
+        {"poll", async_poll},
+        {"read", async_read},
+        {"remove", async_remove},
+        {"rename", async_rename},
+        {"rmdir", async_rmdir},
+        {"write", async_write},
+        {NULL, NULL},
+};
+#endif
+
+
 
+#ifndef _WIN32
 /*
-** Creates lock metatable.
+** Stat objects.
+** lfs.stat returns a userdata holding the raw result of statx; fields are
+** converted only when they are read, through a name to field table kept as
+** the upvalue of __index.
 */
-static int lock_create_meta (lua_State *L) {
-        luaL_newmetatable (L, LOCK_METATABLE);
+#define STAT_METATABLE "stat metatable"
 
-        /* Method table */
-        lua_newtable(L);
-        lua_pushcfunction(L, lfs_unlock_dir);
-        lua_setfield(L, -2, "free");
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+#define LFS_HAVE_STATX
+typedef struct statx lfs_statx;
+typedef struct statx_timestamp lfs_statx_timestamp;
+#define stx_dev_of(sx)  makedev ((sx)->stx_dev_major, (sx)->stx_dev_minor)
+#define stx_rdev_of(sx) makedev ((sx)->stx_rdev_major, (sx)->stx_rdev_minor)
+#else
+/* The parts of struct statx that can be filled from stat */
+#define STATX_TYPE   0x0001U
+#define STATX_MODE   0x0002U
+#define STATX_NLINK  0x0004U
+#define STATX_UID    0x0008U
+#define STATX_GID    0x0010U
+#define STATX_ATIME  0x0020U
+#define STATX_MTIME  0x0040U
+#define STATX_CTIME  0x0080U
+#define STATX_INO    0x0100U
+#define STATX_SIZE   0x0200U
+#define STATX_BLOCKS 0x0400U
+#define STATX_BASIC_STATS 0x07ffU
+#define STATX_BTIME  0x0800U
+typedef struct lfs_statx_timestamp {
+        int64_t tv_sec;
+        uint32_t tv_nsec;
+} lfs_statx_timestamp;
+typedef struct lfs_statx {
+        uint32_t stx_mask;
+        uint32_t stx_blksize;
+        uint32_t stx_nlink;
+        uint32_t stx_uid;
+        uint32_t stx_gid;
+        mode_t   stx_mode;
+        uint64_t stx_ino;
+        uint64_t stx_size;
+        uint64_t stx_blocks;
+        lfs_statx_timestamp stx_atime, stx_btime, stx_ctime, stx_mtime;
+        dev_t    stx_rdev, stx_dev;
+} lfs_statx;
+#define stx_dev_of(sx)  ((sx)->stx_dev)
+#define stx_rdev_of(sx) ((sx)->stx_rdev)
+#endif
 
-        /* Metamethods */
-        lua_setfield(L, -2, "__index");
-        lua_pushcfunction(L, lfs_unlock_dir);
-        lua_setfield(L, -2, "__gc");
-        return 1;
-}
+typedef struct stat_data {
+        unsigned int want;  /* STATX_* bits asked for */
+        lfs_statx sx;
+} stat_data;
 
+enum {
+        SF_MODE, SF_DEV, SF_INO, SF_NLINK, SF_UID, SF_GID, SF_RDEV,
+        SF_ACCESS, SF_MODIFICATION, SF_CHANGE, SF_SIZE, SF_PERMISSIONS,
+        SF_BLOCKS, SF_BLKSIZE, SF_BIRTH,
+        SF_ACCESS_NS, SF_MODIFICATION_NS, SF_CHANGE_NS, SF_BIRTH_NS
+};
+
+static const struct {
+        const char *name;
+        unsigned int mask;  /* STATX_* bit the field depends on, 0 if none */
+} stat_fields[] = {
+        { "mode",            STATX_TYPE },
+        { "dev",             0 },
+        { "ino",             STATX_INO },
+        { "nlink",           STATX_NLINK },
+        { "uid",             STATX_UID },
+        { "gid",             STATX_GID },
+        { "rdev",            0 },
+        { "access",          STATX_ATIME },
+        { "modification",    STATX_MTIME },
+        { "change",          STATX_CTIME },
+        { "size",            STATX_SIZE },
+        { "permissions",     STATX_MODE },
+        { "blocks",          STATX_BLOCKS },
+        { "blksize",         0 },
+        { "birth",           STATX_BTIME },
+        { "access_ns",       STATX_ATIME },
+        { "modification_ns", STATX_MTIME },
+        { "change_ns",       STATX_CTIME },
+        { "birth_ns",        STATX_BTIME },
+        { NULL, 0 }
+};
+
+static void push_ns (lua_State *L, const lfs_statx_timestamp *ts) {
+        lua_pushinteger (L, (lua_Integer)ts->tv_sec * 1000000000 + (lua_Integer)ts->tv_nsec);
+}
 
-#ifdef _WIN32
- #ifndef S_ISDIR
-   #define S_ISDIR(mode)  (mode&_S_IFDIR)
- #endif
- #ifndef S_ISREG
-   #define S_ISREG(mode)  (mode&_S_IFREG)
- #endif
- #ifndef S_ISLNK
-   #define S_ISLNK(mode)  (0)
- #endif
- #ifndef S_ISSOCK
-   #define S_ISSOCK(mode)  (0)
- #endif
- #ifndef S_ISFIFO
-   #define S_ISFIFO(mode)  (0)
- #endif
- #ifndef S_ISCHR
-   #define S_ISCHR(mode)  (mode&_S_IFCHR)
- #endif
- #ifndef S_ISBLK
-   #define S_ISBLK(mode)  (0)
- #endif
-#endif
 /*
-** Convert the inode protection mode to a string.
+** Fills a stat object, following symbolic links.
+** Returns 0 on success, -1 with errno set on failure.
 */
-#ifdef _WIN32
-static const char *mode2string (unsigned short mode) {
+static int stat_fill (lfs_State *S, const char *path, stat_data *s) {
+#if defined(LFS_HAVE_STATX) && defined(LFS_HAVE_BOX)
+        char name[NAME_MAX + 1];
+        int fd, cached, res;
+        do {
+                fd = box_parent (S, path, name, &cached);
+                res = fd < 0 ? -1 : statx (fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT,
+                                           s->want | STATX_TYPE, &s->sx);
+        } while (box_done (S, fd, cached, res));
+        if (res != 0 || !S_ISLNK (s->sx.stx_mode))
+                return res;
+        /* follow the link, confined from the root */
+        if ((fd = box_open (S, path, O_PATH)) < 0)
+                return -1;
+        if (statx (fd, "", AT_EMPTY_PATH | AT_STATX_SYNC_AS_STAT, s->want, &s->sx) != 0)
+                return close_keep_errno (fd);
+        close (fd);
+        return 0;
+#elif defined(LFS_HAVE_STATX)
+        return statx (S->cwdfd, path, AT_STATX_SYNC_AS_STAT, s->want, &s->sx);
 #else
-static const char *mode2string (mode_t mode) {
+        STAT_STRUCT info;
+        lfs_statx *sx = &s->sx;
+        if (box_fstatat (S, path, 1, &info))
+                return -1;
+        sx->stx_mask = STATX_BASIC_STATS;
+        sx->stx_blksize = (uint32_t)info.st_blksize;
+        sx->stx_nlink = (uint32_t)info.st_nlink;
+        sx->stx_uid = (uint32_t)info.st_uid;
+        sx->stx_gid = (uint32_t)info.st_gid;
+        sx->stx_mode = info.st_mode;
+        sx->stx_ino = (uint64_t)info.st_ino;
+        sx->stx_size = (uint64_t)info.st_size;
+        sx->stx_blocks = (uint64_t)info.st_blocks;
+        sx->stx_atime.tv_sec = info.st_atime;
+        sx->stx_mtime.tv_sec = info.st_mtime;
+        sx->stx_ctime.tv_sec = info.st_ctime;
+        sx->stx_atime.tv_nsec = sx->stx_mtime.tv_nsec = sx->stx_ctime.tv_nsec = 0;
+        sx->stx_btime.tv_sec = 0;
+        sx->stx_btime.tv_nsec = 0;
+        sx->stx_rdev = info.st_rdev;
+        sx->stx_dev = info.st_dev;
+        return 0;
 #endif
-  if ( S_ISREG(mode) )
-    return "file";
-  else if ( S_ISDIR(mode) )
-    return "directory";
-  else if ( S_ISLNK(mode) )
-        return "link";
-  else if ( S_ISSOCK(mode) )
-    return "socket";
-  else if ( S_ISFIFO(mode) )
-        return "named pipe";
-  else if ( S_ISCHR(mode) )
-        return "char device";
-  else if ( S_ISBLK(mode) )
-        return "block device";
-  else
-        return "other";
 }
 
 
 /*
-** Set access time and modification values for file
+** Reads a field of a stat object.
+** @param #1 Stat object.
+** @param #2 Field name.
+** Fields the system did not fill in are nil.
 */
-static int file_utime (lua_State *L) {
-        const char *file = luaL_checkstring (L, 1);
-        struct utimbuf utb, *buf;
+static int stat_index (lua_State *L) {
+        stat_data *s = (stat_data *)luaL_checkudata (L, 1, STAT_METATABLE);
+        const lfs_statx *sx = &s->sx;
+        char perms[PERMS_LEN];
+        int field;
+        lua_settop (L, 2);
+        lua_rawget (L, lua_upvalueindex (1));
+        if (!lua_isnumber (L, -1))
+                return luaL_error (L, "invalid attribute name '%s'", lua_tostring (L, 2));
+        field = (int)lua_tointeger (L, -1);
+        if (stat_fields[field].mask && !(sx->stx_mask & stat_fields[field].mask))
+                return 0;
+        switch (field) {
+                case SF_MODE:
+                        lua_pushstring (L, mode2string (sx->stx_mode));
+                        break;
+                case SF_DEV:
+                        lua_pushinteger (L, (lua_Integer)stx_dev_of (sx));
+                        break;
+                case SF_INO:
+                        lua_pushinteger (L, (lua_Integer)sx->stx_ino);
+                        break;
+                case SF_NLINK:
+                        lua_pushinteger (L, (lua_Integer)sx->stx_nlink);
+                        break;
+                case SF_UID:
+                        lua_pushinteger (L, (lua_Integer)sx->stx_uid);
+                        break;
+                case SF_GID:
+                        lua_pushinteger (L, (lua_Integer)sx->stx_gid);
+                        break;
+                case SF_RDEV:
+                        lua_pushinteger (L, (lua_Integer)stx_rdev_of (sx));
+                        break;
+                case SF_ACCESS:
+                        lua_pushinteger (L, (lua_Integer)sx->stx_atime.tv_sec);
+                        break;
+                case SF_MODIFICATION:
+                        lua_pushinteger (L, (lua_Integer)sx->stx_mtime.tv_sec);
+                        break;
+                case SF_CHANGE:
+                        lua_pushinteger (L, (lua_Integer)sx->stx_ctime.tv_sec);
+                        break;
+                case SF_SIZE:
+                        lua_pushinteger (L, (lua_Integer)sx->stx_size);
+                        break;
+                case SF_PERMISSIONS:
+                        lua_pushstring (L, perm2string (sx->stx_mode, perms));
+                        break;
+                case SF_BLOCKS:
+                        lua_pushinteger (L, (lua_Integer)sx->stx_blocks);
+                        break;
+                case SF_BLKSIZE:
+                        lua_pushinteger (L, (lua_Integer)sx->stx_blksize);
+                        break;
+                case SF_BIRTH:
+                        lua_pushinteger (L, (lua_Integer)sx->stx_btime.tv_sec);
+                        break;
+                case SF_ACCESS_NS:
+                        push_ns (L, &sx->stx_atime);
+                        break;
+                case SF_MODIFICATION_NS:
+                        push_ns (L, &sx->stx_mtime);
+                        break;
+                case SF_CHANGE_NS:
+                        push_ns (L, &sx->stx_ctime);
+                        break;
+                case SF_BIRTH_NS:
+                        push_ns (L, &sx->stx_btime);
+                        break;
+        }
+        return 1;
+}
 
-        if (lua_gettop (L) == 1) /* set to current date/time */
-                buf = NULL;
-        else {
-                utb.actime = (time_t)luaL_optnumber (L, 2, 0);
-                utb.modtime = (time_t) luaL_optinteger (L, 3, utb.actime);
-                buf = &utb;
+
+/*
+** Get file information as a stat object.
+** @param #1 File path.
+** @param #2 Array of field names (optional). Only what these fields need is
+**           asked from the file system; by default all of them.
+*/
+static int file_stat (lua_State *L) {
+        const char *file = luaL_checkstring (L, 1);
+        unsigned int want = STATX_BASIC_STATS | STATX_BTIME;
+        stat_data *s;
+        if (!lua_isnoneornil (L, 2)) {
+                int n, i;
+                luaL_checktype (L, 2, LUA_TTABLE);
+                want = 0;
+                for (n = 1; ; n++) {
+                        const char *name;
+                        lua_rawgeti (L, 2, n);
+                        if (lua_isnil (L, -1))
+                                break;
+                        name = luaL_checkstring (L, -1);
+                        for (i = 0; stat_fields[i].name; i++)
+                                if (strcmp (stat_fields[i].name, name) == 0)
+                                        break;
+                        if (stat_fields[i].name == NULL)
+                                return luaL_error (L, "invalid attribute name '%s'", name);
+                        want |= stat_fields[i].mask;
+                        lua_pop (L, 1);
+                }
         }
-        if (utime (file, buf)) {
+        s = (stat_data *)lua_newuserdata (L, sizeof(stat_data));
+        s->want = want;
+        if (stat_fill (lfs_state (L), file, s)) {
                 lua_pushnil (L);
-                lua_pushfstring (L, "%s", strerror (errno));
+                lua_pushfstring (L, "cannot obtain information from file '%s': %s", file, strerror (errno));
                 return 2;
         }
-        lua_pushboolean (L, 1);
+        luaL_getmetatable (L, STAT_METATABLE);
+        lua_setmetatable (L, -2);
         return 1;
 }
-
-
-/* inode protection mode */
-static void push_st_mode (lua_State *L, STAT_STRUCT *info) {
-        lua_pushstring (L, mode2string (info->st_mode));
-}
-/* device inode resides on */
-static void push_st_dev (lua_State *L, STAT_STRUCT *info) {
-        lua_pushinteger (L, (lua_Integer) info->st_dev);
-}
-/* inode's number */
-static void push_st_ino (lua_State *L, STAT_STRUCT *info) {
-        lua_pushinteger (L, (lua_Integer) info->st_ino);
-}
-/* number of hard links to the file */
-static void push_st_nlink (lua_State *L, STAT_STRUCT *info) {
-        lua_pushinteger (L, (lua_Integer)info->st_nlink);
-}
-/* user-id of owner */
-static void push_st_uid (lua_State *L, STAT_STRUCT *info) {
-        lua_pushinteger (L, (lua_Integer)info->st_uid);
-}
-/* group-id of owner */
-static void push_st_gid (lua_State *L, STAT_STRUCT *info) {
-        lua_pushinteger (L, (lua_Integer)info->st_gid);
-}
-/* device type, for special file inode */
-static void push_st_rdev (lua_State *L, STAT_STRUCT *info) {
-        lua_pushinteger (L, (lua_Integer) info->st_rdev);
+
+
+static void stat_create_meta (lua_State *L) {
+        int i;
+        luaL_newmetatable (L, STAT_METATABLE);
+
+        /* Field name to field number */
+        lua_newtable (L);
+        for (i = 0; stat_fields[i].name; i++) {
+                lua_pushinteger (L, i);
+                lua_setfield (L, -2, stat_fields[i].name);
+        }
+
+        /* Metamethods */
+        lua_pushcclosure (L, stat_index, 1);
+        lua_setfield (L, -2, "__index");
+        lua_pop (L, 1);
 }
-/* time of last access */
-static void push_st_atime (lua_State *L, STAT_STRUCT *info) {
-        lua_pushinteger (L, (lua_Integer) info->st_atime);
+#endif
+
+
+#ifdef LFS_HAVE_INOTIFY
+/*
+** Watchers.
+** lfs.watch puts inotify watches on a path and, when recursive, on every
+** directory below it, adding the watches of directories created or moved
+** in as their events are read and dropping those of directories moved
+** out. Events are kept in a queue until they are read; repeated events of
+** the same kind on a path that are still queued are merged into one, so a
+** burst of writes to a file costs a single entry. fanotify is not used:
+** it needs CAP_SYS_ADMIN.
+*/
+#define WATCH_METATABLE "watcher metatable"
+#define WATCH_BUCKETS   1024   /* of the table of events that may be merged */
+#define WATCH_MAXQUEUED 65536  /* events queued before the kernel keeps them */
+#define WATCH_MERGE     (IN_ACCESS | IN_ATTRIB | IN_CLOSE_NOWRITE | IN_CLOSE_WRITE | \
+                         IN_MODIFY | IN_OPEN)
+#define WATCH_DEFAULT   (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+                         IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+
+static const struct {
+        const char *name;
+        uint32_t mask;
+} watch_kinds[] = {
+        {"access", IN_ACCESS},
+        {"attrib", IN_ATTRIB},
+        {"close_nowrite", IN_CLOSE_NOWRITE},
+        {"close_write", IN_CLOSE_WRITE},
+        {"create", IN_CREATE},
+        {"delete", IN_DELETE},
+        {"delete_self", IN_DELETE_SELF},
+        {"modify", IN_MODIFY},
+        {"move_self", IN_MOVE_SELF},
+        {"moved_from", IN_MOVED_FROM},
+        {"moved_to", IN_MOVED_TO},
+        {"open", IN_OPEN},
+        {"overflow", IN_Q_OVERFLOW},
+        {NULL, 0}
+};
+
+typedef struct watch_dir {
+        struct watch_dir *next;  /* hash chain by watch descriptor */
+        int wd;
+        char path[1];            /* relative to the watched path, "" for itself */
+} watch_dir;
+
+typedef struct watch_event {
+        struct watch_event *next;   /* queue order */
+        struct watch_event *hnext;  /* chain by path, while it may be merged */
+        size_t hash;
+        uint32_t kind;              /* one of watch_kinds */
+        uint32_t cookie;            /* pairs moved_from and moved_to */
+        int isdir;
+        int merging;
+        lua_Integer count;          /* events merged into this one */
+        char path[1];
+} watch_event;
+
+typedef struct lfs_Watch {
+        int fd;                  /* inotify, -1 once closed */
+        int root;                /* the box, or -1 */
+        int recursive;
+        int lost;                /* events were dropped for lack of memory */
+        uint32_t mask;           /* events reported */
+        watch_dir **dirs;
+        size_t ndirs, dirmask;
+        watch_event *head, *tail;
+        size_t queued;
+        watch_event **merge;     /* queued events that later ones may join */
+        char *buf;               /* to read directories */
+        char *name;              /* the watched path as given */
+        char *base;              /* the same, relative to root or absolute */
+} lfs_Watch;
+
+static watch_dir *watch_find (lfs_Watch *w, int wd) {
+        watch_dir *d = w->dirs[(size_t)wd & w->dirmask];
+        while (d && d->wd != wd)
+                d = d->next;
+        return d;
 }
-/* time of last data modification */
-static void push_st_mtime (lua_State *L, STAT_STRUCT *info) {
-        lua_pushinteger (L, (lua_Integer) info->st_mtime);
+
+static void watch_forget (lfs_Watch *w, watch_dir *d) {
+        watch_dir **p = &w->dirs[(size_t)d->wd & w->dirmask];
+        while (*p != d)
+                p = &(*p)->next;
+        *p = d->next;
+        w->ndirs--;
+        free (d);
 }
-/* time of last file status change */
-static void push_st_ctime (lua_State *L, STAT_STRUCT *info) {
-        lua_pushinteger (L, (lua_Integer) info->st_ctime);
+
+/*
+** Records that wd watches the directory rel.
+** Returns 0, or -1 with errno set.
+*/
+static int watch_set_dir (lfs_Watch *w, int wd, const char *rel) {
+        size_t len = strlen (rel);
+        watch_dir *d = watch_find (w, wd);
+        if (d)  /* the same directory, reached again */
+                watch_forget (w, d);
+        if (w->ndirs >= 2 * (w->dirmask + 1)) {
+                size_t n = 2 * (w->dirmask + 1), i;
+                watch_dir **dirs = (watch_dir **)calloc (n, sizeof(watch_dir *));
+                if (dirs == NULL)
+                        return -1;
+                for (i = 0; i <= w->dirmask; i++)
+                        while ((d = w->dirs[i]) != NULL) {
+                                w->dirs[i] = d->next;
+                                d->next = dirs[(size_t)d->wd & (n - 1)];
+                                dirs[(size_t)d->wd & (n - 1)] = d;
+                        }
+                free (w->dirs);
+                w->dirs = dirs;
+                w->dirmask = n - 1;
+        }
+        if ((d = (watch_dir *)malloc (sizeof(watch_dir) + len)) == NULL)
+                return -1;
+        d->wd = wd;
+        memcpy (d->path, rel, len + 1);
+        d->next = w->dirs[(size_t)wd & w->dirmask];
+        w->dirs[(size_t)wd & w->dirmask] = d;
+        w->ndirs++;
+        return 0;
 }
-/* file size, in bytes */
-static void push_st_size (lua_State *L, STAT_STRUCT *info) {
-        lua_pushinteger (L, (lua_Integer)info->st_size);
+
+/*
+** Removes the watches of the directory rel and of those below it.
+*/
+static void watch_drop (lfs_Watch *w, const char *rel) {
+        size_t len = strlen (rel), i;
+        for (i = 0; i <= w->dirmask; i++) {
+                watch_dir **p = &w->dirs[i];
+                while (*p) {
+                        watch_dir *d = *p;
+                        if (strncmp (d->path, rel, len) == 0 &&
+                            (d->path[len] == '\0' || d->path[len] == '/')) {
+                                inotify_rm_watch (w->fd, d->wd);
+                                *p = d->next;
+                                w->ndirs--;
+                                free (d);
+                        } else
+                                p = &d->next;
+                }
+        }
 }
-#ifndef _WIN32
-/* blocks allocated for file */
-static void push_st_blocks (lua_State *L, STAT_STRUCT *info) {
-        lua_pushinteger (L, (lua_Integer)info->st_blocks);
+
+/*
+** Writes a/b in buf, of LFS_MAXPATHLEN bytes, leaving out empty parts.
+** Returns buf, or NULL with errno set.
+*/
+static char *watch_join (char *buf, const char *a, const char *b) {
+        size_t al = strlen (a), bl = strlen (b);
+        if (al + bl + 2 > LFS_MAXPATHLEN) {
+                errno = ENAMETOOLONG;
+                return NULL;
+        }
+        memcpy (buf, a, al);
+        if (al > 0 && bl > 0)
+                buf[al++] = '/';
+        memcpy (buf + al, b, bl + 1);
+        return buf;
 }
-/* optimal file system I/O blocksize */
-static void push_st_blksize (lua_State *L, STAT_STRUCT *info) {
-        lua_pushinteger (L, (lua_Integer)info->st_blksize);
+
+static void watch_unmerge (lfs_Watch *w, watch_event *e) {
+        watch_event **p = &w->merge[e->hash & (WATCH_BUCKETS - 1)];
+        while (*p != e)
+                p = &(*p)->hnext;
+        *p = e->hnext;
+        e->merging = 0;
 }
-#endif
 
- /*
-** Convert the inode protection mode to a permission list.
+/*
+** Queues an event on the entry name (NULL for the directory itself) of
+** the directory dir, relative to the watched path.
 */
-
-#ifdef _WIN32
-static const char *perm2string (unsigned short mode) {
-  static char perms[10] = "---------";
-  int i;
-  for (i=0;i<9;i++) perms[i]='-';
-  if (mode  & _S_IREAD)
-   { perms[0] = 'r'; perms[3] = 'r'; perms[6] = 'r'; }
-  if (mode  & _S_IWRITE)
-   { perms[1] = 'w'; perms[4] = 'w'; perms[7] = 'w'; }
-  if (mode  & _S_IEXEC)
-   { perms[2] = 'x'; perms[5] = 'x'; perms[8] = 'x'; }
-  return perms;
+static void watch_queue (lfs_Watch *w, uint32_t kind, const char *dir, const char *name,
+                         int isdir, uint32_t cookie) {
+        size_t nl = strlen (w->name), dl = strlen (dir), el = name ? strlen (name) : 0;
+        watch_event *e = (watch_event *)malloc (sizeof(watch_event) + nl + dl + el + 2);
+        watch_event **p;
+        char *path;
+        if (e == NULL) {
+                w->lost = 1;
+                return;
+        }
+        path = e->path;
+        memcpy (path, w->name, nl);
+        path += nl;
+        if (dl > 0) {
+                if (nl > 0 && path[-1] != '/')
+                        *path++ = '/';
+                memcpy (path, dir, dl);
+                path += dl;
+        }
+        if (el > 0) {
+                if (path > e->path && path[-1] != '/')
+                        *path++ = '/';
+                memcpy (path, name, el);
+                path += el;
+        }
+        *path = '\0';
+        e->hash = str_hash (2166136261U, e->path);
+        p = &w->merge[e->hash & (WATCH_BUCKETS - 1)];
+        while (*p) {
+                watch_event *m = *p;
+                if (m->hash == e->hash && strcmp (m->path, e->path) == 0) {
+                        if (m->kind == kind && (kind & WATCH_MERGE)) {
+                                m->count++;
+                                free (e);
+                                return;
+                        }
+                        if (!(kind & WATCH_MERGE)) {
+                                /* the entry changed: later events must not
+                                   join those queued before */
+                                *p = m->hnext;
+                                m->merging = 0;
+                                continue;
+                        }
+                }
+                p = &m->hnext;
+        }
+        e->kind = kind;
+        e->cookie = cookie;
+        e->isdir = isdir;
+        e->count = 1;
+        e->next = NULL;
+        e->merging = (kind & WATCH_MERGE) != 0;
+        if (e->merging) {
+                e->hnext = w->merge[e->hash & (WATCH_BUCKETS - 1)];
+                w->merge[e->hash & (WATCH_BUCKETS - 1)] = e;
+        }
+        if (w->tail)
+                w->tail->next = e;
+        else
+                w->head = e;
+        w->tail = e;
+        w->queued++;
 }
+
+/*
+** Opens rel, relative to the watched path, without following a symbolic
+** link in its place. No descriptor is kept open between calls: the kernel
+** only reports the deletion of a file once the last one is closed.
+*/
+static int watch_open (lfs_Watch *w, const char *rel, int flags) {
+        char path[LFS_MAXPATHLEN];
+        if (*rel != '\0')
+                flags |= O_NOFOLLOW;
+        if (watch_join (path, w->base, rel) == NULL)
+                return -1;
+#ifdef LFS_HAVE_BOX
+        return box_openat (w->root, path, flags);
 #else
-static const char *perm2string (mode_t mode) {
-  static char perms[10] = "---------";
-  int i;
-  for (i=0;i<9;i++) perms[i]='-';
-  if (mode & S_IRUSR) perms[0] = 'r';
-  if (mode & S_IWUSR) perms[1] = 'w';
-  if (mode & S_IXUSR) perms[2] = 'x';
-  if (mode & S_IRGRP) perms[3] = 'r';
-  if (mode & S_IWGRP) perms[4] = 'w';
-  if (mode & S_IXGRP) perms[5] = 'x';
-  if (mode & S_IROTH) perms[6] = 'r';
-  if (mode & S_IWOTH) perms[7] = 'w';
-  if (mode & S_IXOTH) perms[8] = 'x';
-  return perms;
-}
+        return open (path, flags | O_CLOEXEC);  /* base is absolute */
 #endif
-
-/* permssions string */
-static void push_st_perm (lua_State *L, STAT_STRUCT *info) {
-    lua_pushstring (L, perm2string (info->st_mode));
 }
 
-typedef void (*_push_function) (lua_State *L, STAT_STRUCT *info);
+static uint32_t watch_mask (lfs_Watch *w) {
+        return (w->mask & ~(uint32_t)IN_Q_OVERFLOW) | IN_EXCL_UNLINK |
+               (w->recursive ? IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO : 0);
+}
 
-struct _stat_members {
-        const char *name;
-        _push_function push;
-};
+/*
+** Watches the directory rel, relative to the watched path, and the ones
+** below it when the watch is recursive. With report set, the entries found
+** are queued as created: they were made before the watch was in place.
+** Directories that vanish meanwhile are skipped.
+** Returns 0, or -1 with errno set.
+*/
+static int watch_add (lfs_Watch *w, const char *rel, int report) {
+        char link[32], sub[LFS_MAXPATHLEN];
+        walk_names nm;
+        int fd, wd, err = 0;
+        size_t i;
+        if ((fd = watch_open (w, rel, O_RDONLY | O_DIRECTORY)) < 0)
+                return -1;
+        fd_path (fd, link);
+        if ((wd = inotify_add_watch (w->fd, link, watch_mask (w) | IN_ONLYDIR)) < 0 ||
+            watch_set_dir (w, wd, rel) != 0) {
+                close_keep_errno (fd);
+                return -1;
+        }
+        if (!w->recursive) {
+                close (fd);
+                return 0;
+        }
+        if (w->buf == NULL && (w->buf = (char *)malloc (WALK_BUFSIZE)) == NULL) {
+                close_keep_errno (fd);
+                return -1;
+        }
+        memset (&nm, 0, sizeof(nm));
+        err = walk_list (fd, w->buf, &nm);
+        for (i = 0; err == 0 && i < nm.n; i++) {
+                const char *name = nm.arena + nm.off[i];
+                STAT_STRUCT info;
+                if (fstatat (fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+                        continue;
+                if (report)
+                        watch_queue (w, IN_CREATE, rel, name, S_ISDIR (info.st_mode), 0);
+                if (S_ISDIR (info.st_mode)) {
+                        if (watch_join (sub, rel, name) == NULL ||
+                            (watch_add (w, sub, report) != 0 &&
+                             errno != ENOENT && errno != ENOTDIR && errno != ELOOP))
+                                err = errno;
+                }
+        }
+        close (fd);
+        free (nm.arena);
+        free (nm.off);
+        errno = err;
+        return err ? -1 : 0;
+}
 
-struct _stat_members members[] = {
-        { "mode",         push_st_mode },
-        { "dev",          push_st_dev },
-        { "ino",          push_st_ino },
-        { "nlink",        push_st_nlink },
-        { "uid",          push_st_uid },
-        { "gid",          push_st_gid },
-        { "rdev",         push_st_rdev },
-        { "access",       push_st_atime },
-        { "modification", push_st_mtime },
-        { "change",       push_st_ctime },
-        { "size",         push_st_size },
-        { "permissions",  push_st_perm },
-#ifndef _WIN32
-        { "blocks",       push_st_blocks },
-        { "blksize",      push_st_blksize },
-#endif
-        { NULL, NULL }
-};
+static void watch_handle (lfs_Watch *w, const struct inotify_event *ev) {
+        const char *name = ev->len > 0 ? ev->name : NULL;
+        int isdir = (ev->mask & IN_ISDIR) != 0;
+        char sub[LFS_MAXPATHLEN];
+        uint32_t kinds;
+        watch_dir *d;
+        size_t i;
+        if (ev->mask & IN_Q_OVERFLOW) {
+                watch_queue (w, IN_Q_OVERFLOW, "", NULL, 1, 0);
+                return;
+        }
+        if ((d = watch_find (w, ev->wd)) == NULL)
+                return;
+        if (ev->mask & IN_IGNORED) {
+                watch_forget (w, d);
+                return;
+        }
+        kinds = ev->mask & w->mask;
+        if (d->path[0] != '\0')  /* reported by the parent */
+                kinds &= ~(uint32_t)(IN_DELETE_SELF | IN_MOVE_SELF);
+        for (i = 0; watch_kinds[i].name; i++)
+                if (kinds & watch_kinds[i].mask)
+                        watch_queue (w, watch_kinds[i].mask, d->path, name, isdir, ev->cookie);
+        if (!w->recursive || !isdir || name == NULL || watch_join (sub, d->path, name) == NULL)
+                return;
+        if (ev->mask & IN_MOVED_FROM)
+                watch_drop (w, sub);
+        else if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+                 watch_add (w, sub, (ev->mask & IN_CREATE) && (w->mask & IN_CREATE)) != 0 &&
+                 errno != ENOENT && errno != ENOTDIR && errno != ELOOP)
+                /* events below it will be missed */
+                watch_queue (w, IN_Q_OVERFLOW, sub, NULL, 1, 0);
+}
 
 /*
-** Get file or symbolic link information
+** Queues the events read from the kernel.
+** Returns 0, or -1 with errno set.
 */
-static int _file_info_ (lua_State *L, int (*st)(const char*, STAT_STRUCT*)) {
-        STAT_STRUCT info;
-        const char *file = luaL_checkstring (L, 1);
-        int i;
+static int watch_drain (lfs_Watch *w) {
+        union {
+                struct inotify_event ev;
+                char buf[4096];
+        } u;
+        while (w->queued < WATCH_MAXQUEUED) {
+                ssize_t n = read (w->fd, u.buf, sizeof(u.buf));
+                char *p;
+                if (n < 0)
+                        return errno == EAGAIN ? 0 : -1;
+                for (p = u.buf; p < u.buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+                        watch_handle (w, (struct inotify_event *)p);
+        }
+        return 0;
+}
 
-        if (st(file, &info)) {
-                lua_pushnil(L);
-                lua_pushfstring(L, "cannot obtain information from file '%s': %s", file, strerror(errno));
-                return 2;
+static void watch_free (lfs_Watch *w) {
+        size_t i;
+        if (w->fd >= 0)
+                close (w->fd);
+        if (w->root >= 0)
+                close (w->root);
+        w->fd = w->root = -1;
+        while (w->head) {
+                watch_event *e = w->head;
+                w->head = e->next;
+                free (e);
         }
-        if (lua_isstring (L, 2)) {
-                const char *member = lua_tostring (L, 2);
-                for (i = 0; members[i].name; i++) {
-                        if (strcmp(members[i].name, member) == 0) {
-                                /* push member value and return */
-                                members[i].push (L, &info);
-                                return 1;
+        w->tail = NULL;
+        w->queued = 0;
+        if (w->dirs)
+                for (i = 0; i <= w->dirmask; i++)
+                        while (w->dirs[i]) {
+                                watch_dir *d = w->dirs[i];
+                                w->dirs[i] = d->next;
+                                free (d);
+                        }
+        free (w->dirs);
+        free (w->merge);
+        free (w->buf);
+        free (w->name);
+        free (w->base);
+        w->dirs = NULL;
+        w->merge = NULL;
+        w->buf = w->name = w->base = NULL;
+}
+
+/*
+** Reads the queued events.
+** @param #1 Watcher.
+** @param #2 Maximum number of events (optional, all of them by default).
+** @param #3 Seconds to wait for events when there are none (optional,
+**           0 by default; negative to wait with no limit).
+** Returns an array of events, possibly empty.
+*/
+static int watch_read (lua_State *L) {
+        lfs_Watch *w = (lfs_Watch *)luaL_checkudata (L, 1, WATCH_METATABLE);
+        lua_Integer max = luaL_optinteger (L, 2, 0);
+        lua_Number timeout = luaL_optnumber (L, 3, 0);
+        lua_Integer i = 0;
+        luaL_argcheck (L, w->fd >= 0, 1, "closed watcher");
+        luaL_argcheck (L, lua_isnoneornil (L, 2) || max > 0, 2, "batch size must be positive");
+        if (watch_drain (w) != 0)
+                return pusherror (L, NULL);
+        if (w->head == NULL && !w->lost && timeout != 0) {
+                double end = cache_now () + timeout;
+                for (;;) {
+                        struct pollfd p;
+                        int ms = -1;
+                        if (timeout > 0) {
+                                double left = end - cache_now ();
+                                if (left <= 0)
+                                        break;
+                                ms = (int)(left * 1000) + 1;
                         }
+                        p.fd = w->fd;
+                        p.events = POLLIN;
+                        if (poll (&p, 1, ms) < 0 && errno != EINTR)
+                                return pusherror (L, NULL);
+                        if (watch_drain (w) != 0)
+                                return pusherror (L, NULL);
+                        if (w->head != NULL)
+                                break;
                 }
-                /* member not found */
-                return luaL_error(L, "invalid attribute name '%s'", member);
         }
-        /* creates a table if none is given, removes extra arguments */
-        lua_settop(L, 2);
-        if (!lua_istable (L, 2)) {
-                lua_newtable (L);
+        if (lua_isnoneornil (L, 2))
+                max = (lua_Integer)w->queued + 1;
+        lua_createtable (L, (int)(w->queued < 256 ? w->queued : 256), 0);
+        if (w->lost) {
+                lua_createtable (L, 0, 4);
+                lua_pushstring (L, w->name);
+                lua_setfield (L, -2, "path");
+                lua_pushliteral (L, "overflow");
+                lua_setfield (L, -2, "event");
+                lua_rawseti (L, -2, (int)++i);
+                w->lost = 0;
         }
-        /* stores all members in table on top of the stack */
-        for (i = 0; members[i].name; i++) {
-                lua_pushstring (L, members[i].name);
-                members[i].push (L, &info);
-                lua_rawset (L, -3);
+        while (i < max && w->head) {
+                watch_event *e = w->head;
+                size_t k;
+                for (k = 0; watch_kinds[k].mask != e->kind; k++)
+                        ;
+                lua_createtable (L, 0, 5);
+                lua_pushstring (L, e->path);
+                lua_setfield (L, -2, "path");
+                lua_pushstring (L, watch_kinds[k].name);
+                lua_setfield (L, -2, "event");
+                lua_pushboolean (L, e->isdir);
+                lua_setfield (L, -2, "directory");
+                lua_pushinteger (L, e->count);
+                lua_setfield (L, -2, "count");
+                if (e->kind & (IN_MOVED_FROM | IN_MOVED_TO)) {
+                        lua_pushinteger (L, (lua_Integer)e->cookie);
+                        lua_setfield (L, -2, "cookie");
+                }
+                lua_rawseti (L, -2, (int)++i);
+                if (e->merging)
+                        watch_unmerge (w, e);
+                if ((w->head = e->next) == NULL)
+                        w->tail = NULL;
+                w->queued--;
+                free (e);
         }
         return 1;
 }
 
-
 /*
-** Get file information using stat.
+** Returns the inotify descriptor of the watcher, to wait on it with poll
+** or an event loop.
 */
-static int file_info (lua_State *L) {
-        return _file_info_ (L, STAT_FUNC);
+static int watch_fd (lua_State *L) {
+        lfs_Watch *w = (lfs_Watch *)luaL_checkudata (L, 1, WATCH_METATABLE);
+        luaL_argcheck (L, w->fd >= 0, 1, "closed watcher");
+        lua_pushinteger (L, w->fd);
+        return 1;
 }
 
+static int watch_close (lua_State *L) {
+        watch_free ((lfs_Watch *)luaL_checkudata (L, 1, WATCH_METATABLE));
+        return 0;
+}
 
 /*
-** Push the symlink target to the top of the stack.
-** Assumes the file name is at position 1 of the stack.
-** Returns 1 if successful (with the target on top of the stack),
-** 0 on failure (with stack unchanged, and errno set).
+** Watches a file or directory for changes.
+** @param #1 Path.
+** @param #2 Table with options (optional): recursive, to watch the whole
+**           tree below a directory, and events, an array of the names of
+**           the events to report.
+** Returns a watcher object.
 */
-static int push_link_target(lua_State *L) {
-#ifdef _WIN32
-        errno = ENOSYS;
-        return 0;
+static int watch_factory (lua_State *L) {
+        const char *path = luaL_checkstring (L, 1);
+        int recursive = opt_boolean (L, 2, "recursive", 0);
+        uint32_t mask = WATCH_DEFAULT;
+        size_t len = strlen (path);
+        char base[LFS_MAXPATHLEN];
+        STAT_STRUCT info;
+        lfs_Watch *w;
+        int fd;
+        if (lua_istable (L, 2)) {
+                lua_getfield (L, 2, "events");
+                if (!lua_isnil (L, -1)) {
+                        int n, i;
+                        luaL_checktype (L, -1, LUA_TTABLE);
+                        mask = 0;
+                        for (n = 1; ; n++) {
+                                const char *name;
+                                lua_rawgeti (L, -1, n);
+                                if (lua_isnil (L, -1))
+                                        break;
+                                name = luaL_checkstring (L, -1);
+                                for (i = 0; watch_kinds[i].name; i++)
+                                        if (strcmp (watch_kinds[i].name, name) == 0)
+                                                break;
+                                if (watch_kinds[i].name == NULL)
+                                        return luaL_error (L, "invalid event name '%s'", name);
+                                mask |= watch_kinds[i].mask;
+                                lua_pop (L, 1);
+                        }
+                        lua_pop (L, 1);
+                }
+                lua_pop (L, 1);
+        }
+        w = (lfs_Watch *)lua_newuserdata (L, sizeof(lfs_Watch));
+        memset (w, 0, sizeof(lfs_Watch));
+        w->fd = w->root = -1;
+        luaL_getmetatable (L, WATCH_METATABLE);
+        lua_setmetatable (L, -2);
+        w->recursive = recursive;
+        w->mask = mask;
+        w->dirmask = 63;
+        while (len > 1 && path[len - 1] == '/')
+                len--;
+        if ((w->dirs = (watch_dir **)calloc (w->dirmask + 1, sizeof(watch_dir *))) == NULL ||
+            (w->merge = (watch_event **)calloc (WATCH_BUCKETS, sizeof(watch_event *))) == NULL ||
+            (w->name = (char *)malloc (len + 1)) == NULL)
+                return pusherror (L, path);
+        memcpy (w->name, path, len);
+        w->name[len] = '\0';
+#ifdef LFS_HAVE_BOX
+        if (box_path (lfs_state (L), path, base) == NULL ||
+            (w->root = fcntl (lfs_state (L)->root, F_DUPFD_CLOEXEC, 0)) < 0)
+                goto fail;
 #else
-        const char *file = luaL_checkstring(L, 1);
-        char *target = NULL;
-        int tsize, size = 256; /* size = initial buffer capacity */
-        while (1) {
-            target = realloc(target, size);
-            if (!target) /* failed to allocate */
-                return 0;
-            tsize = readlink(file, target, size);
-            if (tsize < 0) { /* a readlink() error occurred */
-                free(target);
-                return 0;
-            }
-            if (tsize < size)
-                break;
-            /* possibly truncated readlink() result, double size and retry */
-            size *= 2;
+        {
+                char buf[LFS_MAXPATHLEN];
+                const char *cwd = *path == '/' ? "" : lfs_state (L)->cwd;
+                if ((cwd == NULL && (cwd = getcwd (buf, sizeof(buf))) == NULL) ||
+                    watch_join (base, cwd, path) == NULL)
+                        goto fail;
         }
-        target[tsize] = '\0';
-        lua_pushlstring(L, target, tsize);
-        free(target);
-        return 1;
 #endif
-}
-
-/*
-** Get symbolic link information using lstat.
-*/
-static int link_info (lua_State *L) {
-        int ret;
-        if (lua_isstring (L, 2) && (strcmp(lua_tostring(L, 2), "target") == 0)) {
-                int ok = push_link_target(L);
-                return ok ? 1 : pusherror(L, "could not obtain link target");
+        if ((w->base = strdup (base)) == NULL ||
+            (w->fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)) < 0 ||
+            (fd = watch_open (w, "", O_PATH)) < 0)
+                goto fail;
+        if (fstat (fd, &info) != 0) {
+                close_keep_errno (fd);
+                goto fail;
         }
-        ret = _file_info_ (L, LSTAT_FUNC);
-        if (ret == 1 && lua_type(L, -1) == LUA_TTABLE) {
-                int ok = push_link_target(L);
-                if (ok) {
-                        lua_setfield(L, -2, "target");
-                }
+        if (S_ISDIR (info.st_mode)) {
+                close (fd);
+                if (watch_add (w, "", 0) != 0)
+                        goto fail;
+        } else {
+                char link[32];
+                int wd;
+                fd_path (fd, link);
+                w->recursive = 0;
+                wd = inotify_add_watch (w->fd, link, watch_mask (w));
+                close_keep_errno (fd);
+                if (wd < 0 || watch_set_dir (w, wd, "") != 0)
+                        goto fail;
         }
-        return ret;
+        return 1;
+fail:
+        {
+                int en = errno;
+                watch_free (w);
+                errno = en;
+        }
+        return pusherror (L, path);
 }
 
+static void watch_create_meta (lua_State *L) {
+        luaL_newmetatable (L, WATCH_METATABLE);
+
+        /* Method table */
+        lua_newtable (L);
+        lua_pushcfunction (L, watch_read);
+        lua_setfield (L, -2, "read");
+        lua_pushcfunction (L, watch_fd);
+        lua_setfield (L, -2, "fd");
+        lua_pushcfunction (L, watch_close);
+        lua_setfield (L, -2, "close");
+
+        /* Metamethods */
+        lua_setfield (L, -2, "__index");
+        lua_pushcfunction (L, watch_close);
+        lua_setfield (L, -2, "__gc");
+        lua_pop (L, 1);
+}
+#endif
 
 /*
 ** Assumes the table is on top of the stack.
@@ -925,6 +11419,7 @@ static void set_info (lua_State *L) {
 
 static const struct luaL_Reg fslib[] = {
         {"attributes", file_info},
+        {"cachestats", dirfd_stats},
         {"chdir", change_dir},
         {"currentdir", get_dir},
         {"dir", dir_iter_factory},
@@ -937,13 +11432,113 @@ static const struct luaL_Reg fslib[] = {
         {"touch", file_utime},
         {"unlock", file_unlock},
         {"lock_dir", lfs_lock_dir},
+#ifndef _WIN32
+        {"attributes_many", file_info_many},
+        {"buffer", buffer_new},
+        {"bufferstats", buffer_stats},
+        {"commit", write_commit},
+        {"copy", file_copy},
+        {"copytree", tree_copy},
+        {"du", disk_usage},
+        {"flock", file_flock},
+        {"glob", glob_expand},
+        {"hash", file_hash},
+        {"hashtree", tree_hash},
+        {"mkdirs", make_dirs},
+        {"loadsnapshot", snap_load},
+        {"lockstats", lock_stats},
+        {"mmap", map_open},
+        {"rmtree", remove_tree},
+        {"snapshot", snap_create},
+        {"stat", file_stat},
+        {"walk", walk_factory},
+        {"write_atomic", write_atomic},
+#endif
+#ifdef LFS_HAVE_STATS
+        {"resetstats", stats_reset},
+        {"stats", stats_get},
+#endif
+#ifdef LFS_HAVE_INOTIFY
+        {"watch", watch_factory},
+#endif
         {NULL, NULL},
 };
 
+#ifdef LFS_HAVE_STATS
+/*
+** Sets the functions of fslib in the table below the state on the top of
+** the stack, as closures of stats_call, and pops the state.
+*/
+static void stats_register (lua_State *L) {
+        lfs_State *S = (lfs_State *)lua_touserdata (L, -1);
+        size_t i, n = sizeof(fslib) / sizeof(fslib[0]);  /* with dir_iter for the sentinel */
+        if ((S->stats = (lfs_Stats *)calloc (1, sizeof(lfs_Stats) + (n - 1) * sizeof(stats_entry))) == NULL)
+                luaL_error (L, "not enough memory");
+        S->stats->n = n;
+        S->stats->entry[STATS_DIR_ITER].name = "dir_iter";
+        S->stats->entry[STATS_DIR_ITER].func = dir_iter;
+        for (i = 0; fslib[i].name != NULL; i++) {
+                stats_entry *e = &S->stats->entry[i + 1];
+                e->name = fslib[i].name;
+                e->func = fslib[i].func;
+                lua_pushvalue (L, -1);
+                if (e->func == stats_get || e->func == stats_reset)
+                        lua_pushcclosure (L, e->func, 1);
+                else {
+                        lua_pushinteger (L, (lua_Integer)(i + 1));
+                        lua_pushcclosure (L, stats_call, 2);
+                }
+                lua_setfield (L, -3, e->name);
+        }
+        lua_pop (L, 1);
+}
+#endif
+
 LFS_EXPORT int luaopen_lfs (lua_State *L) {
         dir_create_meta (L);
         lock_create_meta (L);
-        luaL_newlib (L, fslib);
+#ifndef _WIN32
+        walk_create_meta (L);
+        stat_create_meta (L);
+        map_create_meta (L);
+        buffer_create_meta (L);
+        snap_create_meta (L);
+        index_create_meta (L);
+#endif
+#ifdef LFS_HAVE_INOTIFY
+        watch_create_meta (L);
+#endif
+#ifdef LFS_HAVE_URING
+        async_create_meta (L);
+#endif
+        state_create (L);
+        lua_newtable (L);
+        lua_pushvalue (L, -2);
+#ifdef LFS_HAVE_STATS
+        stats_register (L);
+#else
+        luaL_setfuncs (L, fslib, 1);
+#endif
+#ifdef LFS_HAVE_INOTIFY
+        lua_newtable (L);
+        lua_pushvalue (L, -3);
+        luaL_setfuncs (L, cachelib, 1);
+        lua_setfield (L, -2, "cache");
+#endif
+#ifndef _WIN32
+        lua_newtable (L);
+        lua_pushvalue (L, -3);
+        luaL_setfuncs (L, indexlib, 1);
+        lua_setfield (L, -2, "index");
+#endif
+#ifdef LFS_HAVE_URING
+        lua_newtable (L);
+        lua_pushvalue (L, -3);
+        async_create (L);
+        luaL_setfuncs (L, asynclib, 2);
+        lua_setfield (L, -2, "async");
+#endif
+        lua_remove (L, -2);
         lua_pushvalue(L, -1);
         lua_setglobal(L, LFS_LIBNAME);
         set_info (L);
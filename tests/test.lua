@@ -7,6 +7,16 @@ local upper = ".."
 local lfs = require"lfs"
 print (lfs._VERSION)
 
+-- Paths are confined to the root directory of the box (LFB_ROOT), where
+-- there is no upper directory: run the tests one level down, with the
+-- process, so that io.open and os.remove follow
+local boxed = lfs.attributes ("/..") == nil
+if boxed then
+  tmp = "."
+  lfs.mkdir ("lfs_test_box")
+  assert (lfs.chdir ("lfs_test_box", {process = true}), "could not change to a directory of the box")
+end
+
 io.write(".")
 io.flush()
 
@@ -34,13 +44,29 @@ local reldir = string.gsub (current, "^.*%"..sep.."([^"..sep.."])$", "%1")
 assert (lfs.chdir (upper), "could not change to upper directory")
 assert (lfs.chdir (reldir), "could not change back to current directory")
 assert (lfs.currentdir() == current, "error trying to change directories")
+-- relative paths resolve from the directory set by lfs.chdir
+local name = string.match (current, "[^%"..sep.."]+$")
+assert (lfs.chdir (upper), "could not change to upper directory")
+assert (lfs.attributes (name, "mode") == "directory", "relative path not resolved from the current directory")
+local probe = assert (io.open ("lfs_cwd_probe", "w"))
+probe:close ()
+assert (lfs.attributes (current..sep.."lfs_cwd_probe"), "the process moved without being asked to")
+assert (os.remove ("lfs_cwd_probe"))
+for entry in lfs.dir (".") do
+  if entry == name then
+    name = nil
+  end
+end
+assert (name == nil, "current directory not listed from the upper one")
+assert (lfs.chdir (current), "could not change back to current directory")
 assert (lfs.chdir ("this couldn't be an actual directory") == nil, "could change to a non-existent directory")
 
 io.write(".")
 io.flush()
 
 -- Changing creating and removing directories
-local tmpdir = current..sep.."lfs_tmp_dir"
+-- io.open does not know about the box, but shares the current directory
+local tmpdir = (boxed and "." or current)..sep.."lfs_tmp_dir"
 local tmpfile = tmpdir..sep.."tmp_file"
 -- Test for existence of a previous lfs_tmp_dir
 -- that may have resulted from an interrupted test execution and remove it
@@ -188,4 +214,774 @@ io.flush()
 local iter, dir = lfs.dir(tmp)
 dir:close()
 assert(not pcall(dir.next, dir))
+
+io.write(".")
+io.flush()
+
+-- Batched directory reads
+local expected = 0
+for file in lfs.dir (tmp) do
+  expected = expected + 1
+end
+count = 0
+local iter, dir = lfs.dir(tmp, {batch = 7})
+local names, types, inodes = dir:read()
+while names do
+  assert (#names <= 7 and #names == #types and #names == #inodes)
+  for i = 1, #names do
+    if names[i] ~= "." and names[i] ~= ".." then
+      assert (types[i] == lfs.symlinkattributes (tmp..sep..names[i], "mode"))
+    end
+  end
+  count = count + #names
+  names, types, inodes = dir:read()
+end
+assert (count == expected, "batched reads do not match the iterator")
+assert (dir:read() == nil)
+
+-- A read error that ends a batch is returned by the next call: Linux
+-- reports ENOENT for the entries of a directory that was removed (which
+-- readdir of glibc takes for the end of the directory)
+local linux = io.open ("/proc/version")
+if linux then
+  linux:close ()
+  local gone = tmp..sep.."lfs_gone_dir"
+  assert (lfs.mkdir (gone))
+  for i = 1, 4 do
+    io.open (gone..sep..i, "w"):close ()
+  end
+  iter, dir = lfs.dir (gone)
+  assert (#dir:read (1) == 1)
+  for i = 1, 4 do
+    assert (os.remove (gone..sep..i))
+  end
+  assert (lfs.rmdir (gone))
+  names = dir:read ()
+  assert (names and #names == 5, "the rest of the batch comes first")
+  local ok, msg, code = dir:read ()
+  assert (ok == nil and (msg == nil or type (msg) == "string" and type (code) == "number"))
+  assert (dir:read () == nil)
+  dir:close ()
+end
+
+io.write(".")
+io.flush()
+
+-- Walking a tree
+local function countdir (path)
+  local n = 0
+  for file in lfs.dir (path) do
+    if file ~= "." and file ~= ".." then
+      n = n + 1
+      if lfs.symlinkattributes (path..sep..file, "mode") == "directory" then
+        n = n + countdir (path..sep..file)
+      end
+    end
+  end
+  return n
+end
+count = 0
+for batch in lfs.walk (current, {threads = 4, batch = 16}) do
+  assert (#batch <= 16)
+  for i = 1, #batch do
+    local e = batch[i]
+    assert (e.error == nil, e.error)
+    assert (e.depth >= 1 and e.path:sub(1, #current) == current)
+    assert (e.mode == lfs.symlinkattributes (e.path, "mode"))
+  end
+  count = count + #batch
+end
+assert (count == countdir (current), "walk does not match a recursive lfs.dir")
+count = 0
+for batch in lfs.walk (current, {inodeorder = true}) do
+  count = count + #batch
+end
+assert (count == countdir (current), "inode order loses entries")
+for batch in lfs.walk (current, {maxdepth = 1, fields = {"size"}}) do
+  for i = 1, #batch do
+    assert (batch[i].depth == 1 and batch[i].size and batch[i].mode == nil)
+  end
+end
+count = 0
+for batch in lfs.walk (current, {maxdepth = 0}) do
+  count = count + #batch
+end
+assert (count == 0, "maxdepth 0 lists nothing")
+-- links are followed, and each directory is listed once
+assert (lfs.mkdirs (tmpdir..sep.."d"))
+io.open (tmpdir..sep.."d"..sep.."f", "w"):close ()
+assert (lfs.link ("d", tmpdir..sep.."dl", true))
+assert (lfs.link ("d"..sep.."f", tmpdir..sep.."fl", true))
+local modes = {}
+for batch in lfs.walk (tmpdir, {follow = true}) do
+  for i = 1, #batch do
+    modes[batch[i].path:sub (#tmpdir + 2)] = batch[i].mode
+  end
+end
+assert (modes.d == "directory" and modes.dl == "directory" and modes.fl == "file")
+assert ((modes["d"..sep.."f"] == "file") ~= (modes["dl"..sep.."f"] == "file"))
+assert (lfs.rmtree (tmpdir))
+assert (lfs.walk ("this couldn't be an actual directory") == nil)
+assert (not pcall (lfs.walk, current, {batch = 1e9}), "batch sizes are bounded")
+assert (not pcall (lfs.walk, current, {threads = 2^32 + 1}), "options are checked before narrowing")
+
+io.write(".")
+io.flush()
+
+-- Bulk attributes
+local paths = {}
+for file in lfs.dir (current) do
+  paths[#paths+1] = current..sep..file
+end
+paths[#paths+1] = "this couldn't be an actual file"
+for _, uring in ipairs{true, false} do
+  local results, errors = lfs.attributes_many (paths, nil, {uring = uring, threads = 3})
+  assert (#results == #paths)
+  for i = 1, #paths - 1 do
+    assert (results[i].ino == lfs.attributes (paths[i], "ino"))
+  end
+  assert (results[#paths] == false and type(errors[#paths]) == "string")
+end
+local results = lfs.attributes_many ({current}, {"mode"})
+assert (results[1].mode == "directory" and results[1].size == nil)
+-- more paths than descriptors a process commonly gets
+paths = {}
+for i = 1, 3000 do
+  paths[i] = current
+end
+results = lfs.attributes_many (paths, {"mode"})
+for i = 1, #paths do
+  assert (results[i] and results[i].mode == "directory", "a chunk runs out of descriptors")
+end
+local _, dir_obj = lfs.dir (current)
+local names, _, inodes = dir_obj:read ()
+dir_obj:close ()
+for i = 1, #names do
+  names[i] = current..sep..names[i]
+end
+results = lfs.attributes_many (names, {"ino"}, {inodes = inodes})
+for i = 1, #names do
+  assert (results[i].ino == lfs.attributes (names[i], "ino"), "results follow the paths")
+end
+
+io.write(".")
+io.flush()
+
+-- Stat objects
+local st = assert (lfs.stat (current))
+local attr = lfs.attributes (current)
+for key, value in pairs(attr) do
+  assert (st[key] == value, "lfs.stat values not consistent")
+end
+assert (math.floor (st.modification_ns / 1000000000) == st.modification)
+assert (not pcall (function () return st.bogus end))
+assert (lfs.stat (current, {"size"}).size == attr.size)
+assert (lfs.stat ("this couldn't be an actual file") == nil)
+
+io.write(".")
+io.flush()
+
+-- Stat cache
+if lfs.cache then
+  assert (lfs.cache.enable {max_entries = 2})
+  local size = lfs.attributes (current, "size")
+  assert (lfs.attributes (current, "size") == size)
+  local stats = lfs.cache.stats ()
+  assert (stats.enabled and stats.hits == 1 and stats.misses == 1)
+  assert (lfs.mkdir (tmpdir))
+  assert (lfs.attributes (tmpdir, "mode") == "directory")
+  assert (lfs.touch (tmpdir, testdate))
+  assert (lfs.attributes (tmpdir, "modification") == testdate, "stale cache entry")
+  assert (lfs.rmdir (tmpdir))
+  assert (lfs.attributes (tmpdir) == nil, "stale cache entry")
+  assert (lfs.cache.stats().entries <= 2)
+  -- a rename of a directory above the parent drops what is under it only
+  local deep = tmpdir..sep.."a"..sep.."b"
+  assert (lfs.mkdirs (deep))
+  local f = io.open (deep..sep.."c", "w")
+  f:close ()
+  assert (lfs.cache.enable ())
+  assert (lfs.attributes (deep..sep.."c", "mode") == "file")
+  assert (lfs.attributes (current, "mode") == "directory")
+  assert (os.rename (tmpdir..sep.."a", tmpdir..sep.."x"))
+  lfs.cache.sync ()
+  assert (lfs.attributes (deep..sep.."c") == nil, "stale entry under a renamed directory")
+  stats = lfs.cache.stats ()
+  assert (lfs.attributes (current, "mode") == "directory")
+  assert (lfs.cache.stats ().hits == stats.hits + 1, "unrelated entries are kept")
+  assert (lfs.rmtree (tmpdir))
+  lfs.cache.disable ()
+  assert (not lfs.cache.stats().enabled)
+end
+
+io.write(".")
+io.flush()
+
+-- Directory descriptor cache
+local stats = lfs.cachestats ()
+assert (stats.hit_rate >= 0 and stats.hit_rate <= 1)
+if boxed then
+  local budget = stats.budget
+  stats = lfs.cachestats (16)
+  assert (stats.entries == 0)
+  -- paths under a directory moved by other means do not resolve in it
+  local a, b = tmpdir..sep.."a", tmpdir..sep.."a"..sep.."b"
+  assert (lfs.mkdirs (b))
+  assert (lfs.attributes (b..sep.."c") == nil and lfs.cachestats ().entries > 0)
+  assert (os.rename (b, tmpdir..sep.."moved"))
+  assert (lfs.mkdir (b))
+  assert (lfs.mkdir (b..sep.."c"))
+  assert (lfs.attributes (tmpdir..sep.."moved"..sep.."c") == nil, "stale directory descriptor")
+  -- nor under one whose parent moved
+  assert (os.rename (a, tmpdir..sep.."x"))
+  assert (lfs.mkdirs (b))
+  assert (lfs.mkdir (b..sep.."d"))
+  assert (lfs.attributes (tmpdir..sep.."x"..sep.."b"..sep.."d") == nil, "stale directory descriptor")
+  assert (lfs.rmtree (tmpdir))
+  stats = lfs.cachestats ()
+  assert (lfs.mkdir (tmpdir))
+  assert (lfs.mkdir (tmpdir..sep.."lfs_tmp_dir"))
+  for i = 1, 3 do
+    assert (lfs.attributes (tmpdir..sep.."lfs_tmp_dir", "mode") == "directory")
+  end
+  assert (lfs.cachestats().hits >= stats.hits + 2)
+  assert (lfs.rmdir (tmpdir..sep.."lfs_tmp_dir"))
+  assert (lfs.rmdir (tmpdir))
+  assert (lfs.attributes (tmpdir..sep.."lfs_tmp_dir") == nil, "stale directory descriptor")
+  assert (lfs.mkdir (tmpdir))
+  assert (lfs.mkdir (tmpdir..sep.."lfs_tmp_dir"), "stale directory descriptor")
+  assert (lfs.rmdir (tmpdir..sep.."lfs_tmp_dir"))
+  assert (lfs.rmdir (tmpdir))
+  assert (lfs.cachestats (0).entries == 0)
+  assert (lfs.attributes (current, "mode") == "directory")
+  assert (lfs.cachestats (budget).budget == budget)
+end
+
+io.write(".")
+io.flush()
+
+-- Asynchronous operations
+if lfs.async then
+  local async = lfs.async
+  local done = false
+  local co = coroutine.create (function ()
+    assert (async.mkdir (tmpdir))
+    local fd = assert (async.open (tmpfile, "w"))
+    assert (async.write (fd, "0123456789") == 10)
+    assert (async.close (fd))
+    fd = assert (async.open (tmpfile))
+    assert (async.read (fd, 4, 3) == "3456")
+    assert (async.read (fd, 20) == "0123456789")
+    assert (async.read (fd, 20) == nil)
+    assert (async.close (fd))
+    assert (async.attributes (tmpfile).size == 10)
+    assert (async.rename (tmpfile, tmpfile.."2"))
+    assert (async.attributes (tmpfile) == nil)
+    assert (async.remove (tmpfile.."2"))
+    assert (async.rmdir (tmpdir))
+    done = true
+  end)
+  assert (coroutine.resume (co))
+  while not done do
+    async.poll (true)
+  end
+  -- outside a coroutine operations complete at once
+  assert (async.mkdir (tmpdir))
+  assert (async.attributes (tmpdir).mode == "directory")
+  assert (async.rmdir (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Tree creation and removal
+if lfs.mkdirs then
+  local deep = tmpdir..sep.."a"..sep.."b"..sep.."c"
+  assert (lfs.mkdirs (deep))
+  assert (lfs.mkdirs (deep), "existing directories are fine")
+  assert (lfs.attributes (deep, "mode") == "directory")
+  for i = 1, 20 do
+    local d = tmpdir..sep.."a"..sep..i
+    assert (lfs.mkdirs (d..sep.."x"))
+    io.open (d..sep.."f", "w"):close ()
+  end
+  io.open (tmpfile, "w"):close ()
+  assert (lfs.mkdirs (tmpfile) == nil)
+  assert (lfs.mkdirs (tmpfile..sep.."x") == nil)
+  assert (lfs.rmtree (tmpfile))
+  assert (lfs.rmtree (tmpdir, {threads = 4}))
+  assert (lfs.attributes (tmpdir) == nil)
+  local ok, err, code = lfs.rmtree (tmpdir)
+  assert (ok == nil and type (err) == "string" and type (code) == "number")
+  -- entries that cannot be removed are reported
+  local ro = tmpdir..sep.."a"..sep.."ro"
+  assert (lfs.mkdirs (ro..sep.."x"))
+  os.execute ("chmod 555 "..ro)
+  local probe = io.open (ro..sep.."probe", "w")
+  if probe then
+    probe:close ()  -- the superuser removes anything
+  else
+    local fails
+    ok, err, code, fails = lfs.rmtree (tmpdir)
+    assert (ok == nil and #fails == 1 and fails[1].path:find ("ro"..sep.."x$") and type (fails[1].error) == "string")
+    assert (lfs.attributes (ro..sep.."x", "mode") == "directory", "directories above failures are kept")
+  end
+  os.execute ("chmod 755 "..ro)
+  assert (lfs.rmtree (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Copies
+if lfs.copy then
+  assert (lfs.mkdirs (tmpdir..sep.."src"..sep.."sub"))
+  local src = tmpdir..sep.."src"
+  local data = string.rep ("0123456789", 10000)
+  local f = io.open (src..sep.."sub"..sep.."file", "wb")
+  f:write (data)
+  f:close ()
+  assert (lfs.touch (src..sep.."sub"..sep.."file", 86400, 86400))
+  local bytes, method = assert (lfs.copy (src..sep.."sub"..sep.."file", tmpfile))
+  assert (bytes == #data and type (method) == "string")
+  f = io.open (tmpfile, "rb")
+  assert (f:read ("*a") == data)
+  f:close ()
+  assert (lfs.attributes (tmpfile, "modification") == 86400)
+  assert (lfs.copy (tmpfile, tmpfile) == nil, "a file is not copied onto itself")
+  assert (lfs.copy (src, tmpfile) == nil, "directories are not copied")
+  assert (os.remove (tmpfile))
+  local dst = tmpdir..sep.."dst"
+  local report
+  bytes, report = assert (lfs.copytree (src, dst, {threads = 2}))
+  assert (bytes == #data and #report == 1)
+  assert (report[1].path == dst.."/sub/file" and report[1].bytes == #data)
+  assert (lfs.attributes (dst..sep.."sub"..sep.."file", "size") == #data)
+  assert (lfs.rmtree (dst))
+  -- deeper than the levels kept open, with entries after each subdirectory
+  local deep = src
+  for i = 1, 40 do
+    deep = deep..sep.."d"
+    assert (lfs.mkdirs (deep))
+    io.open (deep..sep.."f", "wb"):close ()
+  end
+  bytes, report = assert (lfs.copytree (src, dst))
+  assert (bytes == #data and #report == 41)
+  assert (lfs.attributes (dst..string.rep (sep.."d", 40)..sep.."f", "mode") == "file")
+  assert (lfs.rmtree (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Memory maps
+if lfs.mmap then
+  assert (lfs.mkdir (tmpdir))
+  local f = io.open (tmpfile, "wb")
+  f:write ("first line\nsecond\n\nlast")
+  f:close ()
+  local m = assert (lfs.mmap (tmpfile))
+  assert (#m == 23 and m:len () == 23 and m:sub (1, 5) == "first" and m:sub (-4) == "last")
+  assert (m:byte (1) == 102 and select ("#", m:byte (1, 3)) == 3)
+  local i, j = m:find ("second")
+  assert (i == 12 and j == 17 and m:find ("line", 8) == nil and m:find ("\n", 18) == 18)
+  local lines = {}
+  for i, j in m:lines () do
+    lines[#lines + 1] = m:sub (i, j)
+  end
+  assert (#lines == 4 and lines[2] == "second" and lines[3] == "" and lines[4] == "last")
+  assert (m:advise ("sequential") and m:advise ("dontneed", 1, 10))
+  assert (not pcall (m.write, m, 1, "F"), "read-only maps cannot be written")
+  m:close ()
+  assert (not pcall (m.sub, m, 1), "closed maps cannot be used")
+  m = assert (lfs.mmap (tmpfile, "w"))
+  m:write (1, "F")
+  assert (m:sync ())
+  m:close ()
+  f = io.open (tmpfile, "rb")
+  assert (f:read (5) == "First")
+  f:close ()
+  assert (lfs.mmap (tmpdir) == nil, "directories are not mapped")
+  assert (os.remove (tmpfile))
+  assert (lfs.rmdir (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Buffers
+if lfs.buffer then
+  assert (lfs.mkdir (tmpdir))
+  local f = io.open (tmpfile, "wb")
+  f:write ("one\ntwo\nthree\n")
+  f:close ()
+  local b = lfs.buffer (100)
+  assert (b:capacity () == 4096 and #b == 0)
+  assert (b:read_from (tmpfile) == 14 and b:tostring () == "one\ntwo\nthree\n")
+  assert (b:find ("two") == 5 and b:sub (-6, -2) == "three" and b:byte (1) == 111)
+  local n = 0
+  for i, j in b:lines () do
+    n = n + 1
+  end
+  assert (n == 3)
+  assert (b:read_from (tmpfile, 4, 4) == 4 and tostring (b) == "two\n")
+  b:append ("four")
+  assert (b:write_to (tmpfile, 14) == 8)
+  assert (b:read_from (tmpfile, 14) == 8 and tostring (b) == "two\nfour")
+  b:clear ()
+  assert (b:write_to (tmpfile) == 0 and lfs.attributes (tmpfile, "size") == 0)
+  if lfs.cache then
+    assert (lfs.cache.enable ())
+    assert (lfs.attributes (tmpfile, "size") == 0)
+    b:append ("cached")
+    assert (b:write_to (tmpfile) == 6 and lfs.attributes (tmpfile, "size") == 6, "writes are seen through the cache")
+    lfs.cache.disable ()
+    b:clear ()
+  end
+  assert (select (2, b:read_from (tmpdir..sep.."missing")), "missing files are reported")
+  assert (b:read_from (-1) == nil and b:write_to (1000000) == nil, "invalid descriptors are reported")
+  assert (not pcall (b.write_to, b, tmpdir..sep.."new", -1))
+  assert (lfs.attributes (tmpdir..sep.."new") == nil, "arguments are checked before opening")
+  local stats = lfs.bufferstats ()
+  assert (stats.buffers >= 1 and stats.peakbytes >= 4096)
+  b:release ()
+  assert (not pcall (b.len, b), "released buffers cannot be used")
+  local pooled = lfs.bufferstats ().pooled
+  b = lfs.buffer (4096)
+  assert (lfs.bufferstats ().pooled == pooled - 4096, "released blocks are reused")
+  b:release ()
+  assert (os.remove (tmpfile))
+  assert (lfs.rmdir (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Snapshots
+if lfs.snapshot then
+  assert (lfs.mkdirs (tmpdir..sep.."sub"))
+  local f = io.open (tmpdir..sep.."sub"..sep.."file", "w")
+  f:write ("data")
+  f:close ()
+  local snap = assert (lfs.snapshot (tmpdir))
+  assert (#snap == 2 and snap:entry (1) == "sub" and snap:find ("sub/file") == 2)
+  local path, info = snap:entry (2)
+  assert (path == "sub/file" and info.mode == "file" and info.size == 4)
+  local saved = tmpdir..sep.."snapshot"
+  assert (snap:save (saved))
+  local loaded = assert (lfs.loadsnapshot (saved))
+  assert (#loaded == 2 and loaded:entry (2) == "sub/file")
+  assert (snap:save (saved) and #assert (lfs.loadsnapshot (saved)) == 2, "saving replaces the file")
+  assert (os.rename (tmpdir..sep.."sub"..sep.."file", tmpdir..sep.."sub"..sep.."moved"))
+  local changes = loaded:diff (assert (lfs.snapshot (tmpdir)))
+  assert (#changes.renamed == 1 and changes.renamed[1].from == "sub/file" and changes.renamed[1].to == "sub/moved")
+  assert (#changes.added == 1 and changes.added[1] == "snapshot" and #changes.removed == 0)
+  assert (changes.modified[1] == "sub", "directories change with their entries")
+  -- deeper than the levels kept open, with entries after each subdirectory
+  local deep, rel = tmpdir, ""
+  for i = 1, 40 do
+    deep, rel = deep..sep.."d", rel.."d/"
+    assert (lfs.mkdirs (deep))
+    io.open (deep..sep.."f", "wb"):close ()
+  end
+  snap = assert (lfs.snapshot (tmpdir))
+  assert (#snap == 83 and snap:find (rel.."f") ~= nil)
+  assert (lfs.rmtree (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Indexes
+if lfs.index then
+  assert (lfs.mkdirs (tmpdir..sep.."tree"..sep.."sub"))
+  local tree = tmpdir..sep.."tree"
+  local f = io.open (tree..sep.."sub"..sep.."file", "w")
+  f:write ("data")
+  f:close ()
+  -- older than the walk, so that unchanged directories are not read again
+  assert (lfs.touch (tree..sep.."sub", 86400, 86400))
+  assert (lfs.touch (tree, 86400, 86400))
+  local file = tmpdir..sep.."index"
+  local index = assert (lfs.index.open (tree, file))
+  assert (index:stats ().rescanned == 2 and #index == 3)
+  index:close ()
+  index = assert (lfs.index.open (tree, file))
+  assert (index:stats ().rescanned == 0 and index:stat ("sub/file").size == 4)
+  assert (index:list (".")[1] == "sub" and index:list ("sub")[1] == "file" and index:list ("sub/file") == nil)
+  f = io.open (tree..sep.."sub"..sep.."new", "w")
+  f:close ()
+  index = assert (lfs.index.open (tree, file))
+  assert (index:stats ().rescanned == 1 and index:stat ("sub/new").size == 0)
+  assert (lfs.rmtree (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Globs
+if lfs.glob then
+  assert (lfs.mkdirs (tmpdir.."/src/lib"))
+  assert (lfs.mkdir (tmpdir.."/.git"))
+  for _, name in ipairs {"src/a.c", "src/b.h", "src/lib/c.c", ".git/d.c"} do
+    local f = io.open (tmpdir.."/"..name, "w")
+    f:close ()
+  end
+  local found = lfs.glob (tmpdir.."/**/*.c")
+  assert (#found == 2 and found[1] == tmpdir.."/src/a.c" and found[2] == tmpdir.."/src/lib/c.c")
+  assert (#lfs.glob (tmpdir.."/**/*.c", {hidden = true}) == 3)
+  assert (#lfs.glob (tmpdir.."/src/*.{c,h,c}") == 2, "alternatives found twice")
+  assert (lfs.glob (tmpdir.."/src/[!a].?")[1] == tmpdir.."/src/b.h")
+  assert (lfs.glob (tmpdir.."/*/")[1] == tmpdir.."/src")
+  found = lfs.glob (tmpdir.."/**/*.c", {exclude = "**/lib"})
+  assert (#found == 1 and found[1] == tmpdir.."/src/a.c")
+  assert (#lfs.glob (tmpdir.."/missing/*") == 0)
+  assert (lfs.rmtree (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Hashing
+if lfs.hash then
+  assert (lfs.mkdirs (tmpdir..sep.."sub"))
+  local f = io.open (tmpfile, "w")
+  f:write ("123456789")
+  f:close ()
+  assert (lfs.hash (tmpfile, "crc32c") == "e3069283")
+  assert (lfs.hash (tmpfile, "sha256") == "15e2b0d3c33891ebb0f1ef609ec419420c20e320ce94c65fbc8c3312448eb225")
+  f = io.open (tmpdir..sep.."sub"..sep.."abc", "w")
+  f:write ("abc")
+  f:close ()
+  assert (lfs.hash (tmpdir..sep.."sub"..sep.."abc") == "44bc2cf5ad770999")
+  assert (lfs.hash (tmpdir) == nil)
+  local digests, errors = lfs.hashtree (tmpdir, "sha256", {threads = 2})
+  assert (digests["sub/abc"] == lfs.hash (tmpdir..sep.."sub"..sep.."abc", "sha256") and next (errors) == nil)
+  assert (digests.tmp_file == lfs.hash (tmpfile, "sha256"))
+  f = io.open (tmpfile, "a")
+  f:write ("0")
+  f:close ()
+  digests = lfs.hashtree (tmpdir, "sha256")
+  assert (digests.tmp_file == lfs.hash (tmpfile, "sha256"), "changed files are hashed again")
+  assert (lfs.rmtree (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Disk usage
+if lfs.du then
+  local sub = tmpdir..sep.."sub"
+  assert (lfs.mkdirs (sub..sep.."deeper"))
+  local f = io.open (sub..sep.."a", "w")
+  f:write (string.rep ("a", 5000))
+  f:close ()
+  f = io.open (sub..sep.."deeper"..sep.."b", "w")
+  f:write ("bcd")
+  f:close ()
+  assert (lfs.link (sub..sep.."a", tmpdir..sep.."a_link"))
+  local reports, errors = lfs.du (tmpdir, {threads = 2, depth = 1, apparent = true})
+  assert (next (errors) == nil)
+  local root, r = reports[tmpdir], reports[sub]
+  assert (root and r and reports[sub..sep.."deeper"] == nil)
+  assert (root.files == 2, "hard links are counted once")
+  assert (root.dirs == 3 and r.dirs == 2 and r.depth == 1)
+  assert (r.files >= 1, "the deeper file is added up to its reported ancestor")
+  assert (root.apparent >= 5003 and root.size == root.apparent)
+  assert (root.allocated >= r.allocated and r.apparent >= 3)
+  assert (lfs.du (tmpdir..sep.."none") == nil)
+  assert (lfs.rmtree (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Atomic writes
+if lfs.write_atomic then
+  assert (lfs.mkdirs (tmpdir..sep.."sub"))
+  local function contents (path)
+    local f = assert (io.open (path, "rb"))
+    local s = f:read ("*a")
+    f:close ()
+    return s
+  end
+  assert (lfs.write_atomic (tmpfile, "first") == true)
+  assert (contents (tmpfile) == "first")
+  local ino = lfs.attributes (tmpfile, "ino")
+  assert (lfs.write_atomic (tmpfile, "second", {mode = tonumber ("600", 8), sync = false}))
+  assert (contents (tmpfile) == "second" and lfs.attributes (tmpfile, "permissions") == "rw-------")
+  assert (lfs.attributes (tmpfile, "ino") ~= ino, "the old file is replaced, not rewritten")
+  local b = lfs.buffer (16)
+  b:append ("from a buffer")
+  assert (lfs.write_atomic (tmpfile, b) and contents (tmpfile) == "from a buffer")
+  b:release ()
+  assert (not pcall (lfs.write_atomic, tmpfile, {}), "contents are strings or buffers")
+  assert (lfs.write_atomic (tmpdir..sep.."none"..sep.."file", "x") == nil)
+  local files = {}
+  for i = 1, 20 do
+    files[string.format ("%s%ssub%sf%02d", tmpdir, sep, sep, i)] = string.rep ("x", i)
+  end
+  files[tmpfile] = "committed"
+  local n, syncs = assert (lfs.commit (files))
+  assert (n == 21 and syncs >= 1 and syncs <= 23)
+  assert (contents (tmpdir..sep.."sub"..sep.."f20") == string.rep ("x", 20) and contents (tmpfile) == "committed")
+  for _, how in ipairs {"data", "fs", false} do
+    assert (lfs.commit ({[tmpfile] = tostring (how)}, {sync = how}))
+    assert (contents (tmpfile) == tostring (how))
+  end
+  assert (select (2, lfs.commit ({[tmpfile] = ""}, {sync = false})) == 0)
+  local ok, msg = lfs.commit {[tmpfile] = "kept", [tmpdir..sep.."none"..sep.."file"] = "x"}
+  assert (ok == nil and msg:find ("none", 1, true))
+  assert (contents (tmpfile) == "", "nothing is published when a write fails")
+  local entries = 0
+  for name in lfs.dir (tmpdir) do
+    entries = entries + 1
+  end
+  assert (entries == 4, "no temporary files are left behind")
+  -- more files than are kept open, in one directory
+  files = {}
+  for i = 1, 700 do
+    files[string.format ("%s%sc%sf%03d", tmpdir, sep, sep, i)] = tostring (i)
+  end
+  assert (lfs.mkdir (tmpdir..sep.."c"))
+  assert (lfs.commit (files) == 700)
+  assert (contents (tmpdir..sep.."c"..sep.."f001") == "1" and contents (tmpdir..sep.."c"..sep.."f700") == "700")
+  entries = 0
+  for name in lfs.dir (tmpdir..sep.."c") do
+    entries = entries + 1
+  end
+  assert (entries == 702, "no temporary files are left behind")
+  assert (lfs.rmtree (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Locks
+if lfs.flock then
+  assert (lfs.mkdir (tmpdir))
+  local f = io.open (tmpfile, "w")
+  f:write ("locked")
+  f:close ()
+  local a, b = io.open (tmpfile, "r+"), io.open (tmpfile, "r+")
+  local before = lfs.lockstats ().lock
+  assert (lfs.lock (a, "w", 0, 4))
+  assert (lfs.lock (b, "w", 4, 2), "ranges apart do not conflict")
+  assert (lfs.lock (b, "r", {timeout = 0}) == nil, "locks belong to the open file")
+  assert (lfs.lock (b, "r", 0, 4, {timeout = 0.2}) == nil)
+  local stats = lfs.lockstats ().lock
+  assert (stats.contended == before.contended + 2 and stats.timeouts == before.timeouts + 2)
+  assert (stats.waited - before.waited >= 0.15, "waits until the timeout")
+  assert (lfs.unlock (a, 0, 4))
+  assert (lfs.lock (b, "r", 0, 4, {timeout = 1}))
+  assert (lfs.flock (a, "w"))
+  assert (lfs.flock (b, "r", {timeout = 0.05}) == nil)
+  assert (lfs.flock (a, "u"))
+  assert (lfs.flock (b, "r") and lfs.flock (a, "r"), "shared locks")
+  a:close ()
+  b:close ()
+  local l = assert (lfs.lock_dir (tmpdir))
+  local _, err = lfs.lock_dir (tmpdir, {timeout = 0.05})
+  assert (err == "File exists")
+  os.execute ("(sleep 0.2; rm -f "..tmpdir.."/lockfile.lfs) &")
+  before = lfs.lockstats ().lock_dir
+  assert (lfs.lock_dir (tmpdir, {timeout = 10}), "waits for the lockfile to go")
+  stats = lfs.lockstats ().lock_dir
+  assert (stats.acquired == before.acquired + 1 and stats.waited - before.waited < 5)
+  l:free ()
+  assert (lfs.rmtree (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Statistics
+if lfs.stats then
+  lfs.resetstats ()
+  assert (next (lfs.stats ()) == nil)
+  assert (lfs.attributes (tmpdir..sep.."none") == nil)
+  for _ in lfs.dir (".") do end
+  assert (lfs.mkdir (tmpdir))
+  local f = io.open (tmpfile, "w")
+  f:write ("0123456789")
+  f:close ()
+  assert (lfs.copy (tmpfile, tmpfile.."2"))
+  local _, _, errno = lfs.copy (tmpdir..sep.."none", tmpfile.."3")
+  local s = lfs.stats ()
+  assert (s.attributes.calls == 1 and s.attributes.errors == 1 and s.attributes.errnos.other == 1)
+  assert (s.copy.calls == 2 and s.copy.errors == 1 and s.copy.errnos[errno] == 1)
+  assert (s.dir.calls == 1 and s.dir_iter.calls >= 2 and s.copy.bytes == 10)
+  local n = 0
+  for _, c in ipairs (s.mkdir.histogram) do
+    n = n + c
+  end
+  assert (n == 1 and s.mkdir.time > 0)
+  local text = lfs.stats ("prometheus")
+  assert (text:find ('lfs_calls_total{function="mkdir"} 1\n', 1, true))
+  assert (text:find ('lfs_call_duration_seconds_count{function="copy"} 2\n', 1, true))
+  assert (text:find ('lfs_bytes_total{function="copy"} 10\n', 1, true))
+  assert (lfs.rmtree (tmpdir))
+end
+
+io.write(".")
+io.flush()
+
+-- Watchers
+if lfs.watch then
+  assert (lfs.mkdir (tmpdir))
+  local w = assert (lfs.watch (tmpdir, {recursive = true}))
+  assert (type (w:fd ()) == "number")
+  assert (#w:read () == 0)
+  local sub = tmpdir..sep.."sub"
+  assert (lfs.mkdir (sub))
+  local events = w:read (nil, 1)
+  assert (events[1].event == "create" and events[1].path == sub and events[1].directory)
+  -- the new directory is watched, and writes to a file are merged
+  local f = io.open (sub..sep.."file", "w")
+  local g = io.open (tmpfile, "w")
+  for i = 1, 10 do
+    f:write ("x") f:flush ()
+    g:write ("x") g:flush ()
+  end
+  f:close ()
+  g:close ()
+  local seen = {}
+  for _, e in ipairs (w:read ()) do
+    seen[e.path..":"..e.event] = e.count
+  end
+  assert (seen[sub..sep.."file:create"] == 1 and seen[tmpfile..":create"] == 1)
+  assert (seen[sub..sep.."file:modify"] == 10 and seen[tmpfile..":modify"] == 10)
+  assert (os.remove (sub..sep.."file"))
+  assert (os.remove (tmpfile))
+  assert (#w:read (nil, 1) == 2)
+  assert (lfs.rmdir (sub))
+  events = w:read (1)
+  assert (#events == 1 and events[1].event == "delete" and events[1].path == sub)
+  w:close ()
+  assert (not pcall (w.read, w))
+  -- only the events asked for
+  w = assert (lfs.watch (tmpdir, {events = {"delete"}}))
+  io.open (tmpfile, "w"):close ()
+  assert (os.remove (tmpfile))
+  events = w:read ()
+  assert (#events == 1 and events[1].event == "delete" and events[1].path == tmpfile)
+  w:close ()
+  assert (lfs.rmdir (tmpdir))
+  assert (lfs.watch (tmpdir) == nil)
+end
+
+io.write(".")
+io.flush()
+
+-- The box
+if boxed then
+  assert (lfs.chdir ("/", {process = true}) and lfs.currentdir () == "/")
+  assert (lfs.chdir (upper) == nil, "could leave the box")
+  assert (lfs.link (upper, "_a_link_out_", true))
+  assert (lfs.attributes ("_a_link_out_") == nil, "could follow a link out of the box")
+  assert (lfs.symlinkattributes ("_a_link_out_", "mode") == "link")
+  assert (lfs.mkdir ("_a_link_out_"..sep.."lfs_tmp_dir") == nil)
+  assert (os.remove ("_a_link_out_"))
+  assert (lfs.rmdir ("lfs_test_box"))
+end
 print"Ok!"